@@ -0,0 +1,58 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef MH_AMCL__CORRECTIONSCHEDULER_HPP_
+#define MH_AMCL__CORRECTIONSCHEDULER_HPP_
+
+#include <cstddef>
+#include <vector>
+
+namespace mh_amcl
+{
+
+typedef struct
+{
+  std::size_t num_particles;
+  float quality;
+  bool selected;  // The hypothesis of the published pose
+  int skipped;  // Corrections skipped in a row
+} CorrectionRequest;
+
+// Splits the beams of a correction between the hypotheses, so its cost, in beams
+// evaluated for a particle, is bounded by a budget and not by the number of hypotheses.
+// The selected hypothesis, and those with a quality close to be selected, get all the
+// beams. The others get a number of beams that grows with their quality, from min_beams,
+// while the budget lasts. The ones that have waited longer go first, and the first one
+// gets min_beams even over the budget, so every hypothesis is corrected from time to time,
+// at a lower rate.
+class CorrectionScheduler
+{
+public:
+  // budget 0 corrects every hypothesis with all the beams
+  CorrectionScheduler(std::size_t budget, std::size_t min_beams, float promote_quality);
+
+  // Beams of each request, 0 for those that skip this correction
+  std::vector<std::size_t> schedule(
+    const std::vector<CorrectionRequest> & requests, std::size_t num_beams) const;
+
+protected:
+  std::size_t budget_;
+  std::size_t min_beams_;
+  float promote_quality_;
+};
+
+}  // namespace mh_amcl
+
+#endif  // MH_AMCL__CORRECTIONSCHEDULER_HPP_
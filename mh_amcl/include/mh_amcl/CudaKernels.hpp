@@ -0,0 +1,69 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MH_AMCL__CUDAKERNELS_HPP_
+#define MH_AMCL__CUDAKERNELS_HPP_
+
+#include <cuda_runtime_api.h>
+
+#include <cstddef>
+
+namespace mh_amcl
+{
+
+// What the kernels of CudaSensorModel read, as plain data in the device memory. It has no
+// ROS headers, so nvcc only compiles CudaKernels.cu, and the rest is built as usual.
+
+// A TiledGrid of distances: tiles[ty * tiles_x + tx] is the block of the tile (tx, ty),
+// with its TILE_CELLS cells at blocks + block * TILE_CELLS, laid out as in the grid
+typedef struct
+{
+  const float * blocks;
+  const unsigned int * tiles;
+  unsigned int size_x;
+  unsigned int size_y;
+  unsigned int tiles_x;
+  unsigned int tile_shift;
+  float origin_x;
+  float origin_y;
+  float resolution;
+} CudaField;
+
+// Sensor in the map, and the points [begin, end) that it reads
+typedef struct
+{
+  float x;
+  float y;
+  float cos_yaw;
+  float sin_yaw;
+  unsigned int begin;
+  unsigned int end;
+} CudaPose;
+
+typedef struct
+{
+  float x;
+  float y;
+} CudaPoint;
+
+// hits[i] is the sum of the likelihood of the points of poses[i], those closer than
+// 3 * distance_perception_error to an obstacle, with a block of threads for each pose
+cudaError_t
+launch_correct(
+  const CudaField & field, const CudaPose * poses, size_t num_poses, const CudaPoint * points,
+  float distance_perception_error, float * hits, cudaStream_t stream);
+
+}  // namespace mh_amcl
+
+#endif  // MH_AMCL__CUDAKERNELS_HPP_
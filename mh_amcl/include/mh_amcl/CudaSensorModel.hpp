@@ -0,0 +1,69 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MH_AMCL__CUDASENSORMODEL_HPP_
+#define MH_AMCL__CUDASENSORMODEL_HPP_
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "mh_amcl/LikelihoodField.hpp"
+#include "mh_amcl/Pose2.hpp"
+#include "mh_amcl/ScanPoints.hpp"
+
+namespace mh_amcl
+{
+
+// Likelihood field sensor model on a CUDA device, only built with MH_AMCL_CUDA. The field
+// stays in the device memory, as its distinct tiles and a table of tiles, and is only
+// uploaded again when it changes. Each scan is a single launch for the particles of all
+// the hypotheses, so only the sensor poses and the points go to the device, and the sum
+// of the beams of each pose comes back.
+//
+// Errors of the device throw std::runtime_error. Not thread safe.
+class CudaSensorModel
+{
+public:
+  // Uses the current device. Throws if there is none.
+  CudaSensorModel();
+  ~CudaSensorModel();
+
+  CudaSensorModel(const CudaSensorModel &) = delete;
+  CudaSensorModel & operator=(const CudaSensorModel &) = delete;
+
+  // Uploads field, if it is not the one in the device already
+  void set_likelihood_field(std::shared_ptr<const LikelihoodField> field);
+
+  // hits[i] is the sum of the likelihood of the points of its scan from poses[i], the sensor
+  // in the map, as ParticlesDistribution::correct_particles computes it with the field. The
+  // poses [first[k], first[k + 1]) read scans[k], so first has a last entry, poses.size().
+  void correct(
+    const std::vector<const ScanPoints *> & scans, const std::vector<size_t> & first,
+    const std::vector<Pose2d> & poses, double distance_perception_error,
+    std::vector<double> & hits);
+
+  // Bytes of the field in the device
+  size_t get_memory_usage() const;
+
+protected:
+  struct Device;
+
+  std::unique_ptr<Device> device_;
+  std::shared_ptr<const LikelihoodField> field_;
+};
+
+}  // namespace mh_amcl
+
+#endif  // MH_AMCL__CUDASENSORMODEL_HPP_
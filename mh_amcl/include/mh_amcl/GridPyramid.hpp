@@ -0,0 +1,72 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef MH_AMCL__GRIDPYRAMID_HPP_
+#define MH_AMCL__GRIDPYRAMID_HPP_
+
+#include <cstddef>
+#include <functional>
+
+#include "mh_amcl/ThreadPool.hpp"
+#include "mh_amcl/TiledGrid.hpp"
+
+namespace mh_amcl
+{
+
+typedef enum TPyramidReduction
+{
+  // LETHAL_OBSTACLE if any of the four cells is, else FREE_SPACE if any is, else the first
+  COSTMAP_REDUCTION,
+  // The maximum of the four cells, an upper bound of any position inside them
+  MAX_REDUCTION
+} PyramidReduction;
+
+// out[k] is the reduction of row0[2k], row0[2k + 1], row1[2k] and row1[2k + 1], for k < n.
+// Uses SSE2 or NEON when the build has them.
+void reduce_2x2(
+  const unsigned char * row0, const unsigned char * row1, std::size_t n,
+  PyramidReduction reduction, unsigned char * out);
+
+// Grid of half the size, where each cell is the reduction of its 2 x 2 cells in grid. Each
+// quarter of a tile comes from a single tile of grid, so uniform tiles are reduced without
+// reading their cells. With a pool, the rows of tiles are built in parallel.
+TiledGrid<unsigned char> half_scale(
+  const TiledGrid<unsigned char> & grid, PyramidReduction reduction,
+  ThreadPool * pool = nullptr);
+
+// Computes again the cells of result, made by half_scale(grid, reduction), under the cells
+// [min_x, max_x] x [min_y, max_y] of grid, after they have changed
+void update_half_scale(
+  const TiledGrid<unsigned char> & grid, PyramidReduction reduction, unsigned int min_x,
+  unsigned int min_y, unsigned int max_x, unsigned int max_y, TiledGrid<unsigned char> & result);
+
+// The run argument of TiledGrid::fill_tiles(): parallel with a pool, in order without it
+inline std::function<void(std::size_t, const std::function<void(std::size_t)> &)>
+tile_rows_runner(ThreadPool * pool)
+{
+  return [pool](std::size_t n, const std::function<void(std::size_t)> & f) {
+           if (pool != nullptr) {
+             pool->parallel_for(n, f);
+           } else {
+             for (std::size_t i = 0; i < n; i++) {
+               f(i);
+             }
+           }
+         };
+}
+
+}  // namespace mh_amcl
+
+#endif  // MH_AMCL__GRIDPYRAMID_HPP_
@@ -0,0 +1,76 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef MH_AMCL__HYPOTHESISINDEX_HPP_
+#define MH_AMCL__HYPOTHESISINDEX_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace mh_amcl
+{
+
+// Hash grid over the mean poses of the hypotheses, in cells of cell_size meters and
+// angle_size radians, so finding the hypotheses near a pose reads only the cells around
+// it instead of all of them. The yaw of each pose is kept, so it is not extracted from a
+// quaternion at each comparison.
+class HypothesisIndex
+{
+public:
+  HypothesisIndex(double cell_size, double angle_size);
+
+  void clear();
+  void insert(std::size_t id, double x, double y, double yaw);
+
+  // Ids of the poses closer than max_distance and max_angle, in insertion order
+  void query(
+    double x, double y, double yaw, double max_distance, double max_angle,
+    std::vector<std::size_t> & ids) const;
+
+  // True if any pose is closer than max_distance and max_angle
+  bool covers(double x, double y, double yaw, double max_distance, double max_angle) const;
+
+  std::size_t size() const {return entries_.size();}
+
+protected:
+  typedef struct
+  {
+    double x;
+    double y;
+    double yaw;
+  } Entry;
+
+  uint64_t get_key(int64_t cx, int64_t cy, int64_t cyaw) const;
+  int64_t get_cell(double value) const;
+  int64_t get_angle_bin(double yaw) const;
+
+  template<class F>
+  void for_each_near(
+    double x, double y, double yaw, double max_distance, double max_angle, F f) const;
+
+  double cell_size_;
+  double angle_size_;
+  int num_angle_bins_;
+
+  std::vector<Entry> entries_;
+  std::vector<std::size_t> ids_;
+  std::unordered_map<uint64_t, std::vector<std::size_t>> cells_;  // Positions in entries_
+};
+
+}  // namespace mh_amcl
+
+#endif  // MH_AMCL__HYPOTHESISINDEX_HPP_
@@ -0,0 +1,51 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef MH_AMCL__HYPOTHESISPOOL_HPP_
+#define MH_AMCL__HYPOTHESISPOOL_HPP_
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "mh_amcl/ParticlesDistribution.hpp"
+
+namespace mh_amcl
+{
+
+// Fixed set of hypotheses sharing a context, created once, so creating a hypothesis
+// allocates nothing and adds no TF subscription. A hypothesis is free again once only the
+// pool holds it, that is, once it is removed from the population. Its particle storage is
+// kept for the next one.
+class HypothesisPool
+{
+public:
+  HypothesisPool(std::shared_ptr<HypothesisContext> context, std::size_t capacity);
+
+  // A free hypothesis, with the given id and still to be configured, or nullptr if all of
+  // them are in use
+  std::shared_ptr<ParticlesDistribution> acquire(int id);
+
+  std::size_t get_capacity() const {return slots_.size();}
+  std::size_t get_num_free() const;
+
+protected:
+  std::shared_ptr<HypothesisContext> context_;
+  std::vector<std::shared_ptr<ParticlesDistribution>> slots_;
+};
+
+}  // namespace mh_amcl
+
+#endif  // MH_AMCL__HYPOTHESISPOOL_HPP_
@@ -0,0 +1,125 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MH_AMCL__INSTRUMENTATION_HPP_
+#define MH_AMCL__INSTRUMENTATION_HPP_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#ifdef MH_AMCL_LTTNG
+#include "mh_amcl/tracepoints.hpp"
+#endif
+
+namespace mh_amcl
+{
+
+// Latencies of a step, in buckets of logarithmic width, as HDR histograms do: each power
+// of two is split in SUB_BUCKETS buckets, so any value is known within 1 / SUB_BUCKETS.
+// Any thread may record values while another one takes them.
+class LatencyHistogram
+{
+public:
+  static constexpr int SUB_BUCKET_BITS = 3;
+  static constexpr int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+  static constexpr int NUM_BUCKETS = 64 * SUB_BUCKETS;
+
+  typedef struct
+  {
+    uint64_t count;
+    uint64_t max;  // Nanoseconds
+    std::array<uint64_t, NUM_BUCKETS> buckets;
+  } Snapshot;
+
+  explicit LatencyHistogram(const char * name)
+  : name_(name) {}
+
+  const char * get_name() const {return name_;}
+
+  void record(uint64_t nanoseconds)
+  {
+    buckets_[get_bucket(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    while (nanoseconds > max &&
+      !max_.compare_exchange_weak(max, nanoseconds, std::memory_order_relaxed))
+    {
+    }
+  }
+
+  // Values since the previous call
+  Snapshot take();
+
+  static int get_bucket(uint64_t value);
+  static uint64_t get_bucket_max(int bucket);
+
+  // Value under which there are a ratio p of the values of snapshot, in nanoseconds
+  static uint64_t get_percentile(const Snapshot & snapshot, double p);
+
+protected:
+  const char * name_;
+  std::array<std::atomic<uint64_t>, NUM_BUCKETS> buckets_ {};
+  std::atomic<uint64_t> count_ {0};
+  std::atomic<uint64_t> max_ {0};
+};
+
+// Steady time since start, which is not affected by use_sim_time or clock jumps
+inline std::chrono::nanoseconds
+elapsed_since(const std::chrono::steady_clock::time_point & start)
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start);
+}
+
+// Records in a histogram the time from its construction to its destruction
+class ScopedTimer
+{
+public:
+  explicit ScopedTimer(LatencyHistogram & histogram)
+  : histogram_(histogram),
+    start_(std::chrono::steady_clock::now())
+  {
+#ifdef MH_AMCL_LTTNG
+    tracepoint(mh_amcl, stage_begin, histogram_.get_name());
+#endif
+  }
+
+  ~ScopedTimer()
+  {
+    histogram_.record(elapsed_since(start_).count());
+
+#ifdef MH_AMCL_LTTNG
+    tracepoint(mh_amcl, stage_end, histogram_.get_name());
+#endif
+  }
+
+protected:
+  LatencyHistogram & histogram_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+}  // namespace mh_amcl
+
+// Times the rest of the enclosing scope. Without MH_AMCL_INSTRUMENTATION it is removed,
+// with no cost at all.
+#ifdef MH_AMCL_INSTRUMENTATION
+#define MH_AMCL_SCOPED_TIMER(histogram) mh_amcl::ScopedTimer mh_amcl_scoped_timer(histogram)
+#else
+#define MH_AMCL_SCOPED_TIMER(histogram) do {} while (0)
+#endif
+
+#endif  // MH_AMCL__INSTRUMENTATION_HPP_
@@ -0,0 +1,101 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MH_AMCL__LIKELIHOODFIELD_HPP_
+#define MH_AMCL__LIKELIHOODFIELD_HPP_
+
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "mh_amcl/LocalizationMap.hpp"
+#include "mh_amcl/MapCache.hpp"
+#include "mh_amcl/TiledGrid.hpp"
+
+namespace mh_amcl
+{
+
+// Distance from every cell to the closest LETHAL_OBSTACLE cell, computed once per map
+// with an exact Euclidean distance transform. The sensor model reads it instead of
+// marching along each beam. Tiles farther than max_distance from any obstacle share a
+// single block of infinite distances.
+class LikelihoodField
+{
+public:
+  // With a cache, the distances are read from it if they are there, and added otherwise
+  LikelihoodField(
+    const LocalizationMap & map, double max_distance,
+    MapCache * cache = nullptr);
+
+  // Field of map, which differs from the map of previous only in the cells
+  // [min_x, max_x] x [min_y, max_y]. It shares the tiles of previous farther than
+  // max_distance from them, and only computes again the others.
+  LikelihoodField(
+    const LikelihoodField & previous, const LocalizationMap & map, unsigned int min_x,
+    unsigned int min_y, unsigned int max_x, unsigned int max_y);
+
+  // Distance in meters to the closest obstacle. Infinity if the point is outside the map
+  // or there is no obstacle closer than max_distance.
+  double get_distance(double wx, double wy) const
+  {
+    if (wx < origin_x_ || wy < origin_y_) {
+      return std::numeric_limits<double>::infinity();
+    }
+
+    unsigned int mx = static_cast<unsigned int>((wx - origin_x_) / resolution_);
+    unsigned int my = static_cast<unsigned int>((wy - origin_y_) / resolution_);
+
+    if (mx >= size_x_ || my >= size_y_) {
+      return std::numeric_limits<double>::infinity();
+    }
+
+    return distances_.get(mx, my);
+  }
+
+  double get_max_distance() const {return max_distance_;}
+  unsigned int get_size_x() const {return size_x_;}
+  unsigned int get_size_y() const {return size_y_;}
+  double get_resolution() const {return resolution_;}
+  double get_origin_x() const {return origin_x_;}
+  double get_origin_y() const {return origin_y_;}
+  const TiledGrid<float> & get_distances() const {return distances_;}
+  size_t get_memory_usage() const {return distances_.get_memory_usage();}
+
+protected:
+  void compute_distances(const LocalizationMap & map);
+  // Only the tiles up to max_distance from the cells [min_x, max_x] x [min_y, max_y]
+  void compute_distances(
+    const LocalizationMap & map, unsigned int min_x, unsigned int min_y, unsigned int max_x,
+    unsigned int max_y);
+  std::string get_cache_section() const;
+  bool load(const MapCache & cache);
+  void save(MapCache & cache) const;
+
+  void distance_transform_1d(
+    const std::vector<double> & f, std::vector<double> & d,
+    std::vector<int> & v, std::vector<double> & z) const;
+
+  unsigned int size_x_;
+  unsigned int size_y_;
+  double resolution_;
+  double origin_x_;
+  double origin_y_;
+  double max_distance_;
+
+  TiledGrid<float> distances_;
+};
+
+}  // namespace mh_amcl
+
+#endif  // MH_AMCL__LIKELIHOODFIELD_HPP_
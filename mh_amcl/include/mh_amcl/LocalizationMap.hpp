@@ -0,0 +1,135 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MH_AMCL__LOCALIZATIONMAP_HPP_
+#define MH_AMCL__LOCALIZATIONMAP_HPP_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "nav_msgs/msg/occupancy_grid.hpp"
+
+#include "nav2_costmap_2d/cost_values.hpp"
+#include "nav2_costmap_2d/costmap_2d.hpp"
+#include "mh_amcl/MapCache.hpp"
+#include "mh_amcl/ThreadPool.hpp"
+#include "mh_amcl/TiledGrid.hpp"
+
+namespace mh_amcl
+{
+
+// The map as the localization reads it: a grid of nav2_costmap_2d costs and the levels of
+// its pyramid, each one at half the resolution of the previous one. Costs are stored in a
+// TiledGrid, so large unknown or free areas take almost no memory. It does not change once
+// built, so it is shared as std::shared_ptr<const LocalizationMap> by the node, the
+// hypotheses and the matcher, and any thread can read it without locks.
+class LocalizationMap
+{
+public:
+  // Costs are translated as Costmap2D does. With a cache, the levels are read from it if
+  // they are there, and added otherwise. With a pool, the rows of tiles of each level are
+  // built in parallel.
+  explicit LocalizationMap(
+    const nav_msgs::msg::OccupancyGrid & map, int num_levels = 1, MapCache * cache = nullptr,
+    ThreadPool * pool = nullptr);
+  explicit LocalizationMap(const nav2_costmap_2d::Costmap2D & costmap, int num_levels = 1);
+  LocalizationMap(
+    unsigned int size_x, unsigned int size_y, double resolution, double origin_x,
+    double origin_y, const std::vector<unsigned char> & costs, int num_levels = 1);
+  LocalizationMap(
+    double resolution, double origin_x, double origin_y, TiledGrid<unsigned char> costs,
+    int num_levels = 1);
+
+  unsigned int get_size_x() const {return costs_.get_size_x();}
+  unsigned int get_size_y() const {return costs_.get_size_y();}
+  double get_resolution() const {return resolution_;}
+  double get_origin_x() const {return origin_x_;}
+  double get_origin_y() const {return origin_y_;}
+  const TiledGrid<unsigned char> & get_costs() const {return costs_;}
+
+  // No bounds checking
+  unsigned char get_cost(unsigned int mx, unsigned int my) const
+  {
+    return costs_.get(mx, my);
+  }
+
+  // NO_INFORMATION out of the map
+  unsigned char get_world_cost(double wx, double wy) const
+  {
+    unsigned int mx, my;
+    if (!world_to_map(wx, wy, mx, my)) {
+      return nav2_costmap_2d::NO_INFORMATION;
+    }
+    return get_cost(mx, my);
+  }
+
+  bool world_to_map(double wx, double wy, unsigned int & mx, unsigned int & my) const
+  {
+    if (wx < origin_x_ || wy < origin_y_) {
+      return false;
+    }
+
+    mx = static_cast<unsigned int>((wx - origin_x_) / resolution_);
+    my = static_cast<unsigned int>((wy - origin_y_) / resolution_);
+    return mx < costs_.get_size_x() && my < costs_.get_size_y();
+  }
+
+  // Center of the cell
+  void map_to_world(unsigned int mx, unsigned int my, double & wx, double & wy) const
+  {
+    wx = origin_x_ + (mx + 0.5) * resolution_;
+    wy = origin_y_ + (my + 0.5) * resolution_;
+  }
+
+  // Level 0 is this map
+  int get_num_levels() const {return levels_.size() + 1;}
+  const LocalizationMap & get_level(int level) const
+  {
+    return level == 0 ? *this : *levels_[level - 1];
+  }
+
+  // Each cell is LETHAL_OBSTACLE if any of its four cells is, else FREE_SPACE if any is,
+  // else the cost of the first one, so NO_INFORMATION if all are
+  std::shared_ptr<const LocalizationMap> half_scale(ThreadPool * pool = nullptr) const;
+
+  // Copy of this map with the occupancies of data, width x height in row-major order, from
+  // the cell (x, y) on, as in a map_msgs/OccupancyGridUpdate. It shares the tiles out of the
+  // patch, and only the cells of the levels under it are computed again. nullptr if the
+  // patch starts out of the map or data is too short.
+  std::shared_ptr<const LocalizationMap> update(
+    unsigned int x, unsigned int y, unsigned int width, unsigned int height,
+    const std::vector<int8_t> & data) const;
+
+  // Bytes of the costs of all the levels
+  size_t get_memory_usage() const;
+
+protected:
+  void build_levels(int num_levels, MapCache * cache, ThreadPool * pool);
+  bool load_level(const MapCache & cache, int level);
+  void save_level(MapCache & cache, int level) const;
+
+  double resolution_;
+  double origin_x_;
+  double origin_y_;
+  TiledGrid<unsigned char> costs_;
+
+  std::vector<std::shared_ptr<const LocalizationMap>> levels_;
+};
+
+nav_msgs::msg::OccupancyGrid toMsg(const LocalizationMap & map);
+
+}  // namespace mh_amcl
+
+#endif  // MH_AMCL__LOCALIZATIONMAP_HPP_
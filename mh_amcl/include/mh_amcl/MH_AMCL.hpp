@@ -22,6 +22,7 @@
 #include <vector>
 #include <list>
 #include <memory>
+#include <string>
 
 #include "tf2_ros/buffer.h"
 #include "tf2_ros/transform_listener.h"
@@ -33,15 +34,30 @@
 
 #include "sensor_msgs/msg/laser_scan.hpp"
 #include "nav_msgs/msg/occupancy_grid.hpp"
+#include "map_msgs/msg/occupancy_grid_update.hpp"
 #include "geometry_msgs/msg/pose_with_covariance_stamped.hpp"
 #include "nav2_msgs/msg/particle_cloud.hpp"
 #include "mh_amcl_msgs/msg/info.hpp"
+#include "mh_amcl_msgs/msg/latencies.hpp"
 #include "vqa_msgs/msg/monologue_hypothesis.hpp"
 #include "vqa_msgs/srv/hypothesis.hpp"
 
-#include "nav2_costmap_2d/costmap_2d.hpp"
+#include "mh_amcl/CorrectionScheduler.hpp"
+#ifdef MH_AMCL_CUDA
+#include "mh_amcl/CudaSensorModel.hpp"
+#endif
+#include "mh_amcl/HypothesisIndex.hpp"
+#include "mh_amcl/HypothesisPool.hpp"
+#include "mh_amcl/Instrumentation.hpp"
 #include "mh_amcl/ParticlesDistribution.hpp"
 #include "mh_amcl/MapMatcher.hpp"
+#include "mh_amcl/LikelihoodField.hpp"
+#include "mh_amcl/LocalizationMap.hpp"
+#include "mh_amcl/MapCache.hpp"
+#include "mh_amcl/Pose2.hpp"
+#include "mh_amcl/Relocalizer.hpp"
+#include "mh_amcl/ScanPoints.hpp"
+#include "mh_amcl/ThreadPool.hpp"
 
 #include "rclcpp/rclcpp.hpp"
 #include "rclcpp_lifecycle/lifecycle_node.hpp"
@@ -66,28 +82,48 @@ public:
 
 protected:
   void predict();
+  void predict_to(const tf2::TimePoint & time);
+  void predict_to_scan();
   void correct();
+  // Corrects the hypotheses with points in the device, in a single launch. False, without
+  // changing them, if the correction runs on the CPU.
+  bool correct_on_device(
+    const std::vector<std::shared_ptr<ParticlesDistribution>> & hypotheses,
+    const std::vector<const mh_amcl::ScanPoints *> & points);
   void reseed();
   void publish_particles();
   void publish_position();
+  void publish_latencies();
   void manage_hypotesis();
+  void request_relocalization();
+  void update_likelihood_field();
+  std::shared_ptr<mh_amcl::LikelihoodField> build_likelihood_field(
+    const mh_amcl::LocalizationMap & map, uint64_t map_key, double max_dist,
+    const std::string & cache_dir);
+  std::unique_ptr<MapCache> get_map_cache(const std::string & cache_dir, uint64_t map_key);
+  void save_map_cache(MapCache * cache);
+  void process_scan();
+  bool moved_enough();
 
   void get_distances(
     const geometry_msgs::msg::Pose & pose1, const geometry_msgs::msg::Pose & pose2,
     double & dist_xy, double & dist_theta);
+  double get_yaw(const geometry_msgs::msg::Pose & pose);
   unsigned char get_cost(const geometry_msgs::msg::Pose & pose);
   geometry_msgs::msg::Pose toMsg(const tf2::Transform & tf);
   std::list<TransformWeighted> fromMsg(const vqa_msgs::msg::MonologueHypothesis & hypo);
 
 private:
   rclcpp::Subscription<nav_msgs::msg::OccupancyGrid>::SharedPtr sub_map_;
-  rclcpp::Subscription<sensor_msgs::msg::LaserScan>::SharedPtr sub_laser_;
+  rclcpp::Subscription<map_msgs::msg::OccupancyGridUpdate>::SharedPtr sub_map_updates_;
+  std::vector<rclcpp::Subscription<sensor_msgs::msg::LaserScan>::SharedPtr> sub_lasers_;
   rclcpp::Subscription<geometry_msgs::msg::PoseWithCovarianceStamped>::SharedPtr sub_init_pose_;
   rclcpp::Subscription<vqa_msgs::msg::MonologueHypothesis>::SharedPtr sub_monologue_hypos;
 
   rclcpp::Publisher<geometry_msgs::msg::PoseWithCovarianceStamped>::SharedPtr pose_pub_;
   rclcpp::Publisher<nav2_msgs::msg::ParticleCloud>::SharedPtr particles_pub_;
   rclcpp::Publisher<mh_amcl_msgs::msg::Info>::SharedPtr info_pub_;
+  rclcpp::Publisher<mh_amcl_msgs::msg::Latencies>::SharedPtr latencies_pub_;
 
   rclcpp::Client<vqa_msgs::srv::Hypothesis>::SharedPtr hypo_client_;
 
@@ -97,7 +133,10 @@ private:
   rclcpp::TimerBase::SharedPtr hypotesys_timer_;
   rclcpp::TimerBase::SharedPtr publish_particles_timer_;
   rclcpp::TimerBase::SharedPtr publish_position_timer_;
+  rclcpp::TimerBase::SharedPtr publish_latencies_timer_;
   rclcpp::CallbackGroup::SharedPtr timer_cb_group_;
+  // map_callback builds the map in its own group, without blocking the other callbacks
+  rclcpp::CallbackGroup::SharedPtr map_cb_group_;
 
   int max_hypotheses_;
   bool multihypothesis_;
@@ -111,14 +150,63 @@ private:
   double hypo_merge_angle_;
   float good_hypo_thereshold_;
   float min_hypo_diff_winner_;
+  std::string sensor_model_;
+  std::string sensor_backend_;
+  double laser_likelihood_max_dist_;
+  int correction_threads_;
+  int max_beams_;
+  std::string beam_selection_;
+  int correction_budget_;
+  int min_candidate_beams_;
+  float promote_hypo_thereshold_;
+  std::string update_mode_;
+  double update_min_d_;
+  double update_min_a_;
+  int resample_interval_;
+  std::string prediction_mode_;
+  double publish_particles_rate_;
+  int particles_decimation_;
+  bool matcher_hypotheses_;
+  mh_amcl::MatcherParams matcher_params_;
+  double matcher_local_radius_;
+  double matcher_local_yaw_window_;
+  double latency_publish_period_;
+  std::string map_cache_dir_;
+  int map_threads_ {0};
+  std::vector<std::string> scan_topics_;
+  double scan_fusion_window_ {0.05};
+
+  nav2_msgs::msg::ParticleCloud particles_msg_;
 
   rclcpp::Time last_time_;
   mh_amcl_msgs::msg::Info info_;
 
+  // Latencies of each step since the last publish_latencies
+  mh_amcl::LatencyHistogram predict_latency_;
+  mh_amcl::LatencyHistogram correct_latency_;
+  mh_amcl::LatencyHistogram reseed_latency_;
+  mh_amcl::LatencyHistogram manage_hypotheses_latency_;
+  mh_amcl::LatencyHistogram publish_markers_latency_;
+  mh_amcl::LatencyHistogram publish_position_latency_;
+
   std::list<std::shared_ptr<ParticlesDistribution>> particles_population_;
   std::shared_ptr<ParticlesDistribution> current_amcl_;
+  std::shared_ptr<mh_amcl::HypothesisContext> hypothesis_context_;
+  std::shared_ptr<mh_amcl::HypothesisPool> hypothesis_pool_;
+  std::shared_ptr<mh_amcl::HypothesisIndex> hypotheses_index_;
   float current_amcl_q_;
 
+  // publish_position runs in its own callback group, so it may run at the same time as
+  // the callbacks that change the hypotheses
+  std::mutex population_mutex_;
+  std::shared_ptr<mh_amcl::ThreadPool> correction_pool_;
+  std::shared_ptr<mh_amcl::CorrectionScheduler> correction_scheduler_;
+  std::shared_ptr<mh_amcl::Relocalizer> relocalizer_;
+  std::shared_ptr<mh_amcl::ThreadPool> map_pool_;
+#ifdef MH_AMCL_CUDA
+  std::shared_ptr<mh_amcl::CudaSensorModel> cuda_sensor_model_;
+#endif
+
   tf2::BufferCore tf_buffer_;
   tf2_ros::TransformListener tf_listener_;
   std::shared_ptr<tf2_ros::TransformBroadcaster> tf_broadcaster_;
@@ -126,15 +214,43 @@ private:
   tf2::Stamped<tf2::Transform> odom2prevbf_;
   bool valid_prev_odom2bf_ {false};
 
-  std::shared_ptr<nav2_costmap_2d::Costmap2D> costmap_;
-  sensor_msgs::msg::LaserScan::UniquePtr last_laser_;
+  // Odometry and hypotheses of the last correction in scan mode
+  tf2::Transform odom2lastcorrection_;
+  bool valid_last_correction_ {false};
+  int counter_at_correction_ {0};
+  int corrections_since_reseed_ {0};
+
+  std::shared_ptr<const mh_amcl::LocalizationMap> map_;
+  uint64_t map_key_ {0};
+  std::shared_ptr<mh_amcl::LikelihoodField> likelihood_field_;
+  // Newest scan, and its endpoints in points_frame_: the frame of the laser, or
+  // base_footprint when the scans of several lasers are merged
+  std::shared_ptr<const sensor_msgs::msg::LaserScan> last_laser_;
+  mh_amcl::ScanPoints last_points_;
+  std::string points_frame_;
+
+  // Last scan of each laser, when there are several, and whether it is not merged yet
+  std::vector<std::shared_ptr<const sensor_msgs::msg::LaserScan>> source_lasers_;
+  std::vector<mh_amcl::ScanPoints> source_points_;
+  std::vector<bool> fresh_sources_;
+  std::vector<mh_amcl::ScanPoints> scheduled_points_;
   std::shared_ptr<mh_amcl::MapMatcher> matcher_;
+
+  // Last pose where the current hypothesis was good, searched first when it gets lost
+  geometry_msgs::msg::Pose last_good_pose_;
+  bool valid_last_good_pose_ {false};
+  bool local_search_running_ {false};
+  bool local_search_failed_ {false};
   std::list<TransformWeighted> hypos_;
   rclcpp::Client<vqa_msgs::srv::Hypothesis>::SharedFuture hypo_future_;
 
 
   void map_callback(const nav_msgs::msg::OccupancyGrid::ConstSharedPtr & msg);
-  void laser_callback(sensor_msgs::msg::LaserScan::UniquePtr lsr_msg);
+  void map_update_callback(const map_msgs::msg::OccupancyGridUpdate::ConstSharedPtr & msg);
+  void laser_callback(sensor_msgs::msg::LaserScan::UniquePtr lsr_msg, size_t source);
+  // Keeps the scan of source, and merges the scans of all the lasers into last_points_ when
+  // they are ready. True if it did.
+  bool fuse_scan(sensor_msgs::msg::LaserScan::UniquePtr lsr_msg, size_t source);
   void initpose_callback(
     const geometry_msgs::msg::PoseWithCovarianceStamped::ConstSharedPtr & pose_msg);
   void monologue_hypos_callback(vqa_msgs::msg::MonologueHypothesis::UniquePtr msg);
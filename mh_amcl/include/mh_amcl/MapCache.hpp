@@ -0,0 +1,184 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MH_AMCL__MAPCACHE_HPP_
+#define MH_AMCL__MAPCACHE_HPP_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "nav_msgs/msg/occupancy_grid.hpp"
+
+namespace mh_amcl
+{
+
+// Artifacts computed from a map (pyramid levels, search grids, distance fields), stored in
+// a binary file that is memory-mapped when read. The file of a map is <directory>/<key>.bin,
+// where the key is a hash of the map data, size, resolution and origin. Each artifact is a
+// named section, whose name should include any parameter it depends on.
+class MapCache
+{
+public:
+  static uint64_t get_key(const nav_msgs::msg::OccupancyGrid & map);
+
+  // Maps the file of key in directory, if it exists and is valid
+  MapCache(const std::string & directory, uint64_t key);
+  ~MapCache();
+
+  MapCache(const MapCache &) = delete;
+  MapCache & operator=(const MapCache &) = delete;
+
+  const std::string & get_path() const {return path_;}
+
+  // Data of a section, valid while this object lives, or nullptr if it is not cached
+  const char * get_section(const std::string & name, size_t & size) const;
+
+  // The section is written by the next save. False, and not added, if name does not fit
+  // in the file, with MAX_NAME - 1 characters at most.
+  bool add_section(const std::string & name, std::vector<char> data);
+
+  // Writes the mapped and the added sections, if any was added. The file is replaced
+  // atomically, so other processes mapping it are not affected.
+  bool save();
+
+protected:
+  static const uint64_t MAGIC = 0x314843414d41484dull;  // "MHAMACH1"
+  static const uint32_t VERSION = 3;
+  static const size_t MAX_NAME = 48;
+  static const size_t ALIGNMENT = 64;
+
+  typedef struct
+  {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t num_sections;
+    uint64_t key;
+    uint64_t file_size;
+  } Header;
+
+  typedef struct
+  {
+    char name[MAX_NAME];
+    uint64_t offset;
+    uint64_t size;
+  } SectionEntry;
+
+  bool map_file();
+
+  std::string path_;
+  uint64_t key_;
+
+  const char * data_ {nullptr};
+  size_t size_ {0};
+  std::vector<std::pair<std::string, std::vector<char>>> added_;
+};
+
+// Serialization of artifacts into sections. All is written in the byte order of the
+// machine, which is part of the reason of the cache being local.
+class SectionWriter
+{
+public:
+  template<class T>
+  void write(const T & value)
+  {
+    static_assert(std::is_trivially_copyable<T>::value, "Only plain data is written");
+    const char * bytes = reinterpret_cast<const char *>(&value);
+    data_.insert(data_.end(), bytes, bytes + sizeof(T));
+  }
+
+  template<class T>
+  void write(const std::vector<T> & values)
+  {
+    static_assert(std::is_trivially_copyable<T>::value, "Only plain data is written");
+    write<uint64_t>(values.size());
+    const char * bytes = reinterpret_cast<const char *>(values.data());
+    data_.insert(data_.end(), bytes, bytes + values.size() * sizeof(T));
+  }
+
+  void write(const unsigned char * values, size_t size)
+  {
+    write<uint64_t>(size);
+    data_.insert(data_.end(), values, values + size);
+  }
+
+  std::vector<char> & get_data() {return data_;}
+
+protected:
+  std::vector<char> data_;
+};
+
+// Reads what SectionWriter wrote. Reads past the end of the section fail, and then
+// is_valid is false and any later read fails too.
+class SectionReader
+{
+public:
+  SectionReader(const char * data, size_t size)
+  : data_(data), size_(data != nullptr ? size : 0), valid_(data != nullptr) {}
+
+  template<class T>
+  bool read(T & value)
+  {
+    static_assert(std::is_trivially_copyable<T>::value, "Only plain data is read");
+    if (!valid_ || size_ - pos_ < sizeof(T)) {
+      valid_ = false;
+      return false;
+    }
+    std::memcpy(&value, data_ + pos_, sizeof(T));
+    pos_ += sizeof(T);
+    return true;
+  }
+
+  template<class T>
+  bool read(std::vector<T> & values)
+  {
+    uint64_t num_values;
+    if (!read(num_values) || num_values > (size_ - pos_) / sizeof(T)) {
+      valid_ = false;
+      return false;
+    }
+    values.resize(num_values);
+    std::memcpy(values.data(), data_ + pos_, num_values * sizeof(T));
+    pos_ += num_values * sizeof(T);
+    return true;
+  }
+
+  // Reads exactly size values
+  bool read(unsigned char * values, size_t size)
+  {
+    uint64_t num_values;
+    if (!read(num_values) || num_values != size || size > size_ - pos_) {
+      valid_ = false;
+      return false;
+    }
+    std::memcpy(values, data_ + pos_, size);
+    pos_ += size;
+    return true;
+  }
+
+  bool is_valid() const {return valid_;}
+
+protected:
+  const char * data_;
+  size_t size_;
+  size_t pos_ {0};
+  bool valid_;
+};
+
+}  // namespace mh_amcl
+
+#endif  // MH_AMCL__MAPCACHE_HPP_
@@ -0,0 +1,32 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MH_AMCL__MAPLOADER_HPP_
+#define MH_AMCL__MAPLOADER_HPP_
+
+#include <string>
+
+#include "nav_msgs/msg/occupancy_grid.hpp"
+
+namespace mh_amcl
+{
+
+// Reads a map_server map: the yaml file and the binary PGM image it points to, for the
+// tools that run without a map server. Only resolution, origin, negate and the
+// thresholds of the yaml are used. Throws std::runtime_error if it can not be read.
+nav_msgs::msg::OccupancyGrid load_map(const std::string & yaml_file);
+
+}  // namespace mh_amcl
+
+#endif  // MH_AMCL__MAPLOADER_HPP_
@@ -15,8 +15,13 @@
 #ifndef MH_AMCL__MAPMATCHER_HPP_
 #define MH_AMCL__MAPMATCHER_HPP_
 
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <list>
 #include <memory>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include "tf2/transform_datatypes.h"
@@ -25,7 +30,11 @@
 #include "sensor_msgs/msg/laser_scan.hpp"
 #include "nav_msgs/msg/occupancy_grid.hpp"
 
-#include "nav2_costmap_2d/costmap_2d.hpp"
+#include "mh_amcl/LocalizationMap.hpp"
+#include "mh_amcl/MapCache.hpp"
+#include "mh_amcl/ScanPoints.hpp"
+#include "mh_amcl/ThreadPool.hpp"
+#include "mh_amcl/TiledGrid.hpp"
 
 #include "rclcpp/rclcpp.hpp"
 
@@ -41,29 +50,153 @@ typedef struct
 
 bool operator<(const TransformWeighted & tw1, const TransformWeighted & tw2);
 
+typedef struct
+{
+  int level {2};  // Level of the map pyramid where the search runs
+  double angular_resolution {0.05};
+  int max_candidates {5};
+  double time_budget {1.0};  // Seconds
+  float min_score {0.5};
+
+  // Candidates closer than this, both in distance and angle, count as the same one
+  double min_distance {0.5};
+  double min_angle {M_PI_2};
+} MatcherParams;
+
+// Poses of a local search: within radius (meters) of (x, y) and yaw_window (radians) of yaw
+typedef struct
+{
+  double x;
+  double y;
+  double yaw;
+  double radius;
+  double yaw_window;
+} SearchRegion;
+
+// Global localization of a scan: finds the poses where most scan points fall on
+// obstacles, with branch and bound (Hess et al., 2016) over windows of positions.
 class MapMatcher
 {
 public:
-  explicit MapMatcher(const nav_msgs::msg::OccupancyGrid & map);
-  std::list<TransformWeighted> get_matchs(const sensor_msgs::msg::LaserScan & scan);
+  // With a cache, the search grids are read from it if they are there, and added otherwise.
+  // With a pool, the rows of tiles of the grids are built in parallel.
+  explicit MapMatcher(
+    const nav_msgs::msg::OccupancyGrid & map, const MatcherParams & params = MatcherParams(),
+    MapCache * cache = nullptr, ThreadPool * pool = nullptr);
 
-protected:
-  static const int NUM_LEVEL_SCALE_COSTMAP = 4;
+  // Shares map, instead of copying it. The search level is limited to its levels.
+  explicit MapMatcher(
+    std::shared_ptr<const LocalizationMap> map,
+    const MatcherParams & params = MatcherParams(), MapCache * cache = nullptr,
+    ThreadPool * pool = nullptr);
+
+  std::list<TransformWeighted> get_matchs(const sensor_msgs::msg::LaserScan & scan) const;
 
-  std::shared_ptr<nav2_costmap_2d::Costmap2D>
-  half_scale(std::shared_ptr<nav2_costmap_2d::Costmap2D> costmap_in);
-  std::vector<tf2::Vector3> laser2points(const sensor_msgs::msg::LaserScan & scan);
+  // The search stops, as when the time budget runs out, once cancel becomes true
   std::list<TransformWeighted> get_matchs(
-    int scale, const std::vector<tf2::Vector3> & scan,
-    float min_x, float min_y, float max_y, float max_x);
-  float match(
-    int scale, const nav2_costmap_2d::Costmap2D & costmap,
-    const std::vector<tf2::Vector3> & scan, tf2::Transform & transform);
+    const ScanPoints & points, const std::atomic<bool> * cancel = nullptr) const;
 
-  std::vector<std::shared_ptr<nav2_costmap_2d::Costmap2D>> costmaps_;
-};
+  // Only the poses in region, with the same grids and time budget. Bounding the search
+  // makes it much faster than the whole map, to recover near a pose that was good.
+  std::list<TransformWeighted> get_matchs(
+    const ScanPoints & points, const SearchRegion & region,
+    const std::atomic<bool> * cancel = nullptr) const;
+
+  // Matcher of map, which differs from the map of this one only in the cells
+  // [min_x, max_x] x [min_y, max_y] of its first level, as LocalizationMap::update() makes
+  // it. It shares the grids out of there, and only computes again the windows over them.
+  // nullptr if map has not the size of the map of this one.
+  std::shared_ptr<MapMatcher> update(
+    std::shared_ptr<const LocalizationMap> map, unsigned int min_x, unsigned int min_y,
+    unsigned int max_x, unsigned int max_y) const;
+
+  // Bytes of the search grids, without the map
+  size_t get_memory_usage() const;
 
-nav_msgs::msg::OccupancyGrid toMsg(const nav2_costmap_2d::Costmap2D & costmap);
+protected:
+  static const int NUM_LEVEL_SCALE_COSTMAP = 4;
+  static const int BNB_DEPTH = 6;
+
+  // Each cell (x, y) has the maximum of the window [x, x + 2^h) x [y, y + 2^h) of the
+  // search level, so it bounds the value of any position in that window
+  typedef struct
+  {
+    int size_x;
+    int size_y;
+    int offset;  // Windows that start before the map begin at cell -offset
+    TiledGrid<unsigned char> data;
+  } MaxGrid;
+
+  typedef struct
+  {
+    int angle;
+    int x;
+    int y;
+    int height;
+    float score;
+  } SearchNode;
+
+  // Cells of the search level where the sensor may be: a box and, inside it, a circle
+  typedef struct
+  {
+    int min_x;
+    int min_y;
+    int max_x;
+    int max_y;
+    double center_x;
+    double center_y;
+    double radius;
+  } SearchBounds;
+
+  typedef std::vector<std::pair<int, int>> DiscreteScan;
+
+  void build_search_grids(ThreadPool * pool);
+
+  std::string get_cache_section() const;
+  bool load(const MapCache & cache);
+  void save(MapCache & cache) const;
+  // Cells of the tile (tx, ty) of the grid of cells with the given cost
+  static void cost_tile(
+    const TiledGrid<unsigned char> & costs, unsigned char cost, unsigned int tx,
+    unsigned int ty, unsigned char * cells);
+  MaxGrid window_max(const MaxGrid & grid_in, int step, ThreadPool * pool) const;
+  void window_max_tile(
+    const MaxGrid & grid_in, const MaxGrid & grid, int step, unsigned int tx, unsigned int ty,
+    unsigned char * cells) const;
+  unsigned char get_max(const MaxGrid & grid, int x, int y) const
+  {
+    x += grid.offset;
+    y += grid.offset;
+    if (x < 0 || y < 0 || x >= grid.size_x || y >= grid.size_y) {
+      return 0;
+    }
+    return grid.data.get(x, y);
+  }
+
+  std::list<TransformWeighted> match(
+    const ScanPoints & points, const std::vector<int> & angles, const SearchBounds & bounds,
+    const std::atomic<bool> * cancel) const;
+
+  // Only the angles given are filled
+  std::vector<DiscreteScan> discretize(
+    const ScanPoints & points, const std::vector<int> & angles) const;
+  float score(int height, const DiscreteScan & scan, int x, int y) const;
+  // Whether the window [x, x + size) x [y, y + size) has cells in bounds
+  static bool in_bounds(const SearchBounds & bounds, int x, int y, int size);
+  void search(
+    const SearchNode & node, const std::vector<DiscreteScan> & scans,
+    const SearchBounds & bounds, std::vector<SearchNode> & candidates,
+    const std::chrono::steady_clock::time_point & deadline,
+    const std::atomic<bool> * cancel) const;
+  void add_candidate(const SearchNode & node, std::vector<SearchNode> & candidates) const;
+
+  MatcherParams params_;
+  double angle_step_;
+
+  std::shared_ptr<const LocalizationMap> map_;
+  std::vector<MaxGrid> hit_grids_;
+  std::vector<MaxGrid> free_grids_;
+};
 
 }  // namespace mh_amcl
 
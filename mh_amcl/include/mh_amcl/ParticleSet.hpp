@@ -0,0 +1,108 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MH_AMCL__PARTICLESET_HPP_
+#define MH_AMCL__PARTICLESET_HPP_
+
+#include <tf2/LinearMath/Transform.h>
+
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+#include "mh_amcl/Pose2.hpp"
+
+namespace mh_amcl
+{
+
+typedef struct
+{
+  tf2::Transform pose;
+  double prob;
+  float hits;
+} Particle;
+
+// Particles stored as structure of arrays. Particles live in the plane, so the pose
+// is (x, y, yaw), with cos(yaw) and sin(yaw) cached for the sensor model. tf2 types are
+// only built when a particle is read back with get() or get_pose().
+class ParticleSet
+{
+public:
+  std::size_t size() const {return x.size();}
+  bool empty() const {return x.empty();}
+
+  void resize(std::size_t n);
+  void reserve(std::size_t n);
+  void clear();
+
+  void set_pose(std::size_t i, double px, double py, double pyaw)
+  {
+    x[i] = px;
+    y[i] = py;
+    yaw[i] = pyaw;
+    cos_yaw[i] = std::cos(pyaw);
+    sin_yaw[i] = std::sin(pyaw);
+  }
+
+  void set_pose(std::size_t i, const Pose2d & pose)
+  {
+    x[i] = pose.x;
+    y[i] = pose.y;
+    yaw[i] = pose.yaw;
+    cos_yaw[i] = pose.cos_yaw;
+    sin_yaw[i] = pose.sin_yaw;
+  }
+
+  Pose2d get_pose2(std::size_t i) const
+  {
+    Pose2d pose;
+    pose.x = x[i];
+    pose.y = y[i];
+    pose.yaw = yaw[i];
+    pose.cos_yaw = cos_yaw[i];
+    pose.sin_yaw = sin_yaw[i];
+    return pose;
+  }
+
+  void set_pose(std::size_t i, const tf2::Transform & pose);
+  tf2::Transform get_pose(std::size_t i) const;
+  tf2::Quaternion get_rotation(std::size_t i) const;
+
+  Particle get(std::size_t i) const;
+  void set(std::size_t i, const Particle & particle);
+  void push_back(const Particle & particle);
+  void push_back(const ParticleSet & other, std::size_t i);
+  void append(const ParticleSet & other);
+
+  // Sort particles in descending order of prob
+  void sort_by_prob();
+
+  std::vector<double> x;
+  std::vector<double> y;
+  std::vector<double> yaw;
+  std::vector<double> cos_yaw;
+  std::vector<double> sin_yaw;
+  std::vector<double> prob;
+  std::vector<float> hits;
+};
+
+// Transform n points by the planar transform (tx, ty, angle), given by cos and sin of
+// its angle: w = R * p + t. Uses AVX2 or NEON when the build enables them.
+void transform_points(
+  double tx, double ty, double cos_t, double sin_t,
+  const double * px, const double * py, std::size_t n, double * wx, double * wy);
+
+}  // namespace mh_amcl
+
+#endif  // MH_AMCL__PARTICLESET_HPP_
@@ -20,9 +20,22 @@
 #include <tf2/LinearMath/Transform.h>
 #include <tf2/transform_datatypes.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <vector>
-#include <random>
+#include <string>
 #include "MapMatcher.hpp"
+#include "LikelihoodField.hpp"
+#include "LocalizationMap.hpp"
+#include "ParticleSet.hpp"
+#include "Pose2.hpp"
+#include "PoseStatistics.hpp"
+#include "RandomGenerator.hpp"
+#include "ScanPoints.hpp"
 
 #include "sensor_msgs/msg/laser_scan.hpp"
 
@@ -33,22 +46,12 @@
 
 #include "mh_amcl_msgs/msg/hypo_info.hpp"
 
-
-#include "nav2_costmap_2d/costmap_2d.hpp"
-
 #include "rclcpp/rclcpp.hpp"
 #include "rclcpp_lifecycle/lifecycle_node.hpp"
 
 namespace mh_amcl
 {
 
-typedef struct
-{
-  tf2::Transform pose;
-  double prob;
-  float hits;
-} Particle;
-
 typedef enum TColor
 {
   RED, GREEN, BLUE, WHITE, GREY, DARK_GREY, BLACK, YELLOW, ORANGE, BROWN, PINK,
@@ -58,19 +61,130 @@ typedef enum TColor
 std_msgs::msg::ColorRGBA
 getColor(Color color_id, double alpha = 1.0);
 
+typedef struct
+{
+  int max_particles;
+  int min_particles;
+  double init_pos_x;
+  double init_pos_y;
+  double init_pos_yaw;
+  double init_error_x;
+  double init_error_y;
+  double init_error_yaw;
+  double translation_noise;
+  double rotation_noise;
+  double distance_perception_error;
+  double reseed_percentage_losers;
+  double reseed_percentage_winners;
+  float good_hypo_thereshold;
+  float low_q_hypo_thereshold;
+  int particles_step;
+  std::string particles_adaptation;
+  std::string resampler;
+  double resample_threshold;
+  double kld_err;
+  double kld_z;
+  double kld_bin_xy;
+  double kld_bin_yaw;
+  std::string particles_marker;
+  int particles_decimation;
+  int random_seed;
+} HypothesisParams;
+
+// What the hypotheses of a node share instead of having their own: the TFs, the publisher
+// of the particles and the parameters
+class HypothesisContext
+{
+public:
+  // Declares the parameters, if they are not declared yet, and listens to the TFs
+  explicit HypothesisContext(rclcpp_lifecycle::LifecycleNode::SharedPtr parent_node);
+
+  // Reads the TFs from tf_buffer, filled by the caller, which must outlive the context
+  HypothesisContext(
+    rclcpp_lifecycle::LifecycleNode::SharedPtr parent_node, tf2::BufferCore & tf_buffer);
+
+  // Snapshot of the parameters, read by the hypotheses until the next call
+  void read_parameters();
+  const HypothesisParams & get_params() const {return params_;}
+
+  // A stream of its own for each call. With random_seed 0 the seed changes in each run;
+  // otherwise the streams repeat since the last read_parameters().
+  void seed(RandomGenerator & generator) {generator.seed(seed_, next_stream_++);}
+
+  // Transform base_footprint -> frame_id. Sensors are mounted on the robot, so it is read
+  // from the TFs once per frame, and shared by the hypotheses and the node until the next
+  // read_parameters(). Safe to call from several threads.
+  bool get_sensor_transform(
+    const std::string & frame_id, const tf2::TimePoint & stamp,
+    tf2::Stamped<tf2::Transform> & bf2sensor, std::string & error);
+
+  rclcpp_lifecycle::LifecycleNode::SharedPtr get_parent_node() const {return parent_node_;}
+  tf2::BufferCore & get_tf_buffer() const {return *tf_buffer_;}
+  rclcpp_lifecycle::LifecyclePublisher<visualization_msgs::msg::MarkerArray>::SharedPtr
+  get_publisher() const {return pub_particles_;}
+
+protected:
+  void declare_parameters();
+
+  rclcpp_lifecycle::LifecycleNode::SharedPtr parent_node_;
+  std::unique_ptr<tf2::BufferCore> own_tf_buffer_;
+  std::unique_ptr<tf2_ros::TransformListener> tf_listener_;
+  tf2::BufferCore * tf_buffer_;
+  rclcpp_lifecycle::LifecyclePublisher<visualization_msgs::msg::MarkerArray>::SharedPtr
+    pub_particles_;
+  HypothesisParams params_ {};
+  uint64_t seed_ {0};
+  std::atomic<uint64_t> next_stream_ {0};
+
+  std::mutex sensors_mutex_;
+  std::map<std::string, tf2::Stamped<tf2::Transform>> sensors_;
+};
+
 class ParticlesDistribution
 {
 public:
+  // With a context of its own, which reads the parameters in each on_configure
   explicit ParticlesDistribution(
     rclcpp_lifecycle::LifecycleNode::SharedPtr parent_node, int id);
 
+  // Shares context with other hypotheses. Its parameters are read by its owner.
+  ParticlesDistribution(std::shared_ptr<HypothesisContext> context, int id);
+
+  void set_id(int id) {info_.id = id;}
+
   void init(const tf2::Transform & pose_init);
   void init(const  std::list<TransformWeighted> & multiple_poses);
   void predict(const tf2::Transform & movement);
   void correct_once(
-    const sensor_msgs::msg::LaserScan & scan, const nav2_costmap_2d::Costmap2D & costmap);
+    const sensor_msgs::msg::LaserScan & scan, const LocalizationMap & map);
+  void correct_once(
+    const sensor_msgs::msg::LaserScan & scan, const LikelihoodField & likelihood_field);
+
+  // correct_once() split in steps, so the node can spread particle chunks over threads.
+  // Chunks only write their own particles; prepare and finish run once per scan.
+  bool prepare_correction(const sensor_msgs::msg::LaserScan & scan);
+  // For points in frame_id, as the scans of several lasers merged in base_footprint
+  bool prepare_correction(const std::string & frame_id, const tf2::TimePoint & stamp);
+  void correct_particles(
+    const sensor_msgs::msg::LaserScan & scan, const ScanPoints & points,
+    const LocalizationMap & map, size_t begin, size_t end);
+  void correct_particles(
+    const ScanPoints & points, const LikelihoodField & likelihood_field,
+    size_t begin, size_t end);
+  void finish_correction(const ScanPoints & points);
+
+  // For the corrections computed out of the hypothesis, as CudaSensorModel does. The pose
+  // of the sensor of the particle i in the map, once prepared, and the weighting of the
+  // particles with hits[i], the sum of the likelihood of the beams of the particle i.
+  Pose2d get_sensor_pose(size_t i) const {return particles_.get_pose2(i) * bf2laser2d_;}
+  void apply_hits(const double * hits);
+
+  // Corrections skipped in a row, by the correction budget of the node
+  void skip_correction() {skipped_corrections_++;}
+  int get_skipped_corrections() const {return skipped_corrections_;}
+
   void reseed();
-  const std::vector<mh_amcl::Particle> & get_particles() const {return particles_;}
+  const ParticleSet & get_particles() const {return particles_;}
 
   using CallbackReturnT =
     rclcpp_lifecycle::node_interfaces::LifecycleNodeInterface::CallbackReturn;
@@ -91,57 +205,75 @@ protected:
   rclcpp_lifecycle::LifecycleNode::SharedPtr parent_node_;
   rclcpp_lifecycle::LifecyclePublisher<visualization_msgs::msg::MarkerArray>::SharedPtr
     pub_particles_;
-
-  tf2::Transform add_noise(const tf2::Transform & dm);
+  std::shared_ptr<HypothesisContext> context_;
+  bool owns_context_ {false};
+  const HypothesisParams & params_;
+
+  bool update_bf2laser(const std::string & frame_id, const tf2::TimePoint & stamp);
+  void update_quality(float num_ranges);
+  void add_hits(size_t i, double hits)
+  {
+    if (hits > 0.0) {
+      particles_.prob[i] = std::max(particles_.prob[i] + hits, 0.000001);
+    }
+    particles_.hits[i] = hits;
+  }
   tf2::Transform get_tranform_to_read(const sensor_msgs::msg::LaserScan & scan, int index);
   double get_error_distance_to_obstacle(
     const tf2::Transform & map2bf, const tf2::Transform & bf2laser,
     const tf2::Transform & laser2point, const sensor_msgs::msg::LaserScan & scan,
-    const nav2_costmap_2d::Costmap2D & costmap, double o);
+    const LocalizationMap & map, double o);
+  // The same, with the point (px, py) in the laser frame, at the end of the beam that starts
+  // at (ox, oy)
+  double get_error_distance_to_obstacle(
+    const Pose2d & map2laser, double px, double py, const LocalizationMap & map, double o,
+    double ox = 0.0, double oy = 0.0);
   unsigned char get_cost(
     const tf2::Transform & transform,
-    const nav2_costmap_2d::Costmap2D & costmap);
+    const LocalizationMap & map);
   void normalize();
-  double normalize_angle(double angle);
-  void update_pose(geometry_msgs::msg::PoseWithCovarianceStamped & pose);
-  void update_covariance(geometry_msgs::msg::PoseWithCovarianceStamped & pose);
+  size_t get_target_size();
+  double get_effective_sample_size() const;
+  void systematic_resample(size_t number_particles);
+  void sort_reseed(size_t number_particles);
+  int count_kld_bins() const;
+  double normalize_angle(double angle) const;
+  void update_pose(
+    const PoseStatistics & stats, geometry_msgs::msg::PoseWithCovarianceStamped & pose);
+  void update_covariance(
+    const PoseStatistics & stats, geometry_msgs::msg::PoseWithCovarianceStamped & pose);
 
   geometry_msgs::msg::PoseWithCovarianceStamped pose_;
 
-  std::random_device rd_;
-  std::mt19937 generator_;
+  RandomGenerator generator_;
+  std::vector<double> noise_tra_;
+  std::vector<double> noise_rot_;
 
-  std::vector<Particle> particles_;
+  ParticleSet particles_;
+  ParticleSet resample_buffer_;
   float quality_;
 
-  tf2::BufferCore tf_buffer_;
-  tf2_ros::TransformListener tf_listener_;
+  std::chrono::steady_clock::time_point correct_start_;
+  int skipped_corrections_ {0};
+
+  tf2::BufferCore & tf_buffer_;
 
   tf2::Stamped<tf2::Transform> bf2laser_;
+  Pose2d bf2laser2d_;
   bool bf2laser_init_ {false};
 
-  // AMCL Parameters
-  int max_particles_;
-  int min_particles_;
-  double init_pos_x_;
-  double init_pos_y_;
-  double init_pos_yaw_;
-  double init_error_x_;
-  double init_error_y_;
-  double init_error_yaw_;
-  double translation_noise_;
-  double rotation_noise_;
-  double distance_perception_error_;
-  double reseed_percentage_losers_;
-  double reseed_percentage_winners_;
-  float good_hypo_thereshold_;
-  float low_q_hypo_thereshold_;
-  int particles_step_;
+  // Reused by publish_particles, only called with the population locked
+  mutable visualization_msgs::msg::MarkerArray markers_msg_;
 
   // Experiments
   mh_amcl_msgs::msg::HypoInfo info_;
 };
 
+// Particles needed so that the error between the sampled and the true distribution is
+// lower than err with probability p, being z the upper 1 - p normal quantile and k the
+// number of occupied histogram bins
+int kld_sample_size(int k, double err, double z);
+
 double weighted_mean(const std::vector<double> & v, const std::vector<double> & w);
 double angle_weighted_mean(const std::vector<double> & v, const std::vector<double> & w);
 double mean(const std::vector<double> & v);
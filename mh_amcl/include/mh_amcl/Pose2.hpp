@@ -0,0 +1,111 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef MH_AMCL__POSE2_HPP_
+#define MH_AMCL__POSE2_HPP_
+
+#include <tf2/LinearMath/Transform.h>
+
+#include <cmath>
+
+namespace mh_amcl
+{
+
+// Yaw of a rotation, as tf2::Matrix3x3::getRPY() gives it, without building the matrix
+template<class T>
+T
+get_yaw(T x, T y, T z, T w)
+{
+  return std::atan2(2 * (w * z + x * y), 1 - 2 * (y * y + z * z));
+}
+
+inline double
+get_yaw(const tf2::Quaternion & q)
+{
+  return get_yaw<double>(q.x(), q.y(), q.z(), q.w());
+}
+
+// A pose in the plane, (x, y, yaw), with cos(yaw) and sin(yaw) cached. Particles, the laser
+// and the motion between predictions are planar; tf2::Transform, with z, roll and pitch,
+// is only used at the interfaces with TF and messages.
+template<class T>
+class Pose2
+{
+public:
+  Pose2() = default;
+  Pose2(T px, T py, T pyaw)
+  : x(px), y(py), yaw(pyaw), cos_yaw(std::cos(pyaw)), sin_yaw(std::sin(pyaw)) {}
+
+  // z, roll and pitch are dropped
+  explicit Pose2(const tf2::Transform & transform)
+  : Pose2(transform.getOrigin().x(), transform.getOrigin().y(),
+      get_yaw(transform.getRotation())) {}
+
+  tf2::Transform to_transform() const
+  {
+    return tf2::Transform(
+      tf2::Quaternion(0.0, 0.0, std::sin(yaw * 0.5), std::cos(yaw * 0.5)),
+      tf2::Vector3(x, y, 0.0));
+  }
+
+  // this * other. yaw is not normalized, but cos and sin are composed without calling them.
+  Pose2 operator*(const Pose2 & other) const
+  {
+    Pose2 result;
+    apply(other.x, other.y, result.x, result.y);
+    result.yaw = yaw + other.yaw;
+    result.cos_yaw = cos_yaw * other.cos_yaw - sin_yaw * other.sin_yaw;
+    result.sin_yaw = sin_yaw * other.cos_yaw + cos_yaw * other.sin_yaw;
+    return result;
+  }
+
+  Pose2 inverse() const
+  {
+    Pose2 result;
+    result.x = -cos_yaw * x - sin_yaw * y;
+    result.y = sin_yaw * x - cos_yaw * y;
+    result.yaw = -yaw;
+    result.cos_yaw = cos_yaw;
+    result.sin_yaw = -sin_yaw;
+    return result;
+  }
+
+  // (wx, wy) = this * (px, py)
+  void apply(T px, T py, T & wx, T & wy) const
+  {
+    wx = x + cos_yaw * px - sin_yaw * py;
+    wy = y + sin_yaw * px + cos_yaw * py;
+  }
+
+  // Only the rotation, for directions
+  void rotate(T px, T py, T & wx, T & wy) const
+  {
+    wx = cos_yaw * px - sin_yaw * py;
+    wy = sin_yaw * px + cos_yaw * py;
+  }
+
+  T x {0};
+  T y {0};
+  T yaw {0};
+  T cos_yaw {1};
+  T sin_yaw {0};
+};
+
+typedef Pose2<double> Pose2d;
+typedef Pose2<float> Pose2f;
+
+}  // namespace mh_amcl
+
+#endif  // MH_AMCL__POSE2_HPP_
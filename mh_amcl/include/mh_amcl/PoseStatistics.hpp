@@ -0,0 +1,88 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MH_AMCL__POSESTATISTICS_HPP_
+#define MH_AMCL__POSESTATISTICS_HPP_
+
+#include <cmath>
+#include <cstddef>
+
+#include "mh_amcl/ParticleSet.hpp"
+
+namespace mh_amcl
+{
+
+// Weighted mean pose and sample covariance of (x, y, yaw), accumulated in one pass
+// without allocations. Values are taken relative to the first particle added, so large
+// map coordinates keep their precision, and yaw differences are wrapped to [-pi, pi].
+class PoseStatistics
+{
+public:
+  PoseStatistics() = default;
+  explicit PoseStatistics(const ParticleSet & particles);
+
+  void add(double x, double y, double yaw, double cos_yaw, double sin_yaw, double w)
+  {
+    if (n_ == 0) {
+      ref_x_ = x;
+      ref_y_ = y;
+      ref_yaw_ = yaw;
+    }
+
+    const double d[3] = {x - ref_x_, y - ref_y_, std::remainder(yaw - ref_yaw_, 2.0 * M_PI)};
+
+    n_++;
+    sum_w_ += w;
+    sum_wx_ += w * x;
+    sum_wy_ += w * y;
+    sum_wcos_ += w * cos_yaw;
+    sum_wsin_ += w * sin_yaw;
+
+    for (int i = 0; i < 3; i++) {
+      sum_[i] += d[i];
+      for (int j = i; j < 3; j++) {
+        sum_prod_[i][j] += d[i] * d[j];
+      }
+    }
+  }
+
+  std::size_t size() const {return n_;}
+
+  // Weighted mean
+  double get_x() const;
+  double get_y() const;
+  double get_yaw() const;
+
+  // Sample covariance, being 0, 1 and 2 the indices of x, y and yaw
+  double get_covariance(int i, int j) const;
+
+protected:
+  std::size_t n_ {0};
+  double ref_x_ {0.0};
+  double ref_y_ {0.0};
+  double ref_yaw_ {0.0};
+
+  double sum_w_ {0.0};
+  double sum_wx_ {0.0};
+  double sum_wy_ {0.0};
+  double sum_wcos_ {0.0};
+  double sum_wsin_ {0.0};
+
+  double sum_[3] {0.0, 0.0, 0.0};
+  double sum_prod_[3][3] {};
+};
+
+}  // namespace mh_amcl
+
+#endif  // MH_AMCL__POSESTATISTICS_HPP_
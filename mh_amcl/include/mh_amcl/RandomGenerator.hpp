@@ -0,0 +1,76 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef MH_AMCL__RANDOMGENERATOR_HPP_
+#define MH_AMCL__RANDOMGENERATOR_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+namespace mh_amcl
+{
+
+// xoshiro256++ (Blackman and Vigna, 2019): four words of state and no divisions, much
+// cheaper than std::mt19937 and its distributions. It is a UniformRandomBitGenerator, so
+// it also works with the std distributions.
+class RandomGenerator
+{
+public:
+  using result_type = uint64_t;
+
+  explicit RandomGenerator(uint64_t seed = 0, uint64_t stream = 0) {this->seed(seed, stream);}
+
+  // Generators with the same seed and different streams give unrelated sequences
+  void seed(uint64_t seed, uint64_t stream = 0);
+
+  static constexpr result_type min() {return 0;}
+  static constexpr result_type max() {return std::numeric_limits<result_type>::max();}
+
+  result_type operator()()
+  {
+    const uint64_t result = rotl(state_[0] + state_[3], 23) + state_[0];
+    const uint64_t t = state_[1] << 17;
+
+    state_[2] ^= state_[0];
+    state_[3] ^= state_[1];
+    state_[1] ^= state_[2];
+    state_[0] ^= state_[3];
+    state_[2] ^= t;
+    state_[3] = rotl(state_[3], 45);
+
+    return result;
+  }
+
+  // In [0, 1), from the 53 upper bits
+  double uniform() {return static_cast<double>((*this)() >> 11) * 0x1.0p-53;}
+
+  // Normal with mean 0 and standard deviation 1
+  double normal();
+
+  // n normals with mean 0 and standard deviation stddev, two per Box-Muller transform
+  void fill_normal(double * out, size_t n, double stddev = 1.0);
+
+protected:
+  static uint64_t rotl(uint64_t x, int k) {return (x << k) | (x >> (64 - k));}
+
+  uint64_t state_[4];
+  double spare_normal_ {0.0};
+  bool has_spare_normal_ {false};
+};
+
+}  // namespace mh_amcl
+
+#endif  // MH_AMCL__RANDOMGENERATOR_HPP_
@@ -0,0 +1,91 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MH_AMCL__RELOCALIZER_HPP_
+#define MH_AMCL__RELOCALIZER_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "mh_amcl/MapMatcher.hpp"
+#include "mh_amcl/ScanPoints.hpp"
+
+namespace mh_amcl
+{
+
+// Runs MapMatcher searches on its own thread, so a global search never delays the
+// tracking of the hypotheses. There is at most one search running at a time.
+class Relocalizer
+{
+public:
+  Relocalizer();
+  ~Relocalizer();
+
+  // Starts a search with a copy of points. Returns false, and does nothing, while the
+  // previous search is running
+  bool request(std::shared_ptr<const MapMatcher> matcher, const ScanPoints & points);
+
+  // The same, only searching region
+  bool request(
+    std::shared_ptr<const MapMatcher> matcher, const ScanPoints & points,
+    const SearchRegion & region);
+
+  // Stops the running search. Its results, and those not taken yet, are discarded
+  void cancel();
+
+  // Moves the results of the last search into matchs. Returns false if there are no new
+  // results. It never blocks.
+  bool take_results(std::list<TransformWeighted> & matchs);
+
+  bool busy() const {return busy_;}
+
+protected:
+  typedef struct
+  {
+    uint64_t generation;
+    std::list<TransformWeighted> matchs;
+  } Results;
+
+  bool request(
+    std::shared_ptr<const MapMatcher> matcher, const ScanPoints & points,
+    const SearchRegion * region);
+  void worker();
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::shared_ptr<const MapMatcher> matcher_;
+  ScanPoints points_;
+  SearchRegion region_ {};
+  bool local_ {false};
+  bool pending_ {false};
+  bool stop_ {false};
+
+  std::atomic<bool> busy_ {false};
+  std::atomic<bool> cancel_ {false};
+  std::atomic<uint64_t> generation_ {0};
+
+  // Single slot from the worker to the caller of take_results
+  std::atomic<Results *> results_ {nullptr};
+
+  std::thread thread_;
+};
+
+}  // namespace mh_amcl
+
+#endif  // MH_AMCL__RELOCALIZER_HPP_
@@ -0,0 +1,100 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MH_AMCL__SCANPOINTS_HPP_
+#define MH_AMCL__SCANPOINTS_HPP_
+
+#include <cstddef>
+#include <vector>
+
+#include "sensor_msgs/msg/laser_scan.hpp"
+
+#include "mh_amcl/Pose2.hpp"
+
+namespace mh_amcl
+{
+
+typedef enum TBeamSelection
+{
+  UNIFORM, ADAPTIVE
+} BeamSelection;
+
+// Endpoints of the valid beams of a scan, in the laser frame. It is computed once per
+// scan and shared by every hypothesis and the map matcher. The cos/sin of each beam
+// angle is kept between scans, and only recomputed when the scan geometry changes.
+class ScanPoints
+{
+public:
+  ScanPoints() = default;
+  explicit ScanPoints(const sensor_msgs::msg::LaserScan & scan) {update(scan);}
+
+  void update(const sensor_msgs::msg::LaserScan & scan);
+
+  // Endpoints of all the sources, one after the other, in the frame where sensor_poses[k]
+  // is the pose of the sensor of sources[k]. Each endpoint keeps the origin of its beam, so
+  // the sources are corrected in a single pass as if they were one scan.
+  void merge(
+    const std::vector<const ScanPoints *> & sources, const std::vector<Pose2d> & sensor_poses);
+
+  // Keep at most max_beams endpoints (0 keeps all). UNIFORM takes them at a fixed stride.
+  // ADAPTIVE drops max range returns, takes half of them at a fixed stride and the rest
+  // where the scan bends, as corners and edges say more about the pose than long walls.
+  void set_max_beams(std::size_t max_beams, BeamSelection selection);
+
+  // Copies n of the endpoints, at a fixed stride, into points. Its equivalent_ranges stay
+  // the same, so hypotheses corrected with fewer beams have comparable qualities.
+  void subsample(std::size_t n, ScanPoints & points) const;
+
+  std::size_t size() const {return x.size();}
+  bool empty() const {return x.empty();}
+
+  // Beams a full scan would have with the same ratio of hits than the selected ones, to
+  // keep the quality comparable whatever the number of beams
+  float equivalent_ranges() const
+  {
+    return num_valid == 0 ? num_ranges : num_ranges * static_cast<float>(size()) / num_valid;
+  }
+
+  std::vector<double> x;
+  std::vector<double> y;
+  std::vector<float> range;
+  std::vector<int> index;  // Position of the beam in scan.ranges
+
+  // Origin of each beam, only after merge(). Otherwise beams start at (0, 0).
+  std::vector<double> origin_x;
+  std::vector<double> origin_y;
+
+  // Beams in the scan, valid or not, and valid beams before the selection
+  std::size_t num_ranges {0};
+  std::size_t num_valid {0};
+
+protected:
+  void update_tables(const sensor_msgs::msg::LaserScan & scan);
+  void select_beams(const sensor_msgs::msg::LaserScan & scan);
+  void uniform_selection(
+    const std::vector<std::size_t> & candidates, std::size_t n, std::vector<char> & selected);
+  void keep(const std::vector<char> & selected);
+
+  std::size_t max_beams_ {0};
+  BeamSelection selection_ {UNIFORM};
+
+  float angle_min_ {0.0f};
+  float angle_increment_ {0.0f};
+  std::vector<double> cos_;
+  std::vector<double> sin_;
+};
+
+}  // namespace mh_amcl
+
+#endif  // MH_AMCL__SCANPOINTS_HPP_
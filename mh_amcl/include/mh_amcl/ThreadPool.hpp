@@ -0,0 +1,64 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MH_AMCL__THREADPOOL_HPP_
+#define MH_AMCL__THREADPOOL_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mh_amcl
+{
+
+// Fixed set of worker threads to split a loop. Each index must write its own data, so
+// results do not depend on which thread runs it.
+class ThreadPool
+{
+public:
+  // num_threads counts the calling thread, so it creates num_threads - 1 workers
+  explicit ThreadPool(unsigned int num_threads);
+  ~ThreadPool();
+
+  unsigned int get_num_threads() const {return workers_.size() + 1;}
+
+  // Runs f(0) ... f(n - 1) and returns when all of them have finished
+  void parallel_for(std::size_t n, const std::function<void(std::size_t)> & f);
+
+protected:
+  void worker();
+  void run_tasks(const std::function<void(std::size_t)> & f, std::size_t n);
+
+  std::vector<std::thread> workers_;
+
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+
+  const std::function<void(std::size_t)> * task_ {nullptr};
+  std::size_t num_tasks_ {0};
+  std::atomic<std::size_t> next_task_ {0};
+  unsigned int active_ {0};
+  uint64_t generation_ {0};
+  bool stop_ {false};
+};
+
+}  // namespace mh_amcl
+
+#endif  // MH_AMCL__THREADPOOL_HPP_
@@ -0,0 +1,285 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef MH_AMCL__TILEDGRID_HPP_
+#define MH_AMCL__TILEDGRID_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "mh_amcl/MapCache.hpp"
+
+namespace mh_amcl
+{
+
+// Grid stored in square tiles of TILE_SIZE x TILE_SIZE cells. A tile whose cells all have
+// the same value, as the unknown space around a building or the inside of a large room,
+// points to a block shared by all of them, so the memory follows the mapped area and not
+// its bounding box. The cells of a tile are contiguous, so the lookups of nearby beams
+// read the same few cache lines.
+//
+// Blocks never change once stored. Copies of a grid share them, and any thread can read
+// a grid without locks.
+template<class T>
+class TiledGrid
+{
+public:
+  static const unsigned int TILE_SHIFT = 6;
+  static const unsigned int TILE_SIZE = 1 << TILE_SHIFT;
+  static const unsigned int TILE_MASK = TILE_SIZE - 1;
+  static const unsigned int TILE_CELLS = TILE_SIZE * TILE_SIZE;
+
+  TiledGrid() = default;
+
+  TiledGrid(unsigned int size_x, unsigned int size_y, T value = T())
+  : size_x_(size_x),
+    size_y_(size_y),
+    tiles_x_((size_x + TILE_MASK) >> TILE_SHIFT),
+    tiles_y_((size_y + TILE_MASK) >> TILE_SHIFT)
+  {
+    blocks_.assign(static_cast<size_t>(tiles_x_) * tiles_y_, get_uniform_block(value));
+    update_tiles();
+  }
+
+  unsigned int get_size_x() const {return size_x_;}
+  unsigned int get_size_y() const {return size_y_;}
+  unsigned int get_tiles_x() const {return tiles_x_;}
+  unsigned int get_tiles_y() const {return tiles_y_;}
+
+  // No bounds checking
+  T get(unsigned int x, unsigned int y) const
+  {
+    return tiles_[(y >> TILE_SHIFT) * tiles_x_ + (x >> TILE_SHIFT)]
+           [((y & TILE_MASK) << TILE_SHIFT) | (x & TILE_MASK)];
+  }
+
+  // Cell (i, j) of the tile is [(j << TILE_SHIFT) + i]
+  const T * get_tile(unsigned int tx, unsigned int ty) const
+  {
+    return tiles_[ty * tiles_x_ + tx];
+  }
+
+  // True, and the value of its cells, if the tile (tx, ty) is a shared block
+  bool is_uniform_tile(unsigned int tx, unsigned int ty, T & value) const
+  {
+    const auto & block = blocks_[ty * tiles_x_ + tx];
+    for (const auto & uniform : uniform_blocks_) {
+      if (uniform.second == block) {
+        value = uniform.first;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Cell (i, j) of the tile is cells[(j << TILE_SHIFT) + i]. Cells out of the grid, in the
+  // last row and column of tiles, are not read.
+  void set_tile(unsigned int tx, unsigned int ty, const std::vector<T> & cells)
+  {
+    const size_t index = ty * tiles_x_ + tx;
+    if (is_uniform(tx, ty, cells.data())) {
+      blocks_[index] = get_uniform_block(cells[0]);
+    } else {
+      auto block = std::make_shared<std::vector<T>>(cells);
+      block->resize(TILE_CELLS);
+      blocks_[index] = std::move(block);
+    }
+    tiles_[index] = blocks_[index]->data();
+  }
+
+  // Sets each cell to f(x, y), one tile at a time
+  template<class F>
+  void fill(F f)
+  {
+    std::vector<T> cells(TILE_CELLS);
+    for (unsigned int ty = 0; ty < tiles_y_; ty++) {
+      for (unsigned int tx = 0; tx < tiles_x_; tx++) {
+        const unsigned int x0 = tx << TILE_SHIFT;
+        const unsigned int y0 = ty << TILE_SHIFT;
+        const unsigned int width = std::min(TILE_SIZE, size_x_ - x0);
+        const unsigned int height = std::min(TILE_SIZE, size_y_ - y0);
+
+        for (unsigned int j = 0; j < height; j++) {
+          for (unsigned int i = 0; i < width; i++) {
+            cells[(j << TILE_SHIFT) + i] = f(x0 + i, y0 + j);
+          }
+        }
+        set_tile(tx, ty, cells);
+      }
+    }
+  }
+
+  // Sets the cells of each tile with f(tx, ty, cells), laid out as in set_tile. The rows of
+  // tiles are given to run(n, g), which has to call g(0) ... g(n - 1), in any order or at
+  // the same time, so f has to be safe to call from several threads.
+  template<class F, class Run>
+  void fill_tiles(F f, Run run)
+  {
+    std::vector<std::shared_ptr<std::vector<T>>> dense(blocks_.size());
+    std::vector<T> values(blocks_.size());
+
+    run(
+      tiles_y_, [&](size_t ty) {
+        auto cells = std::make_shared<std::vector<T>>(TILE_CELLS);
+        for (unsigned int tx = 0; tx < tiles_x_; tx++) {
+          const size_t index = ty * tiles_x_ + tx;
+          f(tx, static_cast<unsigned int>(ty), cells->data());
+          if (is_uniform(tx, static_cast<unsigned int>(ty), cells->data())) {
+            values[index] = (*cells)[0];
+          } else {
+            dense[index] = std::move(cells);
+            cells = std::make_shared<std::vector<T>>(TILE_CELLS);
+          }
+        }
+      });
+
+    // Uniform blocks are shared, so they are only looked up from this thread
+    for (size_t index = 0; index < blocks_.size(); index++) {
+      if (dense[index] != nullptr) {
+        blocks_[index] = std::move(dense[index]);
+      } else {
+        blocks_[index] = get_uniform_block(values[index]);
+      }
+      tiles_[index] = blocks_[index]->data();
+    }
+  }
+
+  // Tiles with a block of their own
+  size_t get_num_dense_tiles() const
+  {
+    size_t num_dense = 0;
+    for (unsigned int ty = 0; ty < tiles_y_; ty++) {
+      for (unsigned int tx = 0; tx < tiles_x_; tx++) {
+        T value;
+        num_dense += !is_uniform_tile(tx, ty, value);
+      }
+    }
+    return num_dense;
+  }
+
+  // Bytes of the blocks and the tile tables
+  size_t get_memory_usage() const
+  {
+    return (get_num_dense_tiles() + uniform_blocks_.size()) * TILE_CELLS * sizeof(T) +
+           blocks_.size() * (sizeof(blocks_[0]) + sizeof(tiles_[0]));
+  }
+
+  // Uniform tiles are written as their value
+  void save(SectionWriter & writer) const
+  {
+    writer.write(size_x_);
+    writer.write(size_y_);
+    for (unsigned int ty = 0; ty < tiles_y_; ty++) {
+      for (unsigned int tx = 0; tx < tiles_x_; tx++) {
+        T value;
+        const uint8_t uniform = is_uniform_tile(tx, ty, value);
+        writer.write(uniform);
+        if (uniform) {
+          writer.write(value);
+        } else {
+          writer.write(*blocks_[ty * tiles_x_ + tx]);
+        }
+      }
+    }
+  }
+
+  bool load(SectionReader & reader)
+  {
+    unsigned int size_x, size_y;
+    if (!reader.read(size_x) || !reader.read(size_y)) {
+      return false;
+    }
+
+    TiledGrid grid(size_x, size_y);
+    std::vector<T> cells;
+    for (unsigned int ty = 0; ty < grid.tiles_y_; ty++) {
+      for (unsigned int tx = 0; tx < grid.tiles_x_; tx++) {
+        uint8_t uniform;
+        if (!reader.read(uniform)) {
+          return false;
+        }
+
+        if (uniform) {
+          T value;
+          if (!reader.read(value)) {
+            return false;
+          }
+          cells.assign(TILE_CELLS, value);
+        } else if (!reader.read(cells) || cells.size() != TILE_CELLS) {
+          return false;
+        }
+        grid.set_tile(tx, ty, cells);
+      }
+    }
+
+    *this = std::move(grid);
+    return true;
+  }
+
+protected:
+  // Whether the cells of the tile (tx, ty) in the grid have all the same value
+  bool is_uniform(unsigned int tx, unsigned int ty, const T * cells) const
+  {
+    const unsigned int width = std::min(TILE_SIZE, size_x_ - (tx << TILE_SHIFT));
+    const unsigned int height = std::min(TILE_SIZE, size_y_ - (ty << TILE_SHIFT));
+
+    bool uniform = true;
+    for (unsigned int j = 0; j < height && uniform; j++) {
+      for (unsigned int i = 0; i < width && uniform; i++) {
+        uniform = cells[(j << TILE_SHIFT) + i] == cells[0];
+      }
+    }
+    return uniform;
+  }
+
+  std::shared_ptr<const std::vector<T>> get_uniform_block(T value)
+  {
+    for (const auto & uniform : uniform_blocks_) {
+      if (uniform.first == value) {
+        return uniform.second;
+      }
+    }
+
+    uniform_blocks_.emplace_back(
+      value, std::make_shared<const std::vector<T>>(TILE_CELLS, value));
+    return uniform_blocks_.back().second;
+  }
+
+  void update_tiles()
+  {
+    tiles_.resize(blocks_.size());
+    for (size_t i = 0; i < blocks_.size(); i++) {
+      tiles_[i] = blocks_[i]->data();
+    }
+  }
+
+  unsigned int size_x_ {0};
+  unsigned int size_y_ {0};
+  unsigned int tiles_x_ {0};
+  unsigned int tiles_y_ {0};
+
+  // tiles_ has the data of blocks_, to read a cell with a single indirection
+  std::vector<std::shared_ptr<const std::vector<T>>> blocks_;
+  std::vector<const T *> tiles_;
+  std::vector<std::pair<T, std::shared_ptr<const std::vector<T>>>> uniform_blocks_;
+};
+
+}  // namespace mh_amcl
+
+#endif  // MH_AMCL__TILEDGRID_HPP_
@@ -0,0 +1,46 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// LTTng-UST tracepoint provider, only used with MH_AMCL_LTTNG. Each step of the localization
+// emits stage_begin and stage_end, with its name, which ros2_tracing can record with
+// `ros2 trace -u mh_amcl:*`.
+
+#undef TRACEPOINT_PROVIDER
+#define TRACEPOINT_PROVIDER mh_amcl
+
+#undef TRACEPOINT_INCLUDE
+#define TRACEPOINT_INCLUDE "mh_amcl/tracepoints.hpp"
+
+#if !defined(MH_AMCL__TRACEPOINTS_HPP_) || defined(TRACEPOINT_HEADER_MULTI_READ)
+#define MH_AMCL__TRACEPOINTS_HPP_
+
+#include <lttng/tracepoint.h>
+
+TRACEPOINT_EVENT(
+  mh_amcl,
+  stage_begin,
+  TP_ARGS(const char *, stage_name),
+  TP_FIELDS(ctf_string(stage, stage_name))
+)
+
+TRACEPOINT_EVENT(
+  mh_amcl,
+  stage_end,
+  TP_ARGS(const char *, stage_name),
+  TP_FIELDS(ctf_string(stage, stage_name))
+)
+
+#endif  // MH_AMCL__TRACEPOINTS_HPP_
+
+#include <lttng/tracepoint-event.h>
@@ -123,6 +123,8 @@ def generate_launch_description():
             name='nav2_container',
             package='rclcpp_components',
             executable='component_container_isolated',
+            # mh_amcl runs its map building and publishing in callback groups of their own
+            arguments=['--use_multi_threaded_executor'],
             parameters=[configured_params, {'autostart': autostart}],
             remappings=remappings,
             output='screen'),
@@ -148,10 +148,11 @@ def generate_launch_description():
                 remappings=remappings),
             ComposableNode(
                 package='mh_amcl',
-                plugin='mh_amcl::AmclNode',
+                plugin='mh_amcl::MH_AMCL_Node',
                 name='mh_amcl',
                 parameters=[configured_params],
-                remappings=remappings),
+                remappings=remappings,
+                extra_arguments=[{'use_intra_process_comms': True}]),
             ComposableNode(
                 package='nav2_lifecycle_manager',
                 plugin='nav2_lifecycle_manager::LifecycleManager',
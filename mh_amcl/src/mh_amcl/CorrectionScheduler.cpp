@@ -0,0 +1,95 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#include <algorithm>
+#include <vector>
+
+#include "mh_amcl/CorrectionScheduler.hpp"
+
+namespace mh_amcl
+{
+
+CorrectionScheduler::CorrectionScheduler(
+  std::size_t budget, std::size_t min_beams, float promote_quality)
+: budget_(budget),
+  min_beams_(std::max<std::size_t>(1, min_beams)),
+  promote_quality_(promote_quality)
+{
+}
+
+std::vector<std::size_t>
+CorrectionScheduler::schedule(
+  const std::vector<CorrectionRequest> & requests, std::size_t num_beams) const
+{
+  if (budget_ == 0) {
+    return std::vector<std::size_t>(requests.size(), num_beams);
+  }
+
+  std::vector<std::size_t> beams(requests.size(), 0);
+  std::size_t left = budget_;
+
+  // Full corrections are taken from the budget even if they do not fit
+  std::vector<std::size_t> candidates;
+  for (std::size_t i = 0; i < requests.size(); i++) {
+    const auto & request = requests[i];
+    if (request.selected || request.quality >= promote_quality_) {
+      beams[i] = num_beams;
+      left -= std::min(left, request.num_particles * num_beams);
+    } else {
+      candidates.push_back(i);
+    }
+  }
+
+  std::stable_sort(
+    candidates.begin(), candidates.end(), [&requests](std::size_t a, std::size_t b) {
+      if (requests[a].skipped != requests[b].skipped) {
+        return requests[a].skipped > requests[b].skipped;
+      }
+      return requests[a].quality > requests[b].quality;
+    });
+
+  // The one that has waited longer always gets min_beams, even if the full corrections
+  // take the whole budget, so none of them waits forever
+  const std::size_t min_beams = std::min(min_beams_, num_beams);
+  if (!candidates.empty()) {
+    const auto i = candidates.front();
+    beams[i] = min_beams;
+    left -= std::min(left, min_beams * requests[i].num_particles);
+  }
+
+  for (auto i : candidates) {
+    const auto & request = requests[i];
+    const float ratio = promote_quality_ > 0.0f ?
+      std::clamp(request.quality / promote_quality_, 0.0f, 1.0f) : 1.0f;
+    const std::size_t wanted = std::max(
+      min_beams, static_cast<std::size_t>(ratio * num_beams));
+    const std::size_t affordable = request.num_particles > 0 ?
+      left / request.num_particles : num_beams;
+
+    // The first one may grow from its min_beams with what is left
+    const std::size_t granted = std::min(wanted, affordable + beams[i]);
+    if (granted == 0 || granted < min_beams || granted <= beams[i]) {
+      continue;
+    }
+
+    left -= (granted - beams[i]) * request.num_particles;
+    beams[i] = granted;
+  }
+
+  return beams;
+}
+
+}  // namespace mh_amcl
@@ -0,0 +1,108 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <cuda_runtime.h>
+#include <math_constants.h>
+
+#include "mh_amcl/CudaKernels.hpp"
+
+namespace mh_amcl
+{
+
+namespace
+{
+
+const unsigned int BLOCK_THREADS = 128;
+
+// As LikelihoodField::get_distance()
+__device__ float
+get_distance(const CudaField & field, float wx, float wy)
+{
+  if (wx < field.origin_x || wy < field.origin_y) {
+    return CUDART_INF_F;
+  }
+
+  const unsigned int mx = static_cast<unsigned int>((wx - field.origin_x) / field.resolution);
+  const unsigned int my = static_cast<unsigned int>((wy - field.origin_y) / field.resolution);
+
+  if (mx >= field.size_x || my >= field.size_y) {
+    return CUDART_INF_F;
+  }
+
+  const unsigned int mask = (1u << field.tile_shift) - 1;
+  const unsigned int tile =
+    field.tiles[(my >> field.tile_shift) * field.tiles_x + (mx >> field.tile_shift)];
+  const unsigned int cell = ((my & mask) << field.tile_shift) | (mx & mask);
+
+  return field.blocks[(static_cast<size_t>(tile) << (2 * field.tile_shift)) + cell];
+}
+
+__global__ void
+correct_kernel(
+  CudaField field, const CudaPose * poses, const CudaPoint * points, float o, float * hits)
+{
+  __shared__ float partial[BLOCK_THREADS];
+
+  const CudaPose pose = poses[blockIdx.x];
+  const float max_error = 3.0f * o;
+  const float normal_comp_1 = 0.3989422804014327f / o;
+
+  // Consecutive threads read consecutive points, and the nearby cells of the same tiles
+  float sum = 0.0f;
+  for (unsigned int j = pose.begin + threadIdx.x; j < pose.end; j += BLOCK_THREADS) {
+    const CudaPoint point = points[j];
+    const float wx = pose.x + pose.cos_yaw * point.x - pose.sin_yaw * point.y;
+    const float wy = pose.y + pose.sin_yaw * point.x + pose.cos_yaw * point.y;
+
+    const float distance = get_distance(field, wx, wy);
+    if (distance < max_error) {
+      const float a = distance / o;
+      sum += fminf(fmaxf(normal_comp_1 * expf(-0.5f * a * a), 0.0f), 1.0f);
+    }
+  }
+
+  partial[threadIdx.x] = sum;
+  __syncthreads();
+
+  for (unsigned int s = BLOCK_THREADS / 2; s > 0; s >>= 1) {
+    if (threadIdx.x < s) {
+      partial[threadIdx.x] += partial[threadIdx.x + s];
+    }
+    __syncthreads();
+  }
+
+  if (threadIdx.x == 0) {
+    hits[blockIdx.x] = partial[0];
+  }
+}
+
+}  // namespace
+
+cudaError_t
+launch_correct(
+  const CudaField & field, const CudaPose * poses, size_t num_poses, const CudaPoint * points,
+  float distance_perception_error, float * hits, cudaStream_t stream)
+{
+  if (num_poses == 0) {
+    return cudaSuccess;
+  }
+
+  correct_kernel<<<static_cast<unsigned int>(num_poses), BLOCK_THREADS, 0, stream>>>(
+    field, poses, points, distance_perception_error, hits);
+
+  return cudaGetLastError();
+}
+
+}  // namespace mh_amcl
@@ -0,0 +1,231 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <cuda_runtime_api.h>
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "mh_amcl/CudaKernels.hpp"
+#include "mh_amcl/CudaSensorModel.hpp"
+
+namespace mh_amcl
+{
+
+namespace
+{
+
+void
+check(cudaError_t error, const char * what)
+{
+  if (error != cudaSuccess) {
+    throw std::runtime_error(std::string(what) + ": " + cudaGetErrorString(error));
+  }
+}
+
+// Buffer in the device memory, which only grows, so the buffers of each scan are reused
+template<class T>
+class DeviceBuffer
+{
+public:
+  DeviceBuffer() = default;
+  DeviceBuffer(const DeviceBuffer &) = delete;
+  DeviceBuffer & operator=(const DeviceBuffer &) = delete;
+  ~DeviceBuffer() {cudaFree(data_);}
+
+  T * data() const {return data_;}
+
+  void upload(const std::vector<T> & values, cudaStream_t stream)
+  {
+    reserve(values.size());
+    check(
+      cudaMemcpyAsync(
+        data_, values.data(), values.size() * sizeof(T), cudaMemcpyHostToDevice, stream),
+      "cudaMemcpyAsync");
+  }
+
+  void download(std::vector<T> & values, size_t size, cudaStream_t stream) const
+  {
+    values.resize(size);
+    check(
+      cudaMemcpyAsync(values.data(), data_, size * sizeof(T), cudaMemcpyDeviceToHost, stream),
+      "cudaMemcpyAsync");
+  }
+
+  void reserve(size_t size)
+  {
+    if (size <= capacity_) {
+      return;
+    }
+
+    check(cudaFree(data_), "cudaFree");
+    data_ = nullptr;
+    capacity_ = 0;
+    check(cudaMalloc(reinterpret_cast<void **>(&data_), size * sizeof(T)), "cudaMalloc");
+    capacity_ = size;
+  }
+
+protected:
+  T * data_ {nullptr};
+  size_t capacity_ {0};
+};
+
+}  // namespace
+
+struct CudaSensorModel::Device
+{
+  cudaStream_t stream {nullptr};
+
+  // Uploaded with each field
+  DeviceBuffer<float> blocks;
+  DeviceBuffer<unsigned int> tiles;
+  CudaField field {};
+  size_t field_bytes {0};
+
+  // Uploaded, or downloaded, with each scan
+  DeviceBuffer<CudaPose> poses;
+  DeviceBuffer<CudaPoint> points;
+  DeviceBuffer<float> hits;
+  std::vector<CudaPose> host_poses;
+  std::vector<CudaPoint> host_points;
+  std::vector<float> host_hits;
+};
+
+CudaSensorModel::CudaSensorModel()
+: device_(std::make_unique<Device>())
+{
+  int num_devices = 0;
+  check(cudaGetDeviceCount(&num_devices), "cudaGetDeviceCount");
+  if (num_devices == 0) {
+    throw std::runtime_error("No CUDA device");
+  }
+
+  check(cudaStreamCreate(&device_->stream), "cudaStreamCreate");
+}
+
+CudaSensorModel::~CudaSensorModel()
+{
+  if (device_->stream != nullptr) {
+    cudaStreamDestroy(device_->stream);
+  }
+}
+
+void
+CudaSensorModel::set_likelihood_field(std::shared_ptr<const LikelihoodField> field)
+{
+  if (field == field_) {
+    return;
+  }
+
+  // Tiles that share a block, as those far from any obstacle, share it in the device too
+  const auto & distances = field->get_distances();
+  std::unordered_map<const float *, unsigned int> block_indices;
+  std::vector<unsigned int> tiles(
+    static_cast<size_t>(distances.get_tiles_x()) * distances.get_tiles_y());
+  std::vector<float> blocks;
+
+  for (unsigned int ty = 0; ty < distances.get_tiles_y(); ty++) {
+    for (unsigned int tx = 0; tx < distances.get_tiles_x(); tx++) {
+      const float * tile = distances.get_tile(tx, ty);
+      const auto inserted = block_indices.emplace(
+        tile, static_cast<unsigned int>(block_indices.size()));
+      if (inserted.second) {
+        blocks.insert(blocks.end(), tile, tile + TiledGrid<float>::TILE_CELLS);
+      }
+      tiles[ty * distances.get_tiles_x() + tx] = inserted.first->second;
+    }
+  }
+
+  // The previous field is not valid once its buffers start to change
+  field_ = nullptr;
+  device_->blocks.upload(blocks, device_->stream);
+  device_->tiles.upload(tiles, device_->stream);
+  check(cudaStreamSynchronize(device_->stream), "cudaStreamSynchronize");
+
+  device_->field.blocks = device_->blocks.data();
+  device_->field.tiles = device_->tiles.data();
+  device_->field.size_x = field->get_size_x();
+  device_->field.size_y = field->get_size_y();
+  device_->field.tiles_x = distances.get_tiles_x();
+  device_->field.tile_shift = TiledGrid<float>::TILE_SHIFT;
+  device_->field.origin_x = field->get_origin_x();
+  device_->field.origin_y = field->get_origin_y();
+  device_->field.resolution = field->get_resolution();
+  device_->field_bytes = blocks.size() * sizeof(float) + tiles.size() * sizeof(unsigned int);
+
+  field_ = field;
+}
+
+void
+CudaSensorModel::correct(
+  const std::vector<const ScanPoints *> & scans, const std::vector<size_t> & first,
+  const std::vector<Pose2d> & poses, double distance_perception_error,
+  std::vector<double> & hits)
+{
+  hits.assign(poses.size(), 0.0);
+  if (field_ == nullptr || poses.empty()) {
+    return;
+  }
+
+  // Each scan is uploaded once, even if it is read by many poses
+  auto & host_poses = device_->host_poses;
+  auto & host_points = device_->host_points;
+  host_poses.resize(poses.size());
+  host_points.clear();
+
+  for (size_t k = 0; k < scans.size(); k++) {
+    const auto begin = static_cast<unsigned int>(host_points.size());
+    for (size_t j = 0; j < scans[k]->size(); j++) {
+      host_points.push_back(
+        {static_cast<float>(scans[k]->x[j]), static_cast<float>(scans[k]->y[j])});
+    }
+    const auto end = static_cast<unsigned int>(host_points.size());
+
+    for (size_t i = first[k]; i < first[k + 1]; i++) {
+      host_poses[i] = {
+        static_cast<float>(poses[i].x), static_cast<float>(poses[i].y),
+        static_cast<float>(poses[i].cos_yaw), static_cast<float>(poses[i].sin_yaw),
+        begin, end};
+    }
+  }
+
+  device_->poses.upload(host_poses, device_->stream);
+  device_->points.upload(host_points, device_->stream);
+  device_->hits.reserve(poses.size());
+
+  check(
+    launch_correct(
+      device_->field, device_->poses.data(), poses.size(), device_->points.data(),
+      static_cast<float>(distance_perception_error), device_->hits.data(), device_->stream),
+    "launch_correct");
+
+  device_->hits.download(device_->host_hits, poses.size(), device_->stream);
+  check(cudaStreamSynchronize(device_->stream), "cudaStreamSynchronize");
+
+  for (size_t i = 0; i < poses.size(); i++) {
+    hits[i] = device_->host_hits[i];
+  }
+}
+
+size_t
+CudaSensorModel::get_memory_usage() const
+{
+  return field_ != nullptr ? device_->field_bytes : 0;
+}
+
+}  // namespace mh_amcl
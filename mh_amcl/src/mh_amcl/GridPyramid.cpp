@@ -0,0 +1,210 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "nav2_costmap_2d/cost_values.hpp"
+
+#include "mh_amcl/GridPyramid.hpp"
+
+namespace mh_amcl
+{
+
+void
+reduce_2x2(
+  const unsigned char * row0, const unsigned char * row1, std::size_t n,
+  PyramidReduction reduction, unsigned char * out)
+{
+  const unsigned char lethal = nav2_costmap_2d::LETHAL_OBSTACLE;
+  const unsigned char free = nav2_costmap_2d::FREE_SPACE;
+  std::size_t k = 0;
+
+  // Four unknown cells give NO_INFORMATION as the first one, so it needs no test of its own
+#if defined(__SSE2__)
+  const __m128i low_bytes = _mm_set1_epi16(0x00ff);
+  const __m128i vlethal = _mm_set1_epi8(static_cast<char>(lethal));
+  const __m128i vfree = _mm_set1_epi8(static_cast<char>(free));
+
+  for (; k + 16 <= n; k += 16) {
+    const __m128i r0a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row0 + 2 * k));
+    const __m128i r0b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row0 + 2 * k + 16));
+    const __m128i r1a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row1 + 2 * k));
+    const __m128i r1b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row1 + 2 * k + 16));
+
+    // Even and odd columns
+    const __m128i a = _mm_packus_epi16(
+      _mm_and_si128(r0a, low_bytes), _mm_and_si128(r0b, low_bytes));
+    const __m128i b = _mm_packus_epi16(_mm_srli_epi16(r0a, 8), _mm_srli_epi16(r0b, 8));
+    const __m128i c = _mm_packus_epi16(
+      _mm_and_si128(r1a, low_bytes), _mm_and_si128(r1b, low_bytes));
+    const __m128i d = _mm_packus_epi16(_mm_srli_epi16(r1a, 8), _mm_srli_epi16(r1b, 8));
+
+    __m128i result;
+    if (reduction == MAX_REDUCTION) {
+      result = _mm_max_epu8(_mm_max_epu8(a, b), _mm_max_epu8(c, d));
+    } else {
+      const __m128i any_lethal = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(a, vlethal), _mm_cmpeq_epi8(b, vlethal)),
+        _mm_or_si128(_mm_cmpeq_epi8(c, vlethal), _mm_cmpeq_epi8(d, vlethal)));
+      const __m128i any_free = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(a, vfree), _mm_cmpeq_epi8(b, vfree)),
+        _mm_or_si128(_mm_cmpeq_epi8(c, vfree), _mm_cmpeq_epi8(d, vfree)));
+
+      result = _mm_or_si128(_mm_andnot_si128(any_free, a), _mm_and_si128(any_free, vfree));
+      result = _mm_or_si128(
+        _mm_andnot_si128(any_lethal, result), _mm_and_si128(any_lethal, vlethal));
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + k), result);
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  const uint8x16_t vlethal = vdupq_n_u8(lethal);
+  const uint8x16_t vfree = vdupq_n_u8(free);
+
+  for (; k + 16 <= n; k += 16) {
+    // Loads even and odd columns apart
+    const uint8x16x2_t r0 = vld2q_u8(row0 + 2 * k);
+    const uint8x16x2_t r1 = vld2q_u8(row1 + 2 * k);
+
+    uint8x16_t result;
+    if (reduction == MAX_REDUCTION) {
+      result = vmaxq_u8(vmaxq_u8(r0.val[0], r0.val[1]), vmaxq_u8(r1.val[0], r1.val[1]));
+    } else {
+      const uint8x16_t any_lethal = vorrq_u8(
+        vorrq_u8(vceqq_u8(r0.val[0], vlethal), vceqq_u8(r0.val[1], vlethal)),
+        vorrq_u8(vceqq_u8(r1.val[0], vlethal), vceqq_u8(r1.val[1], vlethal)));
+      const uint8x16_t any_free = vorrq_u8(
+        vorrq_u8(vceqq_u8(r0.val[0], vfree), vceqq_u8(r0.val[1], vfree)),
+        vorrq_u8(vceqq_u8(r1.val[0], vfree), vceqq_u8(r1.val[1], vfree)));
+
+      result = vbslq_u8(any_free, vfree, r0.val[0]);
+      result = vbslq_u8(any_lethal, vlethal, result);
+    }
+    vst1q_u8(out + k, result);
+  }
+#endif
+
+  for (; k < n; k++) {
+    const unsigned char a = row0[2 * k];
+    const unsigned char b = row0[2 * k + 1];
+    const unsigned char c = row1[2 * k];
+    const unsigned char d = row1[2 * k + 1];
+
+    if (reduction == MAX_REDUCTION) {
+      out[k] = std::max(std::max(a, b), std::max(c, d));
+    } else if (a == lethal || b == lethal || c == lethal || d == lethal) {
+      out[k] = lethal;
+    } else if (a == free || b == free || c == free || d == free) {
+      out[k] = free;
+    } else {
+      out[k] = a;
+    }
+  }
+}
+
+namespace
+{
+
+// Each quarter of the tile (tx, ty) of the result comes from a single tile of grid
+void
+half_scale_tile(
+  const TiledGrid<unsigned char> & grid, PyramidReduction reduction, unsigned int tx,
+  unsigned int ty, unsigned char * cells)
+{
+  typedef TiledGrid<unsigned char> Grid;
+  const unsigned int half = Grid::TILE_SIZE / 2;
+
+  for (unsigned int q = 0; q < 4; q++) {
+    // Quarters with no tile in grid are out of the result
+    const unsigned int in_tx = 2 * tx + (q & 1);
+    const unsigned int in_ty = 2 * ty + (q >> 1);
+    if (in_tx >= grid.get_tiles_x() || in_ty >= grid.get_tiles_y()) {
+      continue;
+    }
+
+    unsigned char * quarter = cells + (((q >> 1) * half) << Grid::TILE_SHIFT) + (q & 1) * half;
+
+    // Both reductions of four equal cells give their value
+    unsigned char value;
+    if (grid.is_uniform_tile(in_tx, in_ty, value)) {
+      for (unsigned int j = 0; j < half; j++) {
+        std::fill_n(quarter + (j << Grid::TILE_SHIFT), half, value);
+      }
+      continue;
+    }
+
+    const unsigned char * in = grid.get_tile(in_tx, in_ty);
+    for (unsigned int j = 0; j < half; j++) {
+      reduce_2x2(
+        in + ((2 * j) << Grid::TILE_SHIFT), in + ((2 * j + 1) << Grid::TILE_SHIFT), half,
+        reduction, quarter + (j << Grid::TILE_SHIFT));
+    }
+  }
+}
+
+}  // namespace
+
+TiledGrid<unsigned char>
+half_scale(
+  const TiledGrid<unsigned char> & grid, PyramidReduction reduction, ThreadPool * pool)
+{
+  TiledGrid<unsigned char> result(grid.get_size_x() / 2, grid.get_size_y() / 2);
+  result.fill_tiles(
+    [&grid, reduction](unsigned int tx, unsigned int ty, unsigned char * cells) {
+      half_scale_tile(grid, reduction, tx, ty, cells);
+    },
+    tile_rows_runner(pool));
+
+  return result;
+}
+
+void
+update_half_scale(
+  const TiledGrid<unsigned char> & grid, PyramidReduction reduction, unsigned int min_x,
+  unsigned int min_y, unsigned int max_x, unsigned int max_y, TiledGrid<unsigned char> & result)
+{
+  typedef TiledGrid<unsigned char> Grid;
+
+  // Cells of result under the region, which may have none on the odd borders of grid
+  const unsigned int out_max_x = std::min(max_x / 2, result.get_size_x() - 1);
+  const unsigned int out_max_y = std::min(max_y / 2, result.get_size_y() - 1);
+  if (result.get_size_x() == 0 || result.get_size_y() == 0 ||
+    min_x / 2 > out_max_x || min_y / 2 > out_max_y)
+  {
+    return;
+  }
+
+  std::vector<unsigned char> cells(Grid::TILE_CELLS);
+  for (unsigned int ty = (min_y / 2) >> Grid::TILE_SHIFT;
+    ty <= (out_max_y >> Grid::TILE_SHIFT); ty++)
+  {
+    for (unsigned int tx = (min_x / 2) >> Grid::TILE_SHIFT;
+      tx <= (out_max_x >> Grid::TILE_SHIFT); tx++)
+    {
+      half_scale_tile(grid, reduction, tx, ty, cells.data());
+      result.set_tile(tx, ty, cells);
+    }
+  }
+}
+
+}  // namespace mh_amcl
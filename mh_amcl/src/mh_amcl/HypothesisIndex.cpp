@@ -0,0 +1,140 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "mh_amcl/HypothesisIndex.hpp"
+
+namespace mh_amcl
+{
+
+HypothesisIndex::HypothesisIndex(double cell_size, double angle_size)
+: cell_size_(std::max(cell_size, 1e-3))
+{
+  // Bins as wide as angle_size, at least, so the whole circle is a whole number of them
+  num_angle_bins_ = std::max(1, static_cast<int>(2.0 * M_PI / std::max(angle_size, 1e-3)));
+  angle_size_ = 2.0 * M_PI / num_angle_bins_;
+}
+
+void
+HypothesisIndex::clear()
+{
+  entries_.clear();
+  ids_.clear();
+  cells_.clear();
+}
+
+void
+HypothesisIndex::insert(std::size_t id, double x, double y, double yaw)
+{
+  cells_[get_key(get_cell(x), get_cell(y), get_angle_bin(yaw))].push_back(entries_.size());
+  entries_.push_back({x, y, yaw});
+  ids_.push_back(id);
+}
+
+void
+HypothesisIndex::query(
+  double x, double y, double yaw, double max_distance, double max_angle,
+  std::vector<std::size_t> & ids) const
+{
+  std::vector<std::size_t> positions;
+  for_each_near(
+    x, y, yaw, max_distance, max_angle, [&positions](std::size_t position) {
+      positions.push_back(position);
+      return true;
+    });
+
+  std::sort(positions.begin(), positions.end());
+  ids.clear();
+  for (auto position : positions) {
+    ids.push_back(ids_[position]);
+  }
+}
+
+bool
+HypothesisIndex::covers(
+  double x, double y, double yaw, double max_distance, double max_angle) const
+{
+  bool covered = false;
+  for_each_near(
+    x, y, yaw, max_distance, max_angle, [&covered](std::size_t) {
+      covered = true;
+      return false;
+    });
+  return covered;
+}
+
+template<class F>
+void
+HypothesisIndex::for_each_near(
+  double x, double y, double yaw, double max_distance, double max_angle, F f) const
+{
+  if (entries_.empty()) {
+    return;
+  }
+
+  const int64_t bin_begin = get_angle_bin(yaw - max_angle);
+  int64_t num_bins = static_cast<int64_t>(std::floor((yaw + max_angle) / angle_size_)) -
+    static_cast<int64_t>(std::floor((yaw - max_angle) / angle_size_)) + 1;
+  num_bins = std::min<int64_t>(num_bins, num_angle_bins_);
+
+  for (int64_t cx = get_cell(x - max_distance); cx <= get_cell(x + max_distance); cx++) {
+    for (int64_t cy = get_cell(y - max_distance); cy <= get_cell(y + max_distance); cy++) {
+      for (int64_t i = 0; i < num_bins; i++) {
+        const auto cell = cells_.find(get_key(cx, cy, (bin_begin + i) % num_angle_bins_));
+        if (cell == cells_.end()) {
+          continue;
+        }
+
+        for (auto position : cell->second) {
+          const auto & entry = entries_[position];
+          const double diff = entry.yaw - yaw;
+          if (std::hypot(entry.x - x, entry.y - y) < max_distance &&
+            std::fabs(std::atan2(std::sin(diff), std::cos(diff))) < max_angle &&
+            !f(position))
+          {
+            return;
+          }
+        }
+      }
+    }
+  }
+}
+
+uint64_t
+HypothesisIndex::get_key(int64_t cx, int64_t cy, int64_t cyaw) const
+{
+  // Cells far apart may share a key, which only costs a few more comparisons
+  return (static_cast<uint64_t>(cx & 0xFFFFFF) << 40) |
+         (static_cast<uint64_t>(cy & 0xFFFFFF) << 16) | static_cast<uint64_t>(cyaw & 0xFFFF);
+}
+
+int64_t
+HypothesisIndex::get_cell(double value) const
+{
+  return static_cast<int64_t>(std::floor(value / cell_size_));
+}
+
+int64_t
+HypothesisIndex::get_angle_bin(double yaw) const
+{
+  const double angle = yaw - 2.0 * M_PI * std::floor(yaw / (2.0 * M_PI));
+  return std::min<int64_t>(static_cast<int64_t>(angle / angle_size_), num_angle_bins_ - 1);
+}
+
+}  // namespace mh_amcl
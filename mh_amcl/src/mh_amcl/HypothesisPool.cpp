@@ -0,0 +1,58 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#include <memory>
+#include <vector>
+
+#include "mh_amcl/HypothesisPool.hpp"
+#include "mh_amcl/ParticlesDistribution.hpp"
+
+namespace mh_amcl
+{
+
+HypothesisPool::HypothesisPool(std::shared_ptr<HypothesisContext> context, std::size_t capacity)
+: context_(context)
+{
+  slots_.reserve(capacity);
+  for (std::size_t i = 0; i < capacity; i++) {
+    slots_.push_back(std::make_shared<ParticlesDistribution>(context_, 0));
+  }
+}
+
+std::shared_ptr<ParticlesDistribution>
+HypothesisPool::acquire(int id)
+{
+  for (auto & slot : slots_) {
+    if (slot.use_count() == 1) {
+      slot->set_id(id);
+      return slot;
+    }
+  }
+
+  return nullptr;
+}
+
+std::size_t
+HypothesisPool::get_num_free() const
+{
+  std::size_t num_free = 0;
+  for (const auto & slot : slots_) {
+    num_free += slot.use_count() == 1;
+  }
+  return num_free;
+}
+
+}  // namespace mh_amcl
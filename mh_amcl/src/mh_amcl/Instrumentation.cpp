@@ -0,0 +1,87 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+
+#include "mh_amcl/Instrumentation.hpp"
+
+namespace mh_amcl
+{
+
+int
+LatencyHistogram::get_bucket(uint64_t value)
+{
+  // The first 2 * SUB_BUCKETS values have a bucket each
+  if (value < 2 * SUB_BUCKETS) {
+    return value;
+  }
+
+  const int msb = 63 - __builtin_clzll(value);
+  const int shift = msb - SUB_BUCKET_BITS;
+  return shift * SUB_BUCKETS + static_cast<int>(value >> shift);
+}
+
+uint64_t
+LatencyHistogram::get_bucket_max(int bucket)
+{
+  if (bucket < 2 * SUB_BUCKETS) {
+    return bucket;
+  }
+
+  const int shift = bucket / SUB_BUCKETS - 1;
+  const uint64_t top = bucket % SUB_BUCKETS + SUB_BUCKETS;
+  return ((top + 1) << shift) - 1;
+}
+
+LatencyHistogram::Snapshot
+LatencyHistogram::take()
+{
+  Snapshot snapshot;
+  snapshot.count = 0;
+  for (int i = 0; i < NUM_BUCKETS; i++) {
+    snapshot.buckets[i] = buckets_[i].exchange(0, std::memory_order_relaxed);
+    snapshot.count += snapshot.buckets[i];
+  }
+
+  count_.store(0, std::memory_order_relaxed);
+  snapshot.max = max_.exchange(0, std::memory_order_relaxed);
+
+  return snapshot;
+}
+
+uint64_t
+LatencyHistogram::get_percentile(const Snapshot & snapshot, double p)
+{
+  if (snapshot.count == 0) {
+    return 0;
+  }
+
+  const uint64_t rank = std::max<uint64_t>(1, std::ceil(p * snapshot.count));
+
+  uint64_t seen = 0;
+  for (int i = 0; i < NUM_BUCKETS; i++) {
+    seen += snapshot.buckets[i];
+    if (seen >= rank) {
+      return std::min(get_bucket_max(i), snapshot.max);
+    }
+  }
+
+  return snapshot.max;
+}
+
+}  // namespace mh_amcl
@@ -0,0 +1,306 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "nav2_costmap_2d/cost_values.hpp"
+
+#include "mh_amcl/LikelihoodField.hpp"
+#include "mh_amcl/LocalizationMap.hpp"
+
+namespace mh_amcl
+{
+
+LikelihoodField::LikelihoodField(
+  const LocalizationMap & map, double max_distance, MapCache * cache)
+: size_x_(map.get_size_x()),
+  size_y_(map.get_size_y()),
+  resolution_(map.get_resolution()),
+  origin_x_(map.get_origin_x()),
+  origin_y_(map.get_origin_y()),
+  max_distance_(max_distance)
+{
+  if (cache != nullptr && load(*cache)) {
+    return;
+  }
+
+  compute_distances(map);
+
+  if (cache != nullptr) {
+    save(*cache);
+  }
+}
+
+LikelihoodField::LikelihoodField(
+  const LikelihoodField & previous, const LocalizationMap & map, unsigned int min_x,
+  unsigned int min_y, unsigned int max_x, unsigned int max_y)
+: LikelihoodField(previous)
+{
+  if (map.get_size_x() != size_x_ || map.get_size_y() != size_y_ || min_x >= size_x_ ||
+    min_y >= size_y_)
+  {
+    return;
+  }
+
+  compute_distances(
+    map, min_x, min_y, std::min(max_x, size_x_ - 1), std::min(max_y, size_y_ - 1));
+}
+
+void
+LikelihoodField::compute_distances(const LocalizationMap & map)
+{
+  const double inf = std::numeric_limits<double>::infinity();
+  const unsigned int max_size = std::max(size_x_, size_y_);
+  const unsigned int tile_size = TiledGrid<float>::TILE_SIZE;
+  const auto & costs = map.get_costs();
+
+  distances_ = TiledGrid<float>(size_x_, size_y_, std::numeric_limits<float>::infinity());
+
+  // Rows of tiles with some obstacle
+  std::vector<bool> obstacles(costs.get_tiles_y(), false);
+  for (unsigned int ty = 0; ty < costs.get_tiles_y(); ty++) {
+    for (unsigned int tx = 0; tx < costs.get_tiles_x() && !obstacles[ty]; tx++) {
+      unsigned char value;
+      if (costs.is_uniform_tile(tx, ty, value)) {
+        obstacles[ty] = value == nav2_costmap_2d::LETHAL_OBSTACLE;
+        continue;
+      }
+
+      const unsigned int y_end = std::min((ty + 1) * tile_size, size_y_);
+      const unsigned int x_end = std::min((tx + 1) * tile_size, size_x_);
+      for (unsigned int j = ty * tile_size; j < y_end && !obstacles[ty]; j++) {
+        for (unsigned int i = tx * tile_size; i < x_end && !obstacles[ty]; i++) {
+          obstacles[ty] = costs.get(i, j) == nav2_costmap_2d::LETHAL_OBSTACLE;
+        }
+      }
+    }
+  }
+
+  std::vector<double> f(max_size), d(max_size), z(max_size + 1);
+  std::vector<int> v(max_size);
+  std::vector<double> sq_dist(static_cast<size_t>(tile_size) * size_x_);
+  std::vector<float> cells(TiledGrid<float>::TILE_CELLS);
+
+  // Obstacles farther than max_distance do not count, so each row of tiles is computed
+  // apart, with the rows of the map up to max_distance above and below it
+  const unsigned int margin = static_cast<unsigned int>(std::ceil(max_distance_ / resolution_));
+  for (unsigned int ty = 0; ty < distances_.get_tiles_y(); ty++) {
+    const unsigned int y0 = ty * tile_size;
+    const unsigned int y1 = std::min(y0 + tile_size, size_y_);
+    const unsigned int begin = y0 > margin ? y0 - margin : 0;
+    const unsigned int end = std::min(y1 + margin, size_y_);
+
+    bool near_obstacles = false;
+    for (unsigned int t = begin / tile_size; t <= (end - 1) / tile_size; t++) {
+      near_obstacles = near_obstacles || obstacles[t];
+    }
+    if (!near_obstacles) {
+      continue;
+    }
+
+    // Squared distance in cells, first along columns and then along rows
+    f.resize(end - begin);
+    d.resize(end - begin);
+    for (unsigned int i = 0; i < size_x_; i++) {
+      for (unsigned int j = begin; j < end; j++) {
+        f[j - begin] = costs.get(i, j) == nav2_costmap_2d::LETHAL_OBSTACLE ? 0.0 : inf;
+      }
+      distance_transform_1d(f, d, v, z);
+      for (unsigned int j = y0; j < y1; j++) {
+        sq_dist[(j - y0) * size_x_ + i] = d[j - begin];
+      }
+    }
+
+    f.resize(size_x_);
+    d.resize(size_x_);
+    for (unsigned int j = 0; j < y1 - y0; j++) {
+      std::copy(sq_dist.begin() + j * size_x_, sq_dist.begin() + (j + 1) * size_x_, f.begin());
+      distance_transform_1d(f, d, v, z);
+      std::copy(d.begin(), d.end(), sq_dist.begin() + j * size_x_);
+    }
+
+    for (unsigned int tx = 0; tx < distances_.get_tiles_x(); tx++) {
+      const unsigned int x0 = tx * tile_size;
+      const unsigned int x1 = std::min(x0 + tile_size, size_x_);
+      for (unsigned int j = 0; j < y1 - y0; j++) {
+        for (unsigned int i = x0; i < x1; i++) {
+          const double dist = std::sqrt(sq_dist[j * size_x_ + i]) * resolution_;
+          cells[j * tile_size + i - x0] = dist <= max_distance_ ?
+            dist : std::numeric_limits<float>::infinity();
+        }
+      }
+      distances_.set_tile(tx, ty, cells);
+    }
+  }
+}
+
+void
+LikelihoodField::compute_distances(
+  const LocalizationMap & map, unsigned int min_x, unsigned int min_y, unsigned int max_x,
+  unsigned int max_y)
+{
+  const double inf = std::numeric_limits<double>::infinity();
+  const unsigned int tile_size = TiledGrid<float>::TILE_SIZE;
+  const auto & costs = map.get_costs();
+
+  // Only the cells up to max_distance from the changed ones may change, and only the
+  // obstacles up to max_distance from these count. Whole tiles are computed again.
+  const unsigned int margin = static_cast<unsigned int>(std::ceil(max_distance_ / resolution_));
+  const unsigned int tx0 = (min_x > margin ? min_x - margin : 0) / tile_size;
+  const unsigned int ty0 = (min_y > margin ? min_y - margin : 0) / tile_size;
+  const unsigned int tx1 = std::min(max_x + margin, size_x_ - 1) / tile_size;
+  const unsigned int ty1 = std::min(max_y + margin, size_y_ - 1) / tile_size;
+
+  const unsigned int out_x0 = tx0 * tile_size;
+  const unsigned int out_y0 = ty0 * tile_size;
+  const unsigned int out_x1 = std::min((tx1 + 1) * tile_size, size_x_);
+  const unsigned int out_y1 = std::min((ty1 + 1) * tile_size, size_y_);
+
+  const unsigned int x0 = out_x0 > margin ? out_x0 - margin : 0;
+  const unsigned int y0 = out_y0 > margin ? out_y0 - margin : 0;
+  const unsigned int x1 = std::min(out_x1 + margin, size_x_);
+  const unsigned int y1 = std::min(out_y1 + margin, size_y_);
+  const unsigned int width = x1 - x0;
+  const unsigned int height = y1 - y0;
+
+  std::vector<double> f(std::max(width, height)), d(f.size()), z(f.size() + 1);
+  std::vector<int> v(f.size());
+  std::vector<double> sq_dist(static_cast<size_t>(width) * height);
+
+  // Squared distance in cells inside the window, first along columns and then along rows
+  f.resize(height);
+  d.resize(height);
+  for (unsigned int i = 0; i < width; i++) {
+    for (unsigned int j = 0; j < height; j++) {
+      f[j] = costs.get(x0 + i, y0 + j) == nav2_costmap_2d::LETHAL_OBSTACLE ? 0.0 : inf;
+    }
+    distance_transform_1d(f, d, v, z);
+    for (unsigned int j = 0; j < height; j++) {
+      sq_dist[static_cast<size_t>(j) * width + i] = d[j];
+    }
+  }
+
+  f.resize(width);
+  d.resize(width);
+  for (unsigned int j = out_y0 - y0; j < out_y1 - y0; j++) {
+    auto row = sq_dist.begin() + static_cast<size_t>(j) * width;
+    std::copy(row, row + width, f.begin());
+    distance_transform_1d(f, d, v, z);
+    std::copy(d.begin(), d.end(), row);
+  }
+
+  std::vector<float> cells(TiledGrid<float>::TILE_CELLS);
+  for (unsigned int ty = ty0; ty <= ty1; ty++) {
+    for (unsigned int tx = tx0; tx <= tx1; tx++) {
+      const unsigned int cx1 = std::min((tx + 1) * tile_size, size_x_);
+      const unsigned int cy1 = std::min((ty + 1) * tile_size, size_y_);
+      for (unsigned int j = ty * tile_size; j < cy1; j++) {
+        for (unsigned int i = tx * tile_size; i < cx1; i++) {
+          const double dist = std::sqrt(
+            sq_dist[static_cast<size_t>(j - y0) * width + i - x0]) * resolution_;
+          cells[(j - ty * tile_size) * tile_size + i - tx * tile_size] =
+            dist <= max_distance_ ? dist : std::numeric_limits<float>::infinity();
+        }
+      }
+      distances_.set_tile(tx, ty, cells);
+    }
+  }
+}
+
+std::string
+LikelihoodField::get_cache_section() const
+{
+  return "likelihood_field_" + std::to_string(std::lround(max_distance_ * 1000.0));
+}
+
+bool
+LikelihoodField::load(const MapCache & cache)
+{
+  size_t size;
+  const char * data = cache.get_section(get_cache_section(), size);
+  SectionReader reader(data, size);
+
+  double max_distance;
+  TiledGrid<float> distances;
+  reader.read(max_distance);
+
+  if (!reader.is_valid() || max_distance != max_distance_ || !distances.load(reader) ||
+    distances.get_size_x() != size_x_ || distances.get_size_y() != size_y_)
+  {
+    return false;
+  }
+
+  distances_ = std::move(distances);
+  return true;
+}
+
+void
+LikelihoodField::save(MapCache & cache) const
+{
+  SectionWriter writer;
+  writer.write(max_distance_);
+  distances_.save(writer);
+
+  cache.add_section(get_cache_section(), std::move(writer.get_data()));
+}
+
+// Felzenszwalb & Huttenlocher lower envelope of parabolas. Infinite samples never
+// contribute a parabola, so a line without obstacles stays infinite.
+void
+LikelihoodField::distance_transform_1d(
+  const std::vector<double> & f, std::vector<double> & d,
+  std::vector<int> & v, std::vector<double> & z) const
+{
+  const double inf = std::numeric_limits<double>::infinity();
+  const int n = f.size();
+
+  int k = -1;
+  for (int q = 0; q < n; q++) {
+    if (std::isinf(f[q])) {continue;}
+
+    const double fq = f[q] + static_cast<double>(q) * q;
+    double s = -inf;
+    while (k >= 0) {
+      const double fv = f[v[k]] + static_cast<double>(v[k]) * v[k];
+      s = (fq - fv) / (2.0 * q - 2.0 * v[k]);
+      if (s > z[k]) {break;}
+      k--;
+    }
+
+    k++;
+    v[k] = q;
+    z[k] = k == 0 ? -inf : s;
+    z[k + 1] = inf;
+  }
+
+  if (k < 0) {
+    std::fill(d.begin(), d.end(), inf);
+    return;
+  }
+
+  k = 0;
+  for (int q = 0; q < n; q++) {
+    while (z[k + 1] < q) {k++;}
+    const double diff = q - v[k];
+    d[q] = diff * diff + f[v[k]];
+  }
+}
+
+}  // namespace mh_amcl
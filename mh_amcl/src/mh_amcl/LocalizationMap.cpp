@@ -0,0 +1,313 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "nav_msgs/msg/occupancy_grid.hpp"
+
+#include "nav2_costmap_2d/cost_values.hpp"
+#include "nav2_costmap_2d/costmap_2d.hpp"
+
+#include "mh_amcl/GridPyramid.hpp"
+#include "mh_amcl/LocalizationMap.hpp"
+
+namespace mh_amcl
+{
+
+namespace
+{
+
+TiledGrid<unsigned char>
+to_tiled(unsigned int size_x, unsigned int size_y, const unsigned char * costs, size_t size)
+{
+  TiledGrid<unsigned char> grid(size_x, size_y);
+  grid.fill(
+    [&](unsigned int x, unsigned int y) {
+      const size_t index = static_cast<size_t>(y) * size_x + x;
+      return index < size ? costs[index] : nav2_costmap_2d::NO_INFORMATION;
+    });
+  return grid;
+}
+
+// Occupancy in [0, 100] is scaled to [FREE_SPACE, LETHAL_OBSTACLE], -1 is unknown
+std::array<unsigned char, 256>
+occupancy_translation()
+{
+  const double scale = static_cast<double>(nav2_costmap_2d::LETHAL_OBSTACLE -
+    nav2_costmap_2d::FREE_SPACE) / 100.0;
+
+  std::array<unsigned char, 256> translation;
+  for (int occupancy = -128; occupancy < 128; occupancy++) {
+    translation[static_cast<uint8_t>(occupancy)] = occupancy < 0 ?
+      nav2_costmap_2d::NO_INFORMATION :
+      static_cast<unsigned char>(std::round(std::min(occupancy, 100) * scale));
+  }
+  return translation;
+}
+
+}  // namespace
+
+LocalizationMap::LocalizationMap(
+  const nav_msgs::msg::OccupancyGrid & map, int num_levels, MapCache * cache,
+  ThreadPool * pool)
+: resolution_(map.info.resolution),
+  origin_x_(map.info.origin.position.x),
+  origin_y_(map.info.origin.position.y),
+  costs_(map.info.width, map.info.height)
+{
+  const auto translation = occupancy_translation();
+
+  // Each row of a tile is a contiguous run of map.data
+  typedef TiledGrid<unsigned char> Grid;
+  const unsigned int size_x = map.info.width;
+  const unsigned int size_y = map.info.height;
+  const size_t size = map.data.size();
+  costs_.fill_tiles(
+    [&](unsigned int tx, unsigned int ty, unsigned char * cells) {
+      const unsigned int x0 = tx << Grid::TILE_SHIFT;
+      const unsigned int y0 = ty << Grid::TILE_SHIFT;
+      const unsigned int width = std::min(Grid::TILE_SIZE, size_x - x0);
+      const unsigned int height = std::min(Grid::TILE_SIZE, size_y - y0);
+
+      for (unsigned int j = 0; j < height; j++) {
+        const size_t row = static_cast<size_t>(y0 + j) * size_x + x0;
+        const unsigned int valid = row >= size ? 0 :
+          static_cast<unsigned int>(std::min<size_t>(width, size - row));
+        unsigned char * out = cells + (j << Grid::TILE_SHIFT);
+        for (unsigned int i = 0; i < valid; i++) {
+          out[i] = translation[static_cast<uint8_t>(map.data[row + i])];
+        }
+        std::fill(out + valid, out + width, nav2_costmap_2d::NO_INFORMATION);
+      }
+    },
+    tile_rows_runner(pool));
+
+  build_levels(num_levels, cache, pool);
+}
+
+LocalizationMap::LocalizationMap(const nav2_costmap_2d::Costmap2D & costmap, int num_levels)
+: LocalizationMap(
+    costmap.getResolution(), costmap.getOriginX(), costmap.getOriginY(),
+    to_tiled(
+      costmap.getSizeInCellsX(), costmap.getSizeInCellsY(), costmap.getCharMap(),
+      static_cast<size_t>(costmap.getSizeInCellsX()) * costmap.getSizeInCellsY()),
+    num_levels)
+{
+}
+
+LocalizationMap::LocalizationMap(
+  unsigned int size_x, unsigned int size_y, double resolution, double origin_x,
+  double origin_y, const std::vector<unsigned char> & costs, int num_levels)
+: LocalizationMap(
+    resolution, origin_x, origin_y, to_tiled(size_x, size_y, costs.data(), costs.size()),
+    num_levels)
+{
+}
+
+LocalizationMap::LocalizationMap(
+  double resolution, double origin_x, double origin_y, TiledGrid<unsigned char> costs,
+  int num_levels)
+: resolution_(resolution),
+  origin_x_(origin_x),
+  origin_y_(origin_y),
+  costs_(std::move(costs))
+{
+  build_levels(num_levels, nullptr, nullptr);
+}
+
+void
+LocalizationMap::build_levels(int num_levels, MapCache * cache, ThreadPool * pool)
+{
+  levels_.clear();
+  for (int level = 1; level < num_levels; level++) {
+    if (cache != nullptr && load_level(*cache, level)) {
+      continue;
+    }
+
+    levels_.push_back(get_level(level - 1).half_scale(pool));
+
+    if (cache != nullptr) {
+      save_level(*cache, level);
+    }
+  }
+}
+
+std::shared_ptr<const LocalizationMap>
+LocalizationMap::half_scale(ThreadPool * pool) const
+{
+  return std::make_shared<const LocalizationMap>(
+    resolution_ * 2.0, origin_x_, origin_y_,
+    mh_amcl::half_scale(costs_, COSTMAP_REDUCTION, pool));
+}
+
+std::shared_ptr<const LocalizationMap>
+LocalizationMap::update(
+  unsigned int x, unsigned int y, unsigned int width, unsigned int height,
+  const std::vector<int8_t> & data) const
+{
+  typedef TiledGrid<unsigned char> Grid;
+
+  if (x >= get_size_x() || y >= get_size_y() || width == 0 || height == 0 ||
+    data.size() < static_cast<size_t>(width) * height)
+  {
+    return nullptr;
+  }
+
+  // The patch may go out of the map, as the map itself may be smaller than the message
+  const unsigned int max_x = std::min(x + width, get_size_x()) - 1;
+  const unsigned int max_y = std::min(y + height, get_size_y()) - 1;
+  const auto translation = occupancy_translation();
+
+  auto map = std::make_shared<LocalizationMap>(*this);
+
+  std::vector<unsigned char> cells;
+  for (unsigned int ty = y >> Grid::TILE_SHIFT; ty <= (max_y >> Grid::TILE_SHIFT); ty++) {
+    for (unsigned int tx = x >> Grid::TILE_SHIFT; tx <= (max_x >> Grid::TILE_SHIFT); tx++) {
+      const unsigned char * tile = costs_.get_tile(tx, ty);
+      cells.assign(tile, tile + Grid::TILE_CELLS);
+
+      const unsigned int x0 = std::max(x, tx << Grid::TILE_SHIFT);
+      const unsigned int y0 = std::max(y, ty << Grid::TILE_SHIFT);
+      const unsigned int x1 = std::min(max_x, ((tx + 1) << Grid::TILE_SHIFT) - 1);
+      const unsigned int y1 = std::min(max_y, ((ty + 1) << Grid::TILE_SHIFT) - 1);
+      for (unsigned int j = y0; j <= y1; j++) {
+        for (unsigned int i = x0; i <= x1; i++) {
+          const int8_t occupancy = data[static_cast<size_t>(j - y) * width + i - x];
+          cells[((j & Grid::TILE_MASK) << Grid::TILE_SHIFT) + (i & Grid::TILE_MASK)] =
+            translation[static_cast<uint8_t>(occupancy)];
+        }
+      }
+      map->costs_.set_tile(tx, ty, cells);
+    }
+  }
+
+  // Each level only changes under the cells that changed in the previous one
+  unsigned int min_level_x = x, min_level_y = y, max_level_x = max_x, max_level_y = max_y;
+  for (size_t level = 0; level < levels_.size(); level++) {
+    auto half = std::make_shared<LocalizationMap>(*levels_[level]);
+    const auto & previous = level == 0 ? map->costs_ : map->levels_[level - 1]->costs_;
+    update_half_scale(
+      previous, COSTMAP_REDUCTION, min_level_x, min_level_y, max_level_x, max_level_y,
+      half->costs_);
+    map->levels_[level] = half;
+
+    min_level_x /= 2;
+    min_level_y /= 2;
+    max_level_x /= 2;
+    max_level_y /= 2;
+  }
+
+  return map;
+}
+
+size_t
+LocalizationMap::get_memory_usage() const
+{
+  size_t bytes = costs_.get_memory_usage();
+  for (const auto & level : levels_) {
+    bytes += level->costs_.get_memory_usage();
+  }
+  return bytes;
+}
+
+bool
+LocalizationMap::load_level(const MapCache & cache, int level)
+{
+  size_t size;
+  const char * data = cache.get_section("map_level" + std::to_string(level), size);
+  SectionReader reader(data, size);
+
+  double resolution, origin_x, origin_y;
+  TiledGrid<unsigned char> costs;
+  reader.read(resolution);
+  reader.read(origin_x);
+  reader.read(origin_y);
+
+  if (!reader.is_valid() || !costs.load(reader) ||
+    costs.get_size_x() != get_level(level - 1).get_size_x() / 2 ||
+    costs.get_size_y() != get_level(level - 1).get_size_y() / 2)
+  {
+    return false;
+  }
+
+  levels_.push_back(
+    std::make_shared<const LocalizationMap>(
+      resolution, origin_x, origin_y, std::move(costs)));
+  return true;
+}
+
+void
+LocalizationMap::save_level(MapCache & cache, int level) const
+{
+  const auto & map = get_level(level);
+
+  SectionWriter writer;
+  writer.write(map.resolution_);
+  writer.write(map.origin_x_);
+  writer.write(map.origin_y_);
+  map.costs_.save(writer);
+
+  cache.add_section("map_level" + std::to_string(level), std::move(writer.get_data()));
+}
+
+nav_msgs::msg::OccupancyGrid
+toMsg(const LocalizationMap & map)
+{
+  nav_msgs::msg::OccupancyGrid grid;
+
+  grid.info.resolution = map.get_resolution();
+  grid.info.width = map.get_size_x();
+  grid.info.height = map.get_size_y();
+
+  double wx, wy;
+  map.map_to_world(0, 0, wx, wy);
+  grid.info.origin.position.x = wx - map.get_resolution() / 2;
+  grid.info.origin.position.y = wy - map.get_resolution() / 2;
+  grid.info.origin.position.z = 0.0;
+  grid.info.origin.orientation.w = 1.0;
+
+  grid.data.resize(grid.info.width * grid.info.height);
+
+  std::vector<char> cost_translation_table(256);
+
+  // special values:
+  cost_translation_table[0] = 0;  // NO obstacle
+  cost_translation_table[253] = 99;  // INSCRIBED obstacle
+  cost_translation_table[254] = 100;  // LETHAL obstacle
+  cost_translation_table[255] = -1;  // UNKNOWN
+
+  // regular cost values scale the range 1 to 252 (inclusive) to fit
+  // into 1 to 98 (inclusive).
+  for (int i = 1; i < 253; i++) {
+    cost_translation_table[i] = static_cast<char>(1 + (97 * (i - 1)) / 251);
+  }
+
+  for (unsigned int j = 0; j < grid.info.height; j++) {
+    for (unsigned int i = 0; i < grid.info.width; i++) {
+      grid.data[j * grid.info.width + i] = cost_translation_table[map.get_cost(i, j)];
+    }
+  }
+
+  return grid;
+}
+
+}  // namespace mh_amcl
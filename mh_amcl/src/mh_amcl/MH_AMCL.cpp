@@ -17,9 +17,18 @@
 #include <Eigen/LU>
 
 #include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <filesystem>
 #include <list>
-
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tf2_ros/buffer_interface.h"
 #include "tf2_ros/transform_listener.h"
 #include "tf2/LinearMath/Transform.h"
 #include "tf2/transform_datatypes.h"
@@ -34,8 +43,8 @@
 #include "nav2_msgs/msg/particle_cloud.hpp"
 #include "nav2_msgs/msg/particle.hpp"
 #include "mh_amcl_msgs/msg/info.hpp"
+#include "mh_amcl_msgs/msg/latencies.hpp"
 
-#include "nav2_costmap_2d/costmap_2d_publisher.hpp"
 #include "nav2_costmap_2d/cost_values.hpp"
 
 #include "mh_amcl/MH_AMCL.hpp"
@@ -49,17 +58,33 @@ namespace mh_amcl
 using std::placeholders::_1;
 using namespace std::chrono_literals;
 
+// Smaller chunks cost more in synchronization than they save
+static constexpr size_t MIN_CORRECTION_CHUNK = 64;
+
 MH_AMCL_Node::MH_AMCL_Node(const rclcpp::NodeOptions & options)
 : nav2_util::LifecycleNode("mh_amcl", "", options),
+  predict_latency_("predict"),
+  correct_latency_("correct"),
+  reseed_latency_("reseed"),
+  manage_hypotheses_latency_("manage_hypotesis"),
+  publish_markers_latency_("publish_markers"),
+  publish_position_latency_("publish_position"),
   tf_buffer_(),
   tf_listener_(tf_buffer_)
 {
   timer_cb_group_ = this->create_callback_group(rclcpp::CallbackGroupType::MutuallyExclusive);
-  sub_laser_ = create_subscription<sensor_msgs::msg::LaserScan>(
-    "scan", rclcpp::QoS(100).best_effort(), std::bind(&MH_AMCL_Node::laser_callback, this, _1));
+  map_cb_group_ = this->create_callback_group(rclcpp::CallbackGroupType::MutuallyExclusive);
+  rclcpp::SubscriptionOptions map_options;
+  map_options.callback_group = map_cb_group_;
+  // Intra-process communication only supports volatile topics, and the map is transient local
+  rclcpp::SubscriptionOptions latched_map_options = map_options;
+  latched_map_options.use_intra_process_comm = rclcpp::IntraProcessSetting::Disable;
   sub_map_ = create_subscription<nav_msgs::msg::OccupancyGrid>(
     "map", rclcpp::QoS(rclcpp::KeepLast(1)).transient_local().reliable(),
-    std::bind(&MH_AMCL_Node::map_callback, this, _1));
+    std::bind(&MH_AMCL_Node::map_callback, this, _1), latched_map_options);
+  sub_map_updates_ = create_subscription<map_msgs::msg::OccupancyGridUpdate>(
+    "map_updates", rclcpp::QoS(10).reliable(),
+    std::bind(&MH_AMCL_Node::map_update_callback, this, _1), map_options);
   sub_init_pose_ = create_subscription<geometry_msgs::msg::PoseWithCovarianceStamped>(
     "initialpose", 100, std::bind(&MH_AMCL_Node::initpose_callback, this, _1));
   sub_monologue_hypos = create_subscription<vqa_msgs::msg::MonologueHypothesis>(
@@ -68,6 +93,7 @@ MH_AMCL_Node::MH_AMCL_Node(const rclcpp::NodeOptions & options)
   pose_pub_ = create_publisher<geometry_msgs::msg::PoseWithCovarianceStamped>("amcl_pose", 1);
   particles_pub_ = create_publisher<nav2_msgs::msg::ParticleCloud>("particle_cloud", 1);
   info_pub_ = create_publisher<mh_amcl_msgs::msg::Info>("info", 1);
+  latencies_pub_ = create_publisher<mh_amcl_msgs::msg::Latencies>("latencies", 1);
   hypo_client_ = create_client<vqa_msgs::srv::Hypothesis>("get_hypothesis");
 
   declare_parameter<int>("max_hypotheses", 5);
@@ -82,6 +108,50 @@ MH_AMCL_Node::MH_AMCL_Node(const rclcpp::NodeOptions & options)
   declare_parameter<double>("hypo_merge_angle", 0.3);
   declare_parameter<float>("good_hypo_thereshold", 0.6);
   declare_parameter<float>("min_hypo_diff_winner", 0.2);
+  declare_parameter<std::string>("sensor_model", "ray_marching");
+  declare_parameter<std::string>("sensor_backend", "cpu");
+  declare_parameter<double>("laser_likelihood_max_dist", 0.5);
+  declare_parameter<int>("correction_threads", 1);
+  declare_parameter<int>("max_beams", 0);
+  declare_parameter<std::string>("beam_selection", "uniform");
+  declare_parameter<int>("correction_budget", 0);
+  declare_parameter<int>("min_candidate_beams", 30);
+  declare_parameter<float>("promote_hypo_thereshold", 0.45f);
+  declare_parameter<std::string>("update_mode", "timers");
+  declare_parameter<double>("update_min_d", 0.25);
+  declare_parameter<double>("update_min_a", 0.2);
+  declare_parameter<int>("resample_interval", 1);
+  declare_parameter<std::string>("prediction_mode", "continuous");
+  declare_parameter<double>("publish_particles_rate", 10.0);
+  declare_parameter<int>("particles_decimation", 1);
+  declare_parameter<int>("random_seed", 0);
+  declare_parameter<bool>("matcher_hypotheses", false);
+  declare_parameter<int>("matcher_level", 2);
+  declare_parameter<double>("matcher_angular_resolution", 0.05);
+  declare_parameter<int>("matcher_max_candidates", 5);
+  declare_parameter<double>("matcher_time_budget", 0.2);
+  declare_parameter<float>("matcher_min_score", 0.5f);
+  declare_parameter<double>("matcher_local_radius", 2.0);
+  declare_parameter<double>("matcher_local_yaw_window", 0.8);
+  declare_parameter<double>("latency_publish_period", 1.0);
+  declare_parameter<std::string>("map_cache_dir", "");
+  declare_parameter<int>("map_threads", 0);
+  declare_parameter<std::vector<std::string>>("scan_topics", {"scan"});
+  declare_parameter<double>("scan_fusion_window", 0.05);
+
+  // One subscription per laser, as they are fixed before configuring
+  get_parameter("scan_topics", scan_topics_);
+  if (scan_topics_.empty()) {
+    scan_topics_.push_back("scan");
+  }
+  for (size_t source = 0; source < scan_topics_.size(); source++) {
+    sub_lasers_.push_back(
+      create_subscription<sensor_msgs::msg::LaserScan>(
+        scan_topics_[source], rclcpp::QoS(100).best_effort(),
+        [this, source](sensor_msgs::msg::LaserScan::UniquePtr lsr_msg) {
+          laser_callback(std::move(lsr_msg), source);
+        }));
+  }
 }
 
 using CallbackReturnT =
@@ -92,6 +162,9 @@ MH_AMCL_Node::on_configure(const rclcpp_lifecycle::State & state)
 {
   RCLCPP_INFO(get_logger(), "Configuring...");
 
+  // map_callback runs in its own callback group and reads the parameters of the map
+  std::unique_lock<std::mutex> lock(population_mutex_);
+
   get_parameter("multihypothesis", multihypothesis_);
   get_parameter("multihypothesis_dialogue", multihypothesis_dialogue_);
   get_parameter("max_hypotheses", max_hypotheses_);
@@ -104,9 +177,139 @@ MH_AMCL_Node::on_configure(const rclcpp_lifecycle::State & state)
   get_parameter("hypo_merge_angle", hypo_merge_angle_);
   get_parameter("good_hypo_thereshold", good_hypo_thereshold_);
   get_parameter("min_hypo_diff_winner", min_hypo_diff_winner_);
+  get_parameter("sensor_model", sensor_model_);
+  get_parameter("sensor_backend", sensor_backend_);
+  get_parameter("laser_likelihood_max_dist", laser_likelihood_max_dist_);
+  get_parameter("correction_threads", correction_threads_);
+  get_parameter("max_beams", max_beams_);
+  get_parameter("beam_selection", beam_selection_);
+  get_parameter("correction_budget", correction_budget_);
+  get_parameter("min_candidate_beams", min_candidate_beams_);
+  get_parameter("promote_hypo_thereshold", promote_hypo_thereshold_);
+  get_parameter("update_mode", update_mode_);
+  get_parameter("update_min_d", update_min_d_);
+  get_parameter("update_min_a", update_min_a_);
+  get_parameter("resample_interval", resample_interval_);
+  get_parameter("prediction_mode", prediction_mode_);
+  get_parameter("publish_particles_rate", publish_particles_rate_);
+  get_parameter("particles_decimation", particles_decimation_);
+  particles_decimation_ = std::max(1, particles_decimation_);
+  get_parameter("matcher_hypotheses", matcher_hypotheses_);
+  get_parameter("matcher_level", matcher_params_.level);
+  get_parameter("matcher_angular_resolution", matcher_params_.angular_resolution);
+  get_parameter("matcher_max_candidates", matcher_params_.max_candidates);
+  get_parameter("matcher_time_budget", matcher_params_.time_budget);
+  get_parameter("matcher_min_score", matcher_params_.min_score);
+  get_parameter("matcher_local_radius", matcher_local_radius_);
+  get_parameter("matcher_local_yaw_window", matcher_local_yaw_window_);
+  get_parameter("latency_publish_period", latency_publish_period_);
+  get_parameter("map_cache_dir", map_cache_dir_);
+  get_parameter("map_threads", map_threads_);
+  get_parameter("scan_fusion_window", scan_fusion_window_);
+  matcher_params_.min_distance = min_candidate_distance_;
+  matcher_params_.min_angle = min_candidate_angle_;
+
+  if (sensor_model_ != "likelihood_field" && sensor_model_ != "ray_marching") {
+    RCLCPP_WARN(
+      get_logger(), "Unknown sensor_model [%s], using ray_marching", sensor_model_.c_str());
+    sensor_model_ = "ray_marching";
+  }
+
+  if (sensor_backend_ != "cpu" && sensor_backend_ != "cuda") {
+    RCLCPP_WARN(
+      get_logger(), "Unknown sensor_backend [%s], using cpu", sensor_backend_.c_str());
+    sensor_backend_ = "cpu";
+  }
+
+  if (beam_selection_ != "uniform" && beam_selection_ != "adaptive") {
+    RCLCPP_WARN(
+      get_logger(), "Unknown beam_selection [%s], using uniform", beam_selection_.c_str());
+    beam_selection_ = "uniform";
+  }
+
+  if (update_mode_ != "timers" && update_mode_ != "scan") {
+    RCLCPP_WARN(get_logger(), "Unknown update_mode [%s], using timers", update_mode_.c_str());
+    update_mode_ = "timers";
+  }
+
+  if (prediction_mode_ != "continuous" && prediction_mode_ != "scan") {
+    RCLCPP_WARN(
+      get_logger(), "Unknown prediction_mode [%s], using continuous", prediction_mode_.c_str());
+    prediction_mode_ = "continuous";
+  }
+  // With several lasers, the beams are selected in each one, and shared among them
+  const size_t num_sources = scan_topics_.size();
+  const size_t max_beams = std::max(0, max_beams_);
+  const auto selection = beam_selection_ == "adaptive" ? ADAPTIVE : UNIFORM;
+  last_points_.set_max_beams(num_sources == 1 ? max_beams : 0, selection);
+  source_lasers_.assign(num_sources, nullptr);
+  source_points_.assign(num_sources, mh_amcl::ScanPoints());
+  fresh_sources_.assign(num_sources, false);
+  for (auto & points : source_points_) {
+    points.set_max_beams((max_beams + num_sources - 1) / num_sources, selection);
+  }
+
+  if (correction_threads_ <= 0) {
+    correction_threads_ = std::max(1u, std::thread::hardware_concurrency());
+  }
+  correction_pool_ = std::make_shared<mh_amcl::ThreadPool>(correction_threads_);
+
+  if (sensor_backend_ == "cuda" && sensor_model_ != "likelihood_field") {
+    RCLCPP_WARN(get_logger(), "sensor_backend cuda needs the likelihood_field, using cpu");
+    sensor_backend_ = "cpu";
+  }
+#ifdef MH_AMCL_CUDA
+  cuda_sensor_model_ = nullptr;
+  if (sensor_backend_ == "cuda") {
+    try {
+      cuda_sensor_model_ = std::make_shared<mh_amcl::CudaSensorModel>();
+      RCLCPP_INFO(get_logger(), "Correcting on the CUDA device");
+    } catch (const std::runtime_error & e) {
+      RCLCPP_WARN(get_logger(), "CUDA not available, using cpu: %s", e.what());
+      sensor_backend_ = "cpu";
+    }
+  }
+#else
+  if (sensor_backend_ == "cuda") {
+    RCLCPP_WARN(get_logger(), "Built without MH_AMCL_CUDA, using cpu");
+    sensor_backend_ = "cpu";
+  }
+#endif
+  hypotheses_index_ = std::make_shared<mh_amcl::HypothesisIndex>(
+    std::max(min_candidate_distance_, hypo_merge_distance_),
+    std::max(min_candidate_angle_, hypo_merge_angle_));
+  correction_scheduler_ = std::make_shared<mh_amcl::CorrectionScheduler>(
+    std::max(0, correction_budget_), std::max(1, min_candidate_beams_),
+    promote_hypo_thereshold_);
+  relocalizer_ = std::make_shared<mh_amcl::Relocalizer>();
+  RCLCPP_INFO(get_logger(), "Correcting with %d threads", correction_threads_);
+
+  if (!map_cache_dir_.empty()) {
+    std::error_code error;
+    std::filesystem::create_directories(map_cache_dir_, error);
+    if (error) {
+      RCLCPP_WARN(
+        get_logger(), "Unable to create map_cache_dir [%s], not caching maps: %s",
+        map_cache_dir_.c_str(), error.message().c_str());
+      map_cache_dir_.clear();
+    }
+  }
+
+  lock.unlock();
+
+  // The map may have arrived before we knew which sensor model to use
+  update_likelihood_field();
 
+  // The hypotheses read the TFs of the node, and share a publisher and the parameters
+  hypothesis_context_ = std::make_shared<mh_amcl::HypothesisContext>(
+    shared_from_this(), tf_buffer_);
+  hypothesis_context_->read_parameters();
+  particles_population_.clear();
+  current_amcl_ = nullptr;
+  hypothesis_pool_ = std::make_shared<mh_amcl::HypothesisPool>(
+    hypothesis_context_, std::max(1, max_hypotheses_));
 
-  current_amcl_ = std::make_shared<ParticlesDistribution>(shared_from_this(), counter_++);
+  current_amcl_ = hypothesis_pool_->acquire(counter_++);
   current_amcl_q_ = 1.0;
 
   particles_population_.push_back(current_amcl_);
@@ -156,16 +359,32 @@ MH_AMCL_Node::on_activate(const rclcpp_lifecycle::State & state)
     RCLCPP_INFO(get_logger(), "multihypothesis_dialogue = false");
   }
 
-  predict_timer_ = create_wall_timer(10ms, std::bind(&MH_AMCL_Node::predict, this));
-  correct_timer_ = create_wall_timer(100ms, std::bind(&MH_AMCL_Node::correct, this));
-  reseed_timer_ = create_wall_timer(3s, std::bind(&MH_AMCL_Node::reseed, this));
+  // In scan mode, each scan runs predict, correct and reseed from laser_callback
+  if (update_mode_ == "timers") {
+    if (prediction_mode_ == "continuous") {
+      predict_timer_ = create_wall_timer(10ms, std::bind(&MH_AMCL_Node::predict, this));
+    }
+    correct_timer_ = create_wall_timer(100ms, std::bind(&MH_AMCL_Node::correct, this));
+    reseed_timer_ = create_wall_timer(3s, std::bind(&MH_AMCL_Node::reseed, this));
+  }
   hypotesys_timer_ = create_wall_timer(4s, std::bind(&MH_AMCL_Node::manage_hypotesis, this));
 
-  publish_particles_timer_ = create_wall_timer(
-    100ms, std::bind(&MH_AMCL_Node::publish_particles, this));
+  if (publish_particles_rate_ > 0.0) {
+    publish_particles_timer_ = create_wall_timer(
+      std::chrono::duration<double>(1.0 / publish_particles_rate_),
+      std::bind(&MH_AMCL_Node::publish_particles, this));
+  }
   publish_position_timer_ = create_wall_timer(
     30ms, std::bind(&MH_AMCL_Node::publish_position, this), timer_cb_group_);
 
+#ifdef MH_AMCL_INSTRUMENTATION
+  if (latency_publish_period_ > 0.0) {
+    publish_latencies_timer_ = create_wall_timer(
+      std::chrono::duration<double>(latency_publish_period_),
+      std::bind(&MH_AMCL_Node::publish_latencies, this));
+  }
+#endif
+
   std::list<CallbackReturnT> ret;
   for (auto & particles : particles_population_) {
     ret.push_back(particles->on_activate(state));
@@ -194,6 +413,7 @@ MH_AMCL_Node::on_deactivate(const rclcpp_lifecycle::State & state)
   reseed_timer_ = nullptr;
   publish_particles_timer_ = nullptr;
   publish_position_timer_ = nullptr;
+  publish_latencies_timer_ = nullptr;
   hypotesys_timer_ = nullptr;
 
   std::list<CallbackReturnT> ret;
@@ -216,6 +436,14 @@ MH_AMCL_Node::on_deactivate(const rclcpp_lifecycle::State & state)
 CallbackReturnT
 MH_AMCL_Node::on_cleanup(const rclcpp_lifecycle::State & state)
 {
+  correction_pool_ = nullptr;
+#ifdef MH_AMCL_CUDA
+  cuda_sensor_model_ = nullptr;
+#endif
+  correction_scheduler_ = nullptr;
+  hypothesis_pool_ = nullptr;
+  hypotheses_index_ = nullptr;
+  relocalizer_ = nullptr;
   return CallbackReturnT::SUCCESS;
 }
 
@@ -234,7 +462,10 @@ MH_AMCL_Node::on_error(const rclcpp_lifecycle::State & state)
 void
 MH_AMCL_Node::publish_particles()
 {
-  auto start = now();
+  MH_AMCL_SCOPED_TIMER(publish_markers_latency_);
+  const auto start = std::chrono::steady_clock::now();
+
+  std::lock_guard<std::mutex> lock(population_mutex_);
 
   Color color = RED;
   int i = 0;
@@ -242,18 +473,57 @@ MH_AMCL_Node::publish_particles()
     color = static_cast<Color>((color + 1) % NUM_COLORS);
     particles->publish_particles(i++, getColor(color));
   }
-  RCLCPP_DEBUG_STREAM(get_logger(), "Publish [" << (now() - start).seconds() << " secs]");
+  RCLCPP_DEBUG_STREAM(
+    get_logger(), "Publish [" << rclcpp::Duration(elapsed_since(start)).seconds() << " secs]");
 }
 
 void
 MH_AMCL_Node::predict()
 {
-  auto start = now();
+  predict_to(tf2::TimePointZero);
+}
 
-  geometry_msgs::msg::TransformStamped odom2bf_msg;
+void
+MH_AMCL_Node::predict_to_scan()
+{
+  tf2::TimePoint stamp;
+  {
+    std::lock_guard<std::mutex> lock(population_mutex_);
+
+    if (last_laser_ == nullptr) {
+      return;
+    }
+
+    // A scan corrected twice has been predicted already
+    stamp = tf2_ros::fromMsg(last_laser_->header.stamp);
+    if (valid_prev_odom2bf_ && odom2prevbf_.stamp_ == stamp) {
+      return;
+    }
+  }
+
+  // All the motion since the previous scan is applied at once, with tf2 interpolating
+  // the odometry at the stamp of the scan
+  predict_to(stamp);
+}
+
+void
+MH_AMCL_Node::predict_to(const tf2::TimePoint & time)
+{
+  MH_AMCL_SCOPED_TIMER(predict_latency_);
+  const auto start = std::chrono::steady_clock::now();
+
+  std::lock_guard<std::mutex> lock(population_mutex_);
+
+  // Odometry may not have reached the time of the scan yet
+  tf2::TimePoint odom_time = time;
   std::string error;
-  if (tf_buffer_.canTransform("odom", "base_footprint", tf2::TimePointZero, &error)) {
-    odom2bf_msg = tf_buffer_.lookupTransform("odom", "base_footprint", tf2::TimePointZero);
+  if (!tf_buffer_.canTransform("odom", "base_footprint", odom_time, &error)) {
+    odom_time = tf2::TimePointZero;
+  }
+
+  geometry_msgs::msg::TransformStamped odom2bf_msg;
+  if (tf_buffer_.canTransform("odom", "base_footprint", odom_time, &error)) {
+    odom2bf_msg = tf_buffer_.lookupTransform("odom", "base_footprint", odom_time);
 
     last_time_ = odom2bf_msg.header.stamp;
 
@@ -272,56 +542,498 @@ MH_AMCL_Node::predict()
     odom2prevbf_ = odom2bf;
   }
 
-  info_.predict_time = now() - start;
+  info_.predict_time = rclcpp::Duration(elapsed_since(start));
 
-  RCLCPP_DEBUG_STREAM(get_logger(), "Predict [" << (now() - start).seconds() << " secs]");
+  RCLCPP_DEBUG_STREAM(
+    get_logger(), "Predict [" << rclcpp::Duration(info_.predict_time).seconds() << " secs]");
 }
 
 void
 MH_AMCL_Node::map_callback(const nav_msgs::msg::OccupancyGrid::ConstSharedPtr & msg)
 {
-  costmap_ = std::make_shared<nav2_costmap_2d::Costmap2D>(*msg);
-  matcher_ = std::make_shared<mh_amcl::MapMatcher>(*msg);
+  // The new map is built without the lock, from a copy of the parameters, so the hypotheses
+  // go on with the previous one until it is swapped in
+  mh_amcl::MatcherParams matcher_params;
+  std::string sensor_model;
+  double likelihood_max_dist;
+  std::string cache_dir;
+  int map_threads;
+  {
+    std::lock_guard<std::mutex> lock(population_mutex_);
+    matcher_params = matcher_params_;
+    sensor_model = sensor_model_;
+    likelihood_max_dist = laser_likelihood_max_dist_;
+    cache_dir = map_cache_dir_;
+    map_threads = map_threads_;
+  }
+
+  // Only used from this callback group, so the pool never runs two loops at once
+  if (map_threads <= 0) {
+    map_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  if (map_pool_ == nullptr || static_cast<int>(map_pool_->get_num_threads()) != map_threads) {
+    map_pool_ = std::make_shared<mh_amcl::ThreadPool>(map_threads);
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+
+  const uint64_t map_key = MapCache::get_key(*msg);
+  auto cache = get_map_cache(cache_dir, map_key);
+
+  // The hypotheses, the likelihood field and the matcher share the map and its levels
+  auto map = std::make_shared<const mh_amcl::LocalizationMap>(
+    *msg, matcher_params.level + 1, cache.get(), map_pool_.get());
+  auto matcher = std::make_shared<mh_amcl::MapMatcher>(
+    map, matcher_params, cache.get(), map_pool_.get());
+  save_map_cache(cache.get());
+
+  RCLCPP_DEBUG_STREAM(
+    get_logger(), "Map matcher [" << rclcpp::Duration(elapsed_since(start)).seconds() <<
+      " secs, " << (map->get_memory_usage() + matcher->get_memory_usage()) / 1024 << " KB]");
+
+  std::shared_ptr<mh_amcl::LikelihoodField> likelihood_field;
+  if (sensor_model == "likelihood_field") {
+    likelihood_field = build_likelihood_field(*map, map_key, likelihood_max_dist, cache_dir);
+  }
+
+  std::lock_guard<std::mutex> lock(population_mutex_);
+
+  map_ = map;
+  map_key_ = map_key;
+  matcher_ = matcher;
+  likelihood_field_ = likelihood_field;
+
+  if (relocalizer_ != nullptr) {
+    relocalizer_->cancel();
+  }
+  valid_last_good_pose_ = false;
+}
+
+void
+MH_AMCL_Node::map_update_callback(const map_msgs::msg::OccupancyGridUpdate::ConstSharedPtr & msg)
+{
+  // Runs in the group of map_callback, so the map can only change here until it returns
+  std::shared_ptr<const mh_amcl::LocalizationMap> map;
+  std::shared_ptr<mh_amcl::MapMatcher> matcher;
+  std::shared_ptr<mh_amcl::LikelihoodField> likelihood_field;
+  {
+    std::lock_guard<std::mutex> lock(population_mutex_);
+    map = map_;
+    matcher = matcher_;
+    likelihood_field = likelihood_field_;
+  }
+
+  if (map == nullptr) {
+    RCLCPP_WARN(get_logger(), "Map update received before the map, not applied");
+    return;
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+
+  // Only the tiles under the patch, and the cells of the levels, grids and distances that
+  // depend on them, are computed again. The rest is shared with the previous map.
+  auto updated = map->update(msg->x, msg->y, msg->width, msg->height, msg->data);
+  if (updated == nullptr) {
+    RCLCPP_WARN(
+      get_logger(), "Map update [%d, %d] %u x %u out of the map, not applied", msg->x, msg->y,
+      msg->width, msg->height);
+    return;
+  }
+
+  const unsigned int max_x = std::min(msg->x + msg->width, updated->get_size_x()) - 1;
+  const unsigned int max_y = std::min(msg->y + msg->height, updated->get_size_y()) - 1;
+  if (matcher != nullptr) {
+    matcher = matcher->update(updated, msg->x, msg->y, max_x, max_y);
+  }
+  if (likelihood_field != nullptr) {
+    likelihood_field = std::make_shared<mh_amcl::LikelihoodField>(
+      *likelihood_field, *updated, msg->x, msg->y, max_x, max_y);
+  }
+
+  RCLCPP_DEBUG_STREAM(
+    get_logger(), "Map update [" << rclcpp::Duration(elapsed_since(start)).seconds() <<
+      " secs, " << msg->width << " x " << msg->height << " cells]");
+
+  {
+    std::lock_guard<std::mutex> lock(population_mutex_);
+
+    // The field may have been built meanwhile by on_configure
+    if (likelihood_field_ != nullptr && likelihood_field == nullptr) {
+      likelihood_field = std::make_shared<mh_amcl::LikelihoodField>(
+        *likelihood_field_, *updated, msg->x, msg->y, max_x, max_y);
+    }
+
+    // The map no longer has the key of the cached one
+    map_ = updated;
+    map_key_ = 0;
+    matcher_ = matcher;
+    likelihood_field_ = likelihood_field;
+  }
+
+  // The field of the previous map may have been dropped by on_configure, if it finished after
+  // this update. Then it is built for the whole map.
+  update_likelihood_field();
+}
+
+std::unique_ptr<MapCache>
+MH_AMCL_Node::get_map_cache(const std::string & cache_dir, uint64_t map_key)
+{
+  if (cache_dir.empty() || map_key == 0) {
+    return nullptr;
+  }
+
+  return std::make_unique<MapCache>(cache_dir, map_key);
+}
+
+void
+MH_AMCL_Node::save_map_cache(MapCache * cache)
+{
+  if (cache != nullptr && !cache->save()) {
+    RCLCPP_WARN(get_logger(), "Unable to write map cache [%s]", cache->get_path().c_str());
+  }
+}
+
+void
+MH_AMCL_Node::update_likelihood_field()
+{
+  std::shared_ptr<const mh_amcl::LocalizationMap> map;
+  uint64_t map_key;
+  {
+    std::lock_guard<std::mutex> lock(population_mutex_);
+    if (map_ == nullptr || likelihood_field_ != nullptr ||
+      sensor_model_ != "likelihood_field")
+    {
+      return;
+    }
+    map = map_;
+    map_key = map_key_;
+  }
+
+  auto likelihood_field = build_likelihood_field(
+    *map, map_key, laser_likelihood_max_dist_, map_cache_dir_);
+
+  // A map that arrived meanwhile brought its own field
+  std::lock_guard<std::mutex> lock(population_mutex_);
+  if (map_ == map) {
+    likelihood_field_ = likelihood_field;
+  }
+}
+
+std::shared_ptr<mh_amcl::LikelihoodField>
+MH_AMCL_Node::build_likelihood_field(
+  const mh_amcl::LocalizationMap & map, uint64_t map_key, double max_dist,
+  const std::string & cache_dir)
+{
+  const auto start = std::chrono::steady_clock::now();
+  auto cache = get_map_cache(cache_dir, map_key);
+  auto likelihood_field = std::make_shared<mh_amcl::LikelihoodField>(
+    map, max_dist, cache.get());
+  save_map_cache(cache.get());
+
+  RCLCPP_DEBUG_STREAM(
+    get_logger(), "Likelihood field [" << rclcpp::Duration(elapsed_since(start)).seconds() <<
+      " secs, " << likelihood_field->get_memory_usage() / 1024 << " KB]");
+
+  return likelihood_field;
+}
+
+void
+MH_AMCL_Node::laser_callback(sensor_msgs::msg::LaserScan::UniquePtr lsr_msg, size_t source)
+{
+  {
+    std::lock_guard<std::mutex> lock(population_mutex_);
+
+    // Shared by all the hypotheses
+    if (scan_topics_.size() == 1) {
+      last_points_.update(*lsr_msg);
+      points_frame_ = lsr_msg->header.frame_id;
+      last_laser_ = std::move(lsr_msg);
+    } else if (!fuse_scan(std::move(lsr_msg), source)) {
+      return;
+    }
+  }
+
+  if (update_mode_ == "scan" &&
+    get_current_state().id() == lifecycle_msgs::msg::State::PRIMARY_STATE_ACTIVE)
+  {
+    process_scan();
+  }
+}
+
+bool
+MH_AMCL_Node::fuse_scan(sensor_msgs::msg::LaserScan::UniquePtr lsr_msg, size_t source)
+{
+  // Too early, before on_configure
+  if (source >= source_lasers_.size() || hypothesis_context_ == nullptr) {
+    return false;
+  }
+
+  source_points_[source].update(*lsr_msg);
+  source_lasers_[source] = std::move(lsr_msg);
+  fresh_sources_[source] = true;
+
+  // Merged once every laser has a new scan, or once the oldest new one is out of the
+  // window, so a laser that stops publishing only delays the others by the window
+  const rclcpp::Time newest(source_lasers_[source]->header.stamp);
+  rclcpp::Time oldest = newest;
+  bool complete = true;
+  for (size_t k = 0; k < source_lasers_.size(); k++) {
+    if (fresh_sources_[k]) {
+      oldest = std::min(oldest, rclcpp::Time(source_lasers_[k]->header.stamp));
+    } else {
+      complete = false;
+    }
+  }
+  if (!complete && (newest - oldest).seconds() <= scan_fusion_window_) {
+    return false;
+  }
+
+  // Endpoints in base_footprint, with the mounting of each laser read from the TFs once
+  std::vector<const mh_amcl::ScanPoints *> points;
+  std::vector<mh_amcl::Pose2d> sensor_poses;
+  for (size_t k = 0; k < source_lasers_.size(); k++) {
+    if (!fresh_sources_[k]) {continue;}
+    fresh_sources_[k] = false;
+
+    const auto & scan = *source_lasers_[k];
+    if ((newest - rclcpp::Time(scan.header.stamp)).seconds() > scan_fusion_window_) {
+      continue;
+    }
+
+    tf2::Stamped<tf2::Transform> bf2laser;
+    std::string error;
+    if (!hypothesis_context_->get_sensor_transform(
+        scan.header.frame_id, tf2_ros::fromMsg(scan.header.stamp), bf2laser, error))
+    {
+      RCLCPP_WARN(
+        get_logger(), "Timeout while waiting TF %s -> base_footprint [%s]",
+        scan.header.frame_id.c_str(), error.c_str());
+      continue;
+    }
+
+    points.push_back(&source_points_[k]);
+    sensor_poses.emplace_back(bf2laser);
+  }
+
+  if (points.empty()) {
+    return false;
+  }
+
+  last_points_.merge(points, sensor_poses);
+  points_frame_ = "base_footprint";
+  last_laser_ = source_lasers_[source];
+  return true;
 }
 
 void
-MH_AMCL_Node::laser_callback(sensor_msgs::msg::LaserScan::UniquePtr lsr_msg)
+MH_AMCL_Node::process_scan()
+{
+  // Timers and subscriptions share the default callback group, so last_laser_ can not
+  // change until this returns
+  predict_to_scan();
+
+  if (!moved_enough()) {
+    RCLCPP_DEBUG(get_logger(), "Correction skipped, the robot has not moved");
+    return;
+  }
+
+  correct();
+
+  {
+    std::lock_guard<std::mutex> lock(population_mutex_);
+    odom2lastcorrection_ = odom2prevbf_;
+    valid_last_correction_ = valid_prev_odom2bf_;
+    counter_at_correction_ = counter_;
+  }
+
+  if (++corrections_since_reseed_ >= resample_interval_) {
+    corrections_since_reseed_ = 0;
+    reseed();
+  }
+}
+
+bool
+MH_AMCL_Node::moved_enough()
 {
-  last_laser_ = std::move(lsr_msg);
+  std::lock_guard<std::mutex> lock(population_mutex_);
+
+  // New hypotheses have to be corrected even if the robot is stopped
+  if (!valid_last_correction_ || !valid_prev_odom2bf_ || counter_ != counter_at_correction_) {
+    return true;
+  }
+
+  const Pose2d motion(odom2lastcorrection_.inverse() * odom2prevbf_);
+
+  return std::hypot(motion.x, motion.y) >= update_min_d_ || std::fabs(motion.yaw) >= update_min_a_;
 }
 
 void
 MH_AMCL_Node::correct()
 {
-  auto start = now();
+  if (update_mode_ == "timers" && prediction_mode_ == "scan") {
+    predict_to_scan();
+  }
+
+  MH_AMCL_SCOPED_TIMER(correct_latency_);
+  const auto start = std::chrono::steady_clock::now();
+
+  std::lock_guard<std::mutex> lock(population_mutex_);
 
-  if (last_laser_ == nullptr || last_laser_->ranges.empty() || costmap_ == nullptr) {
+  if (last_laser_ == nullptr || last_laser_->ranges.empty() || map_ == nullptr) {
     return;
   }
 
+  // TFs are read here, so threads only evaluate particles
+  std::vector<std::shared_ptr<ParticlesDistribution>> hypotheses;
+  std::vector<mh_amcl::CorrectionRequest> requests;
+  const auto stamp = tf2_ros::fromMsg(last_laser_->header.stamp);
   for (auto & particles : particles_population_) {
-    particles->correct_once(*last_laser_, *costmap_);
+    if (particles->prepare_correction(points_frame_, stamp)) {
+      hypotheses.push_back(particles);
+      requests.push_back(
+        {particles->get_particles().size(), particles->get_quality(),
+          particles == current_amcl_, particles->get_skipped_corrections()});
+    }
+  }
+
+  // Hypotheses with fewer beams than the scan read a subsample of it
+  const auto beams = correction_scheduler_->schedule(requests, last_points_.size());
+  scheduled_points_.resize(hypotheses.size());
+  std::vector<const mh_amcl::ScanPoints *> points(hypotheses.size(), &last_points_);
+  size_t num_skipped = 0;
+  for (size_t i = 0; i < hypotheses.size(); i++) {
+    if (beams[i] == 0) {
+      hypotheses[i]->skip_correction();
+      points[i] = nullptr;
+      num_skipped++;
+    } else if (beams[i] < last_points_.size()) {
+      last_points_.subsample(beams[i], scheduled_points_[i]);
+      points[i] = &scheduled_points_[i];
+    }
+  }
+
+  if (!correct_on_device(hypotheses, points)) {
+    // Split each hypothesis in a chunk per thread. Chunks only write their own particles,
+    // so the result does not depend on the number of threads
+    struct Chunk
+    {
+      ParticlesDistribution * particles;
+      const mh_amcl::ScanPoints * points;
+      size_t begin;
+      size_t end;
+    };
+
+    const size_t num_threads = correction_pool_->get_num_threads();
+    std::vector<Chunk> chunks;
+    for (size_t i = 0; i < hypotheses.size(); i++) {
+      if (points[i] == nullptr) {continue;}
+
+      const size_t num_particles = hypotheses[i]->get_particles().size();
+      const size_t chunk_size = std::max<size_t>(
+        MIN_CORRECTION_CHUNK, (num_particles + num_threads - 1) / num_threads);
+
+      for (size_t begin = 0; begin < num_particles; begin += chunk_size) {
+        chunks.push_back(
+          {hypotheses[i].get(), points[i], begin, std::min(begin + chunk_size, num_particles)});
+      }
+    }
+
+    correction_pool_->parallel_for(
+      chunks.size(), [&](size_t i) {
+        const auto & chunk = chunks[i];
+        if (likelihood_field_ != nullptr) {
+          chunk.particles->correct_particles(
+            *chunk.points, *likelihood_field_, chunk.begin, chunk.end);
+        } else {
+          chunk.particles->correct_particles(
+            *last_laser_, *chunk.points, *map_, chunk.begin, chunk.end);
+        }
+      });
+  }
+
+  // Normalization and quality, in the same order than the serial version
+  for (size_t i = 0; i < hypotheses.size(); i++) {
+    if (points[i] != nullptr) {
+      hypotheses[i]->finish_correction(*points[i]);
+    }
   }
 
   last_time_ = last_laser_->header.stamp;
-  info_.correct_time = now() - start;
+  info_.correct_time = rclcpp::Duration(elapsed_since(start));
+
+  RCLCPP_DEBUG_STREAM(
+    get_logger(), "Correct [" << rclcpp::Duration(info_.correct_time).seconds() << " secs, " <<
+      last_points_.size() << " of " << last_points_.num_valid << " beams, " << num_skipped <<
+      " hypotheses skipped]");
+}
+
+bool
+MH_AMCL_Node::correct_on_device(
+  const std::vector<std::shared_ptr<ParticlesDistribution>> & hypotheses,
+  const std::vector<const mh_amcl::ScanPoints *> & points)
+{
+#ifdef MH_AMCL_CUDA
+  if (cuda_sensor_model_ == nullptr || likelihood_field_ == nullptr) {
+    return false;
+  }
+
+  // The particles of all the hypotheses go in one batch, each one with its subsample
+  std::vector<const mh_amcl::ScanPoints *> scans;
+  std::vector<size_t> first {0};
+  std::vector<ParticlesDistribution *> corrected;
+  std::vector<mh_amcl::Pose2d> poses;
+  for (size_t i = 0; i < hypotheses.size(); i++) {
+    if (points[i] == nullptr) {continue;}
+
+    for (size_t j = 0; j < hypotheses[i]->get_particles().size(); j++) {
+      poses.push_back(hypotheses[i]->get_sensor_pose(j));
+    }
+    scans.push_back(points[i]);
+    first.push_back(poses.size());
+    corrected.push_back(hypotheses[i].get());
+  }
+
+  std::vector<double> hits;
+  try {
+    cuda_sensor_model_->set_likelihood_field(likelihood_field_);
+    cuda_sensor_model_->correct(
+      scans, first, poses, hypothesis_context_->get_params().distance_perception_error, hits);
+  } catch (const std::runtime_error & e) {
+    RCLCPP_ERROR(get_logger(), "CUDA correction failed, using cpu: %s", e.what());
+    cuda_sensor_model_ = nullptr;
+    sensor_backend_ = "cpu";
+    return false;
+  }
+
+  for (size_t k = 0; k < corrected.size(); k++) {
+    corrected[k]->apply_hits(hits.data() + first[k]);
+  }
 
-  RCLCPP_DEBUG_STREAM(get_logger(), "Correct [" << (now() - start).seconds() << " secs]");
+  return true;
+#else
+  (void)hypotheses;
+  (void)points;
+  return false;
+#endif
 }
 
 void
 MH_AMCL_Node::reseed()
 {
-  auto start = now();
+  MH_AMCL_SCOPED_TIMER(reseed_latency_);
+  const auto start = std::chrono::steady_clock::now();
+
+  std::lock_guard<std::mutex> lock(population_mutex_);
 
   for (auto & particles : particles_population_) {
     particles->reseed();
   }
 
-  info_.reseed_time = now() - start;
+  info_.reseed_time = rclcpp::Duration(elapsed_since(start));
 
   RCLCPP_DEBUG_STREAM(
-    get_logger(), "==================Reseed [" << (now() - start).seconds() << " secs]");
+    get_logger(),
+    "==================Reseed [" << rclcpp::Duration(info_.reseed_time).seconds() << " secs]");
 }
 
 void
@@ -343,9 +1055,13 @@ MH_AMCL_Node::initpose_callback(
         pose_msg->pose.pose.orientation.z,
         pose_msg->pose.pose.orientation.w});
 
+    std::lock_guard<std::mutex> lock(population_mutex_);
+
+    // Back to the pool before taking the new one
     particles_population_.clear();
+    current_amcl_ = nullptr;
     current_amcl_q_ = 1.0;
-    current_amcl_ = std::make_shared<ParticlesDistribution>(shared_from_this(), counter_++);
+    current_amcl_ = hypothesis_pool_->acquire(counter_++);
 
     particles_population_.push_back(current_amcl_);
     current_amcl_->on_configure(get_current_state());
@@ -371,35 +1087,94 @@ MH_AMCL_Node::monologue_hypos_callback(vqa_msgs::msg::MonologueHypothesis::Uniqu
 void
 MH_AMCL_Node::publish_position()
 {
-  if (costmap_ == nullptr || last_laser_ == nullptr) {
-    return;
-  }
+  MH_AMCL_SCOPED_TIMER(publish_position_latency_);
+
+  geometry_msgs::msg::PoseWithCovarianceStamped pose;
+  bool publish_particles = particles_pub_->get_subscription_count() > 0;
+  bool publish_info = info_pub_->get_subscription_count() > 0;
+  rclcpp::Time stamp;
+
+  // particles_msg_ is only used here, and this timer does not run concurrently with itself
+  nav2_msgs::msg::ParticleCloud * particles_msg = &particles_msg_;
+  std::unique_ptr<rclcpp::LoanedMessage<nav2_msgs::msg::ParticleCloud>> loaned_particles;
+  // With intra-process communication, owned messages are moved to the subscriptions in the
+  // same process, with no copies nor serialization
+  const bool intra_process = get_node_options().use_intra_process_comms();
+  std::unique_ptr<nav2_msgs::msg::ParticleCloud> owned_particles;
+
+  // Copy what we publish, so the hypotheses are not locked while publishing
+  {
+    std::lock_guard<std::mutex> lock(population_mutex_);
+
+    if (map_ == nullptr || last_laser_ == nullptr) {
+      return;
+    }
 
-  geometry_msgs::msg::PoseWithCovarianceStamped pose = current_amcl_->get_pose();
+    pose = current_amcl_->get_pose();
+    stamp = last_time_;
+
+    // Loaned messages avoid the copy into the middleware, when it supports them
+    if (publish_particles) {
+      if (intra_process) {
+        owned_particles = std::make_unique<nav2_msgs::msg::ParticleCloud>();
+        particles_msg = owned_particles.get();
+      } else if (particles_pub_->can_loan_messages()) {
+        loaned_particles =
+          std::make_unique<rclcpp::LoanedMessage<nav2_msgs::msg::ParticleCloud>>(
+          particles_pub_->borrow_loaned_message());
+        particles_msg = &loaned_particles->get();
+      }
+
+      const auto & particles = current_amcl_->get_particles();
+      const size_t step = particles_decimation_;
+      particles_msg->particles.resize((particles.size() + step - 1) / step);
+      for (size_t i = 0, j = 0; i < particles.size(); i += step, j++) {
+        auto & p = particles_msg->particles[j];
+        p.pose.position.x = particles.x[i];
+        p.pose.position.y = particles.y[i];
+        p.pose.position.z = 0.0;
+        p.pose.orientation = tf2::toMsg(particles.get_rotation(i));
+      }
+    }
+
+    if (publish_info) {
+      info_.hypos.clear();
+      for (const auto & hypo : particles_population_) {
+        info_.hypos.push_back(hypo->get_info());
+      }
+
+      const auto & info_selected = current_amcl_->get_info();
+      info_.quality = info_selected.quality;
+      info_.uncertainty = info_selected.uncertainty;
+      info_.pose = info_selected.pose;
+      info_.num_part = info_selected.num_part;
+      info_.id = info_selected.id;
+    }
+  }
 
   // Publish pose
   if (pose_pub_->get_subscription_count() > 0) {
     pose.header.frame_id = "map";
-    pose.header.stamp = last_time_;
-    pose_pub_->publish(pose);
+    pose.header.stamp = stamp;
+    if (intra_process) {
+      pose_pub_->publish(std::make_unique<geometry_msgs::msg::PoseWithCovarianceStamped>(pose));
+    } else {
+      pose_pub_->publish(pose);
+    }
   }
 
   // Publish particle cloud
-  if (particles_pub_->get_subscription_count() > 0) {
-    nav2_msgs::msg::ParticleCloud particles_msgs;
-    particles_msgs.header.frame_id = "map";
-    particles_msgs.header.stamp = last_time_;
-
-    for (const auto & particle : current_amcl_->get_particles()) {
-      nav2_msgs::msg::Particle p;
-      p.pose.position.x = particle.pose.getOrigin().x();
-      p.pose.position.y = particle.pose.getOrigin().y();
-      p.pose.position.z = particle.pose.getOrigin().z();
-      p.pose.orientation = tf2::toMsg(particle.pose.getRotation());
-      particles_msgs.particles.push_back(p);
+  if (publish_particles) {
+    particles_msg->header.frame_id = "map";
+    particles_msg->header.stamp = stamp;
+
+    if (owned_particles != nullptr) {
+      particles_pub_->publish(std::move(owned_particles));
+    } else if (loaned_particles != nullptr) {
+      particles_pub_->publish(std::move(*loaned_particles));
+    } else {
+      particles_pub_->publish(*particles_msg);
     }
-
-    particles_pub_->publish(particles_msgs);
   }
 
   // Publish tf map -> odom
@@ -420,7 +1195,7 @@ MH_AMCL_Node::publish_position()
 
     geometry_msgs::msg::TransformStamped transform;
     transform.header.frame_id = "map";
-    transform.header.stamp = last_time_;
+    transform.header.stamp = stamp;
     transform.child_frame_id = "odom";
 
     transform.transform = tf2::toMsg(map2odom);
@@ -431,22 +1206,12 @@ MH_AMCL_Node::publish_position()
   }
 
 
-  if (info_pub_->get_subscription_count() > 0) {
-    info_.hypos.clear();
-    for (const auto & hypo : particles_population_) {
-      info_.hypos.push_back(hypo->get_info());
-    }
+  if (publish_info) {
+    std::lock_guard<std::mutex> lock(population_mutex_);
 
-    info_.header.stamp = last_time_;
+    info_.header.stamp = stamp;
     info_.header.frame_id = "map";
 
-    const auto & info_selected = current_amcl_->get_info();
-    info_.quality = info_selected.quality;
-    info_.uncertainty = info_selected.uncertainty;
-    info_.pose = info_selected.pose;
-    info_.num_part = info_selected.num_part;
-    info_.id = info_selected.id;
-
     info_pub_->publish(info_);
 
     info_.predict_time = rclcpp::Duration(0s);
@@ -456,6 +1221,36 @@ MH_AMCL_Node::publish_position()
   }
 }
 
+void
+MH_AMCL_Node::publish_latencies()
+{
+  mh_amcl_msgs::msg::Latencies msg;
+  msg.header.stamp = now();
+
+  for (auto * histogram : {&predict_latency_, &correct_latency_, &reseed_latency_,
+      &manage_hypotheses_latency_, &publish_markers_latency_, &publish_position_latency_})
+  {
+    // Taken even without subscribers, so each message has the latencies of its own period
+    const auto snapshot = histogram->take();
+
+    mh_amcl_msgs::msg::StageLatency stage;
+    stage.name = histogram->get_name();
+    stage.count = snapshot.count;
+    stage.p50 = rclcpp::Duration(
+      std::chrono::nanoseconds(LatencyHistogram::get_percentile(snapshot, 0.5)));
+    stage.p90 = rclcpp::Duration(
+      std::chrono::nanoseconds(LatencyHistogram::get_percentile(snapshot, 0.9)));
+    stage.p99 = rclcpp::Duration(
+      std::chrono::nanoseconds(LatencyHistogram::get_percentile(snapshot, 0.99)));
+    stage.max = rclcpp::Duration(std::chrono::nanoseconds(snapshot.max));
+    msg.stages.push_back(stage);
+  }
+
+  if (latencies_pub_->get_subscription_count() > 0) {
+    latencies_pub_->publish(msg);
+  }
+}
+
 std::list<TransformWeighted> MH_AMCL_Node::fromMsg(const vqa_msgs::msg::MonologueHypothesis & hyp)
 {
   std::list<TransformWeighted> ret;
@@ -495,11 +1290,28 @@ MH_AMCL_Node::toMsg(const tf2::Transform & tf)
 void
 MH_AMCL_Node::manage_hypotesis()
 {
-  if (last_laser_ == nullptr || costmap_ == nullptr || matcher_ == nullptr) {return;}
+  MH_AMCL_SCOPED_TIMER(manage_hypotheses_latency_);
+  const auto start = std::chrono::steady_clock::now();
+
+  std::lock_guard<std::mutex> lock(population_mutex_);
+
+  if (last_laser_ == nullptr || map_ == nullptr || matcher_ == nullptr) {return;}
 
   // if (!multihypothesis_) {return;}
 
-  if (hypos_.size() == 0) 
+  // The matcher runs out of this callback, so its candidates come from the previous scan
+  auto tfs = hypos_;
+  if (matcher_hypotheses_ && relocalizer_ != nullptr) {
+    std::list<TransformWeighted> matchs;
+    if (relocalizer_->take_results(matchs)) {
+      // A local search that found nothing falls back to the whole map
+      local_search_failed_ = local_search_running_ && matchs.empty();
+      tfs.splice(tfs.end(), matchs);
+    }
+    request_relocalization();
+  }
+
+  if (tfs.size() == 0) 
     {
       RCLCPP_WARN(get_logger(), "No hypotesis to manage");
       return;
@@ -532,37 +1344,35 @@ MH_AMCL_Node::manage_hypotesis()
   //     return;   
   // }
 
-    
-  auto & tfs = hypos_;
-  auto start = now();
-  
+
   if (multihypothesis_)
   {
     // Multiple hypothesis not too big particles :
     // ----------------------------------------------------
-    // Create new Hypothesis
+    // Create new Hypothesis. Candidates are compared only with the hypotheses near them.
+    hypotheses_index_->clear();
+    for (const auto & distr : particles_population_) {
+      const auto & pose = distr->get_pose().pose.pose;
+      hypotheses_index_->insert(0, pose.position.x, pose.position.y, get_yaw(pose));
+    }
+
     for (const auto & transform : tfs) {
       if (transform.weight > min_candidate_weight_) {
-        bool covered = false;
-
-        for (const auto & distr : particles_population_) {
-          const auto & pose = distr->get_pose().pose.pose;
-          geometry_msgs::msg::Pose posetf = toMsg(transform.transform);
-
-          double dist, difft;
-          get_distances(pose, posetf, dist, difft);
-
-          if (dist < min_candidate_distance_ && difft < min_candidate_angle_) {
-            covered = true;
-          }
-        }
+        const geometry_msgs::msg::Pose posetf = toMsg(transform.transform);
+        const bool covered = hypotheses_index_->covers(
+          posetf.position.x, posetf.position.y, get_yaw(posetf), min_candidate_distance_,
+          min_candidate_angle_);
 
         if (!covered && particles_population_.size() < max_hypotheses_) {
-          auto aux_distr = std::make_shared<ParticlesDistribution>(shared_from_this(), counter_++);
+          auto aux_distr = hypothesis_pool_->acquire(counter_++);
+          if (aux_distr == nullptr) {break;}
           aux_distr->on_configure(get_current_state());
           aux_distr->init(transform.transform);
           aux_distr->on_activate(get_current_state());
           particles_population_.push_back(aux_distr);
+
+          const auto & pose = aux_distr->get_pose().pose.pose;
+          hypotheses_index_->insert(0, pose.position.x, pose.position.y, get_yaw(pose));
         }
       }
 
@@ -573,12 +1383,16 @@ MH_AMCL_Node::manage_hypotesis()
   else
   {
     RCLCPP_INFO(get_logger(), "Executing single dialogue hypo...");
-    auto aux_distr = std::make_shared<ParticlesDistribution>(shared_from_this(), counter_++);
-    aux_distr->on_configure(get_current_state());
-    tfs.erase(++tfs.begin(), tfs.end());
-    aux_distr->init(tfs);
-    aux_distr->on_activate(get_current_state());
-    particles_population_.push_back(aux_distr);
+    auto aux_distr = hypothesis_pool_->acquire(counter_++);
+    if (aux_distr != nullptr) {
+      aux_distr->on_configure(get_current_state());
+      tfs.erase(++tfs.begin(), tfs.end());
+      aux_distr->init(tfs);
+      aux_distr->on_activate(get_current_state());
+      particles_population_.push_back(aux_distr);
+    } else {
+      RCLCPP_WARN(get_logger(), "No free hypothesis, max_hypotheses reached");
+    }
     
   }
   
@@ -672,8 +1486,11 @@ MH_AMCL_Node::manage_hypotesis()
     if (particles_population_.size() > 1 && (!in_free || very_low_quality ||
       (low_quality && max_hypo_reached)))
     {
+      // Checked before erasing it, as it may be the last one, and the selected one goes
+      // back to the pool now
+      const bool selected = current_amcl_ == *it;
       it = particles_population_.erase(it);
-      if (current_amcl_ == *it) {
+      if (selected) {
         current_amcl_ = particles_population_.front();
         current_amcl_q_ = low_q_hypo_thereshold_ + 0.1;
       }
@@ -682,29 +1499,42 @@ MH_AMCL_Node::manage_hypotesis()
     }
   }
 
-  auto it1 = particles_population_.begin();
-  auto it2 = particles_population_.begin();
-  while (it1 != particles_population_.end()) {
-    while (it2 != particles_population_.end()) {
-      if (*it1 == *it2) {
-        ++it2;
-        continue;
-      }
+  // Each hypothesis takes the particles of those near it. Merging does not move the
+  // hypotheses, so their poses are indexed once.
+  std::vector<std::shared_ptr<ParticlesDistribution>> hypotheses(
+    particles_population_.begin(), particles_population_.end());
+  hypotheses_index_->clear();
+  for (size_t i = 0; i < hypotheses.size(); i++) {
+    const auto & pose = hypotheses[i]->get_pose().pose.pose;
+    hypotheses_index_->insert(i, pose.position.x, pose.position.y, get_yaw(pose));
+  }
 
-      double dist_xy, dist_t;
-      get_distances((*it1)->get_pose().pose.pose, (*it2)->get_pose().pose.pose, dist_xy, dist_t);
-      if (dist_xy < hypo_merge_distance_ && dist_t < hypo_merge_angle_) {
-        (*it1)->merge(**it2);
-        it2 = particles_population_.erase(it2);
-        if (current_amcl_ == *it2) {
-          current_amcl_ = particles_population_.front();
-          current_amcl_q_ = current_amcl_->get_quality();
-        }
-      } else {
-        ++it2;
+  std::vector<char> merged(hypotheses.size(), 0);
+  std::vector<size_t> near;
+  for (size_t i = 0; i < hypotheses.size(); i++) {
+    if (merged[i]) {continue;}
+
+    const auto & pose = hypotheses[i]->get_pose().pose.pose;
+    hypotheses_index_->query(
+      pose.position.x, pose.position.y, get_yaw(pose), hypo_merge_distance_,
+      hypo_merge_angle_, near);
+
+    for (auto j : near) {
+      if (j == i || merged[j]) {continue;}
+
+      hypotheses[i]->merge(*hypotheses[j]);
+      merged[j] = 1;
+      if (current_amcl_ == hypotheses[j]) {
+        current_amcl_ = hypotheses[i];
       }
     }
-    ++it1;
+  }
+
+  particles_population_.clear();
+  for (size_t i = 0; i < hypotheses.size(); i++) {
+    if (!merged[i]) {
+      particles_population_.push_back(hypotheses[i]);
+    }
   }
 
   current_amcl_q_ = current_amcl_->get_quality();
@@ -739,20 +1569,66 @@ MH_AMCL_Node::manage_hypotesis()
   //}
   //std::cerr << "=====================================" << std::endl;
 
-  info_.mh_time = now() - start;
+  info_.mh_time = rclcpp::Duration(elapsed_since(start));
+}
+
+void
+MH_AMCL_Node::request_relocalization()
+{
+  if (current_amcl_ != nullptr && current_amcl_->get_quality() >= good_hypo_thereshold_) {
+    last_good_pose_ = current_amcl_->get_pose().pose.pose;
+    valid_last_good_pose_ = true;
+    local_search_failed_ = false;
+  }
+
+  // While the current hypothesis is lost, the robot is first searched near where it was
+  // good, which takes a few milliseconds. The whole map is searched otherwise.
+  const bool lost =
+    current_amcl_ == nullptr || current_amcl_->get_quality() < low_q_hypo_thereshold_;
+
+  // The matcher finds poses of the frame of the points, and hypotheses and the search
+  // region are poses of base_footprint, so the points of a single laser are moved there
+  const mh_amcl::ScanPoints * points = &last_points_;
+  mh_amcl::ScanPoints base_points;
+  if (points_frame_ != "base_footprint") {
+    tf2::Stamped<tf2::Transform> bf2laser;
+    std::string error;
+    if (!hypothesis_context_->get_sensor_transform(
+        points_frame_, tf2_ros::fromMsg(last_laser_->header.stamp), bf2laser, error))
+    {
+      RCLCPP_WARN(
+        get_logger(), "Timeout while waiting TF %s -> base_footprint [%s]",
+        points_frame_.c_str(), error.c_str());
+      return;
+    }
+
+    base_points.merge({&last_points_}, {mh_amcl::Pose2d(bf2laser)});
+    points = &base_points;
+  }
+
+  if (lost && valid_last_good_pose_ && !local_search_failed_ && matcher_local_radius_ > 0.0) {
+    const mh_amcl::SearchRegion region {
+      last_good_pose_.position.x, last_good_pose_.position.y, get_yaw(last_good_pose_),
+      matcher_local_radius_, matcher_local_yaw_window_};
+    if (relocalizer_->request(matcher_, *points, region)) {
+      local_search_running_ = true;
+    }
+  } else if (relocalizer_->request(matcher_, *points)) {
+    local_search_running_ = false;
+  }
 }
 
 unsigned char
 MH_AMCL_Node::get_cost(const geometry_msgs::msg::Pose & pose)
 {
-  unsigned int i, j;
-  costmap_->worldToMap(pose.position.x, pose.position.y, i, j);
+  return map_->get_world_cost(pose.position.x, pose.position.y);
+}
 
-  if (i > 0 && j > 0 && i < costmap_->getSizeInCellsX() && j < costmap_->getSizeInCellsY()) {
-    return costmap_->getCost(i, j);
-  } else {
-    return nav2_costmap_2d::NO_INFORMATION;
-  }
+double
+MH_AMCL_Node::get_yaw(const geometry_msgs::msg::Pose & pose)
+{
+  return mh_amcl::get_yaw(
+    pose.orientation.x, pose.orientation.y, pose.orientation.z, pose.orientation.w);
 }
 
 void
@@ -764,17 +1640,15 @@ MH_AMCL_Node::get_distances(
   double diff_y = pose1.position.y - pose2.position.y;
   dist_xy = sqrt(diff_x * diff_x + diff_y * diff_y);
 
-  tf2::Quaternion q1(pose1.orientation.x, pose1.orientation.y,
-    pose1.orientation.z, pose1.orientation.w);
-  tf2::Quaternion q2(pose2.orientation.x, pose2.orientation.y,
-    pose2.orientation.z, pose2.orientation.w);
-
-  double roll1, pitch1, yaw1;
-  double roll2, pitch2, yaw2;
-  tf2::Matrix3x3(q1).getRPY(roll1, pitch1, yaw1);
-  tf2::Matrix3x3(q2).getRPY(roll2, pitch2, yaw2);
+  const double yaw1 = get_yaw(pose1);
+  const double yaw2 = get_yaw(pose2);
 
   dist_theta = fabs(atan2(sin(yaw1 - yaw2), cos(yaw1 - yaw2)));
 }
 
 }  // namespace mh_amcl
+
+#include "rclcpp_components/register_node_macro.hpp"
+
+// Loadable in a component container, as mh_amcl::MH_AMCL_Node
+RCLCPP_COMPONENTS_REGISTER_NODE(mh_amcl::MH_AMCL_Node)
@@ -0,0 +1,298 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "nav_msgs/msg/occupancy_grid.hpp"
+
+#include "mh_amcl/MapCache.hpp"
+
+namespace mh_amcl
+{
+
+namespace
+{
+
+// FNV-1a, a word at a time
+class Hasher
+{
+public:
+  void add(const void * data, size_t size)
+  {
+    const unsigned char * bytes = static_cast<const unsigned char *>(data);
+
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+      uint64_t word;
+      std::memcpy(&word, bytes + i, sizeof(word));
+      mix(word);
+    }
+    for (; i < size; i++) {
+      mix(bytes[i]);
+    }
+  }
+
+  template<class T>
+  void add(const T & value)
+  {
+    add(&value, sizeof(value));
+  }
+
+  uint64_t get() const {return hash_;}
+
+protected:
+  void mix(uint64_t value)
+  {
+    hash_ ^= value;
+    hash_ *= 0x100000001b3ull;
+  }
+
+  uint64_t hash_ {0xcbf29ce484222325ull};
+};
+
+size_t
+align(size_t offset, size_t alignment)
+{
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+}  // namespace
+
+uint64_t
+MapCache::get_key(const nav_msgs::msg::OccupancyGrid & map)
+{
+  Hasher hasher;
+  hasher.add(map.info.width);
+  hasher.add(map.info.height);
+  hasher.add(map.info.resolution);
+  hasher.add(map.info.origin.position.x);
+  hasher.add(map.info.origin.position.y);
+  hasher.add(map.info.origin.orientation.z);
+  hasher.add(map.info.origin.orientation.w);
+  hasher.add(map.data.data(), map.data.size());
+  return hasher.get();
+}
+
+MapCache::MapCache(const std::string & directory, uint64_t key)
+: key_(key)
+{
+  char name[32];
+  snprintf(name, sizeof(name), "%016" PRIx64 ".bin", key);
+  path_ = directory + "/" + name;
+
+  map_file();
+}
+
+MapCache::~MapCache()
+{
+  if (data_ != nullptr) {
+    munmap(const_cast<char *>(data_), size_);
+  }
+}
+
+bool
+MapCache::map_file()
+{
+  const int fd = open(path_.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Header)) {
+    close(fd);
+    return false;
+  }
+
+  void * data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+
+  data_ = static_cast<const char *>(data);
+  size_ = st.st_size;
+
+  // A file from another map, version or a partial write is ignored, and replaced by save
+  Header header;
+  std::memcpy(&header, data_, sizeof(header));
+  bool valid = header.magic == MAGIC && header.version == VERSION && header.key == key_ &&
+    header.file_size == size_ &&
+    header.num_sections <= (size_ - sizeof(Header)) / sizeof(SectionEntry);
+
+  for (uint32_t i = 0; valid && i < header.num_sections; i++) {
+    SectionEntry entry;
+    std::memcpy(&entry, data_ + sizeof(Header) + i * sizeof(SectionEntry), sizeof(entry));
+    valid = entry.offset <= size_ && entry.size <= size_ - entry.offset &&
+      entry.name[MAX_NAME - 1] == '\0';
+  }
+
+  if (!valid) {
+    munmap(const_cast<char *>(data_), size_);
+    data_ = nullptr;
+    size_ = 0;
+  }
+
+  return valid;
+}
+
+const char *
+MapCache::get_section(const std::string & name, size_t & size) const
+{
+  for (const auto & section : added_) {
+    if (section.first == name) {
+      size = section.second.size();
+      return section.second.data();
+    }
+  }
+
+  if (data_ == nullptr) {
+    return nullptr;
+  }
+
+  Header header;
+  std::memcpy(&header, data_, sizeof(header));
+  for (uint32_t i = 0; i < header.num_sections; i++) {
+    SectionEntry entry;
+    std::memcpy(&entry, data_ + sizeof(Header) + i * sizeof(SectionEntry), sizeof(entry));
+    if (name == entry.name) {
+      size = entry.size;
+      return data_ + entry.offset;
+    }
+  }
+
+  return nullptr;
+}
+
+bool
+MapCache::add_section(const std::string & name, std::vector<char> data)
+{
+  // Truncated, it would not be found by get_section, and could overwrite another one
+  if (name.size() >= MAX_NAME) {
+    return false;
+  }
+
+  for (auto & section : added_) {
+    if (section.first == name) {
+      section.second = std::move(data);
+      return true;
+    }
+  }
+
+  added_.emplace_back(name, std::move(data));
+  return true;
+}
+
+bool
+MapCache::save()
+{
+  if (added_.empty()) {
+    return true;
+  }
+
+  // Sections already in the file, unless they are replaced
+  std::vector<std::pair<std::string, std::pair<const char *, size_t>>> sections;
+  if (data_ != nullptr) {
+    Header header;
+    std::memcpy(&header, data_, sizeof(header));
+    for (uint32_t i = 0; i < header.num_sections; i++) {
+      SectionEntry entry;
+      std::memcpy(&entry, data_ + sizeof(Header) + i * sizeof(SectionEntry), sizeof(entry));
+
+      bool replaced = false;
+      for (const auto & section : added_) {
+        replaced = replaced || section.first == entry.name;
+      }
+      if (!replaced) {
+        sections.push_back({entry.name, {data_ + entry.offset, entry.size}});
+      }
+    }
+  }
+  for (const auto & section : added_) {
+    sections.push_back({section.first, {section.second.data(), section.second.size()}});
+  }
+
+  std::vector<SectionEntry> entries(sections.size());
+  size_t offset = sizeof(Header) + entries.size() * sizeof(SectionEntry);
+  for (size_t i = 0; i < sections.size(); i++) {
+    std::memset(entries[i].name, 0, MAX_NAME);
+    std::strncpy(entries[i].name, sections[i].first.c_str(), MAX_NAME - 1);
+    offset = align(offset, ALIGNMENT);
+    entries[i].offset = offset;
+    entries[i].size = sections[i].second.second;
+    offset += entries[i].size;
+  }
+
+  Header header;
+  header.magic = MAGIC;
+  header.version = VERSION;
+  header.num_sections = entries.size();
+  header.key = key_;
+  header.file_size = offset;
+
+  const std::string tmp_path = path_ + "." + std::to_string(getpid()) + ".tmp";
+  {
+    std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+      return false;
+    }
+
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(
+      reinterpret_cast<const char *>(entries.data()), entries.size() * sizeof(SectionEntry));
+
+    size_t pos = sizeof(Header) + entries.size() * sizeof(SectionEntry);
+    const std::vector<char> padding(ALIGNMENT, 0);
+    for (size_t i = 0; i < sections.size(); i++) {
+      file.write(padding.data(), entries[i].offset - pos);
+      file.write(sections[i].second.first, entries[i].size);
+      pos = entries[i].offset + entries[i].size;
+    }
+
+    if (!file.good()) {
+      file.close();
+      unlink(tmp_path.c_str());
+      return false;
+    }
+  }
+
+  if (rename(tmp_path.c_str(), path_.c_str()) != 0) {
+    unlink(tmp_path.c_str());
+    return false;
+  }
+
+  // The new file has everything, and is the one mapped from now on
+  if (data_ != nullptr) {
+    munmap(const_cast<char *>(data_), size_);
+    data_ = nullptr;
+    size_ = 0;
+  }
+  added_.clear();
+
+  return map_file();
+}
+
+}  // namespace mh_amcl
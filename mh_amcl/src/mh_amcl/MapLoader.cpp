@@ -0,0 +1,135 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "mh_amcl/MapLoader.hpp"
+
+namespace mh_amcl
+{
+
+static std::string
+read_pgm_token(std::istream & in)
+{
+  std::string token;
+  while (in >> token) {
+    if (token[0] != '#') {
+      return token;
+    }
+    std::getline(in, token);
+  }
+  return "";
+}
+
+static std::string
+trim(const std::string & value)
+{
+  const auto begin = value.find_first_not_of(" \t\"'");
+  const auto end = value.find_last_not_of(" \t\"'\r");
+  return begin == std::string::npos ? "" : value.substr(begin, end - begin + 1);
+}
+
+nav_msgs::msg::OccupancyGrid
+load_map(const std::string & yaml_file)
+{
+  std::ifstream yaml(yaml_file);
+  if (!yaml) {
+    throw std::runtime_error("Can not open " + yaml_file);
+  }
+
+  std::string image;
+  double resolution = 0.05, origin_x = 0.0, origin_y = 0.0;
+  double occupied_thresh = 0.65, free_thresh = 0.196;
+  int negate = 0;
+
+  std::string line;
+  while (std::getline(yaml, line)) {
+    const auto colon = line.find(':');
+    if (colon == std::string::npos) {continue;}
+
+    const std::string key = trim(line.substr(0, colon));
+    const std::string value = trim(line.substr(colon + 1));
+    if (key == "image") {
+      image = value;
+    } else if (key == "resolution") {
+      resolution = std::stod(value);
+    } else if (key == "origin") {
+      std::sscanf(value.c_str(), "[%lf, %lf", &origin_x, &origin_y);
+    } else if (key == "negate") {
+      negate = std::stoi(value);
+    } else if (key == "occupied_thresh") {
+      occupied_thresh = std::stod(value);
+    } else if (key == "free_thresh") {
+      free_thresh = std::stod(value);
+    }
+  }
+
+  // The image is relative to the yaml file
+  if (!image.empty() && image[0] != '/') {
+    const auto slash = yaml_file.find_last_of('/');
+    if (slash != std::string::npos) {
+      image = yaml_file.substr(0, slash + 1) + image;
+    }
+  }
+
+  std::ifstream pgm(image, std::ios::binary);
+  if (read_pgm_token(pgm) != "P5") {
+    throw std::runtime_error("Not a binary PGM: " + image);
+  }
+  const int width = std::stoi(read_pgm_token(pgm));
+  const int height = std::stoi(read_pgm_token(pgm));
+  const double max_value = std::stoi(read_pgm_token(pgm));
+  pgm.get();
+
+  std::vector<unsigned char> pixels(width * height);
+  pgm.read(reinterpret_cast<char *>(pixels.data()), pixels.size());
+  if (!pgm) {
+    throw std::runtime_error("Truncated PGM: " + image);
+  }
+
+  nav_msgs::msg::OccupancyGrid grid;
+  grid.header.frame_id = "map";
+  grid.info.resolution = resolution;
+  grid.info.width = width;
+  grid.info.height = height;
+  grid.info.origin.position.x = origin_x;
+  grid.info.origin.position.y = origin_y;
+  grid.info.origin.orientation.w = 1.0;
+  grid.data.resize(width * height);
+
+  // The first row of the image is the top of the map
+  for (int j = 0; j < height; j++) {
+    for (int i = 0; i < width; i++) {
+      const double pixel = pixels[(height - 1 - j) * width + i];
+      const double occupancy = negate ? pixel / max_value : (max_value - pixel) / max_value;
+
+      int8_t value = -1;
+      if (occupancy > occupied_thresh) {
+        value = 100;
+      } else if (occupancy < free_thresh) {
+        value = 0;
+      }
+      grid.data[j * width + i] = value;
+    }
+  }
+
+  return grid;
+}
+
+}  // namespace mh_amcl
@@ -13,9 +13,22 @@
 // limitations under the License.
 
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <list>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <utility>
+#include <vector>
+
 #include "nav2_costmap_2d/cost_values.hpp"
-#include "nav2_costmap_2d/costmap_2d.hpp"
 
+#include "mh_amcl/GridPyramid.hpp"
+#include "mh_amcl/LocalizationMap.hpp"
 #include "mh_amcl/MapMatcher.hpp"
 #include "rclcpp/rclcpp.hpp"
 
@@ -23,225 +36,548 @@ namespace mh_amcl
 {
 
 
-MapMatcher::MapMatcher(const nav_msgs::msg::OccupancyGrid & map)
+MapMatcher::MapMatcher(
+  const nav_msgs::msg::OccupancyGrid & map, const MatcherParams & params, MapCache * cache,
+  ThreadPool * pool)
+: MapMatcher(
+    std::make_shared<const LocalizationMap>(
+      map, std::clamp(params.level, 0, NUM_LEVEL_SCALE_COSTMAP - 1) + 1, nullptr, pool),
+    params, cache, pool)
+{
+}
+
+MapMatcher::MapMatcher(
+  std::shared_ptr<const LocalizationMap> map, const MatcherParams & params, MapCache * cache,
+  ThreadPool * pool)
+: params_(params),
+  map_(map)
 {
-  costmaps_.resize(NUM_LEVEL_SCALE_COSTMAP);
-  costmaps_[0] = std::make_shared<nav2_costmap_2d::Costmap2D>(map);
+  params_.level = std::clamp(params_.level, 0, map_->get_num_levels() - 1);
+
+  const int num_angles = std::max(
+    1, static_cast<int>(std::ceil(2.0 * M_PI / params_.angular_resolution)));
+  angle_step_ = 2.0 * M_PI / num_angles;
+
+  if (cache != nullptr && load(*cache)) {
+    return;
+  }
+
+  build_search_grids(pool);
 
-  for (int i = 1; i < NUM_LEVEL_SCALE_COSTMAP; i++) {
-    costmaps_[i] = half_scale(costmaps_[i - 1]);
+  if (cache != nullptr) {
+    save(*cache);
   }
 }
 
-std::shared_ptr<nav2_costmap_2d::Costmap2D>
-MapMatcher::half_scale(std::shared_ptr<nav2_costmap_2d::Costmap2D> costmap_in)
+std::list<TransformWeighted>
+MapMatcher::get_matchs(const sensor_msgs::msg::LaserScan & scan) const
+{
+  return get_matchs(ScanPoints(scan));
+}
+
+std::list<TransformWeighted>
+MapMatcher::get_matchs(const ScanPoints & points, const std::atomic<bool> * cancel) const
 {
-  auto costmap = std::make_shared<nav2_costmap_2d::Costmap2D>(
-    costmap_in->getSizeInCellsX() / 2, costmap_in->getSizeInCellsY() / 2,
-    costmap_in->getResolution() * 2.0, costmap_in->getOriginX(),
-    costmap_in->getOriginY(), costmap_in->getDefaultValue());
+  const auto & map = map_->get_level(params_.level);
 
-  for (unsigned int i = 0; i < costmap->getSizeInCellsX(); i++) {
-    for (unsigned int j = 0; j < costmap->getSizeInCellsY(); j++) {
-      unsigned int ri = i * 2;
-      unsigned int rj = j * 2;
+  std::vector<int> angles(std::round(2.0 * M_PI / angle_step_));
+  std::iota(angles.begin(), angles.end(), 0);
 
-      auto cost1 = costmap_in->getCost(ri, rj);
-      auto cost2 = costmap_in->getCost(ri + 1, rj);
-      auto cost3 = costmap_in->getCost(ri, rj + 1);
-      auto cost4 = costmap_in->getCost(ri + 1, rj + 1);
+  const SearchBounds bounds {
+    0, 0, static_cast<int>(map.get_size_x()) - 1, static_cast<int>(map.get_size_y()) - 1,
+    0.0, 0.0, std::numeric_limits<double>::infinity()};
 
-      if (cost1 == nav2_costmap_2d::LETHAL_OBSTACLE ||
-        cost2 == nav2_costmap_2d::LETHAL_OBSTACLE ||
-        cost3 == nav2_costmap_2d::LETHAL_OBSTACLE ||
-        cost4 == nav2_costmap_2d::LETHAL_OBSTACLE)
-      {
-        costmap->setCost(i, j, nav2_costmap_2d::LETHAL_OBSTACLE);
-      } else {
-        if (cost1 == nav2_costmap_2d::FREE_SPACE ||
-          cost2 == nav2_costmap_2d::FREE_SPACE ||
-          cost3 == nav2_costmap_2d::FREE_SPACE ||
-          cost4 == nav2_costmap_2d::FREE_SPACE)
+  return match(points, angles, bounds, cancel);
+}
+
+std::list<TransformWeighted>
+MapMatcher::get_matchs(
+  const ScanPoints & points, const SearchRegion & region,
+  const std::atomic<bool> * cancel) const
+{
+  const auto & map = map_->get_level(params_.level);
+  const double resolution = map.get_resolution();
+  const int num_angles = std::round(2.0 * M_PI / angle_step_);
+
+  std::vector<int> angles;
+  const int window = std::min(
+    static_cast<int>(std::ceil(region.yaw_window / angle_step_)), num_angles / 2);
+  const int center = static_cast<int>(std::round(region.yaw / angle_step_));
+  for (int angle = center - window; angle <= center + window; angle++) {
+    angles.push_back(((angle % num_angles) + num_angles) % num_angles);
+  }
+  std::sort(angles.begin(), angles.end());
+  angles.erase(std::unique(angles.begin(), angles.end()), angles.end());
+
+  // Cell coordinates, with the center of cell (i, j) at (i, j)
+  SearchBounds bounds;
+  bounds.center_x = (region.x - map.get_origin_x()) / resolution - 0.5;
+  bounds.center_y = (region.y - map.get_origin_y()) / resolution - 0.5;
+  bounds.radius = region.radius / resolution;
+  bounds.min_x = std::max(0, static_cast<int>(std::floor(bounds.center_x - bounds.radius)));
+  bounds.min_y = std::max(0, static_cast<int>(std::floor(bounds.center_y - bounds.radius)));
+  bounds.max_x = std::min(
+    static_cast<int>(map.get_size_x()) - 1,
+    static_cast<int>(std::ceil(bounds.center_x + bounds.radius)));
+  bounds.max_y = std::min(
+    static_cast<int>(map.get_size_y()) - 1,
+    static_cast<int>(std::ceil(bounds.center_y + bounds.radius)));
+
+  if (bounds.min_x > bounds.max_x || bounds.min_y > bounds.max_y) {
+    return {};
+  }
+
+  return match(points, angles, bounds, cancel);
+}
+
+std::list<TransformWeighted>
+MapMatcher::match(
+  const ScanPoints & points, const std::vector<int> & angles, const SearchBounds & bounds,
+  const std::atomic<bool> * cancel) const
+{
+  std::list<TransformWeighted> ret;
+  if (points.empty()) {
+    return ret;
+  }
+
+  const auto deadline = std::chrono::steady_clock::now() +
+    std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+    std::chrono::duration<double>(params_.time_budget));
+
+  const auto scans = discretize(points, angles);
+  const auto & map = map_->get_level(params_.level);
+  const int root_size = 1 << BNB_DEPTH;
+
+  std::vector<SearchNode> roots;
+  for (int angle : angles) {
+    for (int x = bounds.min_x; x <= bounds.max_x; x += root_size) {
+      for (int y = bounds.min_y; y <= bounds.max_y; y += root_size) {
+        if (get_max(free_grids_[BNB_DEPTH], x, y) == 0 ||
+          !in_bounds(bounds, x, y, root_size))
         {
-          costmap->setCost(i, j, nav2_costmap_2d::FREE_SPACE);
-        } else {
-          if (cost1 == nav2_costmap_2d::NO_INFORMATION &&
-            cost2 == nav2_costmap_2d::NO_INFORMATION &&
-            cost3 == nav2_costmap_2d::NO_INFORMATION &&
-            cost4 == nav2_costmap_2d::NO_INFORMATION)
-          {
-            costmap->setCost(i, j, nav2_costmap_2d::NO_INFORMATION);
-          } else {
-            costmap->setCost(i, j, cost1);
-          }
+          continue;
         }
+
+        roots.push_back({angle, x, y, BNB_DEPTH, score(BNB_DEPTH, scans[angle], x, y)});
       }
     }
   }
 
-  return costmap;
+  // Best first, so good candidates are found soon and prune the rest
+  std::sort(
+    roots.begin(), roots.end(),
+    [](const SearchNode & a, const SearchNode & b) {return a.score > b.score;});
+
+  std::vector<SearchNode> candidates;
+  for (const auto & root : roots) {
+    if (std::chrono::steady_clock::now() > deadline || (cancel != nullptr && *cancel)) {break;}
+    search(root, scans, bounds, candidates, deadline, cancel);
+  }
+
+  for (const auto & candidate : candidates) {
+    double x, y;
+    map.map_to_world(candidate.x, candidate.y, x, y);
+
+    tf2::Quaternion q;
+    q.setRPY(0.0, 0.0, candidate.angle * angle_step_);
+
+    TransformWeighted tw;
+    tw.weight = candidate.score;
+    tw.transform = tf2::Transform(q, {x, y, 0.0});
+    ret.push_back(tw);
+  }
+
+  return ret;
 }
 
-std::list<TransformWeighted>
-MapMatcher::get_matchs(const sensor_msgs::msg::LaserScan & scan)
+void
+MapMatcher::search(
+  const SearchNode & node, const std::vector<DiscreteScan> & scans,
+  const SearchBounds & bounds, std::vector<SearchNode> & candidates,
+  const std::chrono::steady_clock::time_point & deadline,
+  const std::atomic<bool> * cancel) const
 {
-  std::vector<tf2::Vector3> laser_poins = laser2points(scan);
+  float threshold = params_.min_score;
+  if (static_cast<int>(candidates.size()) >= params_.max_candidates) {
+    threshold = std::max(threshold, candidates.back().score);
+  }
 
-  int start_level = NUM_LEVEL_SCALE_COSTMAP - 2;
-  int min_level = 2;
+  if (node.score <= threshold) {
+    return;
+  }
+
+  if (node.height == 0) {
+    add_candidate(node, candidates);
+    return;
+  }
 
-  double min_x, max_x, min_y, max_y;
-  costmaps_[start_level]->mapToWorld(0, 0, min_x, min_y);
-  costmaps_[start_level]->mapToWorld(
-    costmaps_[start_level]->getSizeInCellsX(),
-    costmaps_[start_level]->getSizeInCellsY(), max_x, max_y);
+  if (std::chrono::steady_clock::now() > deadline || (cancel != nullptr && *cancel)) {
+    return;
+  }
 
-  std::list<TransformWeighted> candidates[NUM_LEVEL_SCALE_COSTMAP];
-  candidates[start_level] = get_matchs(start_level, laser_poins, min_x, min_y, max_x, max_y);
-  candidates[start_level].sort();
+  const int height = node.height - 1;
+  const int step = 1 << height;
 
-  for (int level = start_level; level >= min_level; level--) {
-    for (const auto & candidate : candidates[level]) {
-      double min_x, max_x, min_y, max_y;
-      min_x = candidate.transform.getOrigin().x() - costmaps_[level]->getResolution() / 2.0;
-      max_x = candidate.transform.getOrigin().x() + costmaps_[level]->getResolution() / 2.0;
-      min_y = candidate.transform.getOrigin().y() - costmaps_[level]->getResolution() / 2.0;
-      max_y = candidate.transform.getOrigin().y() + costmaps_[level]->getResolution() / 2.0;
+  std::vector<SearchNode> children;
+  children.reserve(4);
+  for (int dx = 0; dx <= step; dx += step) {
+    for (int dy = 0; dy <= step; dy += step) {
+      const int x = node.x + dx;
+      const int y = node.y + dy;
 
-      auto new_candidates = get_matchs(level - 1, laser_poins, min_x, min_y, max_x, max_y);
+      if (!in_bounds(bounds, x, y, step) || get_max(free_grids_[height], x, y) == 0) {
+        continue;
+      }
 
-      candidates[level - 1].insert(
-        candidates[level - 1].end(), new_candidates.begin(), new_candidates.end());
+      children.push_back({node.angle, x, y, height, score(height, scans[node.angle], x, y)});
     }
   }
 
-  candidates[min_level].sort();
+  std::sort(
+    children.begin(), children.end(),
+    [](const SearchNode & a, const SearchNode & b) {return a.score > b.score;});
 
-  return candidates[min_level];
+  for (const auto & child : children) {
+    search(child, scans, bounds, candidates, deadline, cancel);
+  }
 }
 
-std::list<TransformWeighted>
-MapMatcher::get_matchs(
-  int scale, const std::vector<tf2::Vector3> & scan,
-  float min_x, float min_y, float max_y, float max_x)
+void
+MapMatcher::add_candidate(const SearchNode & node, std::vector<SearchNode> & candidates) const
 {
-  std::list<TransformWeighted> ret;
-  const auto & costmap = costmaps_[scale];
-
-  int init_i, init_j, end_i, end_j;
-  costmap->worldToMapEnforceBounds(min_x, min_y, init_i, init_j);
-  costmap->worldToMapEnforceBounds(max_x, max_y, end_i, end_j);
-
-  for (unsigned int i = init_i; i < end_i; i++) {
-    for (unsigned int j = init_j; j < end_j; j++) {
-      auto cost = costmap->getCost(i, j);
-      if (cost == nav2_costmap_2d::FREE_SPACE) {
-        double inc_theta = (M_PI / 4.0);
-        for (double theta = 0; theta < 1.9 * M_PI; theta = theta + inc_theta) {
-          double x, y;
-          costmap->mapToWorld(i, j, x, y);
-          TransformWeighted tw;
-
-          tf2::Quaternion q;
-          q.setRPY(0.0, 0.0, theta);
-          tw.transform = tf2::Transform(q, {x, y, 0.0});
-
-          tw.weight = match(scale, *costmap, scan, tw.transform);
-
-          if (tw.weight > 0.5) {
-            ret.push_back(tw);
-          }
-        }
+  const double resolution = map_->get_level(params_.level).get_resolution();
+
+  for (auto & candidate : candidates) {
+    const double dist = std::hypot(candidate.x - node.x, candidate.y - node.y) * resolution;
+    const double diff_angle = (candidate.angle - node.angle) * angle_step_;
+    const double dist_angle = std::fabs(std::atan2(std::sin(diff_angle), std::cos(diff_angle)));
+
+    if (dist < params_.min_distance && dist_angle < params_.min_angle) {
+      if (node.score > candidate.score) {
+        candidate = node;
       }
+      std::sort(
+        candidates.begin(), candidates.end(),
+        [](const SearchNode & a, const SearchNode & b) {return a.score > b.score;});
+      return;
     }
   }
-  return ret;
+
+  auto it = std::find_if(
+    candidates.begin(), candidates.end(),
+    [&node](const SearchNode & candidate) {return candidate.score < node.score;});
+  candidates.insert(it, node);
+
+  if (static_cast<int>(candidates.size()) > params_.max_candidates) {
+    candidates.pop_back();
+  }
 }
 
 float
-MapMatcher::match(
-  int scale, const nav2_costmap_2d::Costmap2D & costmap,
-  const std::vector<tf2::Vector3> & scan, tf2::Transform & transform)
+MapMatcher::score(int height, const DiscreteScan & scan, int x, int y) const
 {
+  const auto & grid = hit_grids_[height];
+
   int hits = 0;
-  int total = 0;
+  for (const auto & point : scan) {
+    hits += get_max(grid, x + point.first, y + point.second);
+  }
 
-  for (int i = 0; i < scan.size(); i = i + scale) {
-    tf2::Vector3 test_point = transform * scan[i];
-    int gi, gj;
+  return static_cast<float>(hits) / static_cast<float>(scan.size());
+}
 
-    costmap.worldToMapNoBounds(test_point.x(), test_point.y(), gi, gj);
+bool
+MapMatcher::in_bounds(const SearchBounds & bounds, int x, int y, int size)
+{
+  if (x > bounds.max_x || y > bounds.max_y || x + size <= bounds.min_x ||
+    y + size <= bounds.min_y)
+  {
+    return false;
+  }
 
+  // Distance from the center to the closest cell of the window
+  const double dx = std::max({x - bounds.center_x, bounds.center_x - (x + size - 1), 0.0});
+  const double dy = std::max({y - bounds.center_y, bounds.center_y - (y + size - 1), 0.0});
+  return dx * dx + dy * dy <= bounds.radius * bounds.radius;
+}
 
-    if (gi > 0 && gj > 0 && gi < costmap.getSizeInCellsX() && gj < costmap.getSizeInCellsY() &&
-      costmap.getCost(gi, gj) == nav2_costmap_2d::LETHAL_OBSTACLE)
-    {
-      hits++;
+std::vector<MapMatcher::DiscreteScan>
+MapMatcher::discretize(const ScanPoints & points, const std::vector<int> & angles) const
+{
+  const double resolution = map_->get_level(params_.level).get_resolution();
+  const int num_angles = std::round(2.0 * M_PI / angle_step_);
+
+  // Cell of each point relative to the cell of the sensor, for every angle. Points in
+  // the same cell are only counted once.
+  std::vector<DiscreteScan> scans(num_angles);
+  for (int angle : angles) {
+    const double c = std::cos(angle * angle_step_);
+    const double s = std::sin(angle * angle_step_);
+
+    auto & scan = scans[angle];
+    scan.reserve(points.size());
+    for (std::size_t i = 0; i < points.size(); i++) {
+      const double rx = c * points.x[i] - s * points.y[i];
+      const double ry = s * points.x[i] + c * points.y[i];
+      scan.emplace_back(
+        static_cast<int>(std::floor(0.5 + rx / resolution)),
+        static_cast<int>(std::floor(0.5 + ry / resolution)));
     }
-    total++;
+
+    std::sort(scan.begin(), scan.end());
+    scan.erase(std::unique(scan.begin(), scan.end()), scan.end());
   }
 
-  return static_cast<float>(hits) / static_cast<float>(total);
+  return scans;
 }
 
-std::vector<tf2::Vector3>
-MapMatcher::laser2points(const sensor_msgs::msg::LaserScan & scan)
+void
+MapMatcher::build_search_grids(ThreadPool * pool)
 {
-  std::list<tf2::Vector3> points;
-  for (auto i = 0; i < scan.ranges.size(); i++) {
-    if (std::isnan(scan.ranges[i]) || std::isinf(scan.ranges[i])) {continue;}
+  const auto & map = map_->get_level(params_.level);
+  const auto & costs = map.get_costs();
+
+  MaxGrid hits, free;
+  hits.size_x = free.size_x = map.get_size_x();
+  hits.size_y = free.size_y = map.get_size_y();
+  hits.offset = free.offset = 0;
+  hits.data = TiledGrid<unsigned char>(hits.size_x, hits.size_y);
+  free.data = TiledGrid<unsigned char>(free.size_x, free.size_y);
+
+  for (auto grid_cost : {std::make_pair(&hits, nav2_costmap_2d::LETHAL_OBSTACLE),
+      std::make_pair(&free, nav2_costmap_2d::FREE_SPACE)})
+  {
+    const unsigned char cost = grid_cost.second;
+    grid_cost.first->data.fill_tiles(
+      [&costs, cost](unsigned int tx, unsigned int ty, unsigned char * cells) {
+        cost_tile(costs, cost, tx, ty, cells);
+      },
+      tile_rows_runner(pool));
+  }
+
+  hit_grids_.resize(BNB_DEPTH + 1);
+  free_grids_.resize(BNB_DEPTH + 1);
+  hit_grids_[0] = std::move(hits);
+  free_grids_[0] = std::move(free);
 
-    tf2::Vector3 p;
-    float dist = scan.ranges[i];
-    float theta = scan.angle_min + i * scan.angle_increment;
-    p.setX(dist * cos(theta));
-    p.setY(dist * sin(theta));
-    p.setZ(0.0);
-    points.push_back(p);
+  for (int h = 1; h <= BNB_DEPTH; h++) {
+    hit_grids_[h] = window_max(hit_grids_[h - 1], 1 << (h - 1), pool);
+    free_grids_[h] = window_max(free_grids_[h - 1], 1 << (h - 1), pool);
+  }
+}
+
+size_t
+MapMatcher::get_memory_usage() const
+{
+  size_t bytes = 0;
+  for (const auto * grids : {&hit_grids_, &free_grids_}) {
+    for (const auto & grid : *grids) {
+      bytes += grid.data.get_memory_usage();
+    }
   }
-  return std::vector<tf2::Vector3>(points.begin(), points.end());
+  return bytes;
 }
 
-nav_msgs::msg::OccupancyGrid
-toMsg(const nav2_costmap_2d::Costmap2D & costmap)
+std::string
+MapMatcher::get_cache_section() const
 {
-  nav_msgs::msg::OccupancyGrid grid;
+  return "matcher_level" + std::to_string(params_.level) + "_depth" + std::to_string(BNB_DEPTH);
+}
 
-  grid.info.resolution = costmap.getResolution();
-  grid.info.width = costmap.getSizeInCellsX();
-  grid.info.height = costmap.getSizeInCellsY();
+bool
+MapMatcher::load(const MapCache & cache)
+{
+  size_t size;
+  const char * data = cache.get_section(get_cache_section(), size);
+  SectionReader reader(data, size);
+
+  std::vector<MaxGrid> hit_grids(BNB_DEPTH + 1), free_grids(BNB_DEPTH + 1);
+  for (auto * grids : {&hit_grids, &free_grids}) {
+    for (auto & grid : *grids) {
+      reader.read(grid.size_x);
+      reader.read(grid.size_y);
+      reader.read(grid.offset);
+      if (!reader.is_valid() || !grid.data.load(reader) ||
+        grid.data.get_size_x() != static_cast<unsigned int>(grid.size_x) ||
+        grid.data.get_size_y() != static_cast<unsigned int>(grid.size_y))
+      {
+        return false;
+      }
+    }
+  }
 
-  double wx, wy;
-  costmap.mapToWorld(0, 0, wx, wy);
-  grid.info.origin.position.x = wx - costmap.getResolution() / 2;
-  grid.info.origin.position.y = wy - costmap.getResolution() / 2;
-  grid.info.origin.position.z = 0.0;
-  grid.info.origin.orientation.w = 1.0;
+  // Grids of another map with the same key, which should not happen, are not used
+  const auto & map = map_->get_level(params_.level);
+  if (!reader.is_valid() || hit_grids[0].size_x != static_cast<int>(map.get_size_x()) ||
+    hit_grids[0].size_y != static_cast<int>(map.get_size_y()))
+  {
+    return false;
+  }
 
-  grid.data.resize(grid.info.width * grid.info.height);
+  hit_grids_ = std::move(hit_grids);
+  free_grids_ = std::move(free_grids);
 
-  std::vector<char> cost_translation_table(256);
+  return true;
+}
 
-  // special values:
-  cost_translation_table[0] = 0;  // NO obstacle
-  cost_translation_table[253] = 99;  // INSCRIBED obstacle
-  cost_translation_table[254] = 100;  // LETHAL obstacle
-  cost_translation_table[255] = -1;  // UNKNOWN
+void
+MapMatcher::save(MapCache & cache) const
+{
+  SectionWriter writer;
+  for (const auto * grids : {&hit_grids_, &free_grids_}) {
+    for (const auto & grid : *grids) {
+      writer.write(grid.size_x);
+      writer.write(grid.size_y);
+      writer.write(grid.offset);
+      grid.data.save(writer);
+    }
+  }
+
+  cache.add_section(get_cache_section(), std::move(writer.get_data()));
+}
+
+void
+MapMatcher::cost_tile(
+  const TiledGrid<unsigned char> & costs, unsigned char cost, unsigned int tx, unsigned int ty,
+  unsigned char * cells)
+{
+  typedef TiledGrid<unsigned char> Grid;
 
-  // regular cost values scale the range 1 to 252 (inclusive) to fit
-  // into 1 to 98 (inclusive).
-  for (int i = 1; i < 253; i++) {
-    cost_translation_table[i] = static_cast<char>(1 + (97 * (i - 1)) / 251);
+  unsigned char value;
+  if (costs.is_uniform_tile(tx, ty, value)) {
+    std::fill_n(cells, Grid::TILE_CELLS, value == cost);
+    return;
   }
 
-  unsigned char * data = costmap.getCharMap();
-  for (unsigned int i = 0; i < grid.data.size(); i++) {
-    grid.data[i] = cost_translation_table[data[i]];
+  const unsigned char * in = costs.get_tile(tx, ty);
+  for (unsigned int k = 0; k < Grid::TILE_CELLS; k++) {
+    cells[k] = in[k] == cost;
   }
+}
+
+MapMatcher::MaxGrid
+MapMatcher::window_max(const MaxGrid & grid_in, int step, ThreadPool * pool) const
+{
+  // A window of 2 * step is four windows of step, starting at x and at x + step
+  MaxGrid grid;
+  grid.offset = grid_in.offset + step;
+  grid.size_x = grid_in.size_x + step;
+  grid.size_y = grid_in.size_y + step;
+  grid.data = TiledGrid<unsigned char>(grid.size_x, grid.size_y);
+
+  grid.data.fill_tiles(
+    [&](unsigned int tx, unsigned int ty, unsigned char * cells) {
+      window_max_tile(grid_in, grid, step, tx, ty, cells);
+    },
+    tile_rows_runner(pool));
 
   return grid;
 }
 
+void
+MapMatcher::window_max_tile(
+  const MaxGrid & grid_in, const MaxGrid & grid, int step, unsigned int tx, unsigned int ty,
+  unsigned char * cells) const
+{
+  typedef TiledGrid<unsigned char> Grid;
+
+  const int x0 = tx << Grid::TILE_SHIFT;
+  const int y0 = ty << Grid::TILE_SHIFT;
+  const int width = std::min<int>(Grid::TILE_SIZE, grid.size_x - x0);
+  const int height = std::min<int>(Grid::TILE_SIZE, grid.size_y - y0);
+
+  // Cell i of grid reads the cells [i - step, i] of grid_in. If these are all in uniform
+  // tiles of the same value, so is this tile, as in most of the unknown or free space.
+  const int in_x0 = x0 - step;
+  const int in_y0 = y0 - step;
+  const int in_x1 = x0 + width - 1;
+  const int in_y1 = y0 + height - 1;
+  if (in_x0 >= 0 && in_y0 >= 0 && in_x1 < grid_in.size_x && in_y1 < grid_in.size_y) {
+    unsigned char first;
+    bool uniform = grid_in.data.is_uniform_tile(
+      in_x0 >> Grid::TILE_SHIFT, in_y0 >> Grid::TILE_SHIFT, first);
+    for (int in_ty = in_y0 >> Grid::TILE_SHIFT;
+      uniform && in_ty <= (in_y1 >> Grid::TILE_SHIFT); in_ty++)
+    {
+      for (int in_tx = in_x0 >> Grid::TILE_SHIFT;
+        uniform && in_tx <= (in_x1 >> Grid::TILE_SHIFT); in_tx++)
+      {
+        unsigned char value;
+        uniform = grid_in.data.is_uniform_tile(in_tx, in_ty, value) && value == first;
+      }
+    }
+
+    if (uniform) {
+      std::fill_n(cells, Grid::TILE_CELLS, first);
+      return;
+    }
+  }
+
+  for (int j = 0; j < height; j++) {
+    for (int i = 0; i < width; i++) {
+      const int x = x0 + i - grid.offset;
+      const int y = y0 + j - grid.offset;
+      cells[(j << Grid::TILE_SHIFT) + i] = std::max(
+        std::max(get_max(grid_in, x, y), get_max(grid_in, x + step, y)),
+        std::max(get_max(grid_in, x, y + step), get_max(grid_in, x + step, y + step)));
+    }
+  }
+}
+
+std::shared_ptr<MapMatcher>
+MapMatcher::update(
+  std::shared_ptr<const LocalizationMap> map, unsigned int min_x, unsigned int min_y,
+  unsigned int max_x, unsigned int max_y) const
+{
+  typedef TiledGrid<unsigned char> Grid;
+
+  auto matcher = std::make_shared<MapMatcher>(*this);
+  matcher->map_ = map;
+
+  const auto & level = map->get_level(params_.level);
+  if (level.get_size_x() != static_cast<unsigned int>(hit_grids_[0].size_x) ||
+    level.get_size_y() != static_cast<unsigned int>(hit_grids_[0].size_y))
+  {
+    return nullptr;
+  }
+
+  // Cells of each grid that changed, in its own coordinates
+  int x0 = min_x >> params_.level;
+  int y0 = min_y >> params_.level;
+  int x1 = std::min<int>(max_x >> params_.level, level.get_size_x() - 1);
+  int y1 = std::min<int>(max_y >> params_.level, level.get_size_y() - 1);
+
+  std::vector<unsigned char> cells(Grid::TILE_CELLS);
+  for (int ty = y0 >> Grid::TILE_SHIFT; ty <= (y1 >> Grid::TILE_SHIFT); ty++) {
+    for (int tx = x0 >> Grid::TILE_SHIFT; tx <= (x1 >> Grid::TILE_SHIFT); tx++) {
+      cost_tile(level.get_costs(), nav2_costmap_2d::LETHAL_OBSTACLE, tx, ty, cells.data());
+      matcher->hit_grids_[0].data.set_tile(tx, ty, cells);
+      cost_tile(level.get_costs(), nav2_costmap_2d::FREE_SPACE, tx, ty, cells.data());
+      matcher->free_grids_[0].data.set_tile(tx, ty, cells);
+    }
+  }
+
+  // A cell of the grid h reads the cells [i - step, i] of the grid h - 1
+  for (int h = 1; h <= BNB_DEPTH; h++) {
+    const int step = 1 << (h - 1);
+    x1 = std::min(x1 + step, hit_grids_[h].size_x - 1);
+    y1 = std::min(y1 + step, hit_grids_[h].size_y - 1);
+
+    for (int ty = y0 >> Grid::TILE_SHIFT; ty <= (y1 >> Grid::TILE_SHIFT); ty++) {
+      for (int tx = x0 >> Grid::TILE_SHIFT; tx <= (x1 >> Grid::TILE_SHIFT); tx++) {
+        window_max_tile(
+          matcher->hit_grids_[h - 1], matcher->hit_grids_[h], step, tx, ty, cells.data());
+        matcher->hit_grids_[h].data.set_tile(tx, ty, cells);
+        window_max_tile(
+          matcher->free_grids_[h - 1], matcher->free_grids_[h], step, tx, ty, cells.data());
+        matcher->free_grids_[h].data.set_tile(tx, ty, cells);
+      }
+    }
+  }
+
+  return matcher;
+}
+
 bool operator<(const TransformWeighted & tw1, const TransformWeighted & tw2)
 {
   // To sort incremental
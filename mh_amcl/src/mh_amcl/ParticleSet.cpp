@@ -0,0 +1,199 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include <tf2/LinearMath/Transform.h>
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+#include "mh_amcl/ParticleSet.hpp"
+
+namespace mh_amcl
+{
+
+void
+ParticleSet::resize(std::size_t n)
+{
+  x.resize(n, 0.0);
+  y.resize(n, 0.0);
+  yaw.resize(n, 0.0);
+  cos_yaw.resize(n, 1.0);
+  sin_yaw.resize(n, 0.0);
+  prob.resize(n, 0.0);
+  hits.resize(n, 0.0f);
+}
+
+void
+ParticleSet::reserve(std::size_t n)
+{
+  x.reserve(n);
+  y.reserve(n);
+  yaw.reserve(n);
+  cos_yaw.reserve(n);
+  sin_yaw.reserve(n);
+  prob.reserve(n);
+  hits.reserve(n);
+}
+
+void
+ParticleSet::clear()
+{
+  resize(0);
+}
+
+void
+ParticleSet::set_pose(std::size_t i, const tf2::Transform & pose)
+{
+  set_pose(i, Pose2d(pose));
+}
+
+tf2::Quaternion
+ParticleSet::get_rotation(std::size_t i) const
+{
+  return tf2::Quaternion(0.0, 0.0, std::sin(yaw[i] * 0.5), std::cos(yaw[i] * 0.5));
+}
+
+tf2::Transform
+ParticleSet::get_pose(std::size_t i) const
+{
+  return get_pose2(i).to_transform();
+}
+
+Particle
+ParticleSet::get(std::size_t i) const
+{
+  Particle particle;
+  particle.pose = get_pose(i);
+  particle.prob = prob[i];
+  particle.hits = hits[i];
+  return particle;
+}
+
+void
+ParticleSet::set(std::size_t i, const Particle & particle)
+{
+  set_pose(i, particle.pose);
+  prob[i] = particle.prob;
+  hits[i] = particle.hits;
+}
+
+void
+ParticleSet::push_back(const Particle & particle)
+{
+  resize(size() + 1);
+  set(size() - 1, particle);
+}
+
+void
+ParticleSet::push_back(const ParticleSet & other, std::size_t i)
+{
+  x.push_back(other.x[i]);
+  y.push_back(other.y[i]);
+  yaw.push_back(other.yaw[i]);
+  cos_yaw.push_back(other.cos_yaw[i]);
+  sin_yaw.push_back(other.sin_yaw[i]);
+  prob.push_back(other.prob[i]);
+  hits.push_back(other.hits[i]);
+}
+
+void
+ParticleSet::append(const ParticleSet & other)
+{
+  x.insert(x.end(), other.x.begin(), other.x.end());
+  y.insert(y.end(), other.y.begin(), other.y.end());
+  yaw.insert(yaw.end(), other.yaw.begin(), other.yaw.end());
+  cos_yaw.insert(cos_yaw.end(), other.cos_yaw.begin(), other.cos_yaw.end());
+  sin_yaw.insert(sin_yaw.end(), other.sin_yaw.begin(), other.sin_yaw.end());
+  prob.insert(prob.end(), other.prob.begin(), other.prob.end());
+  hits.insert(hits.end(), other.hits.begin(), other.hits.end());
+}
+
+void
+ParticleSet::sort_by_prob()
+{
+  std::vector<std::size_t> order(size());
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(
+    order.begin(), order.end(),
+    [this](std::size_t a, std::size_t b) -> bool
+    {
+      return prob[a] > prob[b];
+    });
+
+  ParticleSet sorted;
+  sorted.reserve(size());
+  for (auto i : order) {
+    sorted.push_back(*this, i);
+  }
+
+  *this = std::move(sorted);
+}
+
+void
+transform_points(
+  double tx, double ty, double cos_t, double sin_t,
+  const double * px, const double * py, std::size_t n, double * wx, double * wy)
+{
+  std::size_t i = 0;
+
+#if defined(__AVX2__)
+  const __m256d vtx = _mm256_set1_pd(tx);
+  const __m256d vty = _mm256_set1_pd(ty);
+  const __m256d vc = _mm256_set1_pd(cos_t);
+  const __m256d vs = _mm256_set1_pd(sin_t);
+
+  for (; i + 4 <= n; i += 4) {
+    const __m256d vx = _mm256_loadu_pd(px + i);
+    const __m256d vy = _mm256_loadu_pd(py + i);
+
+    const __m256d rx = _mm256_sub_pd(_mm256_mul_pd(vc, vx), _mm256_mul_pd(vs, vy));
+    const __m256d ry = _mm256_add_pd(_mm256_mul_pd(vs, vx), _mm256_mul_pd(vc, vy));
+
+    _mm256_storeu_pd(wx + i, _mm256_add_pd(vtx, rx));
+    _mm256_storeu_pd(wy + i, _mm256_add_pd(vty, ry));
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  const float64x2_t vtx = vdupq_n_f64(tx);
+  const float64x2_t vty = vdupq_n_f64(ty);
+  const float64x2_t vc = vdupq_n_f64(cos_t);
+  const float64x2_t vs = vdupq_n_f64(sin_t);
+
+  for (; i + 2 <= n; i += 2) {
+    const float64x2_t vx = vld1q_f64(px + i);
+    const float64x2_t vy = vld1q_f64(py + i);
+
+    const float64x2_t rx = vsubq_f64(vmulq_f64(vc, vx), vmulq_f64(vs, vy));
+    const float64x2_t ry = vaddq_f64(vmulq_f64(vs, vx), vmulq_f64(vc, vy));
+
+    vst1q_f64(wx + i, vaddq_f64(vtx, rx));
+    vst1q_f64(wy + i, vaddq_f64(vty, ry));
+  }
+#endif
+
+  for (; i < n; i++) {
+    wx[i] = tx + cos_t * px[i] - sin_t * py[i];
+    wy[i] = ty + sin_t * px[i] + cos_t * py[i];
+  }
+}
+
+}  // namespace mh_amcl
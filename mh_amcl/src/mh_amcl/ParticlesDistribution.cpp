@@ -18,15 +18,18 @@
 #include <random>
 #include <cmath>
 #include <algorithm>
+#include <chrono>
 #include <numeric>
+#include <string>
+#include <unordered_map>
 
 #include "visualization_msgs/msg/marker_array.hpp"
 #include "sensor_msgs/msg/laser_scan.hpp"
 #include "mh_amcl_msgs/msg/hypo_info.hpp"
 
-#include "nav2_costmap_2d/costmap_2d.hpp"
 #include "nav2_costmap_2d/cost_values.hpp"
 
+#include "mh_amcl/Instrumentation.hpp"
 #include "mh_amcl/ParticlesDistribution.hpp"
 
 #include "rclcpp/rclcpp.hpp"
@@ -37,66 +40,194 @@ namespace mh_amcl
 
 using namespace std::chrono_literals;
 
-ParticlesDistribution::ParticlesDistribution(
-  rclcpp_lifecycle::LifecycleNode::SharedPtr parent_node, int id)
+HypothesisContext::HypothesisContext(rclcpp_lifecycle::LifecycleNode::SharedPtr parent_node)
 : parent_node_(parent_node),
-  tf_buffer_(),
-  tf_listener_(tf_buffer_),
-  rd_(),
-  generator_(rd_())
+  own_tf_buffer_(std::make_unique<tf2::BufferCore>()),
+  tf_listener_(std::make_unique<tf2_ros::TransformListener>(*own_tf_buffer_)),
+  tf_buffer_(own_tf_buffer_.get()),
+  pub_particles_(
+    parent_node->create_publisher<visualization_msgs::msg::MarkerArray>("poses", 1000))
 {
-  pub_particles_ = parent_node->create_publisher<visualization_msgs::msg::MarkerArray>(
-    "poses", 1000);
+  declare_parameters();
+}
+
+HypothesisContext::HypothesisContext(
+  rclcpp_lifecycle::LifecycleNode::SharedPtr parent_node, tf2::BufferCore & tf_buffer)
+: parent_node_(parent_node),
+  tf_buffer_(&tf_buffer),
+  pub_particles_(
+    parent_node->create_publisher<visualization_msgs::msg::MarkerArray>("poses", 1000))
+{
+  declare_parameters();
+}
 
-  if (!parent_node->has_parameter("max_particles")) {
-    parent_node->declare_parameter<int>("max_particles", 200lu);
+void
+HypothesisContext::declare_parameters()
+{
+  if (!parent_node_->has_parameter("max_particles")) {
+    parent_node_->declare_parameter<int>("max_particles", 200lu);
+  }
+  if (!parent_node_->has_parameter("min_particles")) {
+    parent_node_->declare_parameter<int>("min_particles", 30lu);
+  }
+  if (!parent_node_->has_parameter("init_pos_x")) {
+    parent_node_->declare_parameter("init_pos_x", 0.0);
+  }
+  if (!parent_node_->has_parameter("init_pos_y")) {
+    parent_node_->declare_parameter("init_pos_y", 0.0);
+  }
+  if (!parent_node_->has_parameter("init_pos_yaw")) {
+    parent_node_->declare_parameter("init_pos_yaw", 0.0);
+  }
+  if (!parent_node_->has_parameter("init_error_x")) {
+    parent_node_->declare_parameter("init_error_x", 0.1);
   }
-  if (!parent_node->has_parameter("min_particles")) {
-    parent_node->declare_parameter<int>("min_particles", 30lu);
+  if (!parent_node_->has_parameter("init_error_y")) {
+    parent_node_->declare_parameter("init_error_y", 0.1);
   }
-  if (!parent_node->has_parameter("init_pos_x")) {
-    parent_node->declare_parameter("init_pos_x", 0.0);
+  if (!parent_node_->has_parameter("init_error_yaw")) {
+    parent_node_->declare_parameter("init_error_yaw", 0.05);
   }
-  if (!parent_node->has_parameter("init_pos_y")) {
-    parent_node->declare_parameter("init_pos_y", 0.0);
+  if (!parent_node_->has_parameter("translation_noise")) {
+    parent_node_->declare_parameter("translation_noise", 0.01);
   }
-  if (!parent_node->has_parameter("init_pos_yaw")) {
-    parent_node->declare_parameter("init_pos_yaw", 0.0);
+  if (!parent_node_->has_parameter("rotation_noise")) {
+    parent_node_->declare_parameter("rotation_noise", 0.01);
   }
-  if (!parent_node->has_parameter("init_error_x")) {
-    parent_node->declare_parameter("init_error_x", 0.1);
+  if (!parent_node_->has_parameter("distance_perception_error")) {
+    parent_node_->declare_parameter("distance_perception_error", 0.05);
   }
-  if (!parent_node->has_parameter("init_error_y")) {
-    parent_node->declare_parameter("init_error_y", 0.1);
+  if (!parent_node_->has_parameter("reseed_percentage_losers")) {
+    parent_node_->declare_parameter("reseed_percentage_losers", 0.8);
   }
-  if (!parent_node->has_parameter("init_error_yaw")) {
-    parent_node->declare_parameter("init_error_yaw", 0.05);
+  if (!parent_node_->has_parameter("reseed_percentage_winners")) {
+    parent_node_->declare_parameter("reseed_percentage_winners", 0.03);
   }
-  if (!parent_node->has_parameter("translation_noise")) {
-    parent_node->declare_parameter("translation_noise", 0.01);
+  if (!parent_node_->has_parameter("good_hypo_thereshold")) {
+    parent_node_->declare_parameter("good_hypo_thereshold", 0.6);
   }
-  if (!parent_node->has_parameter("rotation_noise")) {
-    parent_node->declare_parameter("rotation_noise", 0.01);
+  if (!parent_node_->has_parameter("low_q_hypo_thereshold")) {
+    parent_node_->declare_parameter("low_q_hypo_thereshold", 0.25f);
   }
-  if (!parent_node->has_parameter("distance_perception_error")) {
-    parent_node->declare_parameter("distance_perception_error", 0.05);
+  if (!parent_node_->has_parameter("particles_step")) {
+    parent_node_->declare_parameter<int>("particles_step", 30);
   }
-  if (!parent_node->has_parameter("reseed_percentage_losers")) {
-    parent_node->declare_parameter("reseed_percentage_losers", 0.8);
+  if (!parent_node_->has_parameter("particles_adaptation")) {
+    parent_node_->declare_parameter<std::string>("particles_adaptation", "step");
   }
-  if (!parent_node->has_parameter("reseed_percentage_winners")) {
-    parent_node->declare_parameter("reseed_percentage_winners", 0.03);
+  if (!parent_node_->has_parameter("resampler")) {
+    parent_node_->declare_parameter<std::string>("resampler", "systematic");
   }
-  if (!parent_node->has_parameter("good_hypo_thereshold")) {
-    parent_node->declare_parameter("good_hypo_thereshold", 0.6);
+  if (!parent_node_->has_parameter("resample_threshold")) {
+    parent_node_->declare_parameter("resample_threshold", 0.5);
   }
-  if (!parent_node->has_parameter("good_hypo_thereshold")) {
-    parent_node->declare_parameter("low_q_hypo_thereshold", 0.25f);
+  if (!parent_node_->has_parameter("kld_err")) {
+    parent_node_->declare_parameter("kld_err", 0.05);
   }
-  if (!parent_node->has_parameter("particles_step")) {
-    parent_node->declare_parameter<int>("particles_step", 30);
+  if (!parent_node_->has_parameter("kld_z")) {
+    parent_node_->declare_parameter("kld_z", 0.99);
   }
+  if (!parent_node_->has_parameter("kld_bin_xy")) {
+    parent_node_->declare_parameter("kld_bin_xy", 0.5);
+  }
+  if (!parent_node_->has_parameter("kld_bin_yaw")) {
+    parent_node_->declare_parameter("kld_bin_yaw", 0.1745);
+  }
+  if (!parent_node_->has_parameter("particles_marker")) {
+    parent_node_->declare_parameter<std::string>("particles_marker", "lines");
+  }
+  if (!parent_node_->has_parameter("particles_decimation")) {
+    parent_node_->declare_parameter<int>("particles_decimation", 1);
+  }
+  if (!parent_node_->has_parameter("random_seed")) {
+    parent_node_->declare_parameter<int>("random_seed", 0);
+  }
+}
+
+void
+HypothesisContext::read_parameters()
+{
+  parent_node_->get_parameter("max_particles", params_.max_particles);
+  parent_node_->get_parameter("min_particles", params_.min_particles);
+  parent_node_->get_parameter("init_pos_x", params_.init_pos_x);
+  parent_node_->get_parameter("init_pos_y", params_.init_pos_y);
+  parent_node_->get_parameter("init_pos_yaw", params_.init_pos_yaw);
+  parent_node_->get_parameter("init_error_x", params_.init_error_x);
+  parent_node_->get_parameter("init_error_y", params_.init_error_y);
+  parent_node_->get_parameter("init_error_yaw", params_.init_error_yaw);
+  parent_node_->get_parameter("translation_noise", params_.translation_noise);
+  parent_node_->get_parameter("rotation_noise", params_.rotation_noise);
+  parent_node_->get_parameter("distance_perception_error", params_.distance_perception_error);
+  parent_node_->get_parameter("reseed_percentage_losers", params_.reseed_percentage_losers);
+  parent_node_->get_parameter("reseed_percentage_winners", params_.reseed_percentage_winners);
+  parent_node_->get_parameter("low_q_hypo_thereshold", params_.low_q_hypo_thereshold);
+  parent_node_->get_parameter("good_hypo_thereshold", params_.good_hypo_thereshold);
+  parent_node_->get_parameter("particles_step", params_.particles_step);
+  parent_node_->get_parameter("particles_adaptation", params_.particles_adaptation);
+  parent_node_->get_parameter("resampler", params_.resampler);
+  parent_node_->get_parameter("resample_threshold", params_.resample_threshold);
+  parent_node_->get_parameter("kld_err", params_.kld_err);
+  parent_node_->get_parameter("kld_z", params_.kld_z);
+  parent_node_->get_parameter("kld_bin_xy", params_.kld_bin_xy);
+  parent_node_->get_parameter("kld_bin_yaw", params_.kld_bin_yaw);
+  parent_node_->get_parameter("particles_marker", params_.particles_marker);
+  if (params_.particles_marker != "lines" && params_.particles_marker != "points" &&
+    params_.particles_marker != "arrows")
+  {
+    RCLCPP_WARN(
+      parent_node_->get_logger(), "Unknown particles_marker [%s], using points",
+      params_.particles_marker.c_str());
+    params_.particles_marker = "points";
+  }
+  parent_node_->get_parameter("particles_decimation", params_.particles_decimation);
+  params_.particles_decimation = std::max(1, params_.particles_decimation);
+  parent_node_->get_parameter("random_seed", params_.random_seed);
+
+  seed_ = params_.random_seed != 0 ? params_.random_seed : std::random_device()();
+  next_stream_ = 0;
 
+  std::lock_guard<std::mutex> lock(sensors_mutex_);
+  sensors_.clear();
+}
+
+bool
+HypothesisContext::get_sensor_transform(
+  const std::string & frame_id, const tf2::TimePoint & stamp,
+  tf2::Stamped<tf2::Transform> & bf2sensor, std::string & error)
+{
+  std::lock_guard<std::mutex> lock(sensors_mutex_);
+
+  auto it = sensors_.find(frame_id);
+  if (it != sensors_.end()) {
+    bf2sensor = it->second;
+    return true;
+  }
+
+  if (!tf_buffer_->canTransform(frame_id, "base_footprint", stamp, &error)) {
+    return false;
+  }
+
+  auto bf2sensor_msg = tf_buffer_->lookupTransform("base_footprint", frame_id, stamp);
+  tf2::fromMsg(bf2sensor_msg, bf2sensor);
+  sensors_[frame_id] = bf2sensor;
+  return true;
+}
+
+ParticlesDistribution::ParticlesDistribution(
+  rclcpp_lifecycle::LifecycleNode::SharedPtr parent_node, int id)
+: ParticlesDistribution(std::make_shared<HypothesisContext>(parent_node), id)
+{
+  owns_context_ = true;
+}
+
+ParticlesDistribution::ParticlesDistribution(
+  std::shared_ptr<HypothesisContext> context, int id)
+: parent_node_(context->get_parent_node()),
+  pub_particles_(context->get_publisher()),
+  context_(context),
+  params_(context->get_params()),
+  tf_buffer_(context->get_tf_buffer())
+{
   info_.id = id;
 }
 
@@ -106,28 +237,17 @@ using CallbackReturnT =
 CallbackReturnT
 ParticlesDistribution::on_configure(const rclcpp_lifecycle::State & state)
 {
-  parent_node_->get_parameter("max_particles", max_particles_);
-  parent_node_->get_parameter("min_particles", min_particles_);
-  parent_node_->get_parameter("init_pos_x", init_pos_x_);
-  parent_node_->get_parameter("init_pos_y", init_pos_y_);
-  parent_node_->get_parameter("init_pos_yaw", init_pos_yaw_);
-  parent_node_->get_parameter("init_error_x", init_error_x_);
-  parent_node_->get_parameter("init_error_y", init_error_y_);
-  parent_node_->get_parameter("init_error_yaw", init_error_yaw_);
-  parent_node_->get_parameter("translation_noise", translation_noise_);
-  parent_node_->get_parameter("rotation_noise", rotation_noise_);
-  parent_node_->get_parameter("distance_perception_error", distance_perception_error_);
-  parent_node_->get_parameter("reseed_percentage_losers", reseed_percentage_losers_);
-  parent_node_->get_parameter("reseed_percentage_winners", reseed_percentage_winners_);
-  parent_node_->get_parameter("low_q_hypo_thereshold", low_q_hypo_thereshold_);
-  parent_node_->get_parameter("good_hypo_thereshold", good_hypo_thereshold_);
-  parent_node_->get_parameter("particles_step", particles_step_);
+  // Hypotheses of a shared context read the parameters it took in the last configure
+  if (owns_context_) {
+    context_->read_parameters();
+  }
+  skipped_corrections_ = 0;
 
   tf2::Transform init_pose;
-  init_pose.setOrigin(tf2::Vector3(init_pos_x_, init_pos_y_, 0.0));
+  init_pose.setOrigin(tf2::Vector3(params_.init_pos_x, params_.init_pos_y, 0.0));
 
   tf2::Quaternion q;
-  q.setRPY(0.0, 0.0, init_pos_yaw_);
+  q.setRPY(0.0, 0.0, params_.init_pos_yaw);
   init_pose.setRotation(q);
 
   init(init_pose);
@@ -139,48 +259,15 @@ ParticlesDistribution::on_configure(const rclcpp_lifecycle::State & state)
 }
 
 void
-ParticlesDistribution::update_pose(geometry_msgs::msg::PoseWithCovarianceStamped & pose)
+ParticlesDistribution::update_pose(
+  const PoseStatistics & stats, geometry_msgs::msg::PoseWithCovarianceStamped & pose)
 {
-  // How many particles we use to determine the pose. They are sorted by prob in last reseed
-  size_t particles_used = particles_.size();
-
-  std::vector<double> vpx(particles_used, 0.0);
-  std::vector<double> vpy(particles_used, 0.0);
-  std::vector<double> vpz(particles_used, 0.0);
-  std::vector<double> vrr(particles_used, 0.0);
-  std::vector<double> vrp(particles_used, 0.0);
-  std::vector<double> vry(particles_used, 0.0);
-  std::vector<double> w(particles_used, 0.0);
-
-  for (int i = 0; i < particles_used; i++) {
-    const auto & pose = particles_[i].pose.getOrigin();
-    vpx[i] = pose.x();
-    vpy[i] = pose.y();
-    vpz[i] = pose.z();
-
-    double troll, tpitch, tyaw;
-    tf2::Matrix3x3(particles_[i].pose.getRotation()).getRPY(troll, tpitch, tyaw);
-    vrr[i] = troll;
-    vrp[i] = tpitch;
-    vry[i] = tyaw;
-
-    w[i] = particles_[i].prob;
-  }
-
-  pose.pose.pose.position.x = weighted_mean(vpx, w);
-  pose.pose.pose.position.y = weighted_mean(vpy, w);
-  pose.pose.pose.position.z = weighted_mean(vpz, w);
-
-  tf2::WithCovarianceStamped<tf2::Transform> ret;
-  ret.setOrigin({weighted_mean(vpx, w), weighted_mean(vpx, w), weighted_mean(vpz, w)});
+  pose.pose.pose.position.x = stats.get_x();
+  pose.pose.pose.position.y = stats.get_y();
+  pose.pose.pose.position.z = 0.0;
 
   tf2::Quaternion q;
-  double mvrr = angle_weighted_mean(vrr, w);
-  double mvrp = angle_weighted_mean(vrp, w);
-  double mvry = angle_weighted_mean(vry, w);
-
-  q.setRPY(mvrr, mvrp, mvry);
-  ret.setRotation(q);
+  q.setRPY(0.0, 0.0, stats.get_yaw());
 
   pose.pose.pose.orientation.x = q.x();
   pose.pose.pose.orientation.y = q.y();
@@ -192,7 +279,7 @@ ParticlesDistribution::update_pose(geometry_msgs::msg::PoseWithCovarianceStamped
 }
 
 double
-ParticlesDistribution::normalize_angle(double angle)
+ParticlesDistribution::normalize_angle(double angle) const
 {
   while (angle > M_PI) {angle = angle - 2.0 * M_PI;}
   while (angle < -M_PI) {angle = angle + 2.0 * M_PI;}
@@ -200,43 +287,36 @@ ParticlesDistribution::normalize_angle(double angle)
 }
 
 void
-ParticlesDistribution::update_covariance(geometry_msgs::msg::PoseWithCovarianceStamped & pose)
-{
-  std::vector<double> vpx(particles_.size(), 0.0);
-  std::vector<double> vpy(particles_.size(), 0.0);
-  std::vector<double> vpz(particles_.size(), 0.0);
-  std::vector<double> vrr(particles_.size(), 0.0);
-  std::vector<double> vrp(particles_.size(), 0.0);
-  std::vector<double> vry(particles_.size(), 0.0);
-
-  for (int i = 0; i < particles_.size(); i++) {
-    const auto & pose = particles_[i].pose.getOrigin();
-    vpx[i] = pose.x();
-    vpy[i] = pose.y();
-    vpz[i] = pose.z();
-
-    double troll, tpitch, tyaw;
-    tf2::Matrix3x3(particles_[i].pose.getRotation()).getRPY(troll, tpitch, tyaw);
-    vrr[i] = troll;
-    vrp[i] = tpitch;
-    vry[i] = tyaw;
-  }
-
-  std::vector<std::vector<double>> vs = {vpx, vpy, vpz, vrr, vrp, vry};
-
-  for (int i = 0; i < 6; i++) {
-    for (int j = 0; j < 6; j++) {
-      bool is_i_angle = i >= 3;
-      bool is_j_angle = j >= 3;
-      pose.pose.covariance[i * 6 + j] = covariance(vs[i], vs[j], is_i_angle, is_j_angle);
+ParticlesDistribution::update_covariance(
+  const PoseStatistics & stats, geometry_msgs::msg::PoseWithCovarianceStamped & pose)
+{
+  // Particles are planar: z, roll and pitch are always zero
+  static const int index[3] = {0, 1, 5};
+
+  pose.pose.covariance.fill(0.0);
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      pose.pose.covariance[index[i] * 6 + index[j]] = stats.get_covariance(i, j);
     }
   }
 
-
+  info_.pose = pose.pose;
   info_.uncertainty = pose.pose.covariance[0] + pose.pose.covariance[7] +
     pose.pose.covariance[35];  // x^2 + y^2 + t^2
 }
 
+int kld_sample_size(int k, double err, double z)
+{
+  if (k <= 1) {
+    return 0;
+  }
+
+  // Wilson-Hilferty approximation of the chi-square quantile (Fox, 2003)
+  const double a = 2.0 / (9.0 * (k - 1));
+  const double b = 1.0 - a + std::sqrt(a) * z;
+  return static_cast<int>(std::ceil((k - 1) / (2.0 * err) * b * b * b));
+}
+
 double weighted_mean(const std::vector<double> & v, const std::vector<double> & w)
 {
   if (v.empty() || v.size() != w.size()) {
@@ -351,46 +431,37 @@ ParticlesDistribution::init(const  std::list<TransformWeighted> & multiple_poses
     // more particles if it is more probable and less particles if is less probbable
     // this is (mean and standard deviation)
 
-    std::normal_distribution<double> noise_x(0, 1.0);
-    std::normal_distribution<double> noise_y(0, 1.0);
-    std::normal_distribution<double> noise_t(0, 2.0 * M_PI);
+    context_->seed(generator_);
 
     // we do a rest between the points 
 
     // more particles if is more probbable and less if the weight is less 
     particles_.clear();
-    particles_.resize((max_particles_ + min_particles_) / 2);
+    particles_.resize((params_.max_particles + params_.min_particles) / 2);
 
 
     // here we have all the same
-    for (auto & particle : particles_) {
+    for (size_t i = 0; i < particles_.size(); i++) {
       for (auto & transform : multiple_poses) {
       
-        particle.prob = 1.0 / static_cast<double>(particles_.size());
-        particle.pose = transform.transform;
+        particles_.prob[i] = 1.0 / static_cast<double>(particles_.size());
 
-        tf2::Vector3 pose = particle.pose.getOrigin();
-        pose.setX(pose.getX() + noise_x(generator_));
-        pose.setY(pose.getY() + noise_y(generator_));
-        pose.setZ(0.0);
+        const tf2::Vector3 & pose = transform.transform.getOrigin();
 
-        particle.pose.setOrigin(pose);
+        const double yaw = get_yaw(transform.transform.getRotation());
 
-        double roll, pitch, yaw;
-        tf2::Matrix3x3(particle.pose.getRotation()).getRPY(roll, pitch, yaw);
+        double newx = pose.getX() + generator_.normal();
+        double newy = pose.getY() + generator_.normal();
+        double newyaw = yaw + 2.0 * M_PI * generator_.normal();
 
-        double newyaw = yaw + noise_t(generator_);
-
-        tf2::Quaternion q;
-        q.setRPY(roll, pitch, newyaw);
-
-        particle.pose.setRotation(q);
+        particles_.set_pose(i, newx, newy, newyaw);
       }
     }
 
     normalize();
-    update_covariance(pose_);
-    update_pose(pose_);
+    const PoseStatistics stats(particles_);
+    update_covariance(stats, pose_);
+    update_pose(stats, pose_);
 
   
 
@@ -399,83 +470,82 @@ ParticlesDistribution::init(const  std::list<TransformWeighted> & multiple_poses
 void
 ParticlesDistribution::init(const tf2::Transform & pose_init)
 {
-  // std::normal_distribution<double> noise_x(0, init_error_x_);
-  // std::normal_distribution<double> noise_y(0, init_error_y_);
-  // std::normal_distribution<double> noise_t(0, init_error_yaw_);
+  // std::normal_distribution<double> noise_x(0, params_.init_error_x);
+  // std::normal_distribution<double> noise_y(0, params_.init_error_y);
+  // std::normal_distribution<double> noise_t(0, params_.init_error_yaw);
 
-  std::normal_distribution<double> noise_x(0, 0.5);
-  std::normal_distribution<double> noise_y(0, 0.5);
-  std::normal_distribution<double> noise_t(0, 2 * M_PI);
+  context_->seed(generator_);
 
   particles_.clear();
-  particles_.resize((max_particles_ + min_particles_) / 2);
-
-  for (auto & particle : particles_) {
-    particle.prob = 1.0 / static_cast<double>(particles_.size());
-    particle.pose = pose_init;
-
-    tf2::Vector3 pose = particle.pose.getOrigin();
-    pose.setX(pose.getX() + noise_x(generator_));
-    pose.setY(pose.getY() + noise_y(generator_));
-    pose.setZ(0.0);
+  particles_.resize((params_.max_particles + params_.min_particles) / 2);
 
-    particle.pose.setOrigin(pose);
+  const tf2::Vector3 & pose = pose_init.getOrigin();
 
-    double roll, pitch, yaw;
-    tf2::Matrix3x3(particle.pose.getRotation()).getRPY(roll, pitch, yaw);
+  const double yaw = get_yaw(pose_init.getRotation());
 
-    double newyaw = yaw + noise_t(generator_);
+  for (size_t i = 0; i < particles_.size(); i++) {
+    particles_.prob[i] = 1.0 / static_cast<double>(particles_.size());
 
-    tf2::Quaternion q;
-    q.setRPY(roll, pitch, newyaw);
+    double newx = pose.getX() + 0.5 * generator_.normal();
+    double newy = pose.getY() + 0.5 * generator_.normal();
+    double newyaw = yaw + 2.0 * M_PI * generator_.normal();
 
-    particle.pose.setRotation(q);
+    particles_.set_pose(i, newx, newy, newyaw);
   }
 
   normalize();
-  update_covariance(pose_);
-  update_pose(pose_);
+  const PoseStatistics stats(particles_);
+  update_covariance(stats, pose_);
+  update_pose(stats, pose_);
 }
 
 void
 ParticlesDistribution::predict(const tf2::Transform & movement)
 {
-  auto start = parent_node_->now();
-  for (auto & particle : particles_) {
-    particle.pose = particle.pose * movement * add_noise(movement);
+  const auto start = std::chrono::steady_clock::now();
+
+  const Pose2d motion(movement);
+  const double dx = motion.x;
+  const double dy = motion.y;
+  const double dyaw = motion.yaw;
+  const double cos_dyaw = motion.cos_yaw;
+  const double sin_dyaw = motion.sin_yaw;
+
+  // All the noise is drawn in batches before the loop, which is left with arithmetic only
+  noise_tra_.resize(particles_.size());
+  noise_rot_.resize(particles_.size());
+  generator_.fill_normal(noise_tra_.data(), noise_tra_.size(), params_.translation_noise);
+  generator_.fill_normal(noise_rot_.data(), noise_rot_.size(), params_.rotation_noise);
+
+  // The pose is accumulated while moving the particles, with no other pass over them
+  PoseStatistics stats;
+
+  for (size_t i = 0; i < particles_.size(); i++) {
+    // movement * noise, where the noise is proportional to the movement
+    const double noise_tra = noise_tra_[i];
+    const double noise_rot = noise_rot_[i];
+
+    const double nx = dx * noise_tra;
+    const double ny = dy * noise_tra;
+
+    const double mx = dx + cos_dyaw * nx - sin_dyaw * ny;
+    const double my = dy + sin_dyaw * nx + cos_dyaw * ny;
+    const double myaw = dyaw + dyaw * noise_rot;
+
+    const double c = particles_.cos_yaw[i];
+    const double s = particles_.sin_yaw[i];
+
+    particles_.set_pose(
+      i, particles_.x[i] + c * mx - s * my, particles_.y[i] + s * mx + c * my,
+      normalize_angle(particles_.yaw[i] + myaw));
+
+    stats.add(
+      particles_.x[i], particles_.y[i], particles_.yaw[i], particles_.cos_yaw[i],
+      particles_.sin_yaw[i], particles_.prob[i]);
   }
 
-  info_.predict_time = parent_node_->now() - start;
-  update_pose(pose_);
-}
-
-tf2::Transform
-ParticlesDistribution::add_noise(const tf2::Transform & dm)
-{
-  tf2::Transform returned_noise;
-
-  std::normal_distribution<double> translation_noise(0.0, translation_noise_);
-  std::normal_distribution<double> rotation_noise(0.0, rotation_noise_);
-
-  double noise_tra = translation_noise(generator_);
-  double noise_rot = rotation_noise(generator_);
-
-  double x = dm.getOrigin().x() * noise_tra;
-  double y = dm.getOrigin().y() * noise_tra;
-  double z = 0.0;
-
-  returned_noise.setOrigin(tf2::Vector3(x, y, z));
-
-  double roll, pitch, yaw;
-  tf2::Matrix3x3(dm.getRotation()).getRPY(roll, pitch, yaw);
-
-  double newyaw = yaw * noise_rot;
-
-  tf2::Quaternion q;
-  q.setRPY(roll, pitch, newyaw);
-  returned_noise.setRotation(q);
-
-  return returned_noise;
+  info_.predict_time = rclcpp::Duration(elapsed_since(start));
+  update_pose(stats, pose_);
 }
 
 void
@@ -485,104 +555,246 @@ ParticlesDistribution::publish_particles(int base_idx, const std_msgs::msg::Colo
     return;
   }
 
-  visualization_msgs::msg::MarkerArray msg;
+  // The message is kept between calls, so its buffers are only allocated when it grows
+  const size_t step = params_.particles_decimation;
+  const size_t num_published = (particles_.size() + step - 1) / step;
+  const auto stamp = parent_node_->now();
 
-  int counter = 0;
-  for (auto & particle : particles_) {
-    visualization_msgs::msg::Marker pose_msg;
+  if (params_.particles_marker == "arrows") {
+    markers_msg_.markers.resize(num_published);
 
-    pose_msg.header.frame_id = "map";
-    pose_msg.header.stamp = parent_node_->now();
-    pose_msg.id = base_idx * 200 + counter++;
-    pose_msg.type = visualization_msgs::msg::Marker::ARROW;
-    pose_msg.type = visualization_msgs::msg::Marker::ADD;
-    pose_msg.lifetime = rclcpp::Duration(1s);
+    for (size_t i = 0, j = 0; i < particles_.size(); i += step, j++) {
+      auto & pose_msg = markers_msg_.markers[j];
 
-    const auto translation = particle.pose.getOrigin();
-    const auto rotation = particle.pose.getRotation();
+      pose_msg.header.frame_id = "map";
+      pose_msg.header.stamp = stamp;
+      pose_msg.id = base_idx * params_.max_particles + j;
+      pose_msg.type = visualization_msgs::msg::Marker::ARROW;
+      pose_msg.action = visualization_msgs::msg::Marker::ADD;
+      pose_msg.lifetime = rclcpp::Duration(1s);
 
-    pose_msg.pose.position.x = translation.x();
-    pose_msg.pose.position.y = translation.y();
-    pose_msg.pose.position.z = translation.z();
+      const auto rotation = particles_.get_rotation(i);
 
-    pose_msg.pose.orientation.x = rotation.x();
-    pose_msg.pose.orientation.y = rotation.y();
-    pose_msg.pose.orientation.z = rotation.z();
-    pose_msg.pose.orientation.w = rotation.w();
+      pose_msg.pose.position.x = particles_.x[i];
+      pose_msg.pose.position.y = particles_.y[i];
+      pose_msg.pose.position.z = 0.0;
 
-    pose_msg.scale.x = 0.1;
-    pose_msg.scale.y = 0.01;
-    pose_msg.scale.z = 0.01;
+      pose_msg.pose.orientation.x = rotation.x();
+      pose_msg.pose.orientation.y = rotation.y();
+      pose_msg.pose.orientation.z = rotation.z();
+      pose_msg.pose.orientation.w = rotation.w();
 
-    pose_msg.color = color;
+      pose_msg.scale.x = 0.1;
+      pose_msg.scale.y = 0.01;
+      pose_msg.scale.z = 0.01;
 
-    msg.markers.push_back(pose_msg);
+      pose_msg.color = color;
+    }
+  } else {
+    // A single marker for the whole hypothesis: a point, or a line along its heading,
+    // for each particle
+    const bool lines = params_.particles_marker == "lines";
+
+    markers_msg_.markers.resize(1);
+    auto & marker = markers_msg_.markers[0];
+
+    marker.header.frame_id = "map";
+    marker.header.stamp = stamp;
+    marker.id = base_idx;
+    marker.type = lines ?
+      visualization_msgs::msg::Marker::LINE_LIST : visualization_msgs::msg::Marker::POINTS;
+    marker.action = visualization_msgs::msg::Marker::ADD;
+    marker.lifetime = rclcpp::Duration(1s);
+    marker.pose.orientation.w = 1.0;
+    marker.scale.x = lines ? 0.01 : 0.05;
+    marker.scale.y = lines ? 0.0 : 0.05;
+    marker.color = color;
+
+    marker.points.resize(lines ? 2 * num_published : num_published);
+
+    for (size_t i = 0, j = 0; i < particles_.size(); i += step) {
+      auto & point = marker.points[j++];
+      point.x = particles_.x[i];
+      point.y = particles_.y[i];
+      point.z = 0.0;
+
+      if (lines) {
+        auto & end = marker.points[j++];
+        end.x = particles_.x[i] + 0.1 * particles_.cos_yaw[i];
+        end.y = particles_.y[i] + 0.1 * particles_.sin_yaw[i];
+        end.z = 0.0;
+      }
+    }
   }
 
-  pub_particles_->publish(msg);
+  pub_particles_->publish(markers_msg_);
 }
 
-void
-ParticlesDistribution::correct_once(
-  const sensor_msgs::msg::LaserScan & scan, const nav2_costmap_2d::Costmap2D & costmap)
+bool
+ParticlesDistribution::update_bf2laser(const std::string & frame_id, const tf2::TimePoint & stamp)
 {
-  auto start = parent_node_->now();
-
   std::string error;
-  if (tf_buffer_.canTransform(
-      scan.header.frame_id, "base_footprint", tf2_ros::fromMsg(scan.header.stamp), &error))
-  {
-    auto bf2laser_msg = tf_buffer_.lookupTransform(
-      "base_footprint", scan.header.frame_id, tf2_ros::fromMsg(scan.header.stamp));
-    tf2::fromMsg(bf2laser_msg, bf2laser_);
+  if (context_->get_sensor_transform(frame_id, stamp, bf2laser_, error)) {
+    bf2laser2d_ = Pose2d(bf2laser_);
+    return true;
   } else {
     RCLCPP_WARN(
       parent_node_->get_logger(), "Timeout while waiting TF %s -> base_footprint [%s]",
-      scan.header.frame_id.c_str(), error.c_str());
-    return;
+      frame_id.c_str(), error.c_str());
+    return false;
   }
+}
 
-  const double o = distance_perception_error_;
+void
+ParticlesDistribution::correct_once(
+  const sensor_msgs::msg::LaserScan & scan, const LocalizationMap & map)
+{
+  if (!prepare_correction(scan)) {
+    return;
+  }
 
-  static const float inv_sqrt_2pi = 0.3989422804014327;
-  const double normal_comp_1 = inv_sqrt_2pi / o;
+  ScanPoints points(scan);
+  correct_particles(scan, points, map, 0, particles_.size());
+  finish_correction(points);
+}
 
-  for (auto & p : particles_) {
-    p.hits = 0.0;
+void
+ParticlesDistribution::correct_once(
+  const sensor_msgs::msg::LaserScan & scan, const LikelihoodField & likelihood_field)
+{
+  if (!prepare_correction(scan)) {
+    return;
   }
 
-  for (int j = 0; j < scan.ranges.size(); j++) {
-    if (std::isnan(scan.ranges[j]) || std::isinf(scan.ranges[j])) {continue;}
+  ScanPoints points(scan);
+  correct_particles(points, likelihood_field, 0, particles_.size());
+  finish_correction(points);
+}
+
+bool
+ParticlesDistribution::prepare_correction(const sensor_msgs::msg::LaserScan & scan)
+{
+  return prepare_correction(scan.header.frame_id, tf2_ros::fromMsg(scan.header.stamp));
+}
+
+bool
+ParticlesDistribution::prepare_correction(
+  const std::string & frame_id, const tf2::TimePoint & stamp)
+{
+  correct_start_ = std::chrono::steady_clock::now();
+
+  return update_bf2laser(frame_id, stamp);
+}
+
+void
+ParticlesDistribution::correct_particles(
+  const sensor_msgs::msg::LaserScan & scan, const ScanPoints & points,
+  const LocalizationMap & map, size_t begin, size_t end)
+{
+  const double o = params_.distance_perception_error;
 
-    tf2::Transform laser2point = get_tranform_to_read(scan, j);
+  static const float inv_sqrt_2pi = 0.3989422804014327;
+  const double normal_comp_1 = inv_sqrt_2pi / o;
+
+  const bool merged = !points.origin_x.empty();
 
-    for (int i = 0; i < particles_.size(); i++) {
-      auto & p = particles_[i];
+  for (size_t i = begin; i < end; i++) {
+    const Pose2d map2laser = particles_.get_pose2(i) * bf2laser2d_;
+    particles_.hits[i] = 0.0;
 
+    for (size_t j = 0; j < points.size(); j++) {
+      const double ox = merged ? points.origin_x[j] : 0.0;
+      const double oy = merged ? points.origin_y[j] : 0.0;
       double calculated_distance = get_error_distance_to_obstacle(
-        p.pose, bf2laser_, laser2point, scan, costmap, o);
+        map2laser, points.x[j], points.y[j], map, o, ox, oy);
 
       if (!std::isinf(calculated_distance)) {
         const double a = calculated_distance / o;
         const double normal_comp_2 = std::exp(-0.5 * a * a);
 
         double prob = std::clamp(normal_comp_1 * normal_comp_2, 0.0, 1.0);
-        p.prob = std::max(p.prob + prob, 0.000001);
+        particles_.prob[i] = std::max(particles_.prob[i] + prob, 0.000001);
 
-        p.hits += prob;
+        particles_.hits[i] += prob;
       }
     }
   }
+}
+
+void
+ParticlesDistribution::correct_particles(
+  const ScanPoints & points, const LikelihoodField & likelihood_field, size_t begin, size_t end)
+{
+  const double o = params_.distance_perception_error;
+  const double max_error = 3.0 * o;
+
+  static const float inv_sqrt_2pi = 0.3989422804014327;
+  const double normal_comp_1 = inv_sqrt_2pi / o;
+
+  // Chunks of the same distribution may run at the same time, so each thread has its own
+  thread_local std::vector<double> map_x;
+  thread_local std::vector<double> map_y;
 
-  info_.correct_time = parent_node_->now() - start;
+  const size_t num_beams = points.size();
+  map_x.resize(num_beams);
+  map_y.resize(num_beams);
+
+  for (size_t i = begin; i < end; i++) {
+    const Pose2d map2laser = particles_.get_pose2(i) * bf2laser2d_;
+
+    transform_points(
+      map2laser.x, map2laser.y, map2laser.cos_yaw, map2laser.sin_yaw,
+      points.x.data(), points.y.data(), num_beams, map_x.data(), map_y.data());
+
+    double hits = 0.0;
+    for (size_t j = 0; j < num_beams; j++) {
+      double calculated_distance = likelihood_field.get_distance(map_x[j], map_y[j]);
+
+      if (calculated_distance < max_error) {
+        const double a = calculated_distance / o;
+        const double normal_comp_2 = std::exp(-0.5 * a * a);
+
+        hits += std::clamp(normal_comp_1 * normal_comp_2, 0.0, 1.0);
+      }
+    }
+
+    add_hits(i, hits);
+  }
+}
+
+void
+ParticlesDistribution::apply_hits(const double * hits)
+{
+  for (size_t i = 0; i < particles_.size(); i++) {
+    add_hits(i, hits[i]);
+  }
+}
+
+void
+ParticlesDistribution::finish_correction(const ScanPoints & points)
+{
+  info_.correct_time = rclcpp::Duration(elapsed_since(correct_start_));
+  skipped_corrections_ = 0;
+
+  info_.num_beams = points.size();
 
   normalize();
 
-  // Calculate quality
+  // With no beam selected, as when all of them are max range returns, the scan says nothing
+  // of the pose, so the quality of the last one is kept
+  const float num_ranges = points.equivalent_ranges();
+  if (num_ranges > 0.0f) {
+    update_quality(num_ranges);
+  }
+}
+
+void
+ParticlesDistribution::update_quality(float num_ranges)
+{
   quality_ = 0.0;
-  for (auto & p : particles_) {
-    p.hits = p.hits / static_cast<float>(scan.ranges.size());
-    quality_ = std::max(quality_, p.hits);
+  for (auto & hits : particles_.hits) {
+    hits = hits / num_ranges;
+    quality_ = std::max(quality_, hits);
   }
   info_.quality = quality_;
 }
@@ -606,50 +818,53 @@ ParticlesDistribution::get_tranform_to_read(const sensor_msgs::msg::LaserScan &
 
 unsigned char
 ParticlesDistribution::get_cost(
-  const tf2::Transform & transform, const nav2_costmap_2d::Costmap2D & costmap)
+  const tf2::Transform & transform, const LocalizationMap & map)
 {
-  unsigned int mx, my;
-  if (costmap.worldToMap(transform.getOrigin().x(), transform.getOrigin().y(), mx, my)) {
-    return costmap.getCost(mx, my);
-  } else {
-    return nav2_costmap_2d::NO_INFORMATION;
-  }
+  return map.get_world_cost(transform.getOrigin().x(), transform.getOrigin().y());
 }
 
 double
 ParticlesDistribution::get_error_distance_to_obstacle(
   const tf2::Transform & map2bf, const tf2::Transform & bf2laser,
   const tf2::Transform & laser2point, const sensor_msgs::msg::LaserScan & scan,
-  const nav2_costmap_2d::Costmap2D & costmap, double o)
+  const LocalizationMap & map, double o)
 {
-  if (std::isinf(laser2point.getOrigin().x()) || std::isnan(laser2point.getOrigin().x())) {
+  return get_error_distance_to_obstacle(
+    Pose2d(map2bf) * Pose2d(bf2laser), laser2point.getOrigin().x(), laser2point.getOrigin().y(),
+    map, o);
+}
+
+double
+ParticlesDistribution::get_error_distance_to_obstacle(
+  const Pose2d & map2laser, double px, double py, const LocalizationMap & map, double o,
+  double ox, double oy)
+{
+  if (std::isinf(px) || std::isnan(px)) {
     return std::numeric_limits<double>::infinity();
   }
 
-  tf2::Transform map2laser = map2bf * bf2laser;
-  tf2::Transform map2point = map2laser * laser2point;
-  tf2::Transform map2point_aux = map2point;
-  tf2::Transform uvector;
-  tf2::Vector3 unit = laser2point.getOrigin() / laser2point.getOrigin().length();
+  double wx, wy;
+  map2laser.apply(px, py, wx, wy);
+
+  if (map.get_world_cost(wx, wy) == nav2_costmap_2d::LETHAL_OBSTACLE) {return 0.0;}
 
-  if (get_cost(map2point, costmap) == nav2_costmap_2d::LETHAL_OBSTACLE) {return 0.0;}
+  // Along the beam, in the map frame
+  const double length = std::hypot(px - ox, py - oy);
+  double ux, uy;
+  map2laser.rotate((px - ox) / length, (py - oy) / length, ux, uy);
 
-  float dist = costmap.getResolution();
+  float dist = map.get_resolution();
   while (dist < (3.0 * o)) {
-    uvector.setOrigin(unit * dist);
     // For positive
-    map2point = map2point_aux * uvector;
-    auto cost = get_cost(map2point, costmap);
+    auto cost = map.get_world_cost(wx + ux * dist, wy + uy * dist);
 
     if (cost == nav2_costmap_2d::LETHAL_OBSTACLE) {return dist;}
 
     // For negative
-    uvector.setOrigin(uvector.getOrigin() * -1.0);
-    map2point = map2point_aux * uvector;
-    cost = get_cost(map2point, costmap);
+    cost = map.get_world_cost(wx - ux * dist, wy - uy * dist);
 
     if (cost == nav2_costmap_2d::LETHAL_OBSTACLE) {return dist;}
-    dist = dist + costmap.getResolution();
+    dist = dist + map.get_resolution();
   }
 
   return std::numeric_limits<double>::infinity();
@@ -658,99 +873,203 @@ ParticlesDistribution::get_error_distance_to_obstacle(
 void
 ParticlesDistribution::reseed()
 {
-  auto start = parent_node_->now();
+  const auto start = std::chrono::steady_clock::now();
 
-  // Sort particles by prob
-  std::sort(
-    particles_.begin(), particles_.end(),
-    [](const Particle & a, const Particle & b) -> bool
+  const size_t number_particles = get_target_size();
+
+  if (params_.resampler == "systematic") {
+    // Nothing to do while the weights are not degenerated
+    if (number_particles == particles_.size() &&
+      get_effective_sample_size() >= params_.resample_threshold * particles_.size())
     {
-      return a.prob > b.prob;
-    });
-
-  double percentage_losers = reseed_percentage_losers_;
-  double percentage_winners = reseed_percentage_winners_;
-
-  auto number_particles = particles_.size();
-  if (get_quality() < low_q_hypo_thereshold_) {
-    number_particles = std::clamp(
-      static_cast<int>(number_particles + particles_step_), min_particles_, max_particles_);
-    int new_particles = number_particles - particles_.size();
-    for (int i = 0; i < new_particles; i++) {
-      Particle new_p = particles_.front();
-      particles_.push_back(new_p);
+      return;
     }
-  } else if (get_quality() > good_hypo_thereshold_) {
-    number_particles = std::clamp(
-      static_cast<int>(number_particles - particles_step_), min_particles_, max_particles_);
-    for (int i = 0; i < particles_.size() - number_particles; i++) {
-      particles_.pop_back();
+
+    systematic_resample(number_particles);
+  } else {
+    sort_reseed(number_particles);
+  }
+
+  info_.reseed_time = rclcpp::Duration(elapsed_since(start));
+  info_.num_part = particles_.size();
+
+  normalize();
+  update_covariance(PoseStatistics(particles_), pose_);
+}
+
+size_t
+ParticlesDistribution::get_target_size()
+{
+  const int number_particles = particles_.size();
+
+  if (params_.particles_adaptation == "kld") {
+    return std::clamp(
+      kld_sample_size(count_kld_bins(), params_.kld_err, params_.kld_z),
+      params_.min_particles, params_.max_particles);
+  } else if (get_quality() < params_.low_q_hypo_thereshold) {
+    return std::clamp(
+      number_particles + params_.particles_step, params_.min_particles, params_.max_particles);
+  } else if (get_quality() > params_.good_hypo_thereshold) {
+    return std::min(
+      std::clamp(
+        number_particles - params_.particles_step, params_.min_particles,
+        params_.max_particles),
+      number_particles);
+  }
+
+  return number_particles;
+}
+
+double
+ParticlesDistribution::get_effective_sample_size() const
+{
+  double sum = 0.0;
+  double sum_sq = 0.0;
+  for (const auto prob : particles_.prob) {
+    sum += prob;
+    sum_sq += prob * prob;
+  }
+
+  return sum_sq > 0.0 ? sum * sum / sum_sq : 0.0;
+}
+
+void
+ParticlesDistribution::systematic_resample(size_t number_particles)
+{
+  const size_t size = particles_.size();
+  const double total = std::accumulate(particles_.prob.begin(), particles_.prob.end(), 0.0);
+
+  if (size == 0 || number_particles == 0 || total <= 0.0) {
+    return;
+  }
+
+  const double error_x = params_.init_error_x * params_.init_error_x;
+  const double error_y = params_.init_error_y * params_.init_error_y;
+  const double error_yaw = params_.init_error_yaw * params_.init_error_yaw;
+
+  const double step = total / number_particles;
+
+  // The buffers keep their capacity between calls, so this does not allocate
+  resample_buffer_.resize(number_particles);
+
+  double threshold = step * generator_.uniform();
+  double cumulative = particles_.prob[0];
+  size_t i = 0;
+  size_t last = size;
+
+  for (size_t m = 0; m < number_particles; m++) {
+    while (threshold > cumulative && i + 1 < size) {
+      cumulative += particles_.prob[++i];
+    }
+
+    // Copies of the same particle are spread, or they would never separate at rest
+    if (i == last) {
+      resample_buffer_.set_pose(
+        m, particles_.x[i] + error_x * generator_.normal(),
+        particles_.y[i] + error_y * generator_.normal(),
+        normalize_angle(particles_.yaw[i] + error_yaw * generator_.normal()));
+    } else {
+      resample_buffer_.x[m] = particles_.x[i];
+      resample_buffer_.y[m] = particles_.y[i];
+      resample_buffer_.yaw[m] = particles_.yaw[i];
+      resample_buffer_.cos_yaw[m] = particles_.cos_yaw[i];
+      resample_buffer_.sin_yaw[m] = particles_.sin_yaw[i];
     }
+    resample_buffer_.prob[m] = 1.0 / number_particles;
+    resample_buffer_.hits[m] = particles_.hits[i];
+
+    last = i;
+    threshold += step;
+  }
+
+  std::swap(particles_, resample_buffer_);
+}
+
+void
+ParticlesDistribution::sort_reseed(size_t number_particles)
+{
+  // Sort particles by prob
+  particles_.sort_by_prob();
+
+  double percentage_losers = params_.reseed_percentage_losers;
+  double percentage_winners = params_.reseed_percentage_winners;
+
+  while (particles_.size() < number_particles) {
+    particles_.push_back(particles_, 0);
   }
+  particles_.resize(number_particles);
 
   int number_losers = number_particles * percentage_losers;
   int number_no_losers = number_particles - number_losers;
   int number_winners = number_particles * percentage_winners;
 
-  std::vector<Particle> new_particles(particles_.begin(), particles_.begin() + number_no_losers);
+  ParticleSet new_particles;
+  new_particles.reserve(number_particles);
+  for (int i = 0; i < number_no_losers; i++) {
+    new_particles.push_back(particles_, i);
+  }
 
-  std::normal_distribution<double> selector(0, number_winners);
-  std::normal_distribution<double> noise_x(0, init_error_x_ * init_error_x_);
-  std::normal_distribution<double> noise_y(0, init_error_y_ * init_error_y_);
-  std::normal_distribution<double> noise_t(0, init_error_yaw_ * init_error_yaw_);
+  const double error_x = params_.init_error_x * params_.init_error_x;
+  const double error_y = params_.init_error_y * params_.init_error_y;
+  const double error_yaw = params_.init_error_yaw * params_.init_error_yaw;
 
   for (int i = 0; i < number_losers; i++) {
-    int index = std::clamp(static_cast<int>(selector(generator_)), 0, number_winners);
-
-    Particle p;
-    p.prob = new_particles.back().prob;
-
-    auto w_pose = particles_[i].pose.getOrigin();
+    int index = std::clamp(
+      static_cast<int>(number_winners * generator_.normal()), 0, number_winners);
 
-    double nx = noise_x(generator_);
-    double ny = noise_y(generator_);
+    new_particles.resize(new_particles.size() + 1);
+    const size_t p = new_particles.size() - 1;
 
-    p.pose.setOrigin({w_pose.x() + nx, w_pose.y() + ny, w_pose.z()});
+    new_particles.prob[p] = p > 0 ? new_particles.prob[p - 1] : 1.0 / number_particles;
 
-    double roll, pitch, yaw;
+    double nx = error_x * generator_.normal();
+    double ny = error_y * generator_.normal();
 
-    tf2::Matrix3x3 m(particles_[i].pose.getRotation());
-    m.getRPY(roll, pitch, yaw);
-
-    double newyaw = yaw + noise_t(generator_);
+    double newyaw = particles_.yaw[i] + error_yaw * generator_.normal();
     while (newyaw > M_PI) {newyaw -= 2.0 * M_PI;}
     while (newyaw < -M_PI) {newyaw += 2.0 * M_PI;}
 
-    tf2::Quaternion q;
-    q.setRPY(roll, pitch, newyaw);
-
-    p.pose.setRotation(q);
-
-    new_particles.push_back(p);
+    new_particles.set_pose(p, particles_.x[i] + nx, particles_.y[i] + ny, newyaw);
   }
 
-  particles_ = new_particles;
+  particles_ = std::move(new_particles);
+}
 
-  info_.reseed_time = parent_node_->now() - start;
+int
+ParticlesDistribution::count_kld_bins() const
+{
+  // A bin counts when resampling at params_.max_particles would put at least one particle in it
+  const double min_bin_prob = 1.0 / params_.max_particles;
+
+  std::unordered_map<int64_t, double> bins;
+  bins.reserve(particles_.size());
+  for (size_t i = 0; i < particles_.size(); i++) {
+    const int64_t ix = static_cast<int64_t>(std::floor(particles_.x[i] / params_.kld_bin_xy));
+    const int64_t iy = static_cast<int64_t>(std::floor(particles_.y[i] / params_.kld_bin_xy));
+    // Yaws are not wrapped until a predict, as after init, and the same heading has to
+    // fall in the same bin
+    const double yaw = normalize_angle(particles_.yaw[i]);
+    const int64_t iyaw = static_cast<int64_t>(std::floor(yaw / params_.kld_bin_yaw));
+
+    // 21 bits per axis are enough for maps of kilometers with bins of centimeters
+    const int64_t key = ((ix & 0x1FFFFF) << 42) | ((iy & 0x1FFFFF) << 21) | (iyaw & 0x1FFFFF);
+    bins[key] += particles_.prob[i];
+  }
 
-  normalize();
-  update_covariance(pose_);
+  return std::count_if(
+    bins.begin(), bins.end(),
+    [min_bin_prob](const auto & bin) {return bin.second >= min_bin_prob;});
 }
 
 void
 ParticlesDistribution::normalize()
 {
-  double sum = 0.0;
-  std::for_each(
-    particles_.begin(), particles_.end(), [&sum](const Particle & p) {
-      sum += p.prob;
-    });
+  double sum = std::accumulate(particles_.prob.begin(), particles_.prob.end(), 0.0);
 
   if (sum != 0.0) {
-    std::for_each(
-      particles_.begin(), particles_.end(), [&](Particle & p) {
-        p.prob = p.prob / sum;
-      });
+    for (auto & prob : particles_.prob) {
+      prob = prob / sum;
+    }
   }
 }
 
@@ -758,15 +1077,15 @@ void
 ParticlesDistribution::merge(ParticlesDistribution & other)
 {
   size_t size = particles_.size();
-  particles_.insert(particles_.end(), other.particles_.begin(), other.particles_.end());
+  particles_.append(other.particles_);
 
-  std::sort(
-    particles_.begin(), particles_.end(),
-    [](const Particle & a, const Particle & b) -> bool
-    {
-      return a.prob > b.prob;
-    });
-  particles_.erase(particles_.begin() + size, particles_.end());
+  if (params_.resampler == "systematic") {
+    systematic_resample(size);
+    normalize();
+  } else {
+    particles_.sort_by_prob();
+    particles_.resize(size);
+  }
 }
 
 std_msgs::msg::ColorRGBA
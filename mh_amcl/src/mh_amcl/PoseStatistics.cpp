@@ -0,0 +1,67 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <algorithm>
+#include <cmath>
+
+#include "mh_amcl/ParticleSet.hpp"
+#include "mh_amcl/PoseStatistics.hpp"
+
+namespace mh_amcl
+{
+
+PoseStatistics::PoseStatistics(const ParticleSet & particles)
+{
+  for (std::size_t i = 0; i < particles.size(); i++) {
+    add(
+      particles.x[i], particles.y[i], particles.yaw[i], particles.cos_yaw[i],
+      particles.sin_yaw[i], particles.prob[i]);
+  }
+}
+
+double
+PoseStatistics::get_x() const
+{
+  return sum_w_ > 0.0 ? sum_wx_ / sum_w_ : 0.0;
+}
+
+double
+PoseStatistics::get_y() const
+{
+  return sum_w_ > 0.0 ? sum_wy_ / sum_w_ : 0.0;
+}
+
+double
+PoseStatistics::get_yaw() const
+{
+  return atan2(sum_wsin_, sum_wcos_);
+}
+
+double
+PoseStatistics::get_covariance(int i, int j) const
+{
+  if (n_ < 2) {
+    return 0.0;
+  }
+
+  if (i > j) {
+    std::swap(i, j);
+  }
+
+  const double n = static_cast<double>(n_);
+  return (sum_prod_[i][j] - sum_[i] * sum_[j] / n) / (n - 1.0);
+}
+
+}  // namespace mh_amcl
@@ -0,0 +1,80 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#include <cmath>
+
+#include "mh_amcl/RandomGenerator.hpp"
+
+namespace mh_amcl
+{
+
+namespace
+{
+
+uint64_t
+splitmix64(uint64_t & x)
+{
+  uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+}  // namespace
+
+void
+RandomGenerator::seed(uint64_t seed, uint64_t stream)
+{
+  // The stream is mixed before the seed, so that (seed, stream + 1) is not (seed + 1, stream)
+  uint64_t x = stream;
+  x = splitmix64(x) ^ seed;
+  for (auto & word : state_) {
+    word = splitmix64(x);
+  }
+  has_spare_normal_ = false;
+}
+
+double
+RandomGenerator::normal()
+{
+  if (has_spare_normal_) {
+    has_spare_normal_ = false;
+    return spare_normal_;
+  }
+
+  double pair[2];
+  fill_normal(pair, 2);
+  spare_normal_ = pair[1];
+  has_spare_normal_ = true;
+  return pair[0];
+}
+
+void
+RandomGenerator::fill_normal(double * out, size_t n, double stddev)
+{
+  // 1 - uniform() is in (0, 1], so the log is finite
+  for (size_t i = 0; i + 1 < n; i += 2) {
+    const double r = stddev * std::sqrt(-2.0 * std::log(1.0 - uniform()));
+    const double theta = 2.0 * M_PI * uniform();
+    out[i] = r * std::cos(theta);
+    out[i + 1] = r * std::sin(theta);
+  }
+  if (n % 2 == 1) {
+    out[n - 1] = stddev * normal();
+  }
+}
+
+}  // namespace mh_amcl
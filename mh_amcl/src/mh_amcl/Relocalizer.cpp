@@ -0,0 +1,144 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "mh_amcl/Relocalizer.hpp"
+
+namespace mh_amcl
+{
+
+Relocalizer::Relocalizer()
+: thread_(&Relocalizer::worker, this)
+{
+}
+
+Relocalizer::~Relocalizer()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+    cancel_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+
+  delete results_.exchange(nullptr);
+}
+
+bool
+Relocalizer::request(std::shared_ptr<const MapMatcher> matcher, const ScanPoints & points)
+{
+  return request(std::move(matcher), points, nullptr);
+}
+
+bool
+Relocalizer::request(
+  std::shared_ptr<const MapMatcher> matcher, const ScanPoints & points,
+  const SearchRegion & region)
+{
+  return request(std::move(matcher), points, &region);
+}
+
+bool
+Relocalizer::request(
+  std::shared_ptr<const MapMatcher> matcher, const ScanPoints & points,
+  const SearchRegion * region)
+{
+  if (busy_ || matcher == nullptr || points.empty()) {
+    return false;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    matcher_ = std::move(matcher);
+    points_ = points;
+    local_ = region != nullptr;
+    if (local_) {
+      region_ = *region;
+    }
+    pending_ = true;
+    busy_ = true;
+  }
+  cv_.notify_all();
+
+  return true;
+}
+
+void
+Relocalizer::cancel()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  if (pending_) {
+    pending_ = false;
+    matcher_ = nullptr;
+    busy_ = false;
+  }
+
+  generation_++;
+  cancel_ = true;
+}
+
+bool
+Relocalizer::take_results(std::list<TransformWeighted> & matchs)
+{
+  std::unique_ptr<Results> results(results_.exchange(nullptr));
+
+  if (results == nullptr || results->generation != generation_) {
+    return false;
+  }
+
+  matchs = std::move(results->matchs);
+  return true;
+}
+
+void
+Relocalizer::worker()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this] {return stop_ || pending_;});
+
+    if (stop_) {
+      return;
+    }
+
+    auto matcher = std::move(matcher_);
+    const auto points = std::move(points_);
+    const bool local = local_;
+    const SearchRegion region = region_;
+    const uint64_t generation = generation_;
+    pending_ = false;
+    cancel_ = false;
+
+    lock.unlock();
+    auto results = std::make_unique<Results>();
+    results->generation = generation;
+    results->matchs = local ?
+      matcher->get_matchs(points, region, &cancel_) : matcher->get_matchs(points, &cancel_);
+    matcher = nullptr;
+
+    delete results_.exchange(results.release());
+    lock.lock();
+
+    busy_ = false;
+  }
+}
+
+}  // namespace mh_amcl
@@ -0,0 +1,229 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "sensor_msgs/msg/laser_scan.hpp"
+
+#include "mh_amcl/ScanPoints.hpp"
+
+namespace mh_amcl
+{
+
+void
+ScanPoints::update(const sensor_msgs::msg::LaserScan & scan)
+{
+  update_tables(scan);
+
+  num_ranges = scan.ranges.size();
+
+  x.clear();
+  y.clear();
+  range.clear();
+  index.clear();
+  origin_x.clear();
+  origin_y.clear();
+
+  for (std::size_t i = 0; i < num_ranges; i++) {
+    const float dist = scan.ranges[i];
+    if (std::isnan(dist) || std::isinf(dist)) {continue;}
+
+    x.push_back(dist * cos_[i]);
+    y.push_back(dist * sin_[i]);
+    range.push_back(dist);
+    index.push_back(i);
+  }
+
+  num_valid = size();
+  select_beams(scan);
+}
+
+void
+ScanPoints::merge(
+  const std::vector<const ScanPoints *> & sources, const std::vector<Pose2d> & sensor_poses)
+{
+  x.clear();
+  y.clear();
+  range.clear();
+  index.clear();
+  origin_x.clear();
+  origin_y.clear();
+  num_ranges = 0;
+  num_valid = 0;
+
+  for (std::size_t k = 0; k < sources.size(); k++) {
+    const auto & source = *sources[k];
+    const auto & pose = sensor_poses[k];
+    for (std::size_t j = 0; j < source.size(); j++) {
+      double px, py;
+      pose.apply(source.x[j], source.y[j], px, py);
+      x.push_back(px);
+      y.push_back(py);
+      range.push_back(source.range[j]);
+      index.push_back(source.index[j]);
+      origin_x.push_back(pose.x);
+      origin_y.push_back(pose.y);
+    }
+
+    num_ranges += source.num_ranges;
+    num_valid += source.num_valid;
+  }
+}
+
+void
+ScanPoints::set_max_beams(std::size_t max_beams, BeamSelection selection)
+{
+  max_beams_ = max_beams;
+  selection_ = selection;
+}
+
+void
+ScanPoints::subsample(std::size_t n, ScanPoints & points) const
+{
+  n = std::min(n, size());
+  points.x.resize(n);
+  points.y.resize(n);
+  points.range.resize(n);
+  points.index.resize(n);
+  points.origin_x.resize(origin_x.empty() ? 0 : n);
+  points.origin_y.resize(origin_y.empty() ? 0 : n);
+
+  const double stride = n > 0 ? static_cast<double>(size()) / n : 0.0;
+  for (std::size_t k = 0; k < n; k++) {
+    const auto j = static_cast<std::size_t>(k * stride);
+    points.x[k] = x[j];
+    points.y[k] = y[j];
+    points.range[k] = range[j];
+    points.index[k] = index[j];
+    if (!origin_x.empty()) {
+      points.origin_x[k] = origin_x[j];
+      points.origin_y[k] = origin_y[j];
+    }
+  }
+
+  points.num_ranges = num_ranges;
+  points.num_valid = num_valid;
+}
+
+void
+ScanPoints::select_beams(const sensor_msgs::msg::LaserScan & scan)
+{
+  if (max_beams_ == 0) {
+    return;
+  }
+
+  std::vector<std::size_t> candidates;
+  candidates.reserve(size());
+  for (std::size_t j = 0; j < size(); j++) {
+    if (selection_ == UNIFORM || range[j] < scan.range_max) {
+      candidates.push_back(j);
+    }
+  }
+
+  std::vector<char> selected(size(), 0);
+
+  if (candidates.size() <= max_beams_) {
+    for (auto j : candidates) {
+      selected[j] = 1;
+    }
+  } else if (selection_ == UNIFORM) {
+    uniform_selection(candidates, max_beams_, selected);
+  } else {
+    uniform_selection(candidates, max_beams_ / 2, selected);
+
+    // How far each endpoint is from the line of its neighbors, relative to their distance
+    std::vector<double> score(size(), 0.0);
+    for (std::size_t j = 1; j + 1 < size(); j++) {
+      const double dx = x[j + 1] - x[j - 1];
+      const double dy = y[j + 1] - y[j - 1];
+      const double mx = x[j] - 0.5 * (x[j - 1] + x[j + 1]);
+      const double my = y[j] - 0.5 * (y[j - 1] + y[j + 1]);
+      score[j] = std::hypot(mx, my) / (std::hypot(dx, dy) + 1e-6);
+    }
+
+    std::vector<std::size_t> remaining;
+    for (auto j : candidates) {
+      if (!selected[j]) {
+        remaining.push_back(j);
+      }
+    }
+
+    const std::size_t n = std::min(max_beams_ - max_beams_ / 2, remaining.size());
+    std::nth_element(
+      remaining.begin(), remaining.begin() + n, remaining.end(),
+      [&score](std::size_t a, std::size_t b) {return score[a] > score[b];});
+
+    for (std::size_t k = 0; k < n; k++) {
+      selected[remaining[k]] = 1;
+    }
+  }
+
+  keep(selected);
+}
+
+void
+ScanPoints::uniform_selection(
+  const std::vector<std::size_t> & candidates, std::size_t n, std::vector<char> & selected)
+{
+  const double stride = static_cast<double>(candidates.size()) / n;
+  for (std::size_t k = 0; k < n; k++) {
+    selected[candidates[static_cast<std::size_t>(k * stride)]] = 1;
+  }
+}
+
+void
+ScanPoints::keep(const std::vector<char> & selected)
+{
+  std::size_t last = 0;
+  for (std::size_t j = 0; j < size(); j++) {
+    if (!selected[j]) {continue;}
+
+    x[last] = x[j];
+    y[last] = y[j];
+    range[last] = range[j];
+    index[last] = index[j];
+    last++;
+  }
+
+  x.resize(last);
+  y.resize(last);
+  range.resize(last);
+  index.resize(last);
+}
+
+void
+ScanPoints::update_tables(const sensor_msgs::msg::LaserScan & scan)
+{
+  if (cos_.size() == scan.ranges.size() && angle_min_ == scan.angle_min &&
+    angle_increment_ == scan.angle_increment)
+  {
+    return;
+  }
+
+  angle_min_ = scan.angle_min;
+  angle_increment_ = scan.angle_increment;
+
+  cos_.resize(scan.ranges.size());
+  sin_.resize(scan.ranges.size());
+  for (std::size_t i = 0; i < scan.ranges.size(); i++) {
+    const double angle = scan.angle_min + static_cast<double>(i) * scan.angle_increment;
+    cos_[i] = std::cos(angle);
+    sin_[i] = std::sin(angle);
+  }
+}
+
+}  // namespace mh_amcl
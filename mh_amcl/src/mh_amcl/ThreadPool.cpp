@@ -0,0 +1,115 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "mh_amcl/ThreadPool.hpp"
+
+namespace mh_amcl
+{
+
+ThreadPool::ThreadPool(unsigned int num_threads)
+{
+  for (unsigned int i = 1; i < num_threads; i++) {
+    workers_.emplace_back(&ThreadPool::worker, this);
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_cv_.notify_all();
+
+  for (auto & worker : workers_) {
+    worker.join();
+  }
+}
+
+void
+ThreadPool::parallel_for(std::size_t n, const std::function<void(std::size_t)> & f)
+{
+  if (workers_.empty() || n < 2) {
+    for (std::size_t i = 0; i < n; i++) {
+      f(i);
+    }
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    task_ = &f;
+    num_tasks_ = n;
+    next_task_ = 0;
+    active_++;
+    generation_++;
+  }
+  work_cv_.notify_all();
+
+  run_tasks(f, n);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  active_--;
+  done_cv_.wait(lock, [this] {return active_ == 0;});
+
+  // Workers waking up late for this call must not see it
+  task_ = nullptr;
+}
+
+void
+ThreadPool::run_tasks(const std::function<void(std::size_t)> & f, std::size_t n)
+{
+  for (std::size_t i = next_task_++; i < n; i = next_task_++) {
+    f(i);
+  }
+}
+
+void
+ThreadPool::worker()
+{
+  uint64_t seen_generation = 0;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    work_cv_.wait(lock, [&] {return stop_ || generation_ != seen_generation;});
+
+    if (stop_) {
+      return;
+    }
+
+    seen_generation = generation_;
+    if (task_ == nullptr) {
+      continue;
+    }
+
+    const auto & task = *task_;
+    const std::size_t n = num_tasks_;
+    active_++;
+
+    lock.unlock();
+    run_tasks(task, n);
+    lock.lock();
+
+    if (--active_ == 0) {
+      done_cv_.notify_all();
+    }
+  }
+}
+
+}  // namespace mh_amcl
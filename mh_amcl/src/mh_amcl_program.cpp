@@ -21,7 +21,9 @@ int main(int argc, char ** argv)
 {
   rclcpp::init(argc, argv);
 
-  auto mh_amcl = std::make_shared<mh_amcl::MH_AMCL_Node>();
+  // As in a component container with use_intra_process_comms, so both behave the same
+  auto mh_amcl = std::make_shared<mh_amcl::MH_AMCL_Node>(
+    rclcpp::NodeOptions().use_intra_process_comms(true));
   auto executor = rclcpp::executors::MultiThreadedExecutor();
   executor.add_node(mh_amcl->get_node_base_interface());
 
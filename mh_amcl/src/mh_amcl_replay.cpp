@@ -0,0 +1,359 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Replays rosbag2 recordings through the localization core as fast as possible, with no
+// executor or timers. For each bag it reports scans per second, the latency of each step,
+// the peak memory and, if the bag has a motion capture ground truth, the pose error.
+//
+//   ros2 run mh_amcl mh_amcl_replay <map.yaml> <bag> [<bag> ...] [--gt-offset x y yaw]
+//     [--ros-args --params-file <params.yaml>]
+//
+// --gt-offset is the pose of the motion capture frame in the map. Parameters are those of
+// the mh_amcl node. A single hypothesis is tracked from the first ground truth pose, or
+// from init_pos_* if there is no ground truth.
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "tf2/LinearMath/Transform.h"
+#include "tf2/buffer_core.h"
+#include "tf2/convert.h"
+#include "tf2/transform_datatypes.h"
+#include "tf2_ros/buffer_interface.h"
+#include "tf2_geometry_msgs/tf2_geometry_msgs.hpp"
+
+#include "lifecycle_msgs/msg/state.hpp"
+#include "sensor_msgs/msg/laser_scan.hpp"
+#include "tf2_msgs/msg/tf_message.hpp"
+#ifdef MH_AMCL_HAS_MOCAP_MSGS
+#include "mocap_msgs/msg/rigid_body.hpp"
+#endif
+
+
+#include "mh_amcl/LikelihoodField.hpp"
+#include "mh_amcl/LocalizationMap.hpp"
+#include "mh_amcl/MapLoader.hpp"
+#include "mh_amcl/ParticlesDistribution.hpp"
+#include "mh_amcl/Pose2.hpp"
+#include "mh_amcl/ScanPoints.hpp"
+
+#include "rclcpp/rclcpp.hpp"
+#include "rclcpp/serialization.hpp"
+#include "rclcpp_lifecycle/lifecycle_node.hpp"
+#include "rosbag2_cpp/reader.hpp"
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+class Latencies
+{
+public:
+  void add(Clock::duration duration)
+  {
+    values_.push_back(std::chrono::duration<double, std::milli>(duration).count());
+  }
+
+  // In milliseconds
+  double percentile(double p) const
+  {
+    if (values_.empty()) {
+      return 0.0;
+    }
+
+    auto values = values_;
+    const size_t n = std::min(values.size() - 1, static_cast<size_t>(p * values.size()));
+    std::nth_element(values.begin(), values.begin() + n, values.end());
+    return values[n];
+  }
+
+  void print(const char * name) const
+  {
+    std::printf(
+      "  %-8s p50 %8.3f  p90 %8.3f  p99 %8.3f  max %8.3f ms  (%zu)\n", name,
+      percentile(0.5), percentile(0.9), percentile(0.99), percentile(1.0), values_.size());
+  }
+
+protected:
+  std::vector<double> values_;
+};
+
+typedef struct
+{
+  size_t scans;
+  double seconds;
+  Latencies predict;
+  Latencies correct;
+  Latencies reseed;
+  size_t ground_truth_scans;
+  double sum_error_xy;
+  double max_error_xy;
+  double sum_error_yaw;
+} ReplayStats;
+
+template<class T>
+T
+deserialize(const rosbag2_storage::SerializedBagMessage & bag_msg)
+{
+  static const rclcpp::Serialization<T> serialization;
+
+  rclcpp::SerializedMessage serialized(*bag_msg.serialized_data);
+  T msg;
+  serialization.deserialize_message(&serialized, &msg);
+  return msg;
+}
+
+double
+get_yaw(const tf2::Transform & transform)
+{
+  return mh_amcl::get_yaw(transform.getRotation());
+}
+
+tf2::Transform
+make_transform(double x, double y, double yaw)
+{
+  tf2::Quaternion q;
+  q.setRPY(0.0, 0.0, yaw);
+  return tf2::Transform(q, {x, y, 0.0});
+}
+
+ReplayStats
+replay(
+  const std::string & bag, int id, rclcpp_lifecycle::LifecycleNode::SharedPtr node,
+  const mh_amcl::LocalizationMap & map,
+  const std::shared_ptr<mh_amcl::LikelihoodField> & likelihood_field,
+  const tf2::Transform & map2mocap)
+{
+  int resample_interval;
+  int max_beams;
+  std::string beam_selection;
+  node->get_parameter("resample_interval", resample_interval);
+  node->get_parameter("max_beams", max_beams);
+  node->get_parameter("beam_selection", beam_selection);
+
+  // The odometry is read as MH_AMCL_Node does, but from the TFs in the bag. The hypothesis
+  // reads them from the same buffer.
+  tf2::BufferCore tf_buffer(tf2::durationFromSec(3600.0));
+  auto context = std::make_shared<mh_amcl::HypothesisContext>(node, tf_buffer);
+  context->read_parameters();
+
+  mh_amcl::ParticlesDistribution hypothesis(context, id);
+  hypothesis.on_configure(
+    rclcpp_lifecycle::State(lifecycle_msgs::msg::State::PRIMARY_STATE_INACTIVE, "Inactive"));
+  bool initialized = false;
+
+  mh_amcl::ScanPoints points;
+  points.set_max_beams(
+    std::max(0, max_beams), beam_selection == "adaptive" ? mh_amcl::ADAPTIVE : mh_amcl::UNIFORM);
+
+  tf2::Transform odom2prevbf;
+  bool valid_prev_odom2bf = false;
+
+  bool valid_ground_truth = false;
+  tf2::Transform map2gt;
+
+  ReplayStats stats {};
+  rosbag2_cpp::Reader reader;
+  reader.open(bag);
+
+  const auto start = Clock::now();
+  while (reader.has_next()) {
+    const auto bag_msg = reader.read_next();
+
+    if (bag_msg->topic_name == "/tf" || bag_msg->topic_name == "/tf_static") {
+      const bool is_static = bag_msg->topic_name == "/tf_static";
+      for (const auto & transform : deserialize<tf2_msgs::msg::TFMessage>(*bag_msg).transforms) {
+        tf_buffer.setTransform(transform, "replay", is_static);
+      }
+      continue;
+    }
+
+#ifdef MH_AMCL_HAS_MOCAP_MSGS
+    if (bag_msg->topic_name == "/rigid_bodies") {
+      const auto body = deserialize<mocap_msgs::msg::RigidBody>(*bag_msg);
+      tf2::Transform mocap2gt;
+      tf2::fromMsg(body.pose, mocap2gt);
+      map2gt = map2mocap * mocap2gt;
+      valid_ground_truth = true;
+      continue;
+    }
+#endif
+
+    if (bag_msg->topic_name != "/scan") {
+      continue;
+    }
+
+    const auto scan = deserialize<sensor_msgs::msg::LaserScan>(*bag_msg);
+    stats.scans++;
+
+    if (!initialized) {
+      if (valid_ground_truth) {
+        hypothesis.init(
+          make_transform(map2gt.getOrigin().x(), map2gt.getOrigin().y(), get_yaw(map2gt)));
+      }
+      initialized = true;
+    }
+
+    // Predict to the stamp of the scan, or to the latest odometry if it is not there yet
+    auto step_start = Clock::now();
+    tf2::TimePoint odom_time = tf2_ros::fromMsg(scan.header.stamp);
+    if (!tf_buffer.canTransform("odom", "base_footprint", odom_time)) {
+      odom_time = tf2::TimePointZero;
+    }
+    if (tf_buffer.canTransform("odom", "base_footprint", odom_time)) {
+      tf2::Transform odom2bf;
+      tf2::fromMsg(
+        tf_buffer.lookupTransform("odom", "base_footprint", odom_time).transform, odom2bf);
+
+      if (valid_prev_odom2bf) {
+        hypothesis.predict(odom2prevbf.inverse() * odom2bf);
+      }
+      odom2prevbf = odom2bf;
+      valid_prev_odom2bf = true;
+    }
+    stats.predict.add(Clock::now() - step_start);
+
+    step_start = Clock::now();
+    points.update(scan);
+    if (hypothesis.prepare_correction(scan)) {
+      const size_t num_particles = hypothesis.get_particles().size();
+      if (likelihood_field != nullptr) {
+        hypothesis.correct_particles(points, *likelihood_field, 0, num_particles);
+      } else {
+        hypothesis.correct_particles(scan, points, map, 0, num_particles);
+      }
+      hypothesis.finish_correction(points);
+    }
+    stats.correct.add(Clock::now() - step_start);
+
+    if (stats.scans % std::max(1, resample_interval) == 0) {
+      step_start = Clock::now();
+      hypothesis.reseed();
+      stats.reseed.add(Clock::now() - step_start);
+    }
+
+    if (valid_ground_truth) {
+      const auto & pose = hypothesis.get_pose().pose.pose;
+      tf2::Transform map2bf;
+      tf2::fromMsg(pose, map2bf);
+
+      const double error_xy = std::hypot(
+        map2bf.getOrigin().x() - map2gt.getOrigin().x(),
+        map2bf.getOrigin().y() - map2gt.getOrigin().y());
+      const double error_yaw =
+        std::fabs(std::remainder(get_yaw(map2bf) - get_yaw(map2gt), 2.0 * M_PI));
+
+      stats.ground_truth_scans++;
+      stats.sum_error_xy += error_xy;
+      stats.max_error_xy = std::max(stats.max_error_xy, error_xy);
+      stats.sum_error_yaw += error_yaw;
+    }
+  }
+  stats.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  return stats;
+}
+
+}  // namespace
+
+int main(int argc, char ** argv)
+{
+  rclcpp::init(argc, argv);
+
+  const auto args = rclcpp::remove_ros_arguments(argc, argv);
+
+  std::vector<std::string> bags;
+  tf2::Transform map2mocap = tf2::Transform::getIdentity();
+  for (size_t i = 2; i < args.size(); i++) {
+    if (args[i] == "--gt-offset" && i + 3 < args.size()) {
+      map2mocap = make_transform(
+        std::stod(args[i + 1]), std::stod(args[i + 2]), std::stod(args[i + 3]));
+      i += 3;
+    } else {
+      bags.push_back(args[i]);
+    }
+  }
+
+  if (args.size() < 2 || bags.empty()) {
+    std::fprintf(
+      stderr, "Usage: %s <map.yaml> <bag> [<bag> ...] [--gt-offset x y yaw]\n", argv[0]);
+    return 1;
+  }
+
+#ifndef MH_AMCL_HAS_MOCAP_MSGS
+  std::fprintf(stderr, "Built without mocap_msgs, the pose error is not computed\n");
+#endif
+
+  // Same name than the node, so its parameter files apply
+  auto node = rclcpp_lifecycle::LifecycleNode::make_shared("mh_amcl");
+  node->declare_parameter<std::string>("sensor_model", "ray_marching");
+  node->declare_parameter<double>("laser_likelihood_max_dist", 0.5);
+  node->declare_parameter<int>("max_beams", 0);
+  node->declare_parameter<std::string>("beam_selection", "uniform");
+  node->declare_parameter<int>("resample_interval", 1);
+
+  std::string sensor_model;
+  double laser_likelihood_max_dist;
+  node->get_parameter("sensor_model", sensor_model);
+  node->get_parameter("laser_likelihood_max_dist", laser_likelihood_max_dist);
+
+  const mh_amcl::LocalizationMap map(mh_amcl::load_map(args[1]));
+  std::shared_ptr<mh_amcl::LikelihoodField> likelihood_field;
+  if (sensor_model == "likelihood_field") {
+    likelihood_field = std::make_shared<mh_amcl::LikelihoodField>(
+      map, laser_likelihood_max_dist);
+  }
+
+  size_t total_scans = 0;
+  double total_seconds = 0.0;
+  for (size_t i = 0; i < bags.size(); i++) {
+    const auto stats = replay(bags[i], i, node, map, likelihood_field, map2mocap);
+
+    std::printf(
+      "%s: %zu scans in %.2f s, %.1f scans/s\n", bags[i].c_str(),
+      stats.scans, stats.seconds, stats.scans / std::max(stats.seconds, 1e-9));
+    stats.predict.print("predict");
+    stats.correct.print("correct");
+    stats.reseed.print("reseed");
+
+    if (stats.ground_truth_scans > 0) {
+      std::printf(
+        "  error    mean %.3f m  max %.3f m  mean yaw %.3f rad  (%zu scans)\n",
+        stats.sum_error_xy / stats.ground_truth_scans, stats.max_error_xy,
+        stats.sum_error_yaw / stats.ground_truth_scans, stats.ground_truth_scans);
+    }
+
+    total_scans += stats.scans;
+    total_seconds += stats.seconds;
+  }
+
+  // The peak of the whole process, as the bags replayed before count too
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  std::printf(
+    "Total: %zu scans in %.2f s, %.1f scans/s, process peak RSS %.1f MB\n", total_scans,
+    total_seconds, total_scans / std::max(total_seconds, 1e-9), usage.ru_maxrss / 1024.0);
+
+  rclcpp::shutdown();
+  return 0;
+}
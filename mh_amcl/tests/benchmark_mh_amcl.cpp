@@ -0,0 +1,411 @@
+// Copyright 2022 Intelligent Robotics Lab
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Baseline of the hot paths, on the maps in maps/. Run it with
+//   benchmark_mh_amcl --benchmark_out=results.json --benchmark_out_format=json
+// to keep the results of each release.
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mh_amcl/LikelihoodField.hpp"
+#include "mh_amcl/LocalizationMap.hpp"
+#include "mh_amcl/MapLoader.hpp"
+#include "mh_amcl/MapMatcher.hpp"
+#include "mh_amcl/ParticlesDistribution.hpp"
+#include "mh_amcl/PoseStatistics.hpp"
+#include "mh_amcl/ScanPoints.hpp"
+#include "mh_amcl/ThreadPool.hpp"
+#include "nav2_costmap_2d/cost_values.hpp"
+#include "nav_msgs/msg/occupancy_grid.hpp"
+#include "sensor_msgs/msg/laser_scan.hpp"
+#include "tf2_ros/static_transform_broadcaster.h"
+#include "lifecycle_msgs/msg/state.hpp"
+
+#include "rclcpp/rclcpp.hpp"
+#include "rclcpp_lifecycle/lifecycle_node.hpp"
+
+namespace
+{
+
+const std::vector<std::string> MAPS = {"lab", "aulario", "turtlebot3_world"};
+
+// Free pose, with free space around, closest to the center row of the map
+void
+find_free_pose(const mh_amcl::LocalizationMap & map, double & x, double & y)
+{
+  const int size_x = map.get_size_x();
+  const int size_y = map.get_size_y();
+  const int margin = 5;
+
+  for (int offset = 0; offset < size_y / 2; offset++) {
+    for (int j : {size_y / 2 + offset, size_y / 2 - offset}) {
+      for (int i = margin; i < size_x - margin; i++) {
+        bool free = j >= margin && j < size_y - margin;
+        for (int dj = -margin; free && dj <= margin; dj++) {
+          for (int di = -margin; free && di <= margin; di++) {
+            free = map.get_cost(i + di, j + dj) == nav2_costmap_2d::FREE_SPACE;
+          }
+        }
+
+        if (free) {
+          map.map_to_world(i, j, x, y);
+          return;
+        }
+      }
+    }
+  }
+
+  throw std::runtime_error("No free space in the map");
+}
+
+sensor_msgs::msg::LaserScan
+cast_scan(const mh_amcl::LocalizationMap & map, double x, double y, int num_beams)
+{
+  sensor_msgs::msg::LaserScan scan;
+  scan.header.frame_id = "laser";
+  scan.range_min = 0.05;
+  scan.range_max = 20.0;
+  scan.angle_min = -M_PI;
+  scan.angle_increment = 2.0 * M_PI / num_beams;
+  scan.angle_max = scan.angle_min + (num_beams - 1) * scan.angle_increment;
+
+  const double step = map.get_resolution() / 2.0;
+  for (int i = 0; i < num_beams; i++) {
+    const double angle = scan.angle_min + i * scan.angle_increment;
+
+    float range = std::numeric_limits<float>::infinity();
+    for (double r = scan.range_min; r < scan.range_max; r += step) {
+      unsigned int mx, my;
+      if (!map.world_to_map(x + r * std::cos(angle), y + r * std::sin(angle), mx, my)) {
+        break;
+      }
+      if (map.get_cost(mx, my) == nav2_costmap_2d::LETHAL_OBSTACLE) {
+        range = r;
+        break;
+      }
+    }
+    scan.ranges.push_back(range);
+  }
+
+  return scan;
+}
+
+class ParticlesDistributionBench : public mh_amcl::ParticlesDistribution
+{
+public:
+  ParticlesDistributionBench(rclcpp_lifecycle::LifecycleNode::SharedPtr node, int id)
+  : ParticlesDistribution(node, id) {}
+
+  mh_amcl::ParticleSet & get_particles_bench() {return particles_;}
+
+  double get_error_distance_to_obstacle_bench(
+    const tf2::Transform & map2bf, const tf2::Transform & bf2laser,
+    const tf2::Transform & laser2point, const sensor_msgs::msg::LaserScan & scan,
+    const mh_amcl::LocalizationMap & map, double o)
+  {
+    return get_error_distance_to_obstacle(map2bf, bf2laser, laser2point, scan, map, o);
+  }
+
+  void update_covariance_bench()
+  {
+    update_covariance(mh_amcl::PoseStatistics(particles_), pose_);
+  }
+};
+
+// Everything the benchmarks of a map need, built once
+struct MapFixture
+{
+  nav_msgs::msg::OccupancyGrid grid;
+  std::shared_ptr<const mh_amcl::LocalizationMap> localization_map;
+  std::shared_ptr<mh_amcl::LikelihoodField> likelihood_field;
+  double x;
+  double y;
+};
+
+const MapFixture &
+get_map(int index)
+{
+  static std::vector<std::unique_ptr<MapFixture>> maps(MAPS.size());
+
+  auto & map = maps[index];
+  if (map == nullptr) {
+    map = std::make_unique<MapFixture>();
+    map->grid = mh_amcl::load_map(std::string(MH_AMCL_MAPS_DIR) + "/" + MAPS[index] + ".yaml");
+    map->localization_map = std::make_shared<const mh_amcl::LocalizationMap>(map->grid);
+    map->likelihood_field = std::make_shared<mh_amcl::LikelihoodField>(
+      *map->localization_map, 0.5);
+    find_free_pose(*map->localization_map, map->x, map->y);
+  }
+
+  return *map;
+}
+
+rclcpp_lifecycle::LifecycleNode::SharedPtr
+get_node()
+{
+  static rclcpp_lifecycle::LifecycleNode::SharedPtr node;
+  static std::shared_ptr<tf2_ros::StaticTransformBroadcaster> tf_pub;
+
+  if (node == nullptr) {
+    node = rclcpp_lifecycle::LifecycleNode::make_shared("benchmark_node");
+
+    // The same noise in every run, so results of different builds can be compared
+    node->declare_parameter<int>("random_seed", 1);
+
+    tf_pub = std::make_shared<tf2_ros::StaticTransformBroadcaster>(node);
+    geometry_msgs::msg::TransformStamped bf2laser;
+    bf2laser.header.stamp = node->now();
+    bf2laser.header.frame_id = "base_footprint";
+    bf2laser.child_frame_id = "laser";
+    bf2laser.transform.rotation.w = 1.0;
+    tf_pub->sendTransform({bf2laser});
+  }
+
+  return node;
+}
+
+// A hypothesis at the free pose of the map, ready to correct scans
+std::shared_ptr<ParticlesDistributionBench>
+make_hypothesis(
+  const MapFixture & map, int num_particles, const sensor_msgs::msg::LaserScan & scan,
+  int id = 0, const std::string & resampler = "systematic")
+{
+  auto node = get_node();
+  node->set_parameter({"min_particles", num_particles});
+  node->set_parameter({"max_particles", num_particles});
+  node->set_parameter({"resampler", resampler});
+
+  auto hypothesis = std::make_shared<ParticlesDistributionBench>(node, id);
+  hypothesis->on_configure(
+    rclcpp_lifecycle::State(lifecycle_msgs::msg::State::PRIMARY_STATE_ACTIVE, "Inactive"));
+  hypothesis->init(tf2::Transform(tf2::Quaternion::getIdentity(), {map.x, map.y, 0.0}));
+
+  // Its TF listener needs some time to receive base_footprint -> laser
+  for (int i = 0; i < 100 && !hypothesis->prepare_correction(scan); i++) {
+    rclcpp::spin_some(node->get_node_base_interface());
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+
+  return hypothesis;
+}
+
+}  // namespace
+
+// Args: map, particles, beams
+static void
+BM_CorrectLikelihoodField(benchmark::State & state)
+{
+  const auto & map = get_map(state.range(0));
+  const auto scan = cast_scan(*map.localization_map, map.x, map.y, state.range(2));
+  auto hypothesis = make_hypothesis(map, state.range(1), scan);
+
+  for (auto _ : state) {
+    hypothesis->correct_once(scan, *map.likelihood_field);
+  }
+
+  state.SetLabel(MAPS[state.range(0)]);
+  state.SetItemsProcessed(state.iterations() * state.range(1) * state.range(2));
+}
+BENCHMARK(BM_CorrectLikelihoodField)
+->ArgsProduct({{0, 1, 2}, {200, 1000, 5000}, {90, 360, 1080}})
+->Unit(benchmark::kMicrosecond);
+
+// Args: map, particles, beams
+static void
+BM_CorrectRayMarching(benchmark::State & state)
+{
+  const auto & map = get_map(state.range(0));
+  const auto scan = cast_scan(*map.localization_map, map.x, map.y, state.range(2));
+  auto hypothesis = make_hypothesis(map, state.range(1), scan);
+
+  for (auto _ : state) {
+    hypothesis->correct_once(scan, *map.localization_map);
+  }
+
+  state.SetLabel(MAPS[state.range(0)]);
+  state.SetItemsProcessed(state.iterations() * state.range(1) * state.range(2));
+}
+BENCHMARK(BM_CorrectRayMarching)
+->ArgsProduct({{0, 1, 2}, {200, 1000}, {90, 360}})
+->Unit(benchmark::kMillisecond);
+
+// Args: hypotheses, threads. Corrects all the hypotheses as MH_AMCL_Node::correct does.
+static void
+BM_CorrectHypotheses(benchmark::State & state)
+{
+  const auto & map = get_map(0);
+  const auto scan = cast_scan(*map.localization_map, map.x, map.y, 360);
+  const mh_amcl::ScanPoints points(scan);
+
+  std::vector<std::shared_ptr<ParticlesDistributionBench>> hypotheses;
+  for (int i = 0; i < state.range(0); i++) {
+    hypotheses.push_back(make_hypothesis(map, 1000, scan, i));
+  }
+
+  mh_amcl::ThreadPool pool(state.range(1));
+  const size_t chunk_size = 1000 / state.range(1);
+
+  for (auto _ : state) {
+    for (auto & hypothesis : hypotheses) {
+      hypothesis->prepare_correction(scan);
+    }
+
+    pool.parallel_for(
+      hypotheses.size() * state.range(1), [&](size_t i) {
+        const size_t begin = (i % state.range(1)) * chunk_size;
+        const size_t end = std::min<size_t>(begin + chunk_size, 1000);
+        hypotheses[i / state.range(1)]->correct_particles(
+          points, *map.likelihood_field, begin, end);
+      });
+
+    for (auto & hypothesis : hypotheses) {
+      hypothesis->finish_correction(points);
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * state.range(0) * 1000);
+}
+BENCHMARK(BM_CorrectHypotheses)
+->ArgsProduct({{1, 3, 5, 10}, {1, 2, 4}})
+->Unit(benchmark::kMicrosecond)
+->UseRealTime();
+
+// Args: map
+static void
+BM_GetErrorDistanceToObstacle(benchmark::State & state)
+{
+  const auto & map = get_map(state.range(0));
+  const auto scan = cast_scan(*map.localization_map, map.x, map.y, 360);
+  auto hypothesis = make_hypothesis(map, 200, scan);
+
+  const tf2::Transform map2bf(tf2::Quaternion::getIdentity(), {map.x, map.y, 0.0});
+  const tf2::Transform bf2laser = tf2::Transform::getIdentity();
+
+  size_t beam = 0;
+  for (auto _ : state) {
+    const double angle = scan.angle_min + beam * scan.angle_increment;
+    const double range = std::min<double>(scan.ranges[beam], scan.range_max);
+    const tf2::Transform laser2point(
+      tf2::Quaternion::getIdentity(), {range * std::cos(angle), range * std::sin(angle), 0.0});
+
+    benchmark::DoNotOptimize(
+      hypothesis->get_error_distance_to_obstacle_bench(
+        map2bf, bf2laser, laser2point, scan, *map.localization_map, 0.05));
+
+    beam = (beam + 1) % scan.ranges.size();
+  }
+
+  state.SetLabel(MAPS[state.range(0)]);
+}
+BENCHMARK(BM_GetErrorDistanceToObstacle)->DenseRange(0, 2);
+
+// Args: particles, resampler (0 systematic, 1 reseed)
+static void
+BM_Reseed(benchmark::State & state)
+{
+  const auto & map = get_map(0);
+  const auto scan = cast_scan(*map.localization_map, map.x, map.y, 360);
+  auto hypothesis = make_hypothesis(
+    map, state.range(0), scan, 0, state.range(1) == 0 ? "systematic" : "reseed");
+
+  // Weights of a real correction, with a low effective sample size
+  hypothesis->correct_once(scan, *map.likelihood_field);
+  const mh_amcl::ParticleSet corrected = hypothesis->get_particles_bench();
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    hypothesis->get_particles_bench() = corrected;
+    state.ResumeTiming();
+
+    hypothesis->reseed();
+  }
+
+  state.SetLabel(state.range(1) == 0 ? "systematic" : "reseed");
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Reseed)
+->ArgsProduct({{200, 1000, 5000}, {0, 1}})
+->Unit(benchmark::kMicrosecond);
+
+// Args: particles
+static void
+BM_UpdateCovariance(benchmark::State & state)
+{
+  const auto & map = get_map(0);
+  const auto scan = cast_scan(*map.localization_map, map.x, map.y, 360);
+  auto hypothesis = make_hypothesis(map, state.range(0), scan);
+
+  for (auto _ : state) {
+    hypothesis->update_covariance_bench();
+  }
+
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_UpdateCovariance)->Arg(200)->Arg(1000)->Arg(5000);
+
+// Args: map, beams
+static void
+BM_GetMatchs(benchmark::State & state)
+{
+  const auto & map = get_map(state.range(0));
+  const mh_amcl::ScanPoints points(cast_scan(*map.localization_map, map.x, map.y, state.range(1)));
+
+  mh_amcl::MatcherParams params;
+  params.time_budget = 60.0;
+  const mh_amcl::MapMatcher matcher(map.grid, params);
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(matcher.get_matchs(points));
+  }
+
+  state.SetLabel(MAPS[state.range(0)]);
+}
+BENCHMARK(BM_GetMatchs)
+->ArgsProduct({{0, 1, 2}, {90, 360}})
+->Unit(benchmark::kMillisecond);
+
+// Args: map
+static void
+BM_HalfScale(benchmark::State & state)
+{
+  const auto & map = get_map(state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(map.localization_map->half_scale());
+  }
+
+  state.SetLabel(MAPS[state.range(0)]);
+}
+BENCHMARK(BM_HalfScale)->DenseRange(0, 2)->Unit(benchmark::kMillisecond);
+
+int main(int argc, char ** argv)
+{
+  rclcpp::init(argc, argv);
+
+  benchmark::Initialize(&argc, argv);
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+
+  rclcpp::shutdown();
+  return 0;
+}
@@ -13,9 +13,31 @@
 // limitations under the License.
 
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <list>
+#include <memory>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
+
 #include "gtest/gtest.h"
 
+#include "nav2_costmap_2d/cost_values.hpp"
+
+#include "mh_amcl/GridPyramid.hpp"
+#include "mh_amcl/LikelihoodField.hpp"
+#include "mh_amcl/LocalizationMap.hpp"
+#include "mh_amcl/MapCache.hpp"
 #include "mh_amcl/MapMatcher.hpp"
+#include "mh_amcl/Relocalizer.hpp"
+#include "mh_amcl/ThreadPool.hpp"
 
 #include "rclcpp/rclcpp.hpp"
 
@@ -36,9 +58,9 @@ public:
 
   void publish_maps()
   {
-    for (int i = 0; i < NUM_LEVEL_SCALE_COSTMAP; i++) {
+    for (int i = 0; i < map_->get_num_levels(); i++) {
       if (pubs_[i]->get_subscription_count() > 0) {
-        nav_msgs::msg::OccupancyGrid grid = mh_amcl::toMsg(*costmaps_[i]);
+        nav_msgs::msg::OccupancyGrid grid = mh_amcl::toMsg(map_->get_level(i));
         grid.header.frame_id = "map";
         grid.header.stamp = node_->now();
         pubs_[i]->publish(grid);
@@ -50,6 +72,694 @@ public:
   std::vector<rclcpp::Publisher<nav_msgs::msg::OccupancyGrid>::SharedPtr> pubs_;
 };
 
+// 10 x 8 m room with an inner wall that breaks its symmetry
+nav_msgs::msg::OccupancyGrid
+room_map()
+{
+  nav_msgs::msg::OccupancyGrid grid;
+  grid.info.resolution = 0.05;
+  grid.info.width = 200;
+  grid.info.height = 160;
+  grid.info.origin.orientation.w = 1.0;
+  grid.data.assign(grid.info.width * grid.info.height, 0);
+
+  for (unsigned int j = 0; j < grid.info.height; j++) {
+    for (unsigned int i = 0; i < grid.info.width; i++) {
+      bool wall = i < 2 || j < 2 || i >= grid.info.width - 2 || j >= grid.info.height - 2;
+      wall = wall || (i >= 120 && i < 122 && j < 100);
+      wall = wall || (j >= 40 && j < 42 && i >= 40 && i < 80);
+      if (wall) {
+        grid.data[j * grid.info.width + i] = 100;
+      }
+    }
+  }
+
+  return grid;
+}
+
+sensor_msgs::msg::LaserScan
+cast_scan(const nav_msgs::msg::OccupancyGrid & grid, double x, double y, double yaw)
+{
+  sensor_msgs::msg::LaserScan scan;
+  scan.angle_min = -M_PI;
+  scan.angle_increment = 2.0 * M_PI / 360;
+  scan.angle_max = scan.angle_min + 359 * scan.angle_increment;
+  scan.range_min = 0.1;
+  scan.range_max = 20.0;
+
+  const double res = grid.info.resolution;
+  for (int i = 0; i < 360; i++) {
+    const double angle = yaw + scan.angle_min + i * scan.angle_increment;
+    double range = scan.range_min;
+    for (; range < scan.range_max; range += res / 2.0) {
+      int mx = std::floor((x + range * std::cos(angle)) / res);
+      int my = std::floor((y + range * std::sin(angle)) / res);
+      if (mx < 0 || my < 0 || mx >= static_cast<int>(grid.info.width) ||
+        my >= static_cast<int>(grid.info.height) ||
+        grid.data[my * grid.info.width + mx] == 100)
+      {
+        break;
+      }
+    }
+    scan.ranges.push_back(range);
+  }
+
+  return scan;
+}
+
+TEST(test1, test_localization_map)
+{
+  nav_msgs::msg::OccupancyGrid grid;
+  grid.info.resolution = 0.1;
+  grid.info.width = 5;
+  grid.info.height = 4;
+  grid.info.origin.position.x = -1.0;
+  grid.info.origin.position.y = 2.0;
+  grid.info.origin.orientation.w = 1.0;
+  grid.data = {
+    0, 0, -1, -1, 0,
+    0, 100, -1, -1, 0,
+    50, 0, 50, 50, 0,
+    -1, 50, -1, 50, 0};
+
+  const mh_amcl::LocalizationMap map(grid, 3);
+  ASSERT_EQ(map.get_cost(0, 0), nav2_costmap_2d::FREE_SPACE);
+  ASSERT_EQ(map.get_cost(1, 1), nav2_costmap_2d::LETHAL_OBSTACLE);
+  ASSERT_EQ(map.get_cost(2, 0), nav2_costmap_2d::NO_INFORMATION);
+  ASSERT_EQ(map.get_cost(0, 2), 127);
+
+  unsigned int mx, my;
+  ASSERT_TRUE(map.world_to_map(-0.85, 2.25, mx, my));
+  ASSERT_EQ(mx, 1u);
+  ASSERT_EQ(my, 2u);
+  ASSERT_FALSE(map.world_to_map(-1.05, 2.25, mx, my));
+  ASSERT_FALSE(map.world_to_map(-0.45, 2.25, mx, my));
+  ASSERT_EQ(map.get_world_cost(-0.85, 2.15), nav2_costmap_2d::LETHAL_OBSTACLE);
+  ASSERT_EQ(map.get_world_cost(-0.85, 1.95), nav2_costmap_2d::NO_INFORMATION);
+
+  double wx, wy;
+  map.map_to_world(1, 2, wx, wy);
+  ASSERT_NEAR(wx, -0.85, 1e-6);
+  ASSERT_NEAR(wy, 2.25, 1e-6);
+
+  // Obstacles first, then free space, then unknown, then the first cell
+  ASSERT_EQ(map.get_num_levels(), 3);
+  const auto & level1 = map.get_level(1);
+  ASSERT_EQ(level1.get_size_x(), 2u);
+  ASSERT_EQ(level1.get_size_y(), 2u);
+  ASSERT_NEAR(level1.get_resolution(), 0.2, 1e-6);
+  ASSERT_EQ(level1.get_cost(0, 0), nav2_costmap_2d::LETHAL_OBSTACLE);
+  ASSERT_EQ(level1.get_cost(1, 0), nav2_costmap_2d::NO_INFORMATION);
+  ASSERT_EQ(level1.get_cost(0, 1), nav2_costmap_2d::FREE_SPACE);
+  ASSERT_EQ(level1.get_cost(1, 1), 127);
+
+  const auto & level2 = map.get_level(2);
+  ASSERT_EQ(level2.get_size_x(), 1u);
+  ASSERT_EQ(level2.get_cost(0, 0), nav2_costmap_2d::LETHAL_OBSTACLE);
+}
+
+TEST(test1, test_tiled_map)
+{
+  // A room in a large unknown map, not aligned with the tiles
+  nav_msgs::msg::OccupancyGrid grid;
+  grid.info.resolution = 0.05;
+  grid.info.width = 2000;
+  grid.info.height = 1500;
+  grid.info.origin.orientation.w = 1.0;
+  grid.data.assign(grid.info.width * grid.info.height, -1);
+
+  const unsigned int x0 = 1030, y0 = 517, size = 100;
+  for (unsigned int j = y0; j <= y0 + size; j++) {
+    for (unsigned int i = x0; i <= x0 + size; i++) {
+      const bool wall = i == x0 || j == y0 || i == x0 + size || j == y0 + size ||
+        (i == x0 + 40 && j < y0 + 70);
+      grid.data[j * grid.info.width + i] = wall ? 100 : 0;
+    }
+  }
+
+  const mh_amcl::LocalizationMap map(grid, 3);
+  for (unsigned int j = 0; j < grid.info.height; j++) {
+    for (unsigned int i = 0; i < grid.info.width; i++) {
+      const int occupancy = grid.data[j * grid.info.width + i];
+      const auto expected = occupancy < 0 ? nav2_costmap_2d::NO_INFORMATION :
+        occupancy == 0 ? nav2_costmap_2d::FREE_SPACE : nav2_costmap_2d::LETHAL_OBSTACLE;
+      ASSERT_EQ(map.get_cost(i, j), expected);
+    }
+  }
+
+  // Only the tiles of the room take memory
+  ASSERT_LT(map.get_memory_usage(), grid.data.size() / 20);
+
+  mh_amcl::MatcherParams params;
+  params.level = 0;
+  mh_amcl::MapMatcher matcher(std::make_shared<const mh_amcl::LocalizationMap>(grid), params);
+  ASSERT_LT(matcher.get_memory_usage(), grid.data.size());
+
+  // Same distances as computed over the whole map
+  const double max_distance = 0.5;
+  mh_amcl::LikelihoodField field(map, max_distance);
+  ASSERT_LT(field.get_memory_usage(), grid.data.size() / 10);
+
+  std::vector<std::pair<int, int>> walls;
+  for (unsigned int j = y0; j <= y0 + size; j++) {
+    for (unsigned int i = x0; i <= x0 + size; i++) {
+      if (grid.data[j * grid.info.width + i] == 100) {
+        walls.emplace_back(i, j);
+      }
+    }
+  }
+
+  for (int j = y0 - 20; j <= static_cast<int>(y0 + size) + 20; j++) {
+    for (int i = x0 - 20; i <= static_cast<int>(x0 + size) + 20; i++) {
+      double expected = std::numeric_limits<double>::infinity();
+      for (const auto & wall : walls) {
+        expected = std::min(
+          expected, std::hypot(wall.first - i, wall.second - j) * grid.info.resolution);
+      }
+      if (expected > max_distance) {
+        expected = std::numeric_limits<double>::infinity();
+      }
+
+      const double distance = field.get_distance(
+        (i + 0.5) * grid.info.resolution, (j + 0.5) * grid.info.resolution);
+      if (std::isinf(expected)) {
+        ASSERT_TRUE(std::isinf(distance));
+      } else {
+        ASSERT_NEAR(distance, expected, 1e-5);
+      }
+    }
+  }
+}
+
+TEST(test1, test_grid_pyramid)
+{
+  typedef mh_amcl::TiledGrid<unsigned char> Grid;
+
+  // Odd sizes, with unknown, free and dense blocks of 2 x 2 tiles
+  const unsigned int size_x = 517, size_y = 331;
+  std::mt19937 generator(42);
+  std::uniform_int_distribution<int> cost(0, 255);
+  const unsigned char special[] = {
+    nav2_costmap_2d::FREE_SPACE, nav2_costmap_2d::LETHAL_OBSTACLE,
+    nav2_costmap_2d::NO_INFORMATION};
+
+  Grid grid(size_x, size_y);
+  grid.fill(
+    [&](unsigned int x, unsigned int y) {
+      const unsigned int tile = (x >> (Grid::TILE_SHIFT + 1)) + (y >> (Grid::TILE_SHIFT + 1));
+      if (tile % 3 == 0) {
+        return nav2_costmap_2d::NO_INFORMATION;
+      } else if (tile % 3 == 1) {
+        return nav2_costmap_2d::FREE_SPACE;
+      }
+      const int value = cost(generator);
+      return value < 192 ? special[value % 3] : static_cast<unsigned char>(value);
+    });
+
+  // Rows whose length is not a multiple of the vector width, through the scalar tail
+  std::vector<unsigned char> row0(74), row1(74), out(37), max_out(37);
+  for (size_t k = 0; k < row0.size(); k++) {
+    row0[k] = special[k % 3];
+    row1[k] = static_cast<unsigned char>(cost(generator));
+  }
+  mh_amcl::reduce_2x2(
+    row0.data(), row1.data(), out.size(), mh_amcl::COSTMAP_REDUCTION, out.data());
+  mh_amcl::reduce_2x2(
+    row0.data(), row1.data(), max_out.size(), mh_amcl::MAX_REDUCTION, max_out.data());
+  for (size_t k = 0; k < out.size(); k++) {
+    const unsigned char * cells[] = {&row0[2 * k], &row1[2 * k]};
+    const unsigned char high = std::max(
+      std::max(cells[0][0], cells[0][1]), std::max(cells[1][0], cells[1][1]));
+    ASSERT_EQ(max_out[k], high);
+    if (std::count(cells[0], cells[0] + 2, nav2_costmap_2d::LETHAL_OBSTACLE) +
+      std::count(cells[1], cells[1] + 2, nav2_costmap_2d::LETHAL_OBSTACLE) > 0)
+    {
+      ASSERT_EQ(out[k], nav2_costmap_2d::LETHAL_OBSTACLE);
+    } else if (std::count(cells[0], cells[0] + 2, nav2_costmap_2d::FREE_SPACE) +
+      std::count(cells[1], cells[1] + 2, nav2_costmap_2d::FREE_SPACE) > 0)
+    {
+      ASSERT_EQ(out[k], nav2_costmap_2d::FREE_SPACE);
+    } else {
+      ASSERT_EQ(out[k], cells[0][0]);
+    }
+  }
+
+  mh_amcl::ThreadPool pool(4);
+  for (auto reduction : {mh_amcl::COSTMAP_REDUCTION, mh_amcl::MAX_REDUCTION}) {
+    const auto serial = mh_amcl::half_scale(grid, reduction);
+    const auto parallel = mh_amcl::half_scale(grid, reduction, &pool);
+    ASSERT_EQ(serial.get_size_x(), size_x / 2);
+    ASSERT_EQ(serial.get_size_y(), size_y / 2);
+    ASSERT_EQ(parallel.get_size_x(), size_x / 2);
+    ASSERT_EQ(parallel.get_size_y(), size_y / 2);
+
+    for (unsigned int j = 0; j < size_y / 2; j++) {
+      for (unsigned int i = 0; i < size_x / 2; i++) {
+        const unsigned char cells[] = {
+          grid.get(2 * i, 2 * j), grid.get(2 * i + 1, 2 * j),
+          grid.get(2 * i, 2 * j + 1), grid.get(2 * i + 1, 2 * j + 1)};
+
+        unsigned char expected;
+        if (reduction == mh_amcl::MAX_REDUCTION) {
+          expected = *std::max_element(std::begin(cells), std::end(cells));
+        } else if (std::count(cells, cells + 4, nav2_costmap_2d::LETHAL_OBSTACLE) > 0) {
+          expected = nav2_costmap_2d::LETHAL_OBSTACLE;
+        } else if (std::count(cells, cells + 4, nav2_costmap_2d::FREE_SPACE) > 0) {
+          expected = nav2_costmap_2d::FREE_SPACE;
+        } else {
+          expected = cells[0];
+        }
+
+        ASSERT_EQ(serial.get(i, j), expected);
+        ASSERT_EQ(parallel.get(i, j), expected);
+      }
+    }
+
+    // Uniform tiles stay shared
+    ASSERT_LT(serial.get_num_dense_tiles(), serial.get_tiles_x() * serial.get_tiles_y());
+  }
+
+  // Maps and matchers built in parallel are the same
+  const auto room = room_map();
+  const mh_amcl::LocalizationMap map(room, 3);
+  const mh_amcl::LocalizationMap parallel_map(room, 3, nullptr, &pool);
+  for (int level = 0; level < map.get_num_levels(); level++) {
+    const auto & expected = map.get_level(level);
+    const auto & costs = parallel_map.get_level(level);
+    ASSERT_EQ(costs.get_size_x(), expected.get_size_x());
+    ASSERT_EQ(costs.get_size_y(), expected.get_size_y());
+    for (unsigned int j = 0; j < expected.get_size_y(); j++) {
+      for (unsigned int i = 0; i < expected.get_size_x(); i++) {
+        ASSERT_EQ(costs.get_cost(i, j), expected.get_cost(i, j));
+      }
+    }
+  }
+
+  mh_amcl::MatcherParams params;
+  params.time_budget = 10.0;
+  mh_amcl::MapMatcher matcher(room, params);
+  mh_amcl::MapMatcher parallel_matcher(room, params, nullptr, &pool);
+  const auto scan = cast_scan(room, 3.1, 5.3, 0.7);
+  const auto tfs = matcher.get_matchs(scan);
+  const auto parallel_tfs = parallel_matcher.get_matchs(scan);
+  ASSERT_FALSE(tfs.empty());
+  ASSERT_EQ(tfs.size(), parallel_tfs.size());
+  for (auto it = tfs.begin(), pit = parallel_tfs.begin(); it != tfs.end(); ++it, ++pit) {
+    ASSERT_EQ(it->weight, pit->weight);
+    ASSERT_EQ(it->transform.getOrigin().x(), pit->transform.getOrigin().x());
+    ASSERT_EQ(it->transform.getOrigin().y(), pit->transform.getOrigin().y());
+  }
+  ASSERT_EQ(parallel_matcher.get_memory_usage(), matcher.get_memory_usage());
+}
+
+TEST(test1, test_map_update)
+{
+  auto grid = room_map();
+  const auto map = std::make_shared<const mh_amcl::LocalizationMap>(grid, 3);
+  mh_amcl::MatcherParams params;
+  params.level = 1;
+  params.time_budget = 10.0;
+  const mh_amcl::MapMatcher matcher(map, params);
+  const mh_amcl::LikelihoodField field(*map, 0.5);
+
+  // Opens a door in a wall, applies a patch that goes out of the map and adds a box
+  std::shared_ptr<const mh_amcl::LocalizationMap> updated = map;
+  auto updated_matcher = std::make_shared<const mh_amcl::MapMatcher>(matcher);
+  auto updated_field = std::make_shared<const mh_amcl::LikelihoodField>(field);
+  const unsigned int patches[][4] = {{118, 18, 6, 20}, {185, 140, 30, 30}, {150, 110, 20, 15}};
+  for (const auto & patch : patches) {
+    const unsigned int x = patch[0], y = patch[1], width = patch[2], height = patch[3];
+    std::vector<int8_t> data(width * height);
+    for (unsigned int j = 0; j < height; j++) {
+      for (unsigned int i = 0; i < width; i++) {
+        const unsigned int mx = x + i, my = y + j;
+        int8_t occupancy = mx < grid.info.width && my < grid.info.height ?
+          grid.data[my * grid.info.width + mx] : 0;
+        if (mx >= 120 && mx < 122 && my >= 20 && my < 35) {
+          occupancy = 0;
+        } else if (mx >= 150 && mx < 170 && my >= 110 && my < 125) {
+          occupancy = 100;
+        } else if (mx >= 190 && my >= 145) {
+          occupancy = -1;
+        }
+        data[j * width + i] = occupancy;
+        if (mx < grid.info.width && my < grid.info.height) {
+          grid.data[my * grid.info.width + mx] = occupancy;
+        }
+      }
+    }
+
+    updated = updated->update(x, y, width, height, data);
+    ASSERT_NE(updated, nullptr);
+    const unsigned int max_x = std::min(x + width, grid.info.width) - 1;
+    const unsigned int max_y = std::min(y + height, grid.info.height) - 1;
+    updated_matcher = updated_matcher->update(updated, x, y, max_x, max_y);
+    ASSERT_NE(updated_matcher, nullptr);
+    updated_field = std::make_shared<const mh_amcl::LikelihoodField>(
+      *updated_field, *updated, x, y, max_x, max_y);
+  }
+
+  // The same as built from the whole map
+  const mh_amcl::LocalizationMap expected(grid, 3);
+  for (int level = 0; level < expected.get_num_levels(); level++) {
+    const auto & costs = updated->get_level(level);
+    const auto & expected_costs = expected.get_level(level);
+    for (unsigned int j = 0; j < expected_costs.get_size_y(); j++) {
+      for (unsigned int i = 0; i < expected_costs.get_size_x(); i++) {
+        ASSERT_EQ(costs.get_cost(i, j), expected_costs.get_cost(i, j));
+      }
+    }
+  }
+
+  const mh_amcl::LikelihoodField expected_field(expected, 0.5);
+  for (unsigned int j = 0; j < grid.info.height; j++) {
+    for (unsigned int i = 0; i < grid.info.width; i++) {
+      const double wx = (i + 0.5) * grid.info.resolution;
+      const double wy = (j + 0.5) * grid.info.resolution;
+      const double distance = updated_field->get_distance(wx, wy);
+      const double expected_distance = expected_field.get_distance(wx, wy);
+      if (std::isinf(expected_distance)) {
+        ASSERT_TRUE(std::isinf(distance));
+      } else {
+        ASSERT_DOUBLE_EQ(distance, expected_distance);
+      }
+    }
+  }
+
+  const mh_amcl::MapMatcher expected_matcher(grid, params);
+  ASSERT_EQ(updated_matcher->get_memory_usage(), expected_matcher.get_memory_usage());
+  for (const auto & pose : {std::make_pair(3.1, 5.3), std::make_pair(7.0, 3.0)}) {
+    const auto scan = cast_scan(grid, pose.first, pose.second, 0.7);
+    const auto tfs = updated_matcher->get_matchs(scan);
+    const auto expected_tfs = expected_matcher.get_matchs(scan);
+    ASSERT_FALSE(tfs.empty());
+    ASSERT_EQ(tfs.size(), expected_tfs.size());
+    for (auto it = tfs.begin(), eit = expected_tfs.begin(); it != tfs.end(); ++it, ++eit) {
+      ASSERT_EQ(it->weight, eit->weight);
+      ASSERT_EQ(it->transform.getOrigin().x(), eit->transform.getOrigin().x());
+      ASSERT_EQ(it->transform.getOrigin().y(), eit->transform.getOrigin().y());
+    }
+  }
+
+  // Patches that start out of the map are not applied
+  ASSERT_EQ(map->update(grid.info.width, 0, 1, 1, {0}), nullptr);
+  ASSERT_EQ(map->update(0, 0, 2, 2, {0}), nullptr);
+}
+
+TEST(test1, test_branch_and_bound)
+{
+  const auto grid = room_map();
+  const double x = 3.1, y = 5.3, yaw = 0.7;
+
+  mh_amcl::MatcherParams params;
+  params.time_budget = 10.0;
+  mh_amcl::MapMatcher matcher(grid, params);
+
+  const auto tfs = matcher.get_matchs(cast_scan(grid, x, y, yaw));
+  ASSERT_FALSE(tfs.empty());
+  ASSERT_LE(static_cast<int>(tfs.size()), params.max_candidates);
+
+  const auto & best = tfs.front();
+  double roll, pitch, best_yaw;
+  tf2::Matrix3x3(best.transform.getRotation()).getRPY(roll, pitch, best_yaw);
+
+  ASSERT_NEAR(best.transform.getOrigin().x(), x, 0.3);
+  ASSERT_NEAR(best.transform.getOrigin().y(), y, 0.3);
+  ASSERT_NEAR(std::remainder(best_yaw - yaw, 2.0 * M_PI), 0.0, 0.1);
+  ASSERT_GT(best.weight, params.min_score);
+
+  float last_weight = best.weight;
+  for (const auto & tf : tfs) {
+    ASSERT_LE(tf.weight, last_weight);
+    last_weight = tf.weight;
+  }
+
+  // No time to search returns before finding anything
+  params.time_budget = 0.0;
+  mh_amcl::MapMatcher hurried_matcher(grid, params);
+  ASSERT_TRUE(hurried_matcher.get_matchs(cast_scan(grid, x, y, yaw)).empty());
+}
+
+TEST(test1, test_local_search)
+{
+  const auto grid = room_map();
+  const double x = 3.1, y = 5.3, yaw = 0.7;
+  const mh_amcl::ScanPoints points(cast_scan(grid, x, y, yaw));
+
+  mh_amcl::MatcherParams params;
+  params.time_budget = 10.0;
+  mh_amcl::MapMatcher matcher(grid, params);
+
+  // Around the last good pose, also with its yaw out of [-PI, PI)
+  auto tfs = matcher.get_matchs(points, {x + 0.8, y - 0.5, yaw + 2.0 * M_PI - 0.2, 1.5, 0.5});
+  ASSERT_FALSE(tfs.empty());
+
+  const auto & best = tfs.front();
+  double roll, pitch, best_yaw;
+  tf2::Matrix3x3(best.transform.getRotation()).getRPY(roll, pitch, best_yaw);
+  ASSERT_NEAR(best.transform.getOrigin().x(), x, 0.3);
+  ASSERT_NEAR(best.transform.getOrigin().y(), y, 0.3);
+  ASSERT_NEAR(std::remainder(best_yaw - yaw, 2.0 * M_PI), 0.0, 0.1);
+
+  // Candidates never leave the region, even if the best pose is out of it
+  const mh_amcl::SearchRegion region {7.0, 2.0, -2.0, 1.0, 0.3};
+  const double resolution = grid.info.resolution * 4;
+  params.min_score = 0.0;
+  mh_amcl::MapMatcher greedy_matcher(grid, params);
+  tfs = greedy_matcher.get_matchs(points, region);
+  ASSERT_FALSE(tfs.empty());
+  for (const auto & tf : tfs) {
+    double tf_yaw;
+    tf2::Matrix3x3(tf.transform.getRotation()).getRPY(roll, pitch, tf_yaw);
+    ASSERT_LE(
+      std::hypot(tf.transform.getOrigin().x() - region.x, tf.transform.getOrigin().y() - region.y),
+      region.radius + resolution);
+    ASSERT_LE(
+      std::fabs(std::remainder(tf_yaw - region.yaw, 2.0 * M_PI)),
+      region.yaw_window + params.angular_resolution);
+  }
+
+  // Out of the map there is nothing to search
+  ASSERT_TRUE(matcher.get_matchs(points, {-10.0, -10.0, 0.0, 2.0, M_PI}).empty());
+
+  // Also on the thread of the relocalizer
+  mh_amcl::Relocalizer relocalizer;
+  ASSERT_TRUE(
+    relocalizer.request(
+      std::make_shared<mh_amcl::MapMatcher>(grid, params), points, region));
+
+  std::list<mh_amcl::TransformWeighted> matchs;
+  const auto start = std::chrono::steady_clock::now();
+  while (!relocalizer.take_results(matchs) &&
+    std::chrono::steady_clock::now() - start < std::chrono::seconds(10))
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  ASSERT_EQ(matchs.size(), tfs.size());
+}
+
+TEST(test1, test_mounted_laser)
+{
+  // A laser mounted backwards, out of the center of the robot. Its points moved to
+  // base_footprint match poses of the robot, and not of the laser.
+  const auto grid = room_map();
+  const mh_amcl::Pose2d map2bf(3.1, 5.3, 0.7);
+  const mh_amcl::Pose2d bf2laser(-0.3, 0.1, M_PI);
+  const mh_amcl::Pose2d map2laser = map2bf * bf2laser;
+  const mh_amcl::ScanPoints laser_points(cast_scan(grid, map2laser.x, map2laser.y, map2laser.yaw));
+
+  mh_amcl::ScanPoints points;
+  points.merge({&laser_points}, {bf2laser});
+
+  mh_amcl::MatcherParams params;
+  params.time_budget = 10.0;
+  mh_amcl::MapMatcher matcher(grid, params);
+
+  auto check = [&](const std::list<mh_amcl::TransformWeighted> & tfs) {
+      ASSERT_FALSE(tfs.empty());
+      const mh_amcl::Pose2d best(tfs.front().transform);
+      ASSERT_NEAR(best.x, map2bf.x, 0.3);
+      ASSERT_NEAR(best.y, map2bf.y, 0.3);
+      ASSERT_NEAR(std::remainder(best.yaw - map2bf.yaw, 2.0 * M_PI), 0.0, 0.1);
+    };
+
+  check(matcher.get_matchs(points));
+  check(matcher.get_matchs(points, {map2bf.x + 0.5, map2bf.y, map2bf.yaw, 1.0, 0.3}));
+}
+
+TEST(test1, test_relocalizer)
+{
+  const auto grid = room_map();
+  const double x = 3.1, y = 5.3, yaw = 0.7;
+  const mh_amcl::ScanPoints points(cast_scan(grid, x, y, yaw));
+
+  mh_amcl::MatcherParams params;
+  params.time_budget = 10.0;
+  auto matcher = std::make_shared<mh_amcl::MapMatcher>(grid, params);
+
+  // A cancelled search finds nothing
+  std::atomic<bool> cancel {true};
+  ASSERT_TRUE(matcher->get_matchs(points, &cancel).empty());
+
+  mh_amcl::Relocalizer relocalizer;
+  std::list<mh_amcl::TransformWeighted> matchs;
+  ASSERT_FALSE(relocalizer.take_results(matchs));
+
+  ASSERT_TRUE(relocalizer.request(matcher, points));
+  auto start = std::chrono::steady_clock::now();
+  while (!relocalizer.take_results(matchs) &&
+    std::chrono::steady_clock::now() - start < std::chrono::seconds(10))
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  ASSERT_FALSE(matchs.empty());
+  ASSERT_NEAR(matchs.front().transform.getOrigin().x(), x, 0.3);
+  ASSERT_NEAR(matchs.front().transform.getOrigin().y(), y, 0.3);
+  ASSERT_FALSE(relocalizer.take_results(matchs));
+
+  // A search too long to finish is stopped by cancel, and its results discarded
+  params.angular_resolution = 0.0005;
+  params.min_score = 0.0;
+  auto slow_matcher = std::make_shared<mh_amcl::MapMatcher>(grid, params);
+
+  while (relocalizer.busy()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  ASSERT_TRUE(relocalizer.request(slow_matcher, points));
+  ASSERT_FALSE(relocalizer.request(matcher, points));
+
+  relocalizer.cancel();
+  start = std::chrono::steady_clock::now();
+  while (relocalizer.busy() &&
+    std::chrono::steady_clock::now() - start < std::chrono::seconds(5))
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  ASSERT_FALSE(relocalizer.busy());
+  ASSERT_FALSE(relocalizer.take_results(matchs));
+}
+
+TEST(test1, test_map_cache)
+{
+  const auto grid = room_map();
+  const double x = 3.1, y = 5.3, yaw = 0.7;
+  const mh_amcl::ScanPoints points(cast_scan(grid, x, y, yaw));
+  const mh_amcl::LocalizationMap map(grid);
+
+  const auto dir = std::filesystem::temp_directory_path() / "mh_amcl_test_map_cache";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+
+  const uint64_t key = mh_amcl::MapCache::get_key(grid);
+  auto other_grid = grid;
+  other_grid.data[0] = 0;
+  ASSERT_NE(mh_amcl::MapCache::get_key(other_grid), key);
+
+  mh_amcl::MatcherParams params;
+  params.time_budget = 10.0;
+  const auto expected = mh_amcl::MapMatcher(grid, params).get_matchs(points);
+  const mh_amcl::LikelihoodField expected_field(map, 0.5);
+
+  auto check = [&](const mh_amcl::MapMatcher & matcher, const mh_amcl::LikelihoodField & field) {
+      const auto tfs = matcher.get_matchs(points);
+      ASSERT_EQ(tfs.size(), expected.size());
+      for (auto it = tfs.begin(), it_exp = expected.begin(); it != tfs.end(); ++it, ++it_exp) {
+        ASSERT_EQ(it->weight, it_exp->weight);
+        ASSERT_EQ(it->transform.getOrigin().x(), it_exp->transform.getOrigin().x());
+        ASSERT_EQ(it->transform.getOrigin().y(), it_exp->transform.getOrigin().y());
+      }
+
+      for (double wx = 0.0; wx < 10.0; wx += 0.13) {
+        for (double wy = 0.0; wy < 8.0; wy += 0.13) {
+          ASSERT_EQ(field.get_distance(wx, wy), expected_field.get_distance(wx, wy));
+        }
+      }
+    };
+
+  // The first time the artifacts are computed and written
+  {
+    mh_amcl::MapCache cache(dir.string(), key);
+    size_t size;
+    ASSERT_EQ(cache.get_section("likelihood_field_500", size), nullptr);
+
+    mh_amcl::MapMatcher matcher(grid, params, &cache);
+    mh_amcl::LikelihoodField field(map, 0.5, &cache);
+    ASSERT_TRUE(cache.save());
+    check(matcher, field);
+  }
+  ASSERT_TRUE(std::filesystem::exists(mh_amcl::MapCache(dir.string(), key).get_path()));
+
+  // Then they are read, and any new one is added to the file
+  {
+    mh_amcl::MapCache cache(dir.string(), key);
+    size_t size;
+    ASSERT_NE(cache.get_section("likelihood_field_500", size), nullptr);
+
+    mh_amcl::MapMatcher matcher(grid, params, &cache);
+    mh_amcl::LikelihoodField field(map, 0.5, &cache);
+    check(matcher, field);
+
+    // Levels of the pyramid are sections too
+    const mh_amcl::LocalizationMap built(grid, 3, &cache);
+    ASSERT_TRUE(cache.save());
+    ASSERT_NE(cache.get_section("map_level2", size), nullptr);
+    const mh_amcl::LocalizationMap loaded(grid, 3, &cache);
+    ASSERT_EQ(loaded.get_num_levels(), 3);
+    for (int level = 1; level < 3; level++) {
+      const auto & expected_level = built.get_level(level);
+      const auto & loaded_level = loaded.get_level(level);
+      ASSERT_EQ(loaded_level.get_size_x(), expected_level.get_size_x());
+      ASSERT_EQ(loaded_level.get_size_y(), expected_level.get_size_y());
+      ASSERT_EQ(loaded_level.get_resolution(), expected_level.get_resolution());
+      for (unsigned int j = 0; j < loaded_level.get_size_y(); j++) {
+        for (unsigned int i = 0; i < loaded_level.get_size_x(); i++) {
+          ASSERT_EQ(loaded_level.get_cost(i, j), expected_level.get_cost(i, j));
+        }
+      }
+    }
+
+    mh_amcl::LikelihoodField other_field(map, 0.3, &cache);
+    ASSERT_TRUE(cache.save());
+    ASSERT_NE(cache.get_section("likelihood_field_300", size), nullptr);
+    ASSERT_NE(cache.get_section("likelihood_field_500", size), nullptr);
+
+    // Names that do not fit in the file are rejected, instead of truncated
+    const std::string long_name(47, 'a');
+    ASSERT_TRUE(cache.add_section(long_name, std::vector<char>(8, 1)));
+    ASSERT_FALSE(cache.add_section(long_name + "b", std::vector<char>(8, 2)));
+    ASSERT_FALSE(cache.add_section(long_name + "c", std::vector<char>(8, 3)));
+    ASSERT_TRUE(cache.save());
+    ASSERT_EQ(cache.get_section(long_name + "b", size), nullptr);
+    const char * data = cache.get_section(long_name, size);
+    ASSERT_NE(data, nullptr);
+    ASSERT_EQ(size, 8u);
+    ASSERT_EQ(data[0], 1);
+  }
+
+  // A damaged file is ignored, and replaced
+  const std::string path = mh_amcl::MapCache(dir.string(), key).get_path();
+  std::filesystem::resize_file(path, std::filesystem::file_size(path) / 2);
+  {
+    mh_amcl::MapCache cache(dir.string(), key);
+    size_t size;
+    ASSERT_EQ(cache.get_section("likelihood_field_500", size), nullptr);
+
+    mh_amcl::MapMatcher matcher(grid, params, &cache);
+    mh_amcl::LikelihoodField field(map, 0.5, &cache);
+    ASSERT_TRUE(cache.save());
+    check(matcher, field);
+  }
+  {
+    mh_amcl::MapCache cache(dir.string(), key);
+    size_t size;
+    ASSERT_NE(cache.get_section("likelihood_field_500", size), nullptr);
+  }
+
+  std::filesystem::remove_all(dir);
+}
+
 /*TEST(test1, test_match)
 {
   auto test_node = rclcpp::Node::make_shared("test_node");
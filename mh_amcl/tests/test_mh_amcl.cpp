@@ -13,10 +13,15 @@
 // limitations under the License.
 
 
+#include <array>
+#include <cmath>
 #include <limits>
+#include <random>
+#include <vector>
 
 #include "gtest/gtest.h"
 
+#include "mh_amcl/HypothesisIndex.hpp"
 #include "mh_amcl/MH_AMCL.hpp"
 
 #include "nav2_costmap_2d/cost_values.hpp"
@@ -42,6 +47,49 @@ TEST(test1, test_aux)
 {
 }
 
+TEST(test1, test_hypothesis_index)
+{
+  // Same poses found as comparing with all of them, also across -PI / PI and the origin
+  std::mt19937 generator(1);
+  std::uniform_real_distribution<double> position(-5.0, 5.0);
+  std::uniform_real_distribution<double> angle(-M_PI, M_PI);
+
+  std::vector<std::array<double, 3>> poses(200);
+  mh_amcl::HypothesisIndex index(0.5, 0.3);
+  for (size_t i = 0; i < poses.size(); i++) {
+    poses[i] = {position(generator), position(generator), angle(generator)};
+    index.insert(i, poses[i][0], poses[i][1], poses[i][2]);
+  }
+  ASSERT_EQ(index.size(), poses.size());
+
+  std::vector<size_t> near;
+  for (int k = 0; k < 500; k++) {
+    const double x = position(generator), y = position(generator), yaw = angle(generator);
+    const double max_distance = k % 2 ? 0.5 : 1.2;
+    const double max_angle = k % 3 ? 0.3 : M_PI;
+
+    std::vector<size_t> expected;
+    for (size_t i = 0; i < poses.size(); i++) {
+      const double diff = poses[i][2] - yaw;
+      if (std::hypot(poses[i][0] - x, poses[i][1] - y) < max_distance &&
+        std::fabs(std::atan2(std::sin(diff), std::cos(diff))) < max_angle)
+      {
+        expected.push_back(i);
+      }
+    }
+
+    index.query(x, y, yaw, max_distance, max_angle, near);
+    ASSERT_EQ(near, expected);
+    ASSERT_EQ(index.covers(x, y, yaw, max_distance, max_angle), !expected.empty());
+  }
+
+  index.clear();
+  ASSERT_FALSE(index.covers(0.0, 0.0, 0.0, 100.0, M_PI));
+  index.insert(7, 1.0, 1.0, M_PI - 0.05);
+  index.query(1.1, 1.0, -M_PI + 0.05, 0.5, 0.2, near);
+  ASSERT_EQ(near, std::vector<size_t>({7}));
+}
+
 int main(int argc, char * argv[])
 {
   testing::InitGoogleTest(&argc, argv);
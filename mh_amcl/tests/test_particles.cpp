@@ -14,10 +14,23 @@
 
 
 #include <limits>
+#include <list>
+#include <memory>
+#include <random>
+#include <vector>
 
 #include "gtest/gtest.h"
 
+#include "mh_amcl/CorrectionScheduler.hpp"
+#include "mh_amcl/HypothesisPool.hpp"
+#include "mh_amcl/Instrumentation.hpp"
+#include "mh_amcl/LocalizationMap.hpp"
 #include "mh_amcl/ParticlesDistribution.hpp"
+#include "mh_amcl/LikelihoodField.hpp"
+#include "mh_amcl/Pose2.hpp"
+#include "mh_amcl/PoseStatistics.hpp"
+#include "mh_amcl/RandomGenerator.hpp"
+#include "mh_amcl/ThreadPool.hpp"
 #include "nav2_costmap_2d/cost_values.hpp"
 #include "tf2_ros/static_transform_broadcaster.h"
 #include "sensor_msgs/msg/laser_scan.hpp"
@@ -38,7 +51,7 @@ public:
   int get_num_particles() {return particles_.size();}
 
   rclcpp_lifecycle::LifecycleNode::SharedPtr get_parent() {return parent_node_;}
-  std::vector<mh_amcl::Particle> & get_particles_test() {return particles_;}
+  mh_amcl::ParticleSet & get_particles_test() {return particles_;}
   tf2::Transform get_tranform_to_read_test(const sensor_msgs::msg::LaserScan & scan, int index)
   {
     return get_tranform_to_read(scan, index);
@@ -47,16 +60,16 @@ public:
   double get_error_distance_to_obstacle_test(
     const tf2::Transform & map2bf, const tf2::Transform & bf2laser,
     const tf2::Transform & laser2point, const sensor_msgs::msg::LaserScan & scan,
-    const nav2_costmap_2d::Costmap2D & costmap, double o)
+    const mh_amcl::LocalizationMap & map, double o)
   {
-    return get_error_distance_to_obstacle(map2bf, bf2laser, laser2point, scan, costmap, o);
+    return get_error_distance_to_obstacle(map2bf, bf2laser, laser2point, scan, map, o);
   }
 
   void normalize_test() {normalize();}
   unsigned char get_cost_test(
-    const tf2::Transform & transform, const nav2_costmap_2d::Costmap2D & costmap)
+    const tf2::Transform & transform, const mh_amcl::LocalizationMap & map)
   {
-    return get_cost(transform, costmap);
+    return get_cost(transform, map);
   }
 };
 
@@ -103,13 +116,13 @@ TEST(test1, test_init)
   std::vector<double> angle_z(particles.size());
 
   for (int i = 0; i < particles.size(); i++) {
-    auto pos = particles[i].pose.getOrigin();
+    auto pos = particles.get_pose(i).getOrigin();
 
     pos_x[i] = pos.x();
     pos_y[i] = pos.y();
     pos_z[i] = pos.z();
 
-    tf2::Matrix3x3 m(particles[i].pose.getRotation());
+    tf2::Matrix3x3 m(particles.get_rotation(i));
     double roll, pitch, yaw;
     m.getRPY(roll, pitch, yaw);
 
@@ -117,7 +130,7 @@ TEST(test1, test_init)
     angle_y[i] = pitch;
     angle_z[i] = yaw;
 
-    ASSERT_NEAR(particles[i].prob, 1.0 / particles.size(), 0.0001);
+    ASSERT_NEAR(particles.prob[i], 1.0 / particles.size(), 0.0001);
   }
 
   ASSERT_NE(particles.size(), 0);
@@ -182,13 +195,13 @@ TEST(test1, test_init_2)
   std::vector<double> angle_z(particles.size());
 
   for (int i = 0; i < particles.size(); i++) {
-    auto pos = particles[i].pose.getOrigin();
+    auto pos = particles.get_pose(i).getOrigin();
 
     pos_x[i] = pos.x();
     pos_y[i] = pos.y();
     pos_z[i] = pos.z();
 
-    tf2::Matrix3x3 m(particles[i].pose.getRotation());
+    tf2::Matrix3x3 m(particles.get_rotation(i));
     double roll, pitch, yaw;
     m.getRPY(roll, pitch, yaw);
 
@@ -196,7 +209,7 @@ TEST(test1, test_init_2)
     angle_y[i] = pitch;
     angle_z[i] = yaw;
 
-    ASSERT_NEAR(particles[i].prob, 1.0 / particles.size(), 0.0001);
+    ASSERT_NEAR(particles.prob[i], 1.0 / particles.size(), 0.0001);
   }
 
   ASSERT_NE(particles.size(), 0);
@@ -242,7 +255,7 @@ TEST(test1, test_reseed)
   std::vector<double> pos_z(particles.size());
 
   for (int i = 0; i < particles.size(); i++) {
-    auto pos = particles[i].pose.getOrigin();
+    auto pos = particles.get_pose(i).getOrigin();
 
     pos_x[i] = pos.x();
     pos_y[i] = pos.y();
@@ -262,6 +275,100 @@ TEST(test1, test_reseed)
   ASSERT_NEAR(mean_z, 0.0, 0.0001);
 }
 
+TEST(test1, test_systematic_resample)
+{
+  ParticlesDistributionTest particle_dist;
+  particle_dist.get_parent()->set_parameter({"min_particles", 100});
+  particle_dist.get_parent()->set_parameter({"max_particles", 100});
+  particle_dist.get_parent()->set_parameter({"resampler", "systematic"});
+
+  particle_dist.on_configure(
+    rclcpp_lifecycle::State(lifecycle_msgs::msg::State::PRIMARY_STATE_ACTIVE, "Inactive"));
+
+  // Uniform weights: nothing to resample
+  auto & particles = particle_dist.get_particles_test();
+  particles.resize(100);
+  for (size_t i = 0; i < particles.size(); i++) {
+    particles.set_pose(i, i * 0.1, 0.0, 0.0);
+    particles.prob[i] = 0.01;
+  }
+
+  const std::vector<double> xs = particles.x;
+  particle_dist.reseed();
+  ASSERT_EQ(particles.x, xs);
+
+  // Three particles hold all the weight, in a 1 : 1 : 2 ratio
+  std::fill(particles.prob.begin(), particles.prob.end(), 0.0);
+  particles.prob[10] = 0.25;
+  particles.prob[50] = 0.25;
+  particles.prob[90] = 0.5;
+
+  particle_dist.reseed();
+  ASSERT_EQ(particle_dist.get_num_particles(), 100);
+
+  int near_10 = 0, near_50 = 0, near_90 = 0;
+  for (size_t i = 0; i < particles.size(); i++) {
+    ASSERT_NEAR(particles.prob[i], 0.01, 0.000001);
+    near_10 += fabs(particles.x[i] - 1.0) < 0.1;
+    near_50 += fabs(particles.x[i] - 5.0) < 0.1;
+    near_90 += fabs(particles.x[i] - 9.0) < 0.1;
+  }
+
+  // Systematic resampling gives each particle its share of copies, off by one at most
+  ASSERT_NEAR(near_10, 25, 1);
+  ASSERT_NEAR(near_50, 25, 1);
+  ASSERT_NEAR(near_90, 50, 1);
+}
+
+TEST(test1, test_kld_reseed)
+{
+  ASSERT_EQ(mh_amcl::kld_sample_size(1, 0.05, 0.99), 0);
+  ASSERT_EQ(mh_amcl::kld_sample_size(2, 0.05, 0.99), 20);
+  ASSERT_EQ(mh_amcl::kld_sample_size(10, 0.05, 0.99), 131);
+  ASSERT_EQ(mh_amcl::kld_sample_size(100, 0.05, 0.99), 1129);
+
+  ParticlesDistributionTest particle_dist;
+  particle_dist.get_parent()->set_parameter({"min_particles", 30});
+  particle_dist.get_parent()->set_parameter({"max_particles", 200});
+  particle_dist.get_parent()->set_parameter({"particles_adaptation", "kld"});
+
+  particle_dist.on_configure(
+    rclcpp_lifecycle::State(lifecycle_msgs::msg::State::PRIMARY_STATE_ACTIVE, "Inactive"));
+
+  // Converged: every particle in the same bin
+  auto & particles = particle_dist.get_particles_test();
+  particles.resize(200);
+  for (size_t i = 0; i < particles.size(); i++) {
+    particles.set_pose(i, 0.2 + 0.001 * (i % 10), 0.2, 0.05);
+    particles.prob[i] = 1.0 / particles.size();
+  }
+
+  particle_dist.reseed();
+  ASSERT_EQ(particle_dist.get_num_particles(), 30);
+  ASSERT_EQ(particle_dist.get_info().num_part, 30);
+
+  // Also with yaws out of [-PI, PI], as init leaves them: the same heading is the same bin
+  particles.resize(200);
+  for (size_t i = 0; i < particles.size(); i++) {
+    particles.set_pose(i, 0.2 + 0.001 * (i % 10), 0.2, 0.05 + 2.0 * M_PI * (i % 3));
+    particles.prob[i] = 1.0 / particles.size();
+  }
+
+  particle_dist.reseed();
+  ASSERT_EQ(particle_dist.get_num_particles(), 30);
+
+  // Spread over 100 bins of 10 x 10 meters needs all the particles we can have
+  particles.resize(200);
+  for (size_t i = 0; i < particles.size(); i++) {
+    const int bin = i / 2;
+    particles.set_pose(i, 0.25 + (bin % 10) * 1.0, 0.25 + (bin / 10) * 1.0, 0.05);
+    particles.prob[i] = 1.0 / particles.size();
+  }
+
+  particle_dist.reseed();
+  ASSERT_EQ(particle_dist.get_num_particles(), 200);
+}
+
 TEST(test1, test_predict)
 {
   ParticlesDistributionTest particle_dist;
@@ -284,7 +391,7 @@ TEST(test1, test_predict)
   std::vector<double> pos_z(particles.size());
 
   for (int i = 0; i < particles.size(); i++) {
-    auto pos = particles[i].pose.getOrigin();
+    auto pos = particles.get_pose(i).getOrigin();
 
     pos_x[i] = pos.x();
     pos_y[i] = pos.y();
@@ -404,15 +511,16 @@ TEST(test1, test_get_cost)
   costmap.worldToMap(0.0, 1.0, mx, my);
   ASSERT_EQ(costmap.getCost(mx, my), nav2_costmap_2d::LETHAL_OBSTACLE);
 
+  const mh_amcl::LocalizationMap map(costmap);
   tf2::Transform tf_test;
   tf_test.setOrigin({0.0, 0.0, 0.0});
-  ASSERT_EQ(particle_dist.get_cost_test(tf_test, costmap), nav2_costmap_2d::FREE_SPACE);
+  ASSERT_EQ(particle_dist.get_cost_test(tf_test, map), nav2_costmap_2d::FREE_SPACE);
   tf_test.setOrigin({0.75, 0.0, 0.0});
-  ASSERT_EQ(particle_dist.get_cost_test(tf_test, costmap), nav2_costmap_2d::LETHAL_OBSTACLE);
+  ASSERT_EQ(particle_dist.get_cost_test(tf_test, map), nav2_costmap_2d::LETHAL_OBSTACLE);
   tf_test.setOrigin({0.0, -0.5, 0.0});
-  ASSERT_EQ(particle_dist.get_cost_test(tf_test, costmap), nav2_costmap_2d::LETHAL_OBSTACLE);
+  ASSERT_EQ(particle_dist.get_cost_test(tf_test, map), nav2_costmap_2d::LETHAL_OBSTACLE);
   tf_test.setOrigin({0.0, 1.0, 0.0});
-  ASSERT_EQ(particle_dist.get_cost_test(tf_test, costmap), nav2_costmap_2d::LETHAL_OBSTACLE);
+  ASSERT_EQ(particle_dist.get_cost_test(tf_test, map), nav2_costmap_2d::LETHAL_OBSTACLE);
 }
 
 TEST(test1, test_get_error_distance_to_obstacle)
@@ -503,6 +611,8 @@ TEST(test1, test_get_error_distance_to_obstacle)
   bf2lasert.setOrigin({0.0, 0.0, 0.0});
   bf2lasert.setRotation({0.0, 0.0, 0.0, 1.0});
 
+  const mh_amcl::LocalizationMap map(costmap);
+
   // Real tests
   {
     tf2::Transform laser2point;
@@ -512,7 +622,7 @@ TEST(test1, test_get_error_distance_to_obstacle)
     ASSERT_NEAR(laser2point.getOrigin().y(), 0.00, 0.0001);
 
     double distance = particle_dist.get_error_distance_to_obstacle_test(
-      map2bf, bf2lasert, laser2point, scan, costmap, 0.02);
+      map2bf, bf2lasert, laser2point, scan, map, 0.02);
 
     ASSERT_FALSE(std::isinf(distance));
     ASSERT_NEAR(distance, 0.05, 0.0001);
@@ -526,7 +636,7 @@ TEST(test1, test_get_error_distance_to_obstacle)
     ASSERT_NEAR(laser2point.getOrigin().y(), -0.76, 0.0001);
 
     double distance = particle_dist.get_error_distance_to_obstacle_test(
-      map2bf, bf2lasert, laser2point, scan, costmap, 0.02);
+      map2bf, bf2lasert, laser2point, scan, map, 0.02);
 
     ASSERT_FALSE(std::isinf(distance));
     ASSERT_NEAR(distance, 0.0, 0.0001);
@@ -540,7 +650,7 @@ TEST(test1, test_get_error_distance_to_obstacle)
     ASSERT_NEAR(laser2point.getOrigin().y(), 0.0, 0.0001);
 
     double distance = particle_dist.get_error_distance_to_obstacle_test(
-      map2bf, bf2lasert, laser2point, scan, costmap, 0.02);
+      map2bf, bf2lasert, laser2point, scan, map, 0.02);
 
     ASSERT_FALSE(std::isinf(distance));
     ASSERT_NEAR(distance, 0.0, 0.0001);
@@ -551,7 +661,7 @@ TEST(test1, test_get_error_distance_to_obstacle)
     laser2point = particle_dist.get_tranform_to_read_test(scan, 3);
 
     double distance = particle_dist.get_error_distance_to_obstacle_test(
-      map2bf, bf2lasert, laser2point, scan, costmap, 0.02);
+      map2bf, bf2lasert, laser2point, scan, map, 0.02);
 
     ASSERT_TRUE(std::isinf(distance));
   }
@@ -561,7 +671,7 @@ TEST(test1, test_get_error_distance_to_obstacle)
     laser2point = particle_dist.get_tranform_to_read_test(scan, 4);
 
     double distance = particle_dist.get_error_distance_to_obstacle_test(
-      map2bf, bf2lasert, laser2point, scan, costmap, 0.02);
+      map2bf, bf2lasert, laser2point, scan, map, 0.02);
 
     ASSERT_TRUE(std::isinf(distance));
   }
@@ -577,25 +687,25 @@ TEST(test1, normalize)
   auto & particles = particle_dist.get_particles_test();
 
   std::for_each(
-    particles.begin(), particles.end(), [&](const mh_amcl::Particle & p) {
-      ASSERT_NEAR(p.prob, 1.0 / particles.size(), 0.0001);
+    particles.prob.begin(), particles.prob.end(), [&](const double & prob) {
+      ASSERT_NEAR(prob, 1.0 / particles.size(), 0.0001);
     });
 
   std::for_each(
-    particles.begin(), particles.end(), [&](mh_amcl::Particle & p) {
-      p.prob = p.prob * 2.0;
+    particles.prob.begin(), particles.prob.end(), [&](double & prob) {
+      prob = prob * 2.0;
     });
 
   std::for_each(
-    particles.begin(), particles.end(), [&](const mh_amcl::Particle & p) {
-      ASSERT_NEAR(p.prob, 2.0 / particles.size(), 0.0001);
+    particles.prob.begin(), particles.prob.end(), [&](const double & prob) {
+      ASSERT_NEAR(prob, 2.0 / particles.size(), 0.0001);
     });
 
   particle_dist.normalize_test();
 
   std::for_each(
-    particles.begin(), particles.end(), [&](const mh_amcl::Particle & p) {
-      ASSERT_NEAR(p.prob, 1.0 / particles.size(), 0.0001);
+    particles.prob.begin(), particles.prob.end(), [&](const double & prob) {
+      ASSERT_NEAR(prob, 1.0 / particles.size(), 0.0001);
     });
 }
 
@@ -674,25 +784,18 @@ TEST(test1, test_correct)
     std::numeric_limits<float>::infinity()};
   // Here we should set perception noise to 0.0 to avoid random errors
 
-  particle_dist.correct_once(scan, costmap);
+  particle_dist.correct_once(scan, mh_amcl::LocalizationMap(costmap));
 
   ASSERT_GT(particle_dist.get_quality(), 0.3);
 
   auto & particles = particle_dist.get_particles_test();
 
   // Sort particles by prob
-  std::sort(
-    particles.begin(), particles.end(),
-    [](const mh_amcl::Particle & a, const mh_amcl::Particle & b) -> bool
-    {
-      return a.prob > b.prob;
-    });
+  particles.sort_by_prob();
 
   for (int i = 0; i < 5; i++) {
-    const mh_amcl::Particle & part = particles[i];
-
-    const double x = part.pose.getOrigin().x();
-    const double y = part.pose.getOrigin().y();
+    const double x = particles.x[i];
+    const double y = particles.y[i];
 
     double dist = sqrt(x * x + y * y);
     ASSERT_LE(dist, 0.15);
@@ -701,11 +804,177 @@ TEST(test1, test_correct)
   particle_dist.normalize_test();
 
   double sum_probs = 0.0;
-  for (const auto p : particle_dist.get_particles_test()) {
-    sum_probs += p.prob;
+  for (const auto prob : particle_dist.get_particles_test().prob) {
+    sum_probs += prob;
+  }
+
+  ASSERT_NEAR(sum_probs, 1.0, 0.000001);
+}
+
+TEST(test1, test_likelihood_field)
+{
+  // Costmap with an obstacle line in x = 1.0
+  unsigned int size_x = 400;
+  unsigned int size_y = 400;
+  double resolution = 0.01;
+
+  nav2_costmap_2d::Costmap2D costmap;
+  costmap.resizeMap(size_x, size_y, resolution, -2.0, -2.0);
+
+  for (unsigned int i = 0; i < size_x; ++i) {
+    for (unsigned int j = 0; j < size_y; ++j) {
+      costmap.setCost(i, j, nav2_costmap_2d::FREE_SPACE);
+    }
+  }
+
+  for (double y = -1.0; y < 1.0; y = y + resolution) {
+    unsigned int mx, my;
+    costmap.worldToMap(1.0, y, mx, my);
+    costmap.setCost(mx, my, nav2_costmap_2d::LETHAL_OBSTACLE);
+  }
+
+  mh_amcl::LikelihoodField field(mh_amcl::LocalizationMap(costmap), 0.5);
+
+  ASSERT_NEAR(field.get_distance(1.0, 0.0), 0.0, 0.0001);
+  ASSERT_NEAR(field.get_distance(0.9, 0.0), 0.1, resolution);
+  ASSERT_NEAR(field.get_distance(1.2, 0.5), 0.2, resolution);
+  ASSERT_NEAR(field.get_distance(0.7, 0.0), 0.3, resolution);
+  ASSERT_TRUE(std::isinf(field.get_distance(0.0, 0.0)));
+  ASSERT_TRUE(std::isinf(field.get_distance(-3.0, 0.0)));
+  ASSERT_TRUE(std::isinf(field.get_distance(1.0, 3.0)));
+}
+
+TEST(test1, test_correct_likelihood_field)
+{
+  // Costmap with an obstacle in (1, 0)
+  unsigned int size_x = 400;
+  unsigned int size_y = 400;
+  double resolution = 0.01;
+
+  nav2_costmap_2d::Costmap2D costmap;
+  costmap.resizeMap(size_x, size_y, resolution, -2.0, -2.0);
+
+  for (unsigned int i = 0; i < size_x; ++i) {
+    for (unsigned int j = 0; j < size_y; ++j) {
+      costmap.setCost(i, j, nav2_costmap_2d::FREE_SPACE);
+    }
+  }
+
+  for (double x = -1.0; x < 1.0; x = x + resolution) {
+    unsigned int mx, my;
+    costmap.worldToMap(x, 1.0, mx, my);
+    costmap.setCost(mx, my, nav2_costmap_2d::LETHAL_OBSTACLE);
+  }
+
+  for (double y = -1.0; y < 1.0; y = y + resolution) {
+    unsigned int mx, my;
+    costmap.worldToMap(1.0, y, mx, my);
+    costmap.setCost(mx, my, nav2_costmap_2d::LETHAL_OBSTACLE);
+  }
+
+  mh_amcl::LikelihoodField field(mh_amcl::LocalizationMap(costmap), 0.5);
+
+  auto test_node = rclcpp_lifecycle::LifecycleNode::make_shared("test_node");
+  // Transform base_footprint -> laser
+  tf2_ros::StaticTransformBroadcaster tf_pub(test_node);
+  geometry_msgs::msg::TransformStamped bf2laser;
+  bf2laser.header.stamp = test_node->now();
+  bf2laser.header.frame_id = "base_footprint";
+  bf2laser.child_frame_id = "laser";
+  bf2laser.transform.rotation.w = 1.0;
+  tf_pub.sendTransform({bf2laser});
+
+  // Init particles to (x=0.0, y=0.0, t=0.0)
+  ParticlesDistributionTest particle_dist;
+  particle_dist.get_parent()->set_parameter({"min_particles", 200});
+  particle_dist.on_configure(
+    rclcpp_lifecycle::State(lifecycle_msgs::msg::State::PRIMARY_STATE_ACTIVE, "Inactive"));
+
+  // Spin for 1 sec to receive TFs
+  rclcpp::Rate rate(20);
+  auto start = test_node->now();
+  while ((test_node->now() - start).seconds() < 1.0) {
+    rclcpp::spin_some(test_node->get_node_base_interface());
+    rate.sleep();
+  }
+
+  sensor_msgs::msg::LaserScan scan;
+  scan.header.frame_id = "laser";
+  scan.header.stamp = test_node->now();
+  scan.range_min = 0.05;
+  scan.range_max = 20.0;
+  scan.angle_min = -M_PI;
+  scan.angle_max = M_PI;
+  scan.angle_increment = M_PI_2;
+  scan.ranges = {
+    std::numeric_limits<float>::infinity(),
+    std::numeric_limits<float>::infinity(),
+    1.0,
+    1.0,
+    std::numeric_limits<float>::infinity()};
+
+  const mh_amcl::ParticleSet initial_particles = particle_dist.get_particles_test();
+
+  // Correcting by chunks in several threads gives the same result than in one pass
+  mh_amcl::ThreadPool pool(4);
+  const mh_amcl::ScanPoints points(scan);
+  ASSERT_TRUE(particle_dist.prepare_correction(scan));
+  const size_t num_particles = initial_particles.size();
+  const size_t chunk_size = 16;
+  pool.parallel_for(
+    (num_particles + chunk_size - 1) / chunk_size, [&](size_t chunk) {
+      const size_t begin = chunk * chunk_size;
+      const size_t end = std::min(begin + chunk_size, num_particles);
+      particle_dist.correct_particles(points, field, begin, end);
+    });
+  particle_dist.finish_correction(points);
+
+  const std::vector<double> chunked_probs = particle_dist.get_particles_test().prob;
+  const float chunked_quality = particle_dist.get_quality();
+
+  particle_dist.get_particles_test() = initial_particles;
+  particle_dist.correct_once(scan, field);
+
+  ASSERT_EQ(chunked_probs, particle_dist.get_particles_test().prob);
+  ASSERT_EQ(chunked_quality, particle_dist.get_quality());
+  ASSERT_GT(particle_dist.get_quality(), 0.3);
+
+  auto & particles = particle_dist.get_particles_test();
+
+  particles.sort_by_prob();
+
+  for (int i = 0; i < 5; i++) {
+    const double x = particles.x[i];
+    const double y = particles.y[i];
+
+    double dist = sqrt(x * x + y * y);
+    ASSERT_LE(dist, 0.15);
+  }
+
+  double sum_probs = 0.0;
+  for (const auto prob : particle_dist.get_particles_test().prob) {
+    sum_probs += prob;
   }
 
   ASSERT_NEAR(sum_probs, 1.0, 0.000001);
+
+  // Adaptive selection drops max range returns, so a scan with only them has no beams.
+  // It does not change the quality, instead of dividing the hits by 0.
+  const float quality = particle_dist.get_quality();
+  scan.ranges.assign(scan.ranges.size(), scan.range_max);
+  mh_amcl::ScanPoints max_range_points;
+  max_range_points.set_max_beams(2, mh_amcl::ADAPTIVE);
+  max_range_points.update(scan);
+  ASSERT_TRUE(max_range_points.empty());
+  ASSERT_EQ(max_range_points.equivalent_ranges(), 0.0f);
+
+  ASSERT_TRUE(particle_dist.prepare_correction(scan));
+  particle_dist.correct_particles(max_range_points, field, 0, num_particles);
+  particle_dist.finish_correction(max_range_points);
+  ASSERT_EQ(particle_dist.get_quality(), quality);
+  for (const auto hits : particle_dist.get_particles_test().hits) {
+    ASSERT_FALSE(std::isnan(hits));
+  }
 }
 
 TEST(test1, test_statistics)
@@ -718,6 +987,443 @@ TEST(test1, test_statistics)
   ASSERT_NEAR(mh_amcl::covariance(v1, v2), 17, 0.001);
 }
 
+TEST(test1, test_pose_statistics)
+{
+  std::mt19937 generator(0);
+  std::normal_distribution<double> noise(0.0, 0.3);
+
+  // Far from the origin, to check the precision
+  mh_amcl::ParticleSet particles;
+  particles.resize(500);
+  for (size_t i = 0; i < particles.size(); i++) {
+    particles.set_pose(i, 1000.0 + noise(generator), -500.0 + 2.0 * noise(generator),
+      0.5 + 0.5 * noise(generator));
+    particles.prob[i] = 1.0 / particles.size();
+  }
+
+  mh_amcl::PoseStatistics stats(particles);
+  ASSERT_EQ(stats.size(), 500u);
+  ASSERT_NEAR(stats.get_x(), mh_amcl::weighted_mean(particles.x, particles.prob), 1e-6);
+  ASSERT_NEAR(stats.get_y(), mh_amcl::weighted_mean(particles.y, particles.prob), 1e-6);
+  ASSERT_NEAR(
+    stats.get_yaw(), mh_amcl::angle_weighted_mean(particles.yaw, particles.prob), 1e-6);
+
+  const std::vector<const std::vector<double> *> vs = {&particles.x, &particles.y, &particles.yaw};
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      ASSERT_NEAR(
+        stats.get_covariance(i, j), mh_amcl::covariance(*vs[i], *vs[j], i == 2, j == 2), 1e-6);
+    }
+  }
+
+  // Yaw around pi, where the difference of angles wraps
+  mh_amcl::PoseStatistics wrapped;
+  wrapped.add(0.0, 0.0, M_PI - 0.1, cos(M_PI - 0.1), sin(M_PI - 0.1), 0.5);
+  wrapped.add(0.0, 0.0, -M_PI + 0.1, cos(-M_PI + 0.1), sin(-M_PI + 0.1), 0.5);
+  ASSERT_NEAR(fabs(wrapped.get_yaw()), M_PI, 1e-6);
+  ASSERT_NEAR(wrapped.get_covariance(2, 2), 0.02, 1e-6);
+}
+
+TEST(test1, test_particle_set)
+{
+  mh_amcl::ParticleSet particles;
+  particles.resize(3);
+
+  tf2::Transform pose;
+  pose.setOrigin({1.0, 2.0, 0.0});
+  pose.setRotation({0.0, 0.0, 0.707, 0.707});
+  particles.set_pose(0, pose);
+  particles.set_pose(1, -1.0, 0.5, -M_PI_2);
+  particles.set_pose(2, 0.0, 0.0, 0.0);
+  particles.prob = {0.2, 0.5, 0.3};
+
+  ASSERT_NEAR(particles.yaw[0], M_PI_2, 0.001);
+  ASSERT_NEAR(particles.cos_yaw[0], 0.0, 0.001);
+  ASSERT_NEAR(particles.sin_yaw[0], 1.0, 0.001);
+  ASSERT_NEAR(particles.get_pose(1).getOrigin().x(), -1.0, 0.0001);
+  ASSERT_NEAR(particles.get_rotation(1).z(), -0.707, 0.001);
+
+  particles.sort_by_prob();
+  ASSERT_NEAR(particles.prob[0], 0.5, 0.0001);
+  ASSERT_NEAR(particles.x[0], -1.0, 0.0001);
+  ASSERT_NEAR(particles.yaw[0], -M_PI_2, 0.0001);
+  ASSERT_NEAR(particles.prob[2], 0.2, 0.0001);
+  ASSERT_NEAR(particles.x[2], 1.0, 0.0001);
+
+  // Odd size to exercise the scalar tail of the vectorized kernel
+  std::vector<double> px = {1.0, 0.0, -1.0, 2.0, 0.5, 3.0, -0.5};
+  std::vector<double> py = {0.0, 1.0, 0.0, -2.0, 0.5, 0.0, 1.5};
+  std::vector<double> wx(px.size()), wy(py.size());
+
+  const double angle = 0.3;
+  mh_amcl::transform_points(
+    1.0, -2.0, cos(angle), sin(angle), px.data(), py.data(), px.size(), wx.data(), wy.data());
+
+  tf2::Transform transform;
+  transform.setOrigin({1.0, -2.0, 0.0});
+  tf2::Quaternion q;
+  q.setRPY(0.0, 0.0, angle);
+  transform.setRotation(q);
+
+  for (size_t i = 0; i < px.size(); i++) {
+    tf2::Vector3 expected = transform * tf2::Vector3(px[i], py[i], 0.0);
+    ASSERT_NEAR(wx[i], expected.x(), 0.000001);
+    ASSERT_NEAR(wy[i], expected.y(), 0.000001);
+  }
+}
+
+TEST(test1, test_scan_points)
+{
+  sensor_msgs::msg::LaserScan scan;
+  scan.angle_min = -M_PI;
+  scan.angle_max = M_PI;
+  scan.angle_increment = M_PI_2;
+  scan.ranges = {1.0, std::numeric_limits<float>::quiet_NaN(), 2.0, 3.0,
+    std::numeric_limits<float>::infinity()};
+
+  mh_amcl::ScanPoints points(scan);
+  ASSERT_EQ(points.num_ranges, 5u);
+  ASSERT_EQ(points.size(), 3u);
+  ASSERT_EQ(points.index, std::vector<int>({0, 2, 3}));
+
+  ParticlesDistributionTest particle_dist;
+  for (size_t i = 0; i < points.size(); i++) {
+    tf2::Transform point = particle_dist.get_tranform_to_read_test(scan, points.index[i]);
+    ASSERT_NEAR(points.x[i], point.getOrigin().x(), 0.0001);
+    ASSERT_NEAR(points.y[i], point.getOrigin().y(), 0.0001);
+    ASSERT_NEAR(points.range[i], scan.ranges[points.index[i]], 0.0001);
+  }
+
+  // A scan with other geometry recomputes the angles
+  scan.angle_min = 0.0;
+  scan.ranges = {1.0, 1.0};
+  points.update(scan);
+  ASSERT_EQ(points.size(), 2u);
+  ASSERT_NEAR(points.x[0], 1.0, 0.0001);
+  ASSERT_NEAR(points.y[1], 1.0, 0.0001);
+
+  // 80 beams on a square room of side 2, and 20 max range returns through a door
+  scan.angle_min = -M_PI;
+  scan.angle_increment = 2.0 * M_PI / 100.0;
+  scan.range_max = 10.0;
+  scan.ranges.resize(100);
+  for (size_t i = 0; i < scan.ranges.size(); i++) {
+    const double angle = scan.angle_min + i * scan.angle_increment;
+    scan.ranges[i] = 1.0 / std::max(fabs(cos(angle)), fabs(sin(angle)));
+  }
+  std::fill(scan.ranges.begin() + 40, scan.ranges.begin() + 60, 10.0);
+
+  points.set_max_beams(10, mh_amcl::UNIFORM);
+  points.update(scan);
+  ASSERT_EQ(points.size(), 10u);
+  ASSERT_EQ(points.num_valid, 100u);
+  ASSERT_NEAR(points.equivalent_ranges(), 10.0, 0.0001);
+  ASSERT_TRUE(std::is_sorted(points.index.begin(), points.index.end()));
+
+  points.set_max_beams(10, mh_amcl::ADAPTIVE);
+  points.update(scan);
+  ASSERT_EQ(points.size(), 10u);
+  ASSERT_TRUE(std::is_sorted(points.index.begin(), points.index.end()));
+  for (auto i : points.index) {
+    ASSERT_TRUE(i < 40 || i >= 60);
+  }
+
+  points.set_max_beams(0, mh_amcl::UNIFORM);
+  points.update(scan);
+  ASSERT_EQ(points.size(), 100u);
+
+  // A front and a rear laser merged in base_footprint
+  scan.angle_min = 0.0;
+  scan.angle_increment = M_PI_2;
+  scan.ranges = {1.0, 2.0, std::numeric_limits<float>::quiet_NaN()};
+  const mh_amcl::ScanPoints front(scan);
+  scan.ranges = {3.0};
+  const mh_amcl::ScanPoints rear(scan);
+
+  tf2::Transform bf2front({0.0, 0.0, 0.0, 1.0}, {0.2, 0.0, 0.0});
+  tf2::Transform bf2rear(tf2::Quaternion({0.0, 0.0, 1.0}, M_PI), {-0.3, 0.1, 0.0});
+  mh_amcl::ScanPoints merged;
+  merged.merge({&front, &rear}, {mh_amcl::Pose2d(bf2front), mh_amcl::Pose2d(bf2rear)});
+
+  ASSERT_EQ(merged.size(), 3u);
+  ASSERT_EQ(merged.num_ranges, 4u);
+  ASSERT_EQ(merged.num_valid, 3u);
+  ASSERT_EQ(merged.index, std::vector<int>({0, 1, 0}));
+  const double expected[][4] = {{1.2, 0.0, 0.2, 0.0}, {0.2, 2.0, 0.2, 0.0},
+    {-3.3, 0.1, -0.3, 0.1}};
+  for (size_t j = 0; j < merged.size(); j++) {
+    ASSERT_NEAR(merged.x[j], expected[j][0], 1e-6);
+    ASSERT_NEAR(merged.y[j], expected[j][1], 1e-6);
+    ASSERT_NEAR(merged.origin_x[j], expected[j][2], 1e-6);
+    ASSERT_NEAR(merged.origin_y[j], expected[j][3], 1e-6);
+    ASSERT_NEAR(
+      std::hypot(merged.x[j] - merged.origin_x[j], merged.y[j] - merged.origin_y[j]),
+      merged.range[j], 1e-6);
+  }
+
+  mh_amcl::ScanPoints merged_subsample;
+  merged.subsample(2, merged_subsample);
+  ASSERT_EQ(merged_subsample.origin_x.size(), 2u);
+  ASSERT_EQ(merged_subsample.origin_y.size(), 2u);
+  ASSERT_NEAR(merged_subsample.origin_x[1], 0.2, 1e-6);
+}
+
+TEST(test1, test_thread_pool)
+{
+  mh_amcl::ThreadPool pool(4);
+  ASSERT_EQ(pool.get_num_threads(), 4u);
+
+  for (size_t n : {0, 1, 3, 1000}) {
+    std::vector<int> calls(n, 0);
+    pool.parallel_for(n, [&](size_t i) {calls[i]++;});
+
+    for (size_t i = 0; i < n; i++) {
+      ASSERT_EQ(calls[i], 1);
+    }
+  }
+
+  mh_amcl::ThreadPool serial(1);
+  std::vector<size_t> order;
+  serial.parallel_for(5, [&](size_t i) {order.push_back(i);});
+  ASSERT_EQ(order, std::vector<size_t>({0, 1, 2, 3, 4}));
+}
+
+TEST(test1, test_latency_histogram)
+{
+  using mh_amcl::LatencyHistogram;
+
+  // Buckets are contiguous, and each one is at most 1 / SUB_BUCKETS of its values wide
+  for (uint64_t value = 0; value < 100000; value++) {
+    const int bucket = LatencyHistogram::get_bucket(value);
+    ASSERT_LE(value, LatencyHistogram::get_bucket_max(bucket));
+    if (bucket > 0) {
+      ASSERT_GT(value, LatencyHistogram::get_bucket_max(bucket - 1));
+    }
+    ASSERT_LE(
+      LatencyHistogram::get_bucket_max(bucket) - value,
+      value / LatencyHistogram::SUB_BUCKETS);
+  }
+  ASSERT_LT(
+    LatencyHistogram::get_bucket(std::numeric_limits<uint64_t>::max()),
+    LatencyHistogram::NUM_BUCKETS);
+
+  LatencyHistogram histogram("test");
+  for (uint64_t ms = 1; ms <= 100; ms++) {
+    histogram.record(ms * 1000000);
+  }
+
+  auto snapshot = histogram.take();
+  ASSERT_EQ(snapshot.count, 100u);
+  ASSERT_EQ(snapshot.max, 100000000u);
+  ASSERT_NEAR(LatencyHistogram::get_percentile(snapshot, 0.5), 50000000, 50000000 / 8);
+  ASSERT_NEAR(LatencyHistogram::get_percentile(snapshot, 0.99), 99000000, 99000000 / 8);
+  ASSERT_EQ(LatencyHistogram::get_percentile(snapshot, 1.0), 100000000u);
+
+  // Taking the values resets the histogram
+  snapshot = histogram.take();
+  ASSERT_EQ(snapshot.count, 0u);
+  ASSERT_EQ(LatencyHistogram::get_percentile(snapshot, 0.5), 0u);
+}
+
+TEST(test1, test_hypothesis_pool)
+{
+  auto node = rclcpp_lifecycle::LifecycleNode::make_shared("test_node");
+  auto context = std::make_shared<mh_amcl::HypothesisContext>(node);
+  node->set_parameter({"max_particles", 100});
+  node->set_parameter({"min_particles", 100});
+  context->read_parameters();
+
+  mh_amcl::HypothesisPool pool(context, 3);
+  ASSERT_EQ(pool.get_capacity(), 3u);
+  ASSERT_EQ(pool.get_num_free(), 3u);
+
+  const rclcpp_lifecycle::State state(
+    lifecycle_msgs::msg::State::PRIMARY_STATE_INACTIVE, "Inactive");
+
+  std::list<std::shared_ptr<mh_amcl::ParticlesDistribution>> population;
+  for (int id = 0; id < 3; id++) {
+    auto hypothesis = pool.acquire(id);
+    ASSERT_NE(hypothesis, nullptr);
+    hypothesis->on_configure(state);
+    ASSERT_EQ(hypothesis->get_info().id, id);
+    ASSERT_EQ(hypothesis->get_particles().size(), 100u);
+    population.push_back(hypothesis);
+  }
+  ASSERT_EQ(pool.get_num_free(), 0u);
+  ASSERT_EQ(pool.acquire(3), nullptr);
+
+  // Removed from the population, it is reused, with its storage
+  const auto * removed = population.front().get();
+  const auto * storage = population.front()->get_particles().x.data();
+  population.pop_front();
+  ASSERT_EQ(pool.get_num_free(), 1u);
+
+  auto hypothesis = pool.acquire(4);
+  ASSERT_EQ(hypothesis.get(), removed);
+  hypothesis->on_configure(state);
+  ASSERT_EQ(hypothesis->get_info().id, 4);
+  ASSERT_EQ(hypothesis->get_particles().x.data(), storage);
+
+  // The parameters are the snapshot of the context, until it reads them again
+  node->set_parameter({"max_particles", 50});
+  node->set_parameter({"min_particles", 50});
+  hypothesis->on_configure(state);
+  ASSERT_EQ(hypothesis->get_particles().size(), 100u);
+  context->read_parameters();
+  hypothesis->on_configure(state);
+  ASSERT_EQ(hypothesis->get_particles().size(), 50u);
+}
+
+TEST(test1, test_correction_scheduler)
+{
+  const std::vector<mh_amcl::CorrectionRequest> requests = {
+    {200, 0.2f, false, 0},
+    {200, 0.7f, true, 0},
+    {200, 0.4f, false, 0},
+    {200, 0.5f, false, 0},
+    {200, 0.1f, false, 3}};
+
+  // Without budget, all the beams for all
+  mh_amcl::CorrectionScheduler unlimited(0, 30, 0.5f);
+  for (auto beams : unlimited.schedule(requests, 100)) {
+    ASSERT_EQ(beams, 100u);
+  }
+
+  // The selected and the promoted ones are corrected first, even over the budget
+  mh_amcl::CorrectionScheduler scheduler(60000, 30, 0.5f);
+  auto beams = scheduler.schedule(requests, 100);
+  ASSERT_EQ(beams[1], 100u);
+  ASSERT_EQ(beams[3], 100u);
+
+  // Then the one that has waited longer, with few beams as its quality is low, then the
+  // best of the others, with the rest of the budget, and none for the last one
+  ASSERT_EQ(beams[4], 30u);
+  ASSERT_EQ(beams[2], 70u);
+  ASSERT_EQ(beams[0], 0u);
+
+  size_t cost = 0;
+  for (size_t i = 0; i < requests.size(); i++) {
+    cost += beams[i] * requests[i].num_particles;
+  }
+  ASSERT_LE(cost, 60000u);
+
+  // Over the budget, only the one that has waited longer, with min_beams
+  beams = mh_amcl::CorrectionScheduler(1000, 30, 0.5f).schedule(requests, 100);
+  ASSERT_EQ(beams, std::vector<size_t>({0, 100, 0, 100, 30}));
+
+  // When the selected one takes the whole budget, the others take turns
+  std::vector<mh_amcl::CorrectionRequest> starving = {
+    {200, 0.7f, true, 0},
+    {200, 0.2f, false, 0},
+    {200, 0.2f, false, 0}};
+  const mh_amcl::CorrectionScheduler tight(200 * 360, 30, 0.5f);
+  std::vector<int> corrections(starving.size(), 0);
+  for (int cycle = 0; cycle < 10; cycle++) {
+    beams = tight.schedule(starving, 360);
+    ASSERT_EQ(beams[0], 360u);
+    for (size_t i = 0; i < starving.size(); i++) {
+      starving[i].skipped = beams[i] == 0 ? starving[i].skipped + 1 : 0;
+      corrections[i] += beams[i] > 0;
+      ASSERT_LE(starving[i].skipped, 1);
+    }
+  }
+  ASSERT_EQ(corrections, std::vector<int>({10, 5, 5}));
+
+  // Fewer beams keep the quality comparable
+  sensor_msgs::msg::LaserScan scan;
+  scan.angle_min = -M_PI_2;
+  scan.angle_increment = M_PI / 99;
+  scan.range_min = 0.1;
+  scan.range_max = 10.0;
+  scan.ranges.assign(100, 2.0);
+  mh_amcl::ScanPoints points(scan);
+
+  mh_amcl::ScanPoints subsample;
+  points.subsample(25, subsample);
+  ASSERT_EQ(subsample.size(), 25u);
+  ASSERT_EQ(subsample.index[1], points.index[4]);
+  ASSERT_FLOAT_EQ(subsample.equivalent_ranges(), points.equivalent_ranges() / 4);
+}
+
+TEST(test1, test_pose2)
+{
+  // The same as composing the 3D transforms, when they are planar
+  tf2::Quaternion q1, q2;
+  q1.setRPY(0.0, 0.0, 2.5);
+  q2.setRPY(0.0, 0.0, -1.2);
+  const tf2::Transform t1(q1, {1.0, -2.0, 0.0});
+  const tf2::Transform t2(q2, {0.5, 3.0, 0.0});
+
+  const mh_amcl::Pose2d p1(t1), p2(t2);
+  ASSERT_NEAR(p1.yaw, 2.5, 1e-9);
+  ASSERT_NEAR(p2.yaw, -1.2, 1e-9);
+
+  const tf2::Transform t12 = t1 * t2;
+  const mh_amcl::Pose2d p12 = p1 * p2;
+  ASSERT_NEAR(p12.x, t12.getOrigin().x(), 1e-9);
+  ASSERT_NEAR(p12.y, t12.getOrigin().y(), 1e-9);
+  ASSERT_NEAR(p12.cos_yaw, cos(mh_amcl::get_yaw(t12.getRotation())), 1e-9);
+  ASSERT_NEAR(p12.sin_yaw, sin(mh_amcl::get_yaw(t12.getRotation())), 1e-9);
+
+  const mh_amcl::Pose2d identity = p1 * p1.inverse();
+  ASSERT_NEAR(identity.x, 0.0, 1e-9);
+  ASSERT_NEAR(identity.y, 0.0, 1e-9);
+  ASSERT_NEAR(identity.cos_yaw, 1.0, 1e-9);
+  ASSERT_NEAR(identity.sin_yaw, 0.0, 1e-9);
+
+  double wx, wy;
+  p1.apply(1.0, 0.0, wx, wy);
+  const tf2::Vector3 w = t1 * tf2::Vector3(1.0, 0.0, 0.0);
+  ASSERT_NEAR(wx, w.x(), 1e-9);
+  ASSERT_NEAR(wy, w.y(), 1e-9);
+
+  const tf2::Transform back = p12.to_transform();
+  ASSERT_NEAR(back.getOrigin().x(), t12.getOrigin().x(), 1e-9);
+  ASSERT_NEAR(fabs(back.getRotation().dot(t12.getRotation())), 1.0, 1e-9);
+
+  // Yaw of any rotation, also with roll and pitch, as getRPY() gives it
+  for (double yaw = -3.0; yaw < 3.0; yaw += 0.5) {
+    tf2::Quaternion q;
+    q.setRPY(0.3, -0.2, yaw);
+    double roll, pitch, expected_yaw;
+    tf2::Matrix3x3(q).getRPY(roll, pitch, expected_yaw);
+    ASSERT_NEAR(mh_amcl::get_yaw(q), expected_yaw, 1e-9);
+  }
+}
+
+TEST(test1, test_random_generator)
+{
+  // Same seed and stream, same numbers; another stream, other numbers
+  mh_amcl::RandomGenerator generator_1(42, 3), generator_2(42, 3), generator_3(42, 4);
+  for (int i = 0; i < 100; i++) {
+    const auto value = generator_1();
+    ASSERT_EQ(value, generator_2());
+    ASSERT_NE(value, generator_3());
+  }
+
+  generator_1.seed(42, 3);
+  generator_2.seed(42, 3);
+  ASSERT_EQ(generator_1.normal(), generator_2.normal());
+
+  double sum = 0.0;
+  for (int i = 0; i < 10000; i++) {
+    const double value = generator_1.uniform();
+    ASSERT_GE(value, 0.0);
+    ASSERT_LT(value, 1.0);
+    sum += value;
+  }
+  ASSERT_NEAR(sum / 10000, 0.5, 0.02);
+
+  // An odd number of normals, with the expected mean and standard deviation
+  std::vector<double> normals(10001);
+  generator_1.fill_normal(normals.data(), normals.size(), 2.0);
+  ASSERT_NEAR(mh_amcl::mean(normals), 0.0, 0.1);
+  ASSERT_NEAR(sqrt(mh_amcl::covariance(normals, normals)), 2.0, 0.1);
+  for (auto value : normals) {
+    ASSERT_TRUE(std::isfinite(value));
+  }
+}
+
 int main(int argc, char * argv[])
 {
   testing::InitGoogleTest(&argc, argv);